@@ -39,6 +39,7 @@
 #include "inifile.h"
 #include "mtlib.h"
 #include "wu.h"
+#include "thread.h"
 
 typedef struct {
 	int frame1, frame2;
@@ -63,6 +64,7 @@ typedef struct {
 int ani_state;
 
 int	ani_frame1 = 1, ani_frame2 = 1, ani_gif_delay = 10;
+int	ani_gpal, ani_delta;
 static int ani_play_state, ani_timer_state;
 
 
@@ -677,14 +679,150 @@ void ani_but_preview(void **awin)
 	run_create(apview_code, &tdata, sizeof(tdata));
 }
 
+/* Frames are rendered in batches on the main thread, as rendering moves the
+ * layers around, and each is then quantized by a thread of its own; buffers
+ * are private to threads so batch size is the thread count. File savers are
+ * not reentrant, so saving is done by the main thread too */
+
+typedef struct {
+	ls_settings settings;
+	png_color pal[256];
+	char path[PATHBUF];
+	unsigned char *rgb, *irgb;
+	unsigned char *prev;	// Previous frame, for delta
+	int w, h, trans, res;
+	int gcols;		// Global palette size, 0 if none
+} ani_frame_state;
+
+DEF_MUTEX(ani_wu_lock);
+
+static void ani_save_frames(tcb *thread)
+{
+	ani_frame_state *fs;
+	unsigned char *rgb;
+	size_t l;
+	int i, n, cols, w, h;
+
+	for (n = thread->step0; n < thread->step0 + thread->nsteps; n++)
+	{
+		fs = thread->tdata->threads[n]->data;
+		rgb = fs->rgb;
+		w = fs->w;
+		h = fs->h;
+
+		if (fs->gcols)	// Use global palette
+		{
+			cols = fs->gcols;
+			if (mem_convert_indexed(fs->irgb, rgb, (size_t)w * h,
+				cols, fs->pal))
+				mem_dumb_dither(rgb, fs->irgb, fs->pal,
+					w, h, cols, FALSE);
+		}
+		else if (fs->settings.bpp == 1)	// Prepare palette
+		{
+			cols = mem_cols_used_real(rgb, w, h, fs->pal);
+						// Count & collect colours in image
+
+			if (cols > 256)		// If >256 use Wu to quantize
+			{
+				cols = 256;
+				/* wu_quant() keeps its state in statics */
+				LOCK_MUTEX(ani_wu_lock);
+				i = wu_quant(rgb, w, h, cols, fs->pal);
+				UNLOCK_MUTEX(ani_wu_lock);
+				if (i)
+				{
+					fs->res = -2; // No memory
+					continue;
+				}
+				// Create new indexed image (cannot fail if no dither)
+				mem_dumb_dither(rgb, fs->irgb, fs->pal,
+					w, h, cols, FALSE);
+			}
+			// Create new indexed image (cannot fail w/ exact palette)
+			else mem_convert_indexed(fs->irgb, rgb, (size_t)w * h,
+				cols, fs->pal);
+		}
+		if (fs->settings.bpp == 1)
+		{
+			fs->settings.xpm_trans = -1;	// Default is no transparency
+			if (fs->trans >= 0)	// Background has transparency
+			{
+				for (i = 0; i < cols; i++)
+				{	// Does it exist in the composite frame?
+					if (PNG_2_INT(fs->pal[i]) != fs->trans) continue;
+					// Transparency found so note it
+					fs->settings.xpm_trans = i;
+					break;
+				}
+			}
+			/* Make pixels same as in previous frame transparent,
+			 * using the palette slot reserved for that */
+			if (fs->prev)
+			{
+				unsigned char *dest = fs->irgb, *src = fs->prev;
+
+				for (l = (size_t)w * h; l; l-- ,
+					dest++ , src += 3 , rgb += 3)
+					if (!((src[0] ^ rgb[0]) | (src[1] ^ rgb[1]) |
+						(src[2] ^ rgb[2]))) *dest = cols;
+				fs->settings.xpm_trans = cols;
+			}
+		}
+		else if (fs->irgb) mem_demultiply(rgb, fs->irgb, (size_t)w * h, 3);
+		fs->res = 0;
+	}
+	thread_done(thread);
+}
+
+/* Build palette for all frames, from a sample of their pixels */
+
+#define ANI_PAL_FRAMES 32
+#define ANI_PAL_PIXELS (1 << 22)
+
+static int ani_global_pal(int a, int b, unsigned char *rgb, int w, int h,
+	png_color *pal, int ncols)
+{
+	unsigned char *buf, *src, *dest;
+	size_t l, sz = (size_t)w * h;
+	int i, n, step, cols;
+
+	n = b - a + 1;
+	if (n > ANI_PAL_FRAMES) n = ANI_PAL_FRAMES;
+	step = (sz * n + ANI_PAL_PIXELS - 1) / ANI_PAL_PIXELS;
+	buf = malloc(((sz + step - 1) / step) * n * 3);
+	if (!buf) return (-1);
+
+	for (dest = buf , i = 0; i < n; i++)
+	{
+		/* Frames evenly spread over the range */
+		ani_set_frame_state(n > 1 ? a + ((b - a) * i) / (n - 1) : a);
+		memset(rgb, 0, sz * 3);
+		view_render_rgb(rgb, 0, 0, w, h, 1);
+		for (src = rgb , l = 0; l < sz; l += step , src += step * 3)
+		{
+			*dest++ = src[0];
+			*dest++ = src[1];
+			*dest++ = src[2];
+		}
+	}
+
+	l = (dest - buf) / 3;
+	cols = mem_cols_used_real(buf, l, 1, pal);
+	if ((cols > ncols) && wu_quant(buf, l, 1, cols = ncols, pal)) cols = -1;
+	free(buf);
+	return (cols);
+}
+
 static void create_frames_ani()
 {
+	da_settings ds;
 	image_info *image;
-	ls_settings settings;
-	png_color pngpal[256], *trans;
-	unsigned char *layer_rgb, *irgb;
+	ani_frame_state fs, *fp;
+	threaddata *tdata;
+	unsigned char *prev = NULL;
 	char output_path[PATHBUF], *command, *wild_path;
-	int a, b, k, i, tr, cols, layer_w, layer_h, npt, l = 0;
+	int a, b, k, i, n, sz, delta, l = 0;
 
 
 	layer_press_save();		// Save layers data file
@@ -718,99 +856,123 @@ static void create_frames_ani()
 
 	image = layer_selected ? &layer_table[0].image->image_ : &mem_image;
 
-	layer_w = image->width;
-	layer_h = image->height;
-	layer_rgb = malloc(layer_w * layer_h * 4);	// Primary layer image for RGB version
-	if (!layer_rgb)
-	{
-		memory_errors(1);
-		return;
-	}
-	irgb = layer_rgb + layer_w * layer_h * 3;	// For indexed or alpha
+	memset(&fs, 0, sizeof(fs));
+	fs.w = image->width;
+	fs.h = image->height;
+	sz = fs.w * fs.h;
 
 	/* Prepare settings */
-	init_ls_settings(&settings, NULL);
-	settings.mode = FS_COMPOSITE_SAVE;
-	settings.width = layer_w;
-	settings.height = layer_h;
-	settings.colors = 256;
-	settings.silent = TRUE;
-	settings.ftype = ani_format;
+	init_ls_settings(&fs.settings, NULL);
+	fs.settings.mode = FS_COMPOSITE_SAVE;
+	fs.settings.width = fs.w;
+	fs.settings.height = fs.h;
+	fs.settings.colors = 256;
+	fs.settings.silent = TRUE;
+	fs.settings.ftype = ani_format;
 	/* Indexed */
 	if (!(file_formats[ani_format].flags & FF_RGB))
 	{
-		settings.img[CHN_IMAGE] = irgb;
-		settings.bpp = 1;
-		settings.pal = pngpal;
+		fs.settings.bpp = 1;
+		fs.trans = image->trans < 0 ? -1 :
+			PNG_2_INT(image->pal[image->trans]);
 	}
 	/* RGB */
 	else
 	{
-		if (!comp_need_alpha(ani_format)) irgb = NULL;
-		settings.img[CHN_IMAGE] = layer_rgb;
-		settings.img[CHN_ALPHA] = irgb;
-		settings.bpp = 3;
+		if (!comp_need_alpha(ani_format)) sz = 0;
+		fs.settings.bpp = 3;
 		/* Background transparency */
-		settings.xpm_trans = tr = image->trans;
-		settings.rgb_trans = tr < 0 ? -1 : PNG_2_INT(image->pal[tr]);
+		fs.settings.xpm_trans = i = image->trans;
+		fs.settings.rgb_trans = i < 0 ? -1 : PNG_2_INT(image->pal[i]);
 	}
 
-	progress_init(_("Creating Animation Frames"), 1);
-	for ( k=a; k<=b; k++ )			// Create each frame and save it as a PNG or GIF image
+	/* Primary layer image for RGB version, and one for indexed or alpha;
+	 * fall back to a single set if not enough memory for more */
+	n = b - a + 1;
+	while (!(tdata = talloc(MA_SKIP_ZEROSIZE, n, &fs, sizeof(fs), NULL,
+		&fs.rgb, fs.w * fs.h * 3, &fs.irgb, sz, NULL)) && (n > 1)) n = 1;
+	if (!tdata)
 	{
-		if (progress_update(b == a ? 0.0 : (k - a) / (float)(b - a)))
-			break;
+		memory_errors(1);
+		return;
+	}
+	tdata->silent = TRUE;
 
-		ani_set_frame_state(k);		// Change layer positions
-		memset(layer_rgb, 0, layer_w * layer_h * 4);	// Init for RGBA compositing
-		view_render_rgb( layer_rgb, 0, 0, layer_w, layer_h, 1 );	// Render layer
+	/* Delta frames need a shared palette with a slot to spare, and opaque
+	 * background for transparency to mean "unchanged" */
+	delta = ani_delta && (ani_format == FT_GIF) && (fs.trans < 0);
+	if (delta && !(prev = malloc((size_t)fs.w * fs.h * 3))) goto nomem;
 
-		snprintf(output_path + l, PATHBUF - l, DIR_SEP_STR "%s%05d.%s",
-			ani_file_prefix, k, file_formats[ani_format].ext);
+	progress_init(_("Creating Animation Frames"), 1);
 
-		if (settings.bpp == 1)	// Prepare palette
+	if ((ani_gpal || delta) && (fs.settings.bpp == 1))
+	{
+		fp = tdata->threads[0]->data;
+		fs.gcols = ani_global_pal(a, b, fp->rgb, fs.w, fs.h, fs.pal,
+			delta ? 255 : 256);
+		if (fs.gcols < 0)
 		{
-			cols = mem_cols_used_real(layer_rgb, layer_w, layer_h, pngpal);
-						// Count & collect colours in image
+			progress_end();
+			goto nomem;
+		}
+		for (i = 0; i < tdata->count; i++)
+		{
+			fp = tdata->threads[i]->data;
+			fp->gcols = fs.gcols;
+			memcpy(fp->pal, fs.pal, sizeof(fs.pal));
+		}
+	}
+	else delta = FALSE;
 
-			if (cols > 256)		// If >256 use Wu to quantize
+	for (k = a; k <= b; k += n)
+	{
+		/* Keep last frame of previous batch */
+		fp = tdata->threads[tdata->count - 1]->data;
+		if (delta && (k > a)) memcpy(prev, fp->rgb, fs.w * fs.h * 3);
+
+		/* Render a batch of frames */
+		for (n = 0; (n < tdata->count) && (k + n <= b); n++)
+		{
+			if (progress_update(b == a ? 0.0 :
+				(k + n - a) / (float)(b - a))) break;
+
+			fp = tdata->threads[n]->data;
+			if (delta) fp->prev = !n ? (k > a ? prev : NULL) :
+				((ani_frame_state *)tdata->threads[n - 1]->data)->rgb;
+			ani_set_frame_state(k + n);	// Change layer positions
+			memset(fp->rgb, 0, fp->w * fp->h * 3);	// Init for RGBA compositing
+			view_render_rgb(fp->rgb, 0, 0, fp->w, fp->h, 1);	// Render layer
+			if (fp->settings.bpp == 3)
 			{
-				cols = 256;
-				if (wu_quant(layer_rgb, layer_w, layer_h, cols,
-					pngpal)) goto failure2; // No memory
-				// Create new indexed image (cannot fail if no dither)
-				mem_dumb_dither(layer_rgb, irgb, pngpal,
-					layer_w, layer_h, cols, FALSE);
+				fp->settings.img[CHN_IMAGE] = fp->rgb;
+				fp->settings.img[CHN_ALPHA] = fp->irgb;
+				if (fp->irgb) collect_alpha(fp->irgb, fp->w, fp->h);
 			}
-			// Create new indexed image (cannot fail w/ exact palette)
-			else mem_convert_indexed(irgb, layer_rgb, layer_w * layer_h,
-				cols, pngpal);
-
-			settings.xpm_trans = -1;	// Default is no transparency
-			if (image->trans >= 0)	// Background has transparency
+			else
 			{
-				trans = image->pal + image->trans;
-				npt = PNG_2_INT(*trans);
-				for (i = 0; i < cols; i++)
-				{	// Does it exist in the composite frame?
-					if (PNG_2_INT(pngpal[i]) != npt) continue;
-					// Transparency found so note it
-					settings.xpm_trans = i;
-					break;
-				}
+				fp->settings.img[CHN_IMAGE] = fp->irgb;
+				fp->settings.pal = fp->pal;
 			}
+
+			memcpy(fp->path, output_path, l);
+			snprintf(fp->path + l, PATHBUF - l, DIR_SEP_STR "%s%05d.%s",
+				ani_file_prefix, k + n, file_formats[ani_format].ext);
 		}
-		else if (irgb)
-		{
-			collect_alpha(irgb, layer_w, layer_h);
-			mem_demultiply(layer_rgb, irgb, layer_w * layer_h, 3);
-		}
+		if (!n) break;
 
-		if (save_image(output_path, &settings) < 0)
+		/* Quantize them, then save */
+		launch_threads(ani_save_frames, tdata, NULL, n);
+		for (i = 0; i < n; i++)
 		{
-			alert_box(_("Error"), _("Unable to save image"), NULL);
+			fp = tdata->threads[i]->data;
+			if (!fp->res) fp->res = save_image(fp->path,
+				&fp->settings) < 0 ? -1 : 0;
+			if (!fp->res) continue;
+			if (fp->res == -2) memory_errors(1);
+			else alert_box(_("Error"), _("Unable to save image"), NULL);
 			goto failure2;
 		}
+		if (n < tdata->count) break; // Cancelled or done
 	}
 
 	/* all GIF files created OK so lets give them to gifsicle */
@@ -821,7 +983,12 @@ static void create_frames_ani()
 		snprintf(output_path + l, PATHBUF - l, DIR_SEP_STR "%s.gif",
 			ani_file_prefix);
 
-		if (!run_def_action(DA_GIF_CREATE, wild_path, output_path, ani_gif_delay) &&
+		memset(&ds, 0, sizeof(ds));
+		ds.sname = wild_path;
+		ds.dname = output_path;
+		ds.delay = ani_gif_delay;
+		if (delta) ds.disposal = 1; // Leave frames in place
+		if (!run_def_action_x(DA_GIF_CREATE, &ds) &&
 			!cmd_mode) /* Don't launch GUI from commandline */
 			run_def_action(DA_GIF_PLAY, output_path, NULL, 0);
 		free(wild_path);
@@ -829,7 +996,13 @@ static void create_frames_ani()
 
 failure2:
 	progress_end();
-	free( layer_rgb );
+	free(prev);
+	free(tdata);
+	return;
+nomem:
+	memory_errors(1);
+	free(prev);
+	free(tdata);
 }
 
 void pressed_remove_key_frames()
@@ -976,6 +1149,8 @@ static void *anim_code[] = {
 	EVENT(CHANGE, ani_widget_changed),
 	TOPTDe(_("File Format"), ftnames, ftype, ani_widget_changed),
 	WDONE, // XTABLE
+	CHECKv(_("Global palette"), ani_gpal),
+	CHECKv(_("Delta frames (GIF)"), ani_delta),
 	WDONE,
 ///	LAYERS TABLES
 	PAGE(_("Positions")),
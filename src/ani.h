@@ -51,6 +51,7 @@ enum {
 int ani_state;
 
 int ani_frame1, ani_frame2, ani_gif_delay;
+int ani_gpal, ani_delta;	// Global palette & delta frames
 ani_cycle ani_cycle_table[MAX_CYC_SLOTS];
 
 
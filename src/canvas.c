@@ -228,7 +228,8 @@ void commit_paste(int swap, int *update)
 	unsigned char *old_image, *old_alpha;
 	int op = 255, opacity = tool_opacity, bpp = MEM_BPP;
 	int fx, fy, fw, fh, fx2, fy2;		// Screen coords
-	int i, ua, cmask, ofs, iofs, upd = UPD_IMGP, fail = TRUE;
+	size_t ofs, iofs;
+	int i, ua, cmask, upd = UPD_IMGP, fail = TRUE;
 
 
 	fx = marq_x1 > 0 ? marq_x1 : 0;
@@ -260,11 +261,16 @@ void commit_paste(int swap, int *update)
 	}
 
 	/* Offset in memory */
-	ofs = (fy - marq_y1) * mem_clip_w + (fx - marq_x1);
+	ofs = (size_t)(fy - marq_y1) * mem_clip_w + (fx - marq_x1);
 	image = mem_clipboard + ofs * mem_clip_bpp;
-	iofs = fy * mem_width + fx;
+	iofs = (size_t)fy * mem_width + fx;
 
-	mem_undo_next(UNDO_PASTE);	// Do memory stuff for undo
+	if (mem_undo_next(UNDO_PASTE)) // Do memory stuff for undo
+	{
+		if (swap) mem_free_chanlist(ti.img);
+		free(mask);
+		return; // Already reported
+	}
 
 	old_image = mem_img[mem_channel];
 	old_alpha = mem_img[CHN_ALPHA];
@@ -316,7 +322,7 @@ void commit_paste(int swap, int *update)
 		if ((fw - mem_clip_w) | (fh - mem_clip_h))
 			upd |= UPD_CGEOM & ~UPD_IMGMASK;
 		/* Remove new mask if it's all 255 */
-		if (is_filled(ti.img[CHN_SEL], 255, fw * fh))
+		if (is_filled(ti.img[CHN_SEL], 255, (size_t)fw * fh))
 		{
 			free(ti.img[CHN_SEL]);
 			ti.img[CHN_SEL] = NULL;
@@ -360,7 +366,7 @@ void iso_trans(int mode)
 
 void pressed_inv(int what)
 {
-	spot_undo(UNDO_INV);
+	if (spot_undo(UNDO_INV)) return;
 
 	if (what == FILT_INVERT) mem_invert();
 	else mem_normalize();
@@ -382,7 +388,7 @@ static int do_map(map_dd *dt, void **wdata)
 
 	run_query(wdata);
 
-	spot_undo(UNDO_FILT);
+	if (spot_undo(UNDO_FILT)) return (FALSE);
 	mem_prepare_map(map, map_from + MAP_GRAD);
 	mem_remap_rgb(map, map_to);
 	mem_undo_prepare();
@@ -419,7 +425,7 @@ static int do_edge(filterwindow_dd *dt, void **wdata)
 		FX_KIRSCH, FX_GRADIENT, FX_ROBERTS, FX_LAPLACE, FX_MORPHEDGE };
 
 	run_query(wdata);
-	spot_undo(UNDO_FILT);
+	if (spot_undo(UNDO_FILT)) return (FALSE);
 	do_effect(fxmap[edge_mode], 0);
 	mem_undo_prepare();
 
@@ -451,7 +457,7 @@ typedef struct {
 static int do_fx(spin1f_dd *dt, void **wdata)
 {
 	run_query(wdata);
-	spot_undo(UNDO_FILT);
+	if (spot_undo(UNDO_FILT)) return (FALSE);
 	do_effect(dt->fx, dt->s1.n[0]);
 	mem_undo_prepare();
 
@@ -476,7 +482,7 @@ void pressed_soften()
 
 void pressed_fx(int what)
 {
-	spot_undo(UNDO_FILT);
+	if (spot_undo(UNDO_FILT)) return;
 	do_effect(what, 0);
 	mem_undo_prepare();
 	update_stuff(UPD_IMG);
@@ -499,7 +505,7 @@ static int do_gauss(gauss_dd *dt, void **wdata)
 	radiusX = radiusY = dt->x;
 	if (dt->xy) radiusY = dt->y;
 
-	spot_undo(UNDO_DRAW);
+	if (spot_undo(UNDO_DRAW)) return (FALSE);
 	mem_gauss(radiusX * 0.01, radiusY * 0.01, gcor);
 	mem_undo_prepare();
 
@@ -542,7 +548,7 @@ static int do_unsharp(unsharp_dd *dt, void **wdata)
 {
 	run_query(wdata);
 	// !!! No RGBA mode for now, so UNDO_DRAW isn't needed
-	spot_undo(UNDO_FILT);
+	if (spot_undo(UNDO_FILT)) return (FALSE);
 	mem_unsharp(dt->radius * 0.01, dt->amount * 0.01, dt->threshold,
 		(mem_channel == CHN_IMAGE) && dt->gamma);
 	mem_undo_prepare();
@@ -583,7 +589,7 @@ static int do_dog(dog_dd *dt, void **wdata)
 	run_query(wdata);
 	if (dt->outer <= dt->inner) return (FALSE); /* Invalid parameters */
 
-	spot_undo(UNDO_FILT);
+	if (spot_undo(UNDO_FILT)) return (FALSE);
 	mem_dog(dt->outer * 0.01, dt->inner * 0.01, dt->norm,
 		(mem_channel == CHN_IMAGE) && dt->gamma);
 	mem_undo_prepare();
@@ -621,7 +627,7 @@ typedef struct {
 static int do_kuwahara(kuw_dd *dt, void **wdata)
 {
 	run_query(wdata);
-	spot_undo(UNDO_COL); // Always processes RGB image channel
+	if (spot_undo(UNDO_COL)) return (FALSE); // Always processes RGB image channel
 	mem_kuwahara(dt->r, dt->gamma, dt->detail);
 	mem_undo_prepare();
 
@@ -650,19 +656,22 @@ void pressed_kuwahara()
 void pressed_convert_rgb()
 {
 	unsigned char *old_img = mem_img[CHN_IMAGE];
-	int res = undo_next_core(UC_NOCOPY, mem_width, mem_height, 3, CMASK_IMAGE);
+	int i, res = undo_next_core(UC_NOCOPY, mem_width, mem_height, 3, CMASK_IMAGE);
 	if (res) memory_errors(res);
 	else
 	{
-		do_convert_rgb(0, 1, mem_width * mem_height, mem_img[CHN_IMAGE],
-			old_img, mem_pal);
+		/* Row by row, as whole image may not fit in int */
+		for (i = 0; i < mem_height; i++)
+			do_convert_rgb(0, 1, mem_width, mem_img[CHN_IMAGE] +
+				(size_t)i * mem_width * 3,
+				old_img + (size_t)i * mem_width, mem_pal);
 		update_stuff(UPD_2RGB);
 	}
 }
 
 void pressed_greyscale(int mode)
 {
-	spot_undo(UNDO_COL);
+	if (spot_undo(UNDO_COL)) return;
 
 	mem_greyscale(mode);
 	mem_undo_prepare();
@@ -755,7 +764,8 @@ void pressed_clip_mask(int val)
 static int do_clip_alphamask()
 {
 	unsigned char *old_mask = mem_clip_mask;
-	int i, j = mem_clip_w * mem_clip_h, k;
+	size_t i, j = (size_t)mem_clip_w * mem_clip_h;
+	int k;
 
 	if (!mem_clipboard || !mem_clip_alpha) return FALSE;
 
@@ -808,17 +818,13 @@ void pressed_clip_mask_clear()
 void pressed_flip_image_v()
 {
 	int i;
-	unsigned char *temp;
 
-	temp = malloc(mem_width * mem_img_bpp);
-	if (!temp) return; /* Not enough memory for temp buffer */
-	spot_undo(UNDO_XFORM);
+	if (spot_undo(UNDO_XFORM)) return;
 	for (i = 0; i < NUM_CHANNELS; i++)
 	{
 		if (!mem_img[i]) continue;
-		mem_flip_v(mem_img[i], temp, mem_width, mem_height, BPP(i));
+		mem_flip_v(mem_img[i], mem_width, mem_height, BPP(i));
 	}
-	free(temp);
 	mem_undo_prepare();
 	update_stuff(UPD_IMG);
 }
@@ -827,7 +833,7 @@ void pressed_flip_image_h()
 {
 	int i;
 
-	spot_undo(UNDO_XFORM);
+	if (spot_undo(UNDO_XFORM)) return;
 	for (i = 0; i < NUM_CHANNELS; i++)
 	{
 		if (!mem_img[i]) continue;
@@ -839,15 +845,12 @@ void pressed_flip_image_h()
 
 void pressed_flip_sel_v()
 {
-	unsigned char *temp;
 	int i, bpp = mem_clip_bpp;
 
-	temp = malloc(mem_clip_w * mem_clip_bpp);
-	if (!temp) return; /* Not enough memory for temp buffer */
 	for (i = 0; i < NUM_CHANNELS; i++ , bpp = 1)
 	{
 		if (!mem_clip.img[i]) continue;
-		mem_flip_v(mem_clip.img[i], temp, mem_clip_w, mem_clip_h, bpp);
+		mem_flip_v(mem_clip.img[i], mem_clip_w, mem_clip_h, bpp);
 	}
 	update_stuff(UPD_CLIP);
 }
@@ -912,7 +915,7 @@ void pressed_rectangle(int filled)
 {
 	int sb;
 
-	spot_undo(UNDO_DRAW);
+	if (spot_undo(UNDO_DRAW)) return;
 
 	/* Shapeburst mode */
 	sb = STROKE_GRADIENT;
@@ -968,7 +971,7 @@ void pressed_rectangle(int filled)
 
 void pressed_ellipse(int filled)
 {
-	spot_undo(UNDO_DRAW);
+	if (spot_undo(UNDO_DRAW)) return;
 	mem_ellipse(marq_x1, marq_y1, marq_x2, marq_y2, filled ? 0 : tool_size);
 	mem_undo_prepare();
 	update_stuff(UPD_IMG);
@@ -1000,7 +1003,8 @@ static int copy_clip()
 
 static int channel_mask()
 {
-	int i, j, ofs, delta;
+	size_t ofs, delta;
+	int i, j;
 
 	if (!mem_img[CHN_SEL] || channel_dis[CHN_SEL]) return (FALSE);
 	if (mem_channel > CHN_ALPHA) return (FALSE);
@@ -1008,7 +1012,7 @@ static int channel_mask()
 	if (!mem_clip_mask) mem_clip_mask_init(255);
 	if (!mem_clip_mask) return (FALSE);
 
-	ofs = mem_clip_y * mem_width + mem_clip_x;
+	ofs = (size_t)mem_clip_y * mem_width + mem_clip_x;
 	delta = 0;
 	for (i = 0; i < mem_clip_h; i++)
 	{
@@ -1024,7 +1028,7 @@ static void cut_clip()
 {
 	int i, sb = 0;
 
-	spot_undo(UNDO_DRAW);
+	if (spot_undo(UNDO_DRAW)) return;
 	/* Shapeburst mode */
 	if (STROKE_GRADIENT)
 	{
@@ -1037,7 +1041,7 @@ static void cut_clip()
 	for (i = 0; i < mem_clip_h; i++)
 	{
 		put_pixel_row(mem_clip_x, mem_clip_y + i, mem_clip_w,
-			mem_clip_mask ? mem_clip_mask + i * mem_clip_w : NULL);
+			mem_clip_mask ? mem_clip_mask + (size_t)i * mem_clip_w : NULL);
 	}
 	if (sb) render_sb(mem_clip_mask);
 	mem_undo_prepare();
@@ -1047,14 +1051,15 @@ static void trim_clip()
 {
 	chanlist old_img;
 	unsigned char *tmp;
-	int i, j, k, offs, offd, maxx, maxy, minx, miny, nw, nh;
+	size_t offs, offd;
+	int i, j, k, maxx, maxy, minx, miny, nw, nh;
 
 	minx = MAX_WIDTH; miny = MAX_HEIGHT; maxx = maxy = 0;
 
 	/* Find max & min values for shrink wrapping */
 	for (j = 0; j < mem_clip_h; j++)
 	{
-		offs = mem_clip_w * j;
+		offs = (size_t)mem_clip_w * j;
 		for (i = 0; i < mem_clip_w; i++)
 		{
 			if (!mem_clip_mask[offs + i]) continue;
@@ -1077,8 +1082,8 @@ static void trim_clip()
 	/* Pack data to front */
 	for (j = miny; j <= maxy; j++)
 	{
-		offs = j * mem_clip_w + minx;
-		offd = (j - miny) * nw;
+		offs = (size_t)j * mem_clip_w + minx;
+		offd = (size_t)(j - miny) * nw;
 		memmove(mem_clipboard + offd * mem_clip_bpp,
 			mem_clipboard + offs * mem_clip_bpp, nw * mem_clip_bpp);
 		for (k = 1; k < NUM_CHANNELS; k++)
@@ -1089,12 +1094,12 @@ static void trim_clip()
 	}
 
 	/* Try to realloc memory for smaller clipboard */
-	tmp = realloc(mem_clipboard, nw * nh * mem_clip_bpp);
+	tmp = realloc(mem_clipboard, (size_t)nw * nh * mem_clip_bpp);
 	if (tmp) mem_clipboard = tmp;
 	for (k = 1; k < NUM_CHANNELS; k++)
 	{
 		if (!(tmp = mem_clip.img[k])) continue;
-		tmp = realloc(tmp, nw * nh);
+		tmp = realloc(tmp, (size_t)nw * nh);
 		if (tmp) mem_clip.img[k] = tmp;
 	}
 
@@ -1150,7 +1155,7 @@ void pressed_lasso(int cut)
 			poly_lasso(FALSE);
 			if (mem_clip_mask && oldmask)
 			{
-				int i, j = mem_clip_w * mem_clip_h;
+				size_t i, j = (size_t)mem_clip_w * mem_clip_h;
 				for (i = 0; i < j; i++)
 					oldmask[i] &= mem_clip_mask[i];
 				mem_clip_mask_clear();
@@ -1238,6 +1243,9 @@ void update_stuff(int flags)
 		(!mem_clipboard || (mem_clip_bpp > MEM_BPP)))
 		pressed_select(FALSE);
 
+	/* Image contents may have changed */
+	if (flags & CF_VDRAW) mip_update_area(0, 0, mem_width, mem_height);
+
 	if (flags & CF_CAB)
 		flags |= mem_channel == CHN_IMAGE ? UPD_AB : UPD_GRAD;
 	if (flags & CF_GEOM)
@@ -2638,7 +2646,8 @@ static int tool_draw(int x, int y, int first_point, int *update)
 {
 	static int ncx, ncy;
 	int minx, miny, xw, yh, ts2, tr2;
-	int i, j, k, ox, oy, px, py, rx, ry, sx, sy, off1, off2;
+	size_t off1, off2;
+	int i, j, k, ox, oy, px, py, rx, ry, sx, sy;
 
 	ts2 = tool_size >> 1;
 	tr2 = tool_size - ts2 - 1;
@@ -2693,8 +2702,8 @@ static int tool_draw(int x, int y, int first_point, int *update)
 				if (pixel_protected(rx, ry) ||
 					pixel_protected(sx, sy))
 					continue;
-				off1 = rx + ry * mem_width;
-				off2 = sx + sy * mem_width;
+				off1 = rx + (size_t)ry * mem_width;
+				off2 = sx + (size_t)sy * mem_width;
 				if ((mem_channel == CHN_IMAGE) &&
 					RGBA_mode && mem_img[CHN_ALPHA])
 				{
@@ -2799,8 +2808,8 @@ void do_tool_action(int cmd, int x, int y, int pressure)
 			/* If not called from draw_arrow() */
 			if (cmd != TC_LINE_ARROW) line_to_gradient();
 
-			mem_undo_next(UNDO_TOOL);
-			if (tool_size > 1)
+			if (mem_undo_next(UNDO_TOOL)); // Image is off limits
+			else if (tool_size > 1)
 			{
 				int oldmode = mem_undo_opacity;
 				mem_undo_opacity = TRUE;
@@ -2939,7 +2948,7 @@ void do_tool_action(int cmd, int x, int y, int pressure)
 		}
 
 		// Do memory stuff for undo
-		mem_undo_next(UNDO_TOOL);	
+		if (mem_undo_next(UNDO_TOOL)) break;
 
 		/* Handle continuous mode */
 		if (mem_continuous && !first_point)
@@ -2960,11 +2969,13 @@ void do_tool_action(int cmd, int x, int y, int pressure)
 			}
 			if (tool_type == TOOL_CIRCLE)
 			{
+				put_pixel_batch(TRUE); // The segment at once
 				/* Redraw stroke gradient in proper direction */
 				if (STROKE_GRADIENT)
 					f_circle(tool_ox, tool_oy, tool_size);
 				tline(tool_ox, tool_oy, x, y, tool_size);
 				f_circle(x, y, tool_size);
+				put_pixel_batch(FALSE);
 				break;
 			}
 			if (tool_type == TOOL_HORIZONTAL)
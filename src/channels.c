@@ -79,7 +79,8 @@ static void click_newchan_cancel(cchan_dd *dt, void **wdata)
 static void click_newchan_ok(cchan_dd *dt, void **wdata)
 {
 	chanlist tlist;
-	int i, ii, j = mem_width * mem_height, range, rgb[3];
+	size_t l, j = (size_t)mem_width * mem_height;
+	int i, ii, range, rgb[3];
 	unsigned char sq1024[1024], *src, *dest, *tmp;
 	unsigned int k;
 	double r2, rr;
@@ -148,14 +149,14 @@ static void click_newchan_ok(cchan_dd *dt, void **wdata)
 				}
 				p2l[i] = ii ^ 255;
 			}
-			for (i = 0; i < j; i++)
+			for (l = 0; l < j; l++)
 			{
-				dest[i] = p2l[src[i]];
+				dest[l] = p2l[src[l]];
 			}
 		}
 		else
 		{
-			for (i = 0; i < j; i++)
+			for (l = 0; l < j; l++)
 			{
 				range = (src[0] - rgb[0]) * (src[0] - rgb[0]) +
 					(src[1] - rgb[1]) * (src[1] - rgb[1]) +
@@ -170,7 +171,7 @@ static void click_newchan_ok(cchan_dd *dt, void **wdata)
 					ii += (k - ii * ii) / (ii + ii);
 					ii -= ((k - ii * ii) >> 17) & 1;
 				}
-				dest[i] = ii ^ 255;
+				dest[l] = ii ^ 255;
 				src += 3;
 			}
 		}
@@ -188,9 +189,9 @@ static void click_newchan_ok(cchan_dd *dt, void **wdata)
 		if (mem_img_bpp == 3) /* RGB */
 		{
 			src = mem_img[CHN_IMAGE] + chan_new_state - 4;
-			for (i = 0; i < j; i++)
+			for (l = 0; l < j; l++)
 			{
-				dest[i] = *src;
+				dest[l] = *src;
 				src += 3;
 			}
 		}
@@ -200,9 +201,9 @@ static void click_newchan_ok(cchan_dd *dt, void **wdata)
 			else if (chan_new_state == 5) tmp = &mem_pal[0].green;
 			else tmp = &mem_pal[0].blue;
 			src = mem_img[CHN_IMAGE];
-			for (i = 0; i < j; i++)
+			for (l = 0; l < j; l++)
 			{
-				dest[i] = *(tmp + src[i] * sizeof(png_color));
+				dest[l] = *(tmp + src[l] * sizeof(png_color));
 			}
 		}
 		break;
@@ -223,7 +224,7 @@ dofail:
 	/* Invert */
 	if (dt->inv)
 	{
-		for (i = 0; i < j; i++) dest[i] ^= 255;
+		for (l = 0; l < j; l++) dest[l] ^= 255;
 	}
 	mem_undo_prepare();
 
@@ -355,8 +356,9 @@ void pressed_channel_disable(int state, int channel)
 static int do_threshold(spin1_dd *dt, void **wdata)
 {
 	run_query(wdata);
-	spot_undo(UNDO_FILT);
-	mem_threshold(mem_img[mem_channel], mem_width * mem_height * MEM_BPP, dt->n[0]);
+	if (spot_undo(UNDO_FILT)) return (FALSE);
+	mem_threshold(mem_img[mem_channel], (size_t)mem_width * mem_height *
+		MEM_BPP, dt->n[0]);
 	mem_undo_prepare();
 	return (TRUE);
 }
@@ -372,8 +374,9 @@ void pressed_threshold()
 void pressed_unassociate()
 {
 	if (mem_img_bpp == 1) return;
-	spot_undo(UNDO_COL);
-	mem_demultiply(mem_img[CHN_IMAGE], mem_img[CHN_ALPHA], mem_width * mem_height, 3);
+	if (spot_undo(UNDO_COL)) return;
+	mem_demultiply(mem_img[CHN_IMAGE], mem_img[CHN_ALPHA],
+		(size_t)mem_width * mem_height, 3);
 	mem_undo_prepare();
 	update_stuff(UPD_IMG);
 }
@@ -401,6 +401,9 @@ static double get_vect(int col)
 	return ((c2 + c2 + c1) * 255 + midc * 255 / (double)maxc);
 }
 
+/* The colour caches need no lock: map fields only ever get set, always to
+ * the same value for the same colour, so a field lost to a concurrent
+ * read-modify-write just reads as unmapped and gets evaluated again */
 #if defined(U_THREADS) && defined(HAVE__SFA)
 /* Hope this and __sync_fetch_and_add() always come as a package */
 #define SETBIT(A,B) __sync_fetch_and_or(&(A), (B))
@@ -408,6 +411,10 @@ static double get_vect(int col)
 #define SETBIT(A,B) (A) |= (B)
 #endif
 
+/* Palette cache entry is colour + 0x1000000, shifted left, plus the verdict;
+ * being one word, it is valid or not as a whole, whatever threads do */
+#define PCACHE_KEY(C) ((C) + 0x1000000)
+
 
 /* Answer which pixels are masked through selectivity */
 int csel_scan(int start, int step, int cnt, unsigned char *mask,
@@ -416,12 +423,8 @@ int csel_scan(int start, int step, int cnt, unsigned char *mask,
 	unsigned char res = 0;
 	double d, dist = 0.0, lxn[3];
 	int i, j, k, l, jj, st3 = step * 3;
-#ifndef HAVE__SFA
-	DEF_MUTEX(csel_lock); // To prevent concurrent writes to *info
 
 
-	LOCK_MUTEX(csel_lock);
-#endif
 	cnt = start + step * (cnt - 1) + 1;
 	if (!mask)
 	{
@@ -432,9 +435,12 @@ int csel_scan(int start, int step, int cnt, unsigned char *mask,
 	{
 		for (i = start; i < cnt; i += step)
 		{
+			guint32 e;
+
 			j = img[i];
 			k = PNG_2_INT(mem_pal[j]);
-			if (info->pcache[j] != k)
+			e = info->pcache[j];
+			if ((e >> 1) != PCACHE_KEY(k))
 			{
 				if (info->mode == 0) /* Sphere mode */
 				{
@@ -459,12 +465,10 @@ int csel_scan(int start, int step, int cnt, unsigned char *mask,
 					jj = abs(INT_2_B(info->center) - INT_2_B(k));
 					dist = l > jj ? l : jj;
 				}
-				if (dist <= info->range2)
-					SETBIT(info->pmap[j >> 5], 1U << (j & 31));
-				info->pcache[j] = k;
+				info->pcache[j] = e = (PCACHE_KEY(k) << 1) +
+					(dist <= info->range2);
 			}
-			if (((info->pmap[j >> 5] >> (j & 31)) ^ info->invert) & 1)
-				mask[i] |= 255;
+			if ((e ^ info->invert) & 1) mask[i] |= 255;
 		}
 	}
 	else if (info->mode == 0)	/* RGB image, sphere mode */
@@ -549,9 +553,6 @@ int csel_scan(int start, int step, int cnt, unsigned char *mask,
 				mask[i] |= 255;
 		}
 	}
-#ifndef HAVE__SFA
-	UNLOCK_MUTEX(csel_lock);
-#endif
 	return (res);
 }
 
@@ -593,8 +594,7 @@ void csel_reset(csel_info *info)
 	int i, j, k, l;
 
 	memset(info->colormap, 0, sizeof(info->colormap));
-	memset(info->pmap, 0, sizeof(info->pmap));
-	memset(info->pcache, 255, sizeof(info->pcache));
+	memset(info->pcache, 0, sizeof(info->pcache));
 	switch (info->mode)
 	{
 	case 0: /* L*X*N* sphere */
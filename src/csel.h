@@ -27,8 +27,8 @@ typedef struct
 	double range;
 	/* Cache fields */
 	guint32 colormap[CMAPSIZE * 2];
-	guint32 pmap[256 / 32];
-	int pcache[256], cbase, irange, amin, amax;
+	guint32 pcache[256];
+	int cbase, irange, amin, amax;
 	double clxn[3], cvec, range2;
 } csel_info;
 #define CSEL_SVSIZE offsetof(csel_info, colormap)
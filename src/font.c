@@ -32,6 +32,7 @@
 #include "canvas.h"
 #include "inifile.h"
 #include "font.h"
+#include "thread.h"
 
 #include <iconv.h>
 #include <ft2build.h>
@@ -188,6 +189,189 @@ static void ft_draw_bitmap(
 	}
 }
 
+/* Opened faces are kept around, most recently used first */
+
+#define FACE_CACHE 4
+
+typedef struct {
+	char *name;
+	int index, serial;
+	FT_Face face;
+} ft_face_slot;
+
+static FT_Library ft_lib;
+static ft_face_slot ft_faces[FACE_CACHE];
+static int ft_serial;
+
+static FT_Face ft_get_face(char *filename, int face_index, int *serial)
+{
+	ft_face_slot tmp;
+	int i;
+
+	if (!ft_lib && FT_Init_FreeType(&ft_lib)) return (NULL);
+	for (i = 0; i < FACE_CACHE; i++)
+	{
+		if (!ft_faces[i].name) break;
+		if ((ft_faces[i].index == face_index) &&
+			!strcmp(ft_faces[i].name, filename)) break;
+	}
+	if ((i < FACE_CACHE) && ft_faces[i].name) tmp = ft_faces[i]; // Found
+	else
+	{
+		tmp.name = strdup(filename);
+		if (!tmp.name) return (NULL);
+		if (FT_New_Face(ft_lib, filename, face_index, &tmp.face))
+		{
+			free(tmp.name);
+			return (NULL);
+		}
+		tmp.index = face_index;
+		tmp.serial = ++ft_serial;
+		if (i >= FACE_CACHE) // Drop the least recently used
+		{
+			i = FACE_CACHE - 1;
+			FT_Done_Face(ft_faces[i].face);
+			free(ft_faces[i].name);
+		}
+	}
+	memmove(ft_faces + 1, ft_faces, i * sizeof(ft_face_slot));
+	ft_faces[0] = tmp;
+	*serial = tmp.serial;
+	return (tmp.face);
+}
+
+/* Rendered glyphs are kept in a hashed LRU cache; a glyph is rendered with
+ * only the subpixel part of its position, and placed by the integer part */
+
+#define GLYPH_HASH 1024 /* Power of two */
+#define GLYPH_CACHE_MAX (4 * 1024 * 1024) /* Bytes */
+
+typedef struct {
+	int face, size, dpi;
+	FT_Int32 flags;
+	FT_Fixed m[4];
+	FT_UInt index;
+	int fx, fy;		// Subpixel offset
+} glyph_key;
+
+typedef struct ft_glyph ft_glyph;
+struct ft_glyph {
+	ft_glyph *prev, *next;	// LRU list
+	ft_glyph *hnext;	// Hash chain
+	glyph_key key;
+	int hash, mem, error;
+	int hadv, bearx, gw;	// Unscaled metrics
+	int ppb, left, top;
+	FT_Vector advance;
+	FT_Bitmap bitmap;
+};
+
+static ft_glyph *glyph_hash[GLYPH_HASH], glyph_lru = { &glyph_lru, &glyph_lru };
+static int glyph_mem;
+
+/* Keys go field by field, as padding between fields needn't match */
+static int glyph_key_eq(const glyph_key *a, const glyph_key *b)
+{
+	return ((a->face == b->face) && (a->size == b->size) &&
+		(a->dpi == b->dpi) && (a->flags == b->flags) &&
+		(a->m[0] == b->m[0]) && (a->m[1] == b->m[1]) &&
+		(a->m[2] == b->m[2]) && (a->m[3] == b->m[3]) &&
+		(a->index == b->index) && (a->fx == b->fx) && (a->fy == b->fy));
+}
+
+static ft_glyph *ft_get_glyph(FT_Face face, glyph_key *key, FT_Matrix *matrix,
+	int scalable)
+{
+	FT_GlyphSlot gs = face->glyph;
+	FT_Vector delta;
+	ft_glyph *g, **gp;
+	unsigned long v[11];
+	unsigned char *src = (void *)v;
+	guint32 h = 0;
+	int i, l, error;
+
+	/* "One at a time" hash, over the fields without padding */
+	v[0] = key->face; v[1] = key->size; v[2] = key->dpi;
+	v[3] = key->flags; v[4] = key->m[0]; v[5] = key->m[1];
+	v[6] = key->m[2]; v[7] = key->m[3]; v[8] = key->index;
+	v[9] = key->fx; v[10] = key->fy;
+	for (i = 0; i < sizeof(v); i++)
+	{
+		h += src[i];
+		h += h << 10;
+		h ^= h >> 6;
+	}
+	h += h << 3;
+	h ^= h >> 11;
+	h += h << 15;
+	h &= GLYPH_HASH - 1;
+
+	for (g = glyph_hash[h]; g; g = g->hnext)
+		if (glyph_key_eq(&g->key, key)) break;
+	if (g) // Move to front
+	{
+		g->prev->next = g->next;
+		g->next->prev = g->prev;
+	}
+	else
+	{
+		if (scalable)
+		{
+			delta.x = key->fx;
+			delta.y = key->fy;
+			FT_Set_Transform(face, matrix, &delta);
+		}
+		error = FT_Load_Glyph(face, key->index, key->flags);
+		l = error ? 0 : abs(gs->bitmap.pitch) * gs->bitmap.rows;
+		g = calloc(1, sizeof(ft_glyph) + l);
+		if (!g) return (NULL);
+		g->key = *key;
+		g->hash = h;
+		g->mem = sizeof(ft_glyph) + l;
+		if (!(g->error = error))
+		{
+			g->hadv = gs->metrics.horiAdvance;
+			g->bearx = gs->metrics.horiBearingX;
+			g->gw = gs->metrics.width;
+			switch (gs->bitmap.pixel_mode)
+			{
+			case FT_PIXEL_MODE_GRAY:	g->ppb = 1; break;
+			case FT_PIXEL_MODE_GRAY2:	g->ppb = 2; break;
+			case FT_PIXEL_MODE_GRAY4:	g->ppb = 4; break;
+			case FT_PIXEL_MODE_MONO:	g->ppb = 8; break;
+			default: g->ppb = 0; break; // Unsupported mode
+			}
+			g->left = gs->bitmap_left;
+			g->top = gs->bitmap_top;
+			g->advance = gs->advance;
+			g->bitmap = gs->bitmap;
+			g->bitmap.buffer = (void *)(g + 1);
+			if (l) memcpy(g->bitmap.buffer, gs->bitmap.buffer, l);
+		}
+		g->hnext = glyph_hash[h];
+		glyph_hash[h] = g;
+		glyph_mem += g->mem;
+	}
+	g->next = glyph_lru.next;
+	g->prev = &glyph_lru;
+	g->next->prev = g;
+	glyph_lru.next = g;
+
+	/* Drop the least recently used, but not the one just used */
+	while ((glyph_mem > GLYPH_CACHE_MAX) && (glyph_lru.prev != g))
+	{
+		ft_glyph *t = glyph_lru.prev;
+
+		t->prev->next = &glyph_lru;
+		glyph_lru.prev = t->prev;
+		for (gp = glyph_hash + t->hash; *gp != t; gp = &(*gp)->hnext);
+		*gp = t->hnext;
+		glyph_mem -= t->mem;
+		free(t);
+	}
+	return (g);
+}
+
 static inline void extend(int *rxy, int x0, int y0, int x1, int y1)
 {
 	if (x0 < rxy[0]) rxy[0] = x0;
@@ -232,13 +416,13 @@ static unsigned char *mt_text_render(
 	int		minxy[4] = { MAX_WIDTH, MAX_HEIGHT, -MAX_WIDTH, -MAX_HEIGHT };
 	size_t		s, ssize1 = characters, ssize2 = characters * 4 + 5;
 	iconv_t		cd;
-	FT_Library	library;
 	FT_Face		face;
 	FT_Matrix	matrix;
 	FT_Vector	pen, uninit_(pen0);
 	FT_Error	error;
-	FT_UInt		glyph_index;
 	FT_Int32	unichar, *txt2, *tmp2;
+	glyph_key	key;
+	ft_glyph	*g;
 	FT_Int32	load_flags = FT_LOAD_RENDER | FT_LOAD_FORCE_AUTOHINT;
 
 //printf("\n%s %i %s %s %f %i %f %i\n", text, characters, filename, encoding, size, face_index, angle, flags);
@@ -247,11 +431,9 @@ static unsigned char *mt_text_render(
 
 	if (characters < 1) return NULL;
 
-	error = FT_Init_FreeType( &library );
-	if (error) return NULL;
-
-	error = FT_New_Face( library, filename, face_index, &face );
-	if (error) goto fail2;
+	memset(&key, 0, sizeof(key));
+	face = ft_get_face(filename, face_index, &key.face);
+	if (!face) return NULL;
 
 	scalable = FT_IS_SCALABLE(face);
 
@@ -291,12 +473,16 @@ static unsigned char *mt_text_render(
 			load_flags |= FT_LOAD_NO_BITMAP;
 		}
 
-		error = FT_Set_Char_Size(face, size * 64, 0, dpi, 0);
+		error = FT_Set_Char_Size(face, key.size = size * 64, 0,
+			key.dpi = dpi, 0);
 		if (error) goto fail1;
+		key.m[0] = matrix.xx; key.m[1] = matrix.xy;
+		key.m[2] = matrix.yx; key.m[3] = matrix.yy;
 
 		Y1 = FT_MulFix(face->ascender, face->size->metrics.y_scale);
 		Y2 = FT_MulFix(face->descender, face->size->metrics.y_scale);
 	}
+	key.flags = load_flags;
 	spc = font_spacing * 0.64;
 	spcx = font_spacing * 0.64 * ca;
 	spcy = font_spacing * 0.64 * sa;
@@ -357,25 +543,25 @@ static unsigned char *mt_text_render(
 			// Apply spacing
 			if (ll) pen.x += spcx , pen.y += spcy;
 
-			glyph_index = FT_Get_Char_Index(face, unichar);
+			key.index = FT_Get_Char_Index(face, unichar);
 
 			if (scalable)	// Cannot rotate fixed fonts
-				FT_Set_Transform(face, &matrix, &pen);
+				key.fx = pen.x & 63 , key.fy = pen.y & 63;
 
-			error = FT_Load_Glyph( face, glyph_index, load_flags );
-			if ( error ) continue;
+			g = ft_get_glyph(face, &key, &matrix, scalable);
+			if (!g || g->error) continue;
 
 			if (pass < 0) // Calculating line bounds
 			{
 				if (lw[0] > tx0) lw[0] = tx0;
-				tx0 += face->glyph->metrics.horiAdvance;
+				tx0 += g->hadv;
 				if (lw[1] < tx0) lw[1] = tx0;
 				tx0 += spc;
 				continue;
 			}
 
 			// Remember boundaries
-			tx0 = lw[0] + face->glyph->metrics.horiBearingX;
+			tx0 = lw[0] + g->bearx;
 			if (!ll++)
 			{
 				if (!xflag++) X1 = X2 = tx0; // First glyph
@@ -383,39 +569,27 @@ static unsigned char *mt_text_render(
 			}
 			tx0 += (pen.x - pen0.x) * ca + (pen.y - pen0.y) * sa;
 			if (X1 > tx0) X1 = tx0;
-			tx0 += face->glyph->metrics.width - 64;
+			tx0 += g->gw - 64;
 			if (X2 < tx0) X2 = tx0;
 
-			switch (face->glyph->bitmap.pixel_mode)
-			{
-				case FT_PIXEL_MODE_GRAY:	ppb = 1; break;
-				case FT_PIXEL_MODE_GRAY2:	ppb = 2; break;
-				case FT_PIXEL_MODE_GRAY4:	ppb = 4; break;
-				case FT_PIXEL_MODE_MONO:	ppb = 8; break;
-				default: continue; // Unsupported mode
-			}
+			if (!(ppb = g->ppb)) continue; // Unsupported mode
 
-			bx = face->glyph->bitmap_left;
-			by = -face->glyph->bitmap_top;
-			bw = face->glyph->bitmap.width;
-			bh = face->glyph->bitmap.rows;
+			// Glyph was rendered at subpixel offset, move it in place
+			bx = g->left + (pen.x >> 6);
+			by = -g->top - (pen.y >> 6);
+			bw = g->bitmap.width;
+			bh = g->bitmap.rows;
 			bits = bw && bh;
 
-			// Bitmap glyphs don't get offset by FreeType
-			if (!scalable || (bits && !face->glyph->outline.n_points))
-			{
-				bx += pen.x >> 6;
-				by -= pen.y >> 6;
-			}
-			pen.x += face->glyph->advance.x;
-			pen.y += face->glyph->advance.y;
+			pen.x += g->advance.x;
+			pen.y += g->advance.y;
 
 			// Remember bitmap bounds
 			if (!mem && bits)
 				extend(minxy, bx, by, bx + bw - 1, by + bh - 1);
 
 			// Draw bitmap onto clipboard memory in pass 1
-			if (mem) ft_draw_bitmap(mem, *width, &face->glyph->bitmap,
+			if (mem) ft_draw_bitmap(mem, *width, &g->bitmap,
 				bx - minxy[0], by - minxy[1], ppb);
 		}
 
@@ -539,10 +713,6 @@ static unsigned char *mt_text_render(
 fail0:
 	free(txt2);
 fail1:
-	FT_Done_Face(face);
-fail2:
-	FT_Done_FreeType(library);
-
 	return mem;
 }
 
@@ -555,12 +725,6 @@ fail2:
 
 #define SIZE_SHIFT 10
 #define MAXLEN 256
-#define SLOT_FONT 0
-#define SLOT_DIR 1
-#define SLOT_STYLE 2
-#define SLOT_SIZE 3
-#define SLOT_FILENAME 4
-#define SLOT_TOT 5
 
 
 
@@ -574,25 +738,101 @@ static void trim_tab( char *buf, char *txt)
 	if ( buf[0] == 0 ) snprintf(buf, MAXLEN, "_None");
 }
 
+/* Index file is binary: a header, then for each file its stamp, directory
+ * number, length of faces' data, and name, followed by faces' data: size
+ * type, family name and style name for each face.  Files with no faces are
+ * recorded too, so that the next reindexing will know to skip them */
+
+#define FONT_INDEX_MAGIC "mtPaint font index 1\n"
+#define FONT_INDEX_HDR 20
+
+#define GET32(buf) (((unsigned)(buf)[3] << 24) + ((buf)[2] << 16) + \
+	((buf)[1] << 8) + (buf)[0])
+#define PUT32(buf, v) (buf)[0] = (v) & 0xFF; (buf)[1] = ((v) >> 8) & 0xFF; \
+	(buf)[2] = ((v) >> 16) & 0xFF; (buf)[3] = (v) >> 24;
+
+typedef struct {
+	char *name, *faces;
+	unsigned int stamp[3];	// Modification time, size, inode
+	int dir, len, own;	// own = name & faces are malloc'ed
+} font_file;
+
+typedef struct {
+	font_file *f;
+	int n, max;
+} font_files;
+
+/* Read one file's record, return pointer past it, or NULL at end or error */
+static unsigned char *font_index_rec(unsigned char *buf, unsigned char *end,
+	font_file *ff)
+{
+	unsigned char *tmp;
+
+	if (end - buf < FONT_INDEX_HDR) return (NULL);
+	ff->stamp[0] = GET32(buf);
+	ff->stamp[1] = GET32(buf + 4);
+	ff->stamp[2] = GET32(buf + 8);
+	ff->dir = GET32(buf + 12);
+	ff->len = GET32(buf + 16);
+	ff->name = (char *)(buf += FONT_INDEX_HDR);
+	if (!(tmp = memchr(buf, 0, end - buf))) return (NULL);
+	ff->faces = (char *)++tmp;
+	if ((ff->len < 0) || (ff->len > end - tmp)) return (NULL);
+	return (tmp + ff->len);
+}
+
+/* Read one face's data, return pointer past it, or NULL at end or error */
+static char *font_index_face(char *buf, char *end, int *size, char **names)
+{
+	if (end - buf < 6) return (NULL);
+	*size = GET32((unsigned char *)buf);
+	names[0] = buf += 4;
+	if (!(buf = memchr(buf, 0, end - buf))) return (NULL);
+	names[1] = ++buf;
+	if (!(buf = memchr(buf, 0, end - buf))) return (NULL);
+	return (buf + 1);
+}
+
+static font_file *font_file_add(font_files *ffs)
+{
+	font_file *tmp;
+	int n = ffs->max ? ffs->max * 2 : 256;
+
+	if (ffs->n >= ffs->max)
+	{
+		if (!(tmp = realloc(ffs->f, n * sizeof(font_file)))) return (NULL);
+		ffs->f = tmp;
+		ffs->max = n;
+	}
+	tmp = ffs->f + ffs->n++;
+	memset(tmp, 0, sizeof(font_file));
+	return (tmp);
+}
+
+static int font_file_cmp(const void *a, const void *b)
+{
+	return (strcmp(((font_file *)a)->name, ((font_file *)b)->name));
+}
+
 typedef struct statchain statchain;
 struct statchain {
 	statchain *p;
 	struct stat buf;
 };
 
-static void font_dir_search(FT_Library *ft_lib, int dirnum, FILE *fp, char *dir,
-	statchain *cc)
+static int font_dir_search(font_files *old, font_files *ffs, int dirnum,
+	char *dir, statchain *cc)
 {	// Search given directory for font files - recursively traverse directories
 	statchain	sc = { cc };
-	FT_Face		face;
+	font_file	*ff, *of;
 	DIR		*dp;
 	struct dirent	*ep;
-	char		full_name[PATHBUF], tmp[2][MAXLEN];
-	int		face_index;
+	char		full_name[PATHBUF];
+	int		res = TRUE;
 
 
 	dp = opendir(dir);
-	if (!dp) return;
+	if (!dp) return (TRUE);
 
 	while ( (ep = readdir(dp)) )
 	{
@@ -618,74 +858,197 @@ static void font_dir_search(FT_Library *ft_lib, int dirnum, FILE *fp, char *dir,
 					(sc.buf.st_ino == cc->buf.st_ino)) break;
 				if (cc) continue; // Directory loop
 			}
-			font_dir_search( ft_lib, dirnum, fp, full_name, &sc );
+			if (!(res = font_dir_search(old, ffs, dirnum, full_name,
+				&sc))) break;
 			continue;
 		}
-		// File so see if its a font
-		for (	face_index = 0;
-			!FT_New_Face( *ft_lib, full_name, face_index, &face );
-			face_index++ )
+		// File so remember it, for checking if it's a font
+		if (!(ff = font_file_add(ffs)))
+		{
+			res = FALSE;
+			break;
+		}
+		ff->dir = dirnum;
+		ff->stamp[0] = sc.buf.st_mtime;
+		ff->stamp[1] = sc.buf.st_size;
+		ff->stamp[2] = sc.buf.st_ino;
+		ff->name = full_name;
+		of = old->n ? bsearch(ff, old->f, old->n, sizeof(font_file),
+			font_file_cmp) : NULL;
+		if (of && !memcmp(of->stamp, ff->stamp, sizeof(ff->stamp)))
+		{	// Unchanged since last time
+			ff->name = of->name;
+			ff->faces = of->faces;
+			ff->len = of->len;
+		}
+		else if ((ff->name = strdup(full_name))) ff->own = TRUE;
+		else
 		{
-			int size_type = 0;
+			ffs->n--;
+			res = FALSE;
+			break;
+		}
+	}
+	closedir(dp);
+	return (res);
+}
 
-			if (!FT_IS_SCALABLE(face)) size_type =
-				face->available_sizes[0].height +
-				(face->available_sizes[0].width << SIZE_SHIFT) +
-				(face_index << (SIZE_SHIFT * 2));
+static void font_file_parse(FT_Library lib, font_file *ff)
+{	// See if the file is a font
+	FT_Face face;
+	char tmp[2][MAXLEN], *buf = NULL, *t;
+	int face_index, n, l, l0, len = 0;
 
-// I use a tab character as a field delimeter, so replace any in the strings with a space
+	for (	face_index = 0;
+		!FT_New_Face(lib, ff->name, face_index, &face);
+		face_index++ )
+	{
+		int size_type = 0;
+
+		if (!FT_IS_SCALABLE(face)) size_type =
+			face->available_sizes[0].height +
+			(face->available_sizes[0].width << SIZE_SHIFT) +
+			(face_index << (SIZE_SHIFT * 2));
+
+		trim_tab( tmp[0], face->family_name );
+		trim_tab( tmp[1], face->style_name );
+		n = face->num_faces;
+		FT_Done_Face(face);
+
+		l0 = strlen(tmp[0]) + 1;
+		l = 4 + l0 + strlen(tmp[1]) + 1;
+		if (!(t = realloc(buf, len + l))) break;
+		buf = t;
+		t += len;
+		len += l;
+		PUT32((unsigned char *)t, size_type);
+		strcpy(t + 4, tmp[0]);
+		strcpy(t + 4 + l0, tmp[1]);
+
+		if (face_index + 1 >= n) break;
+	}
+	ff->faces = buf;
+	ff->len = buf ? len : 0;
+}
 
-			trim_tab( tmp[0], face->family_name );
-			trim_tab( tmp[1], face->style_name );
+typedef struct {
+	font_file *f;
+	int *todo;
+} font_parse_data;
 
-			fprintf(fp, "%s\t%i\t%s\t%i\t%s\n",
-				tmp[0], dirnum, tmp[1], size_type, full_name);
+static void font_parse_files(tcb *thread)
+{
+	font_parse_data *fd = thread->data;
+	FT_Library lib;
+	int i, ii, cnt = thread->nsteps;
 
-			if ( (face_index+1) >= face->num_faces )
-			{
-				FT_Done_Face(face);
-				break;
-			}
-			FT_Done_Face(face);
+	if (!FT_Init_FreeType(&lib))
+	{
+		for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
+		{
+			font_file_parse(lib, fd->f + fd->todo[i]);
+			if (thread_step(thread, ii + 1, cnt, 10)) break;
 		}
+		FT_Done_FreeType(lib);
 	}
-	closedir(dp);
+	thread_done(thread);
 }
 
 static void font_index_create(char *filename, char **dir_in)
 {	// dir_in points to NULL terminated sequence of directories to search for fonts
 	statchain	sc = { NULL };
-	FT_Library	library;
-	int		i;
+	font_files	old = { NULL, 0, 0 }, ffs = { NULL, 0, 0 };
+	font_parse_data	fd;
+	threaddata	*tdata;
+	font_file	*ff;
+	unsigned char	*oldbuf, *tmp, hdr[FONT_INDEX_HDR];
+	int		i, n, l, res = TRUE;
 	FILE		*fp;
 
 
-	if (FT_Init_FreeType(&library)) return;
+	/* Load previous index, to reuse what did not change */
+	oldbuf = (void *)slurp_file_l(filename, 0, &l);
+	if (oldbuf && (l > strlen(FONT_INDEX_MAGIC)) &&
+		!strncmp((char *)oldbuf, FONT_INDEX_MAGIC, strlen(FONT_INDEX_MAGIC)))
+	{
+		tmp = oldbuf + strlen(FONT_INDEX_MAGIC);
+		while ((ff = font_file_add(&old)) &&
+			(tmp = font_index_rec(tmp, oldbuf + l, ff)));
+		if (ff) old.n--; // Drop the unfilled one
+		if (old.n) qsort(old.f, old.n, sizeof(font_file), font_file_cmp);
+	}
 
-	if ((fp = fopen(filename, "w")))
+	for (i = 0; res && dir_in[i]; i++)
 	{
-		for (i = 0; dir_in[i]; i++)
-		{
 #ifdef WIN32
-			/* With old MinGW, stat() fails if dirname has path
-			 * separator on end, so cut it off before call */
-			char *s;
-			int l = strlen(dir_in[i]);
-			if (!l--) continue;
-			s = strdup(dir_in[i]);
-			if ((s[l] == '\\') || (s[l] == '/')) s[l] = '\0';
-			l = stat(s, &sc.buf);
-			free(s);
-			if (l < 0) continue;
+		/* With old MinGW, stat() fails if dirname has path
+		 * separator on end, so cut it off before call */
+		char *s;
+		int l = strlen(dir_in[i]);
+		if (!l--) continue;
+		s = strdup(dir_in[i]);
+		if ((s[l] == '\\') || (s[l] == '/')) s[l] = '\0';
+		l = stat(s, &sc.buf);
+		free(s);
+		if (l < 0) continue;
 #else
-			if (stat(dir_in[i], &sc.buf) < 0) continue;
+		if (stat(dir_in[i], &sc.buf) < 0) continue;
 #endif
-			font_dir_search(&library, i, fp, dir_in[i], &sc);
+		res = font_dir_search(&old, &ffs, i, dir_in[i], &sc);
+	}
+
+	/* Look into new and changed files, in parallel */
+	fd.f = ffs.f;
+	fd.todo = NULL;
+	for (i = n = 0; i < ffs.n; i++) n += ffs.f[i].own;
+	if (res && n && (res = !!(fd.todo = malloc(n * sizeof(int)))))
+	{
+		/* Files left unparsed, if FreeType fails to init or the user
+		 * cancels, are not "no faces" - skip them in the index */
+		for (i = n = 0; i < ffs.n; i++)
+		{
+			if (!ffs.f[i].own) continue;
+			ffs.f[i].len = -1;
+			fd.todo[n++] = i;
+		}
+		if ((tdata = talloc(MA_ALIGN_DEFAULT, n, &fd, sizeof(fd),
+			NULL, NULL)))
+		{
+			launch_threads(font_parse_files, tdata, NULL, n);
+			free(tdata);
+		}
+		else res = FALSE;
+	}
+
+	if (res && (fp = fopen(filename, "wb")))
+	{
+		fputs(FONT_INDEX_MAGIC, fp);
+		for (i = 0; i < ffs.n; i++)
+		{
+			ff = ffs.f + i;
+			if (ff->len < 0) continue; // Try again next time
+			PUT32(hdr, ff->stamp[0]);
+			PUT32(hdr + 4, ff->stamp[1]);
+			PUT32(hdr + 8, ff->stamp[2]);
+			PUT32(hdr + 12, ff->dir);
+			PUT32(hdr + 16, ff->len);
+			fwrite(hdr, 1, FONT_INDEX_HDR, fp);
+			fwrite(ff->name, 1, strlen(ff->name) + 1, fp);
+			if (ff->len) fwrite(ff->faces, 1, ff->len, fp);
 		}
 		fclose(fp);
 	}
 
-	FT_Done_FreeType(library);
+	for (i = 0; i < ffs.n; i++)
+	{
+		if (!ffs.f[i].own) continue;
+		free(ffs.f[i].name);
+		free(ffs.f[i].faces);
+	}
+	free(fd.todo);
+	free(ffs.f);
+	free(old.f);
+	free(oldbuf);
 }
 
 
@@ -785,36 +1148,37 @@ MT 24-8-2007
 
 static void font_index_load(char *filename)
 {
-	char *buf, *tmp, *tail, *slots[SLOT_TOT];
-	int i, dir, size;
+	font_file ff;
+	unsigned char *buf, *end;
+	char *face, *names[2];
+	int l, size;
 
 
 	font_mem = wjmemnew(0, 0);
-	font_text = slurp_file(filename, 1);
+	font_text = slurp_file_l(filename, 0, &l);
 	if (!font_mem || !font_text)
 	{
 		font_mem_clear();
 		return;
 	}
+	/* Not an index in current format - leave it to be recreated */
+	if ((l <= strlen(FONT_INDEX_MAGIC)) ||
+		strncmp(font_text, FONT_INDEX_MAGIC, strlen(FONT_INDEX_MAGIC)))
+	{
+		font_mem_clear();
+		return;
+	}
 
-	for (buf = font_text + 1; *buf; buf = tmp)
+	buf = (void *)(font_text + strlen(FONT_INDEX_MAGIC));
+	end = (void *)(font_text + l);
+	while ((buf = font_index_rec(buf, end, &ff)))
 	{
-		buf += strspn(buf, "\r\n");
-		if (!*buf) break;
-		tmp = buf + strcspn(buf, "\r\n");
-		if (*tmp) *tmp++ = 0;
-		for (i = 0; i < SLOT_TOT; i++)
+		for (face = ff.faces; (face = font_index_face(face,
+			ff.faces + ff.len, &size, names)); )
 		{
-			slots[i] = buf;
-			buf += strcspn(buf, "\t");
-			if (*buf) *buf++ = 0;
-		}
-		dir = strtol(slots[SLOT_DIR], &tail, 10);
-		if (*tail) break;
-		size = strtol(slots[SLOT_SIZE], &tail, 10);
-		if (*tail) break;
-		if (!font_mem_add(slots[0], dir, slots[2], size, slots[4]))
-		{	// Memory failure
+			if (font_mem_add(names[0], ff.dir, names[1], size,
+				ff.name)) continue;
+			// Memory failure
 			font_mem_clear();
 			return;
 		}
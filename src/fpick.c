@@ -75,6 +75,15 @@ typedef struct {
 	void **hbox, **entry;
 	void **ok, **cancel;
 	memx2 files;
+	DIR *scan_dp;		// Directory being scanned in background
+	char *scan_select;	// Name to select when found there
+	guint scan_idle;
+	int scan_rows;		// Size of rows part of "files"
+	memx2 scan_mem;		// Rows read but not yet shown
+	int scan_cnt;		// Count of those
+	int scan_found;		// Row with name to select, or -1
+	int scan_idx;		// Selected row as of last list update
+	time_t scan_time, scan_mtime;
 	char fname[PATHBUF];
 	char txt_directory[PATHBUF];	// Current directory - Normal C string
 	char txt_mask[PATHTXT];		// Filter mask - UTF8 in GTK+2
@@ -294,6 +303,19 @@ static void fpick_directory_new(fpick_dd *dt, char *name)
 	cmd_reset(dt->combo, dt);
 }
 
+static void scan_stop(fpick_dd *dt)
+{
+	if (dt->scan_idle) gtk_idle_remove(dt->scan_idle);
+	dt->scan_idle = 0;
+	if (dt->scan_dp) closedir(dt->scan_dp);
+	dt->scan_dp = NULL;
+	g_free(dt->scan_select);
+	dt->scan_select = NULL;
+	free(dt->scan_mem.buf);
+	memset(&dt->scan_mem, 0, sizeof(dt->scan_mem));
+	dt->scan_cnt = 0;
+}
+
 #ifdef WIN32
 
 #include <ctype.h>
@@ -352,6 +374,7 @@ static void fpick_scan_drives(fpick_dd *dt)	// Scan drives, populate widgets
 	/* Get the current drive letter */
 	if (dt->txt_directory[1] == ':') cdrive = dt->txt_directory[0];
 
+	scan_stop(dt);
 	dt->txt_directory[0] = '\0';
 	cmd_setv(dt->combo, "", ENTRY_VALUE); // Just clear it
 
@@ -363,22 +386,41 @@ static void fpick_scan_drives(fpick_dd *dt)	// Scan drives, populate widgets
 
 #define MAX_DIR_FILES (16 * 1024 * 1024) /* 16+ million is when to say "Enough" */
 
-static void scan_dir(fpick_dd *dt, DIR *dp, char *select)
+#define SCAN_STEP 1000 /* Directory entries to read in one go */
+
+/* Add index array and mapping array after the rows */
+static void scan_index(fpick_dd *dt, memx2 *mem)
 {
-	char full_name[PATHBUF], txt_size[64], txt_date[64], tmp_txt[64];
-	char *nm, *src, *dest, *dir = dt->txt_directory;
-	memx2 mem = dt->files;
-	struct tm *lt;
-	struct dirent *ep;
-	struct stat buf;
+	char *src;
 	int *tc;
-	int subdir, tf, n, l = strlen(dir), cnt = 0;
+	int l, n;
+
+	l = (~(unsigned)mem->here + 1) & (sizeof(int) - 1);
+	n = dt->cnt * COL_MAX;
+	getmemx2(mem, l + (n + dt->cnt) * sizeof(int));
+	// Fill index array
+	tc = dt->fcols = (void *)(mem->buf + mem->here + l);
+	src = mem->buf;
+	while (n-- > 0)
+	{
+		*tc = src - (char *)tc;
+		tc++;
+		src += strlen(src) + 1;
+	}
+	// Setup mapping array
+	dt->fmap = tc;
+}
+
+static void scan_start(fpick_dd *dt, DIR *dp, char *select)
+{
+	memx2 mem = dt->files;
+	int cnt = 0;
 
 	mem.here = 0;
 	getmemx2(&mem, 8000); // default size
 
 	dt->idx = -1;
-	if (strcmp(dir, DIR_SEP_STR)) // Have a parent dir to move to?
+	if (strcmp(dt->txt_directory, DIR_SEP_STR)) // Have a parent dir to move to?
 	{
 		// Field #0 - original name
 		addstr(&mem, "..", 0);
@@ -389,8 +431,63 @@ static void scan_dir(fpick_dd *dt, DIR *dp, char *select)
 		addchars(&mem, 0, 3 + 2);
 		cnt++;
 	}
+	dt->cnt = cnt;
+	dt->scan_rows = mem.here;
+	dt->files = mem;
+	dt->scan_dp = dp;
+	dt->scan_select = g_strdup(select);
+	dt->scan_found = dt->scan_idx = -1;
+}
 
-	while ((cnt < MAX_DIR_FILES) && (ep = readdir(dp)))
+/* File size and time, as shown in the list */
+static void scan_size(char *txt_size, struct stat *buf)
+{
+	char tmp_txt[64], *src, *dest;
+	int k;
+
+#ifdef WIN32
+	k = snprintf(tmp_txt, 64, "%I64u", (unsigned long long)buf->st_size);
+#else
+	k = snprintf(tmp_txt, 64, "%llu", (unsigned long long)buf->st_size);
+#endif
+	memset(txt_size, ' ', 20);
+	dest = txt_size + 20; *dest-- = '\0';
+	for (src = tmp_txt + k - 1; src - tmp_txt > 2; )
+	{
+		*dest-- = *src--;
+		*dest-- = *src--;
+		*dest-- = *src--;
+		*dest-- = ',';
+	}
+	while (src - tmp_txt >= 0) *dest-- = *src--;
+}
+
+static void scan_date(char *txt_date, struct stat *buf)
+{
+	struct tm *lt;
+
+	strcpy(txt_date, " "); // to sort failed files after dirs
+	lt = localtime(&buf->st_mtime);
+	/* !!! localtime() can fail and return NULL if given
+	 * "wrong" input value */
+	if (lt) strftime(txt_date, 60, "%Y-%m-%d   %H:%M.%S", lt);
+}
+
+/* Read up to "n" directory entries, holding them apart from the rows already
+ * shown; return TRUE if no more to read */
+static int scan_dir(fpick_dd *dt, int n)
+{
+	char full_name[PATHBUF], txt_size[64], txt_date[64];
+	char *nm, *src, *dir = dt->txt_directory;
+	char *select = dt->scan_select;
+	memx2 mem = dt->scan_mem;
+	struct dirent *ep;
+	struct stat buf;
+	int subdir, tf, l = strlen(dir), cnt = dt->cnt + dt->scan_cnt;
+	int done = FALSE;
+
+	while ((n-- > 0) && !(done = (cnt >= MAX_DIR_FILES) ||
+		!(ep = readdir(dt->scan_dp))))
 	{
 		wjstrcat(full_name, PATHBUF, dir, l, ep->d_name, NULL);
 
@@ -416,7 +513,7 @@ static void scan_dir(fpick_dd *dt, DIR *dp, char *select)
 		else if (!dt->allow_files) continue;
 
 		/* Remember which row has matching name */
-		if (select && !strcmp(ep->d_name, select)) dt->idx = cnt;
+		if (select && !strcmp(ep->d_name, select)) dt->scan_found = cnt;
 
 		cnt++;
 
@@ -431,21 +528,7 @@ static void scan_dir(fpick_dd *dt, DIR *dp, char *select)
 		else
 		{
 			// Field #2 - file size
-#ifdef WIN32
-			n = snprintf(tmp_txt, 64, "%I64u", (unsigned long long)buf.st_size);
-#else
-			n = snprintf(tmp_txt, 64, "%llu", (unsigned long long)buf.st_size);
-#endif
-			memset(txt_size, ' ', 20);
-			dest = txt_size + 20; *dest-- = '\0';
-			for (src = tmp_txt + n - 1; src - tmp_txt > 2; )
-			{
-				*dest-- = *src--;
-				*dest-- = *src--;
-				*dest-- = *src--;
-				*dest-- = ',';
-			}
-			while (src - tmp_txt >= 0) *dest-- = *src--;
+			scan_size(txt_size, &buf);
 			addstr(&mem, txt_size, 0);
 			// Field #3 - file type (extension)
 			src = strrchr(nm, '.');
@@ -461,11 +544,7 @@ static void scan_dir(fpick_dd *dt, DIR *dp, char *select)
 			}
 			else addchars(&mem, 0, 1);
 			// Field #4 - file modification time
-			strcpy(txt_date, " "); // to sort failed files after dirs
-			lt = localtime(&buf.st_mtime);
-			/* !!! localtime() can fail and return NULL if given
-			 * "wrong" input value */
-			if (lt) strftime(txt_date, 60, "%Y-%m-%d   %H:%M.%S", lt);
+			scan_date(txt_date, &buf);
 			addstr(&mem, txt_date, 0);
 		}
 		// Field #5 - case-insensitive sort key
@@ -482,25 +561,192 @@ static void scan_dir(fpick_dd *dt, DIR *dp, char *select)
 #endif
 		g_free(nm);
 	}
-	dt->cnt = cnt;
+	dt->scan_cnt = cnt - dt->cnt;
+	dt->scan_mem = mem;
 
-	/* Now add index array and mapping arrays to all this */
-	l = (~(unsigned)mem.here + 1) & (sizeof(int) - 1);
-	n = cnt * COL_MAX;
-	getmemx2(&mem, l + (n + cnt) * sizeof(int));
-	// Fill index array
-	tc = dt->fcols = (void *)(mem.buf + mem.here + l);
-	src = mem.buf;
-	while (n-- > 0)
+	return (done);
+}
+
+/* Append the rows read so far to those shown */
+static void scan_flush(fpick_dd *dt)
+{
+	memx2 mem = dt->files;
+	int l = dt->scan_mem.here;
+
+	mem.here = dt->scan_rows;
+	if (getmemx2(&mem, l) < l) l = dt->scan_cnt = 0; // Lose them
+	memcpy(mem.buf + mem.here, dt->scan_mem.buf, l);
+	mem.here += l;
+	dt->cnt += dt->scan_cnt;
+	dt->scan_rows = mem.here;
+	scan_index(dt, &mem);
+	dt->files = mem;
+	dt->scan_mem.here = dt->scan_cnt = 0;
+
+	/* Select the awaited name, unless the user selected something else */
+	if ((dt->scan_found >= 0) && (dt->scan_found < dt->cnt) &&
+		(dt->idx == dt->scan_idx)) dt->idx = dt->scan_found;
+	dt->scan_found = -1;
+}
+
+/* Finished scans are cached by directory's modification time; as that misses
+ * files rewritten in place, each file's own size and time get checked too,
+ * and directories we save into get dropped */
+
+#define FPICK_CACHE 8
+
+typedef struct {
+	char *dir, *rows;
+	time_t mtime;
+	int flags, cnt, len;
+} fpick_cached;
+
+static fpick_cached fpick_cache[FPICK_CACHE];
+
+static int scan_flags(fpick_dd *dt)
+{
+	return (dt->show_hidden + dt->allow_files * 2 + dt->allow_dirs * 4);
+}
+
+static int cache_find(fpick_dd *dt)
+{
+	int i, f = scan_flags(dt);
+
+	for (i = 0; i < FPICK_CACHE; i++)
 	{
-		*tc = src - (char *)tc;
-		tc++;
-		src += strlen(src) + 1;
+		if (!fpick_cache[i].dir) break;
+		if ((fpick_cache[i].flags == f) &&
+			!strcmp(fpick_cache[i].dir, dt->txt_directory)) return (i);
 	}
-	// Setup mapping array
-	dt->fmap = tc;
+	return (-1);
+}
+
+static void cache_remove(int i)
+{
+	if (i < 0) return;
+	free(fpick_cache[i].dir);
+	free(fpick_cache[i].rows);
+	memmove(fpick_cache + i, fpick_cache + i + 1,
+		(FPICK_CACHE - 1 - i) * sizeof(fpick_cached));
+	memset(fpick_cache + FPICK_CACHE - 1, 0, sizeof(fpick_cached));
+}
+
+/* Put at the top, pushing the least recently used out */
+static void cache_top(fpick_cached *c)
+{
+	cache_remove(FPICK_CACHE - 1);
+	memmove(fpick_cache + 1, fpick_cache,
+		(FPICK_CACHE - 1) * sizeof(fpick_cached));
+	fpick_cache[0] = *c;
+}
+
+static void cache_store(fpick_dd *dt)
+{
+	fpick_cached c;
+
+	cache_remove(cache_find(dt));
+	c.dir = strdup(dt->txt_directory);
+	c.rows = malloc(dt->scan_rows);
+	if (!c.dir || !c.rows)
+	{
+		free(c.dir);
+		free(c.rows);
+		return;
+	}
+	memcpy(c.rows, dt->files.buf, c.len = dt->scan_rows);
+	c.mtime = dt->scan_mtime;
+	c.flags = scan_flags(dt);
+	c.cnt = dt->cnt;
+	cache_top(&c);
+}
+
+/* See if cached files are still as they were */
+static int cache_valid(fpick_dd *dt, fpick_cached *c)
+{
+	char full_name[PATHBUF], txt[64], *fields[COL_MAX], *src = c->rows;
+	struct stat buf;
+	int i, j, l = strlen(dt->txt_directory);
+
+	for (i = 0; i < c->cnt; i++)
+	{
+		for (j = 0; j < COL_MAX; j++)
+		{
+			fields[j] = src;
+			src += strlen(src) + 1;
+		}
+		if (fields[COL_NAME][0] != 'F') continue; // Dirs show no details
+		wjstrcat(full_name, PATHBUF, dt->txt_directory, l,
+			fields[COL_FILE], NULL);
+		if (stat(full_name, &buf) < 0) return (FALSE);
+		scan_size(txt, &buf);
+		if (strcmp(txt, fields[COL_SIZE])) return (FALSE);
+		scan_date(txt, &buf);
+		if (strcmp(txt, fields[COL_TIME])) return (FALSE);
+	}
+	return (TRUE);
+}
 
+static int scan_cached(fpick_dd *dt, char *select)
+{
+	fpick_cached c;
+	memx2 mem = dt->files;
+	int i, *rp;
+
+	if ((i = cache_find(dt)) < 0) return (FALSE);
+	if ((fpick_cache[i].mtime != dt->scan_mtime) ||
+		!cache_valid(dt, fpick_cache + i))
+	{
+		cache_remove(i);
+		return (FALSE);
+	}
+	c = fpick_cache[i];
+	memmove(fpick_cache + 1, fpick_cache, i * sizeof(fpick_cached));
+	fpick_cache[0] = c;
+
+	mem.here = 0;
+	i = getmemx2(&mem, c.len) < c.len;
+	dt->files = mem;
+	if (i) return (FALSE);
+	memcpy(mem.buf, c.rows, mem.here = c.len);
+	dt->cnt = c.cnt;
+	dt->scan_rows = c.len;
+	scan_index(dt, &mem);
 	dt->files = mem;
+
+	dt->idx = -1;
+	if (select) for (i = 0 , rp = dt->fcols; i < c.cnt; i++ , rp += COL_MAX)
+	{
+		if (strcmp(RELREF(rp[COL_FILE]), select)) continue;
+		dt->idx = i;
+		break;
+	}
+	return (TRUE);
+}
+
+static void scan_done(fpick_dd *dt)
+{
+	scan_stop(dt);
+	/* Cache the result, unless directory changed too recently to tell */
+	if (dt->scan_time > dt->scan_mtime + 1) cache_store(dt);
+}
+
+static gboolean scan_idle(fpick_dd *dt)
+{
+	int done = scan_dir(dt, SCAN_STEP);
+
+	/* Refilter, resort and refill the list only when the new rows at least
+	 * double it, or it would take quadratic time */
+	if (!done && (dt->scan_cnt < dt->cnt)) return (TRUE);
+	scan_flush(dt);
+	if (done)
+	{
+		dt->scan_idle = 0;
+		scan_done(dt);
+	}
+	filter_dir(dt, dt->txt_mask);
+	cmd_reset(dt->list, dt);
+	dt->scan_idx = dt->idx;
+	return (!done);
 }
 
 /* Scan directory, populate widgets; return 1 if success, 0 if total failure,
@@ -508,11 +754,13 @@ static void scan_dir(fpick_dd *dt, DIR *dp, char *select)
 static int fpick_scan_directory(fpick_dd *dt, char *name, char *select)
 {
 	DIR	*dp;
+	struct stat buf;
 	char	*cp, *parent = NULL;
 	char	full_name[PATHBUF];
-	int len, fail, res = 1;
+	int i, len, fail, res = 1;
 
 
+	scan_stop(dt);
 	strncpy0(full_name, name, PATHBUF - 1);
 	len = strlen(full_name);
 	/* Ensure the invariant */
@@ -556,12 +804,26 @@ static int fpick_scan_directory(fpick_dd *dt, char *name, char *select)
 	strncpy(dt->txt_directory, full_name, PATHBUF);
 	fpick_directory_new(dt, full_name);	// Register directory in combo
 
-	scan_dir(dt, dp, select);
+	/* Reuse what is cached, or read what can be read quickly, and leave
+	 * the rest to be read in the background */
+	dt->scan_time = time(NULL);
+	dt->scan_mtime = stat(full_name, &buf) < 0 ? dt->scan_time :
+		buf.st_mtime;
+	if (scan_cached(dt, select)) closedir(dp);
+	else
+	{
+		scan_start(dt, dp, select);
+		i = scan_dir(dt, SCAN_STEP);
+		scan_flush(dt);
+		if (i) scan_done(dt);
+		else dt->scan_idle = threads_idle_add_priority(
+			GTK_PRIORITY_REDRAW + 5, (GtkFunction)scan_idle, dt);
+	}
 	g_free(parent);
-	closedir(dp);
 	filter_dir(dt, dt->txt_mask);
 
 	cmd_reset(dt->list, dt);
+	dt->scan_idx = dt->idx;
 
 	return (res);
 }
@@ -830,7 +1092,12 @@ static int fpick_entry_key(fpick_dd *dt, void **wdata, int what, void **where,
 static void fpick_btn(fpick_dd *dt, void **wdata, int what, void **where)
 {
 	if (what == op_EVT_CANCEL) do_evt_1_d(dt->cancel);
-	else if (fpick_wildcard(dt, TRUE)) do_evt_1_d(dt->ok);
+	else if (fpick_wildcard(dt, TRUE))
+	{
+		/* Saving can rewrite a file without touching the directory */
+		if (!(dt->flags & FPICK_LOAD)) cache_remove(cache_find(dt));
+		do_evt_1_d(dt->ok);
+	}
 }
 
 static void set_fname(fpick_dd *dt, char *name, int raw)
@@ -856,6 +1123,8 @@ static void fpick_destroy(fpick_dd *dt, void **wdata)
 	char txt[64], buf[PATHBUF];
 	int i;
 
+	scan_stop(dt);
+
 	/* Remember recently used directories */
 	for (i = 0; i < FPICK_COMBO_ITEMS; i++)
 	{
@@ -195,16 +195,17 @@ static void hs_click_normalize(info_dd *dt, void **wdata, int what, void **where
 /* Populate RGB tables */
 static void hs_populate_rgb(int hs_rgb[256][3], int hs_rgb_sorted[256][3])
 {
+	size_t l, n;
 	int i, j, k, t;
 	unsigned char *im = mem_img[CHN_IMAGE];
 
 	memset(&hs_rgb[0][0], 0, 256 * 3 * sizeof(hs_rgb[0][0]));
 
-	j = mem_width * mem_height;
+	n = (size_t)mem_width * mem_height;
 
 	if ( mem_img_bpp == 3 )
 	{
-		for ( i=0; i<j; i++ )			// Populate table with RGB frequencies
+		for ( l=0; l<n; l++ )			// Populate table with RGB frequencies
 		{
 			hs_rgb[im[0]][0]++;
 			hs_rgb[im[1]][1]++;
@@ -214,9 +215,9 @@ static void hs_populate_rgb(int hs_rgb[256][3], int hs_rgb_sorted[256][3])
 	}
 	else
 	{
-		for ( i=0; i<j; i++ )			// Populate table with pixel indexes
+		for ( l=0; l<n; l++ )			// Populate table with pixel indexes
 		{
-			hs_rgb[im[i]][0]++;
+			hs_rgb[im[l]][0]++;
 		}
 	}
 
@@ -306,6 +307,7 @@ void pressed_information()
 {
 	info_dd tdata;
 	char txt[256];
+	double d;
 	int i, j, maxi, orphans;
 
 
@@ -314,7 +316,7 @@ void pressed_information()
 
 	maxi = rint(((double)mem_undo_limit * 1024 * 1024) *
 		(mem_undo_common * layers_total * 0.01 + 1) /
-		(mem_width * mem_height * mem_img_bpp * (layers_total + 1)) - 1.25);
+		((double)mem_width * mem_height * mem_img_bpp * (layers_total + 1)) - 1.25);
 	maxi = maxi < 0 ? 0 : maxi >= mem_undo_max ? mem_undo_max - 1 : maxi;
 
 	snprintf(tdata.mem_d, sizeof(tdata.mem_d), "%1.1f MB\n%d / %d / %d",
@@ -363,18 +365,18 @@ void pressed_information()
 		mem_get_histogram(CHN_IMAGE);
 
 		memset(&mem, 0, sizeof(mem));
-		j = mem_width * mem_height;
+		d = (double)mem_width * mem_height;
 		for (i = 0; i < mem_cols; i++)
 		{
 			snprintf(txt, sizeof(txt), "%d\t%d\t%1.1f\n",
 				i, mem_histogram[i],
-				(100.0 * mem_histogram[i]) / j);
+				(100.0 * mem_histogram[i]) / d);
 			addstr(&mem, txt, 1);
 		}
 		for (orphans = 0 , i = mem_cols; i < 256; i++)
 			orphans += mem_histogram[i];
 		snprintf(txt, sizeof(txt), "%s\t%d\t%1.1f",
-				_("Orphans"), orphans, (100.0 * orphans) / j);
+				_("Orphans"), orphans, (100.0 * orphans) / d);
 		addstr(&mem, txt, 0);
 		tdata.col_d = mem.buf;
 
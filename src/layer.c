@@ -64,7 +64,8 @@ void layers_init()
 	layer_table[0].image = calloc(1, sizeof(layer_image));
 }
 
-/* Allocate layer image, its channels and undo stack
+/* Allocate layer image, its channels and undo stack; channels of src, if
+ * any, get shared copy-on-write
  * !!! Must be followed by update_undo() after setting up image is done */
 layer_image *alloc_layer(int w, int h, int bpp, int cmask, image_info *src)
 {
@@ -73,7 +74,8 @@ layer_image *alloc_layer(int w, int h, int bpp, int cmask, image_info *src)
 	lim = calloc(1, sizeof(layer_image));
 	if (!lim) return (NULL);
 	if (init_undo(&lim->image_.undo_, mem_undo_depth) &&
-		mem_alloc_image(src ? AI_COPY : 0, &lim->image_, w, h, bpp, cmask, src))
+		mem_alloc_image(src ? AI_COPY | AI_SHARE : 0, &lim->image_,
+		w, h, bpp, cmask, src))
 		return (lim);
 	mem_free_image(&lim->image_, FREE_UNDO);
 	free(lim);
@@ -151,12 +153,20 @@ void layer_copy_from_main( int l )	// Copy info from main image to layer
 	lp->state_ = mem_state;
 	lp->image_.undo_.size = 0; // Invalidate
 	update_undo(&lp->image_); // Safety net
+	lp->dense_ = FALSE; // Might have been edited
 }
 
-void layer_copy_to_main( int l )		// Copy info from layer to main image
+int layer_copy_to_main( int l )		// Copy info from layer to main image
 {
 	layer_image *lp = layer_table[l].image;
 
+	/* Callers unpack beforehand so they can back out; if they didn't and
+	 * it fails, main image stays as it was */
+	if (!mem_sparse_unpack(&lp->image_))
+	{
+		memory_errors(1);
+		return (FALSE);
+	}
 	if (!layer_overlay)
 	{
 		lp->state_.iover = mem_state.iover;
@@ -164,6 +174,23 @@ void layer_copy_to_main( int l )		// Copy info from layer to main image
 	}
 	mem_image = lp->image_;
 	mem_state = lp->state_;
+	lr_cache_reset(); // Layers below are now different
+	return (TRUE);
+}
+
+/* Pack inactive layers which are mostly empty */
+static void layers_pack()
+{
+	layer_image *lim;
+	int i;
+
+	for (i = 0; i <= layers_total; i++)
+	{
+		if (i == layer_selected) continue;
+		lim = layer_table[i].image;
+		if (lim->image_.sparse || lim->dense_) continue;
+		lim->dense_ = !mem_sparse_pack(&lim->image_);
+	}
 }
 
 void shift_layer(int val)
@@ -281,6 +308,7 @@ void layer_delete(int item)
 
 	mem_free_image(&lp->image_, FREE_ALL);
 	free(lp);
+	lr_cache_reset(); // Its memory may get reused
 
 	// If deleted item is not at the end shuffle rest down
 	for (i = item; i < layers_total; i++)
@@ -310,10 +338,15 @@ void layer_press_delete()
 
 	i = alert_box(_("Warning"), txt, _("No"), _("Yes"), NULL);
 	if ((i != 2) || (check_for_changes() == 1)) return;
+	if (!mem_sparse_unpack(&layer_table[layer_selected - 1].image->image_))
+	{
+		memory_errors(1);
+		return;
+	}
 
 	if (blend_src == SRC_LAYER + layer_selected) blend_src = SRC_NORMAL;
 	layer_copy_from_main(layer_selected);
-	layer_copy_to_main(--layer_selected);
+	layer_copy_to_main(--layer_selected); // Unpacked above, cannot fail
 	update_main_with_new_layer();
 	layer_delete(layer_selected + 1);
 
@@ -391,21 +424,38 @@ static void layer_update_filename( char *name )
 static void layers_free_all()
 {
 	layer_node *t;
+	int l = layers_total ? layer_selected : 0;
 
 	if (blend_src > SRC_LAYER + 0) blend_src = SRC_NORMAL;
 
-	if (layers_total && layer_selected)	// Copy over layer 0
-	{
-		layer_copy_from_main(layer_selected);
-		layer_copy_to_main(0);
-		layer_selected = 0;
-	}
+	if (l) layer_copy_from_main(l);
 
 	for (t = layer_table + layers_total; t != layer_table; t--)
 	{
+		if (t == layer_table + l) continue; // Main image is there
 		mem_free_image(&t->image->image_, FREE_ALL);
 		free(t->image);
 	}
+
+	/* Copy over layer 0 after the rest is gone, to unpack it in their space;
+	 * if even that fails, keep the current layer as the image instead */
+	if (l)
+	{
+		t = layer_table + l;
+		if (mem_sparse_unpack(&layer_table[0].image->image_))
+		{
+			mem_free_image(&t->image->image_, FREE_ALL);
+			layer_copy_to_main(0); // Unpacked, cannot fail
+		}
+		else
+		{
+			memory_errors(1);
+			mem_free_image(&layer_table[0].image->image_, FREE_ALL);
+			layer_copy_from_main(0);
+		}
+		free(t->image);
+		layer_selected = 0;
+	}
 	memset(layer_table + 1, 0, sizeof(layer_node) * MAX_LAYERS);
 	layers_total = 0;
 	layers_filename[0] = 0;
@@ -505,7 +555,8 @@ int load_layers( char *file_name )
 		t->opacity = k < 1 ? 1 : k > 100 ? 100 : k;
 
 		init_istate(&lim2->state_, &lim2->image_);
-		if (!layers_total++) layer_copy_to_main(0); // Update mem_state
+		/* Update mem_state; just loaded, so not packed */
+		if (!layers_total++) layer_copy_to_main(0);
 	}
 	if (layers_total) layers_total--;
 
@@ -515,6 +566,7 @@ int load_layers( char *file_name )
 	fclose(fp);
 
 	layer_refresh_list(layers_total);
+	layers_pack();
 	cmd_sensitive(GET_WINDOW(layers_box_), TRUE);
 	layer_update_filename( file_name );
 
@@ -621,7 +673,8 @@ int load_to_layers(char *file_name, int ftype, int ani_mode)
 			image->filename = tailed_name(NULL, file_name, tail, PATHBUF);
 
 			init_istate(state, image);
-			if (!l) layer_copy_to_main(0); // Update everything
+			/* Update everything; just loaded, so not packed */
+			if (!l) layer_copy_to_main(0);
 		}
 		layers_total = l ? l - 1 : 0;
 
@@ -646,6 +699,7 @@ int load_to_layers(char *file_name, int ftype, int ani_mode)
 			/* Display 1st layer in sequence */
 			layer_table[1].visible = TRUE;
 			layer_copy_from_main(0);
+			/* Not packed yet, layers_pack() comes after */
 			layer_copy_to_main(layer_selected = 1);
 		}
 		update_main_with_new_layer();
@@ -653,6 +707,7 @@ int load_to_layers(char *file_name, int ftype, int ani_mode)
 	mem_free_frames(&fset);
 
 	layer_refresh_list(layer_selected);
+	layers_pack();
 	cmd_sensitive(GET_WINDOW(layers_box_), TRUE);
 
 	/* Name change so that layers file would not overwrite the source */
@@ -700,15 +755,15 @@ int layer_save_composite(char *fname, ls_settings *settings)
 	image = layer_selected ? &layer_table[0].image->image_ : &mem_image;
 	w = image->width;
 	h = image->height;
-	layer_rgb = calloc(1, w * h * (3 + !!tf));
+	layer_rgb = calloc(1, (size_t)w * h * (3 + !!tf));
 	if (layer_rgb)
 	{
 		view_render_rgb(layer_rgb, 0, 0, w, h, 1);	// Render layer
 		if (tf)
 		{
-			unsigned char *alpha = layer_rgb + w * h * 3;
+			unsigned char *alpha = layer_rgb + (size_t)w * h * 3;
 			collect_alpha(alpha, w, h);
-			mem_demultiply(layer_rgb, alpha, w * h, 3);
+			mem_demultiply(layer_rgb, alpha, (size_t)w * h, 3);
 			settings->img[CHN_ALPHA] = alpha;
 		}
 		settings->img[CHN_IMAGE] = layer_rgb;
@@ -755,7 +810,8 @@ void layer_add_composite()
 		if (img[CHN_ALPHA])
 		{
 			collect_alpha(img[CHN_ALPHA], w, h);
-			mem_demultiply(img[CHN_IMAGE], img[CHN_ALPHA], w * h, 3);
+			mem_demultiply(img[CHN_IMAGE], img[CHN_ALPHA],
+				(size_t)w * h, 3);
 		}
 		/* Copy background's transparency and position */
 		lim->image_.trans = image->trans;
@@ -918,8 +974,17 @@ static void layer_select(layers_dd *dt, void **wdata, int what, void **where)
 	dt->lock++;
 	if (j != layer_selected) /* Move data before doing anything else */
 	{
+		if (!mem_sparse_unpack(&layer_table[j].image->image_))
+		{
+			memory_errors(1);
+			cmd_set(dt->llist, dt->nlayer = layer_selected);
+			dt->lock--;
+			return;
+		}
 		layer_copy_from_main(layer_selected);
+		/* Unpacked above, cannot fail */
 		layer_copy_to_main(layer_selected = j);
+		layers_pack();
 		update_main_with_new_layer();
 	}
 
@@ -956,7 +1021,8 @@ void pressed_paste_layer()
 {
 	layer_image *lim;
 	unsigned char *dest;
-	int i, j, k, chan = mem_channel, cmask = CMASK_IMAGE;
+	size_t i, j;
+	int k, chan = mem_channel, cmask = CMASK_IMAGE;
 
 	if (layers_total >= MAX_LAYERS)
 	{
@@ -981,7 +1047,7 @@ void pressed_paste_layer()
 	lim->state_ = mem_state;
 	lim->state_.channel = chan;
 
-	j = mem_clip_w * mem_clip_h;
+	j = (size_t)mem_clip_w * mem_clip_h;
 	memcpy(lim->image_.img[chan], mem_clipboard, j * mem_clip_bpp);
 
 	/* Image channel with alpha */
@@ -29,6 +29,7 @@ typedef struct {
 	image_info image_;
 	image_state state_;
 	ani_info ani_;
+	int dense_;		// Not worth packing, till next edit
 } layer_image;
 
 typedef struct {
@@ -71,7 +72,7 @@ int load_to_layers(char *file_name, int ftype, int ani_mode);
 
 void layers_notify_changed();
 void layer_copy_from_main( int l );	// Copy info from main image to layer
-void layer_copy_to_main( int l );	// Copy info from layer to main image
+int layer_copy_to_main( int l );	// Copy info from layer to main image
 void layer_refresh_list(int slot);
 void layer_press_remove_all();
 int check_layers_for_changes();
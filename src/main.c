@@ -33,6 +33,7 @@
 #include "prefs.h"
 #include "csel.h"
 #include "spawn.h"
+#include "thread.h"
 
 static int compare_names(const void *s1, const void *s2)
 {
@@ -339,6 +340,239 @@ static void add_filelist(char *name, int nf)
 	printf("%s: %s\n", err, name);
 }
 
+///	BATCH MODE
+
+#ifndef WIN32
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+
+static int batch_mode;
+static char *batch_socket;
+
+static double batch_ms(GTimeVal *t0)
+{
+	GTimeVal t1;
+
+	g_get_current_time(&t1);
+	return ((t1.tv_sec - t0->tv_sec) * 1000.0 +
+		(t1.tv_usec - t0->tv_usec) / 1000.0);
+}
+
+/* Read one line of any length */
+static char *batch_getline(FILE *fp, char **buf, int *len)
+{
+	char *tmp;
+	int l = 0;
+
+	while (TRUE)
+	{
+		if (*len - l < 2)
+		{
+			if (!(tmp = realloc(*buf, *len * 2 + 256))) return (NULL);
+			*buf = tmp;
+			*len = *len * 2 + 256;
+		}
+		if (!fgets(*buf + l, *len - l, fp)) return (l ? *buf : NULL);
+		l += strlen(*buf + l);
+		if ((*buf)[l - 1] == '\n') return (*buf);
+	}
+}
+
+/* Run one script per line, and report how each went */
+static void batch_run(FILE *in, FILE *out)
+{
+	GTimeVal t0;
+	char *buf = NULL, **res;
+	int n = 0, len = 0, l;
+
+	while (batch_getline(in, &buf, &len))
+	{
+		buf[strcspn(buf, "\r\n")] = '\0';
+		/* Skip empty lines and comments */
+		l = strspn(buf, " \t");
+		if (!buf[l] || (buf[l] == '#')) continue;
+
+		n++;
+		g_get_current_time(&t0);
+		res = wj_parse_argv(buf);
+		l = run_script(res) > 0 && !user_break;
+		free(res);
+		user_break = 0;
+
+		fprintf(out, "job %d: %s %.1f ms\n", n, l ? "ok" : "error",
+			batch_ms(&t0));
+		fflush(out);
+	}
+	free(buf);
+}
+
+#ifndef WIN32
+/* Serve clients on a Unix socket, one at a time */
+static void batch_serve(char *path)
+{
+	struct sockaddr_un sa;
+	struct stat buf;
+	FILE *in, *out;
+	int fd, cfd;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa.sun_path))
+	{
+		printf("Socket path too long: %s\n", path);
+		return;
+	}
+	strncpy0(sa.sun_path, path, sizeof(sa.sun_path));
+
+	/* Remove socket left over from a previous run */
+	if (!lstat(path, &buf) && S_ISSOCK(buf.st_mode)) unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((fd < 0) || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) ||
+		listen(fd, 8))
+	{
+		printf("Cannot listen on socket: %s\n", path);
+		if (fd >= 0) close(fd);
+		return;
+	}
+	signal(SIGPIPE, SIG_IGN); // Clients can go away any time
+
+	while (TRUE)
+	{
+		if ((cfd = accept(fd, NULL, NULL)) < 0)
+		{
+			if (errno == EINTR) continue;
+			break;
+		}
+		/* Separate streams, as one cannot switch directions freely */
+		in = fdopen(cfd, "r");
+		out = in ? fdopen(dup(cfd), "w") : NULL;
+		if (out) batch_run(in, out);
+		if (out) fclose(out);
+		if (in) fclose(in);
+		else close(cfd);
+	}
+	close(fd);
+	unlink(path);
+}
+#endif
+
+///	FILE LIST MODE
+
+/* With "--cmd-each", the script is run on every file in turn, in several
+ * worker processes as the program state is all global; results come back
+ * to the parent through a pipe, in records small enough to write at once */
+
+static int each_jobs;
+
+typedef struct {
+	int idx, ok;
+	double ms;
+} each_res;
+
+static unsigned char *each_ok;
+static double each_sum;
+
+static void each_note(each_res *r)
+{
+	each_ok[r->idx] = r->ok + 1;
+	each_sum += r->ms;
+}
+
+/* Process files idx, idx + step, ..., sending results to fd or noting them */
+static void each_run(char **script, int idx, int step, int fd)
+{
+	each_res r;
+	GTimeVal t0;
+	void *cs = compile_script(script);
+
+	for (; idx < files_passed; idx += step)
+	{
+		g_get_current_time(&t0);
+		script_cmds = script; // Script is in charge, no dialogs
+		r.ok = cs && !do_a_load(file_args[idx], FALSE) &&
+			(run_compiled(cs) > 0) && !user_break;
+		user_break = 0;
+		r.idx = idx;
+		r.ms = batch_ms(&t0);
+#ifndef WIN32
+		if (fd >= 0) while ((write(fd, &r, sizeof(r)) < 0) &&
+			(errno == EINTR));
+		else
+#endif
+		each_note(&r);
+	}
+	free(cs);
+}
+
+static void run_each(char **script, int n)
+{
+	GTimeVal t0;
+	int i, nf = 0;
+#ifndef WIN32
+	each_res r;
+	pid_t pid;
+	int fds[2];
+#endif
+
+	each_ok = calloc(files_passed, 1);
+	if (!each_ok)
+	{
+		memory_errors(1);
+		return;
+	}
+	if (n > files_passed) n = files_passed;
+	g_get_current_time(&t0);
+
+#ifndef WIN32
+	if ((n > 1) && !pipe(fds))
+	{
+		fflush(stdout);
+		for (i = 0; i < n; i++)
+		{
+			if ((pid = fork()) < 0) break;
+			if (pid) continue;
+			/* Worker process: one thread, as there are many of us */
+			close(fds[0]);
+			maxthreads = 1;
+			each_run(script, i, n, fds[1]);
+			_exit(0);
+		}
+		close(fds[1]);
+		/* Do the work of workers which failed to start */
+		for (; i < n; i++) each_run(script, i, n, -1);
+		while (TRUE)
+		{
+			int l = read(fds[0], &r, sizeof(r));
+			if ((l < 0) && (errno == EINTR)) continue;
+			if (l != sizeof(r)) break;
+			each_note(&r);
+		}
+		close(fds[0]);
+		while ((wait(NULL) > 0) || (errno == EINTR));
+	}
+	else
+#endif
+	each_run(script, 0, 1, -1);
+
+	/* Report */
+	for (i = 0; i < files_passed; i++)
+	{
+		if (each_ok[i] == 2) continue;
+		printf("%s: %s\n", each_ok[i] ? "Failed" : "Not processed",
+			file_args[i]);
+		nf++;
+	}
+	printf("%d files, %d failed, %.1f s of work in %.1f s\n",
+		files_passed, nf, each_sum / 1000.0, batch_ms(&t0) / 1000.0);
+	user_break = !!nf;
+	free(each_ok);
+}
+
 static gboolean run_init_script()
 {
 	char **res = NULL, *env = getenv("MTPAINT_INIT");
@@ -377,6 +611,9 @@ int main( int argc, char *argv[] )
 				"  --flist         Read a list of files\n"
 				"  --sort          Sort files passed as arguments\n"
 				"  --cmd           Commandline scripting mode, no GUI\n"
+				"  --batch [socket] Run scripts line by line from stdin\n"
+				"                  or a Unix socket, no GUI\n"
+				"  --cmd-each[=N]  Run script on every file, in N processes\n"
 				"  -s              Grab screenshot\n"
 				"  -v              Start in viewer mode\n"
 				"  --              End of options\n\n"
@@ -388,6 +625,20 @@ int main( int argc, char *argv[] )
 			cmd_mode = TRUE;
 			script_cmds = argv + 2;
 		}
+		else if (!strncmp(argv[1], "--cmd-each", 10) &&
+			(!argv[1][10] || (argv[1][10] == '=')))
+		{
+			cmd_mode = TRUE;
+			script_cmds = argv + 2;
+			each_jobs = argv[1][10] ? atoi(argv[1] + 11) : 0;
+			if (each_jobs < 1) each_jobs = helper_threads();
+		}
+		else if (!strcmp(argv[1], "--batch"))
+		{
+			cmd_mode = batch_mode = TRUE;
+			if ((argc > 2) && (argv[2][0] != '-'))
+				batch_socket = argv[2];
+		}
 	}
 
 	putenv( "G_BROKEN_FILENAMES=1" );	// Needed to read non ASCII filenames in GTK+2
@@ -600,8 +851,8 @@ int main( int argc, char *argv[] )
 	}
 	else
 	{
-		if ((files_passed > 0) && !do_a_load(file_args[0], FALSE))
-			new_empty = FALSE;
+		if ((files_passed > 0) && !each_jobs &&
+			!do_a_load(file_args[0], FALSE)) new_empty = FALSE;
 	}
 
 	if ( new_empty )		// If no file was loaded, start with a blank canvas
@@ -611,7 +862,17 @@ int main( int argc, char *argv[] )
 
 	update_menus();
 
-	if (cmd_mode) // Console
+	if (batch_mode) // Resident console
+	{
+#ifndef WIN32
+		if (batch_socket) batch_serve(batch_socket);
+		else
+#endif
+		batch_run(stdin, stdout);
+	}
+	else if (each_jobs) // Console, file by file
+		run_each(script_cmds, each_jobs);
+	else if (cmd_mode) // Console
 		run_script(script_cmds);
 	else // GUI
 	{
@@ -101,6 +101,7 @@ static inilist ini_bool[] = {
 	{ "couple_RGBA",	&RGBA_mode,		TRUE  },
 	{ "gridToggle",		&mem_show_grid,		TRUE  },
 	{ "optimizeChequers",	&chequers_optimize,	TRUE  },
+	{ "canvasMipmap",	&canvas_mipmap,		FALSE },
 	{ "quitToggle",		&q_quit,		TRUE  },
 	{ "continuousPainting",	&mem_continuous,	TRUE  },
 	{ "opacityToggle",	&mem_undo_opacity,	TRUE  },
@@ -113,8 +114,11 @@ static inilist ini_bool[] = {
 	{ "defaultGamma",	&use_gamma,		TRUE  },
 	{ "undoableLoad",	&undo_load,		TRUE  },
 	{ "tiffPredictor",	&tiff_predictor,	TRUE  },
+	{ "tiffTiled",		&tiff_tiled,		FALSE },
 	{ "lbmPack",		&lbm_pack,		TRUE  },
 	{ "lbmIgnoreTrans",	&lbm_untrans,		TRUE  },
+	{ "aniGlobalPalette",	&ani_gpal,		FALSE },
+	{ "aniDeltaFrames",	&ani_delta,		FALSE },
 #if STATUS_ITEMS != 5
 #error Wrong number of "status?Toggle" inifile items defined
 #endif
@@ -343,7 +347,7 @@ static void pressed_remove_unused()
 	}
 	else
 	{
-		spot_undo(UNDO_XPAL);
+		if (spot_undo(UNDO_XPAL)) return;
 
 		mem_remove_unused();
 		mem_undo_prepare();
@@ -374,7 +378,7 @@ static void pressed_remove_duplicates()
 	mess = g_strdup_printf(__("The palette contains %i colours that have identical RGB values.  Do you really want to merge them into one index and realign the canvas?"), dups);
 	if (script_cmds || (alert_box(_("Warning"), mess, _("Yes"), _("No"), NULL) == 1))
 	{
-		spot_undo(UNDO_XPAL);
+		if (spot_undo(UNDO_XPAL)) return;
 
 		remove_duplicates();
 		mem_undo_prepare();
@@ -1331,7 +1335,7 @@ static int pick_color(int ox, int oy, int ab, int area[4], int pixel)
 		{
 			pixel = get_pixel(ox, oy);
 			if (mem_img[CHN_ALPHA])
-				alpha = mem_img[CHN_ALPHA][mem_width * oy + ox];
+				alpha = mem_img[CHN_ALPHA][ox + (size_t)mem_width * oy];
 		}
 	}
 
@@ -1769,7 +1773,8 @@ int bkg_x, bkg_y, bkg_w, bkg_h, bkg_scale, bkg_flag;
 int config_bkg(int src)
 {
 	image_info *img;
-	int l;
+	size_t l;
+	int i;
 
 	if (!src) return (TRUE); // No change
 
@@ -1781,12 +1786,14 @@ int config_bkg(int src)
 	img = src == 2 ? &mem_image : src == 3 ? &mem_clip : NULL;
 	if (!img || !img->img[CHN_IMAGE]) return (TRUE); // No image
 
-	l = img->width * img->height;
+	l = (size_t)img->width * img->height;
 	bkg_rgb = malloc(l * 3);
 	if (!bkg_rgb) return (FALSE);
 
-	if (img->bpp == 1)
-		do_convert_rgb(0, 1, l, bkg_rgb, img->img[CHN_IMAGE], mem_pal);
+	if (img->bpp == 1) for (i = 0; i < img->height; i++)
+		do_convert_rgb(0, 1, img->width, bkg_rgb + (size_t)i *
+			img->width * 3, img->img[CHN_IMAGE] + (size_t)i *
+			img->width, mem_pal);
 	else memcpy(bkg_rgb, img->img[CHN_IMAGE], l * 3);
 	bkg_w = img->width;
 	bkg_h = img->height;
@@ -1826,7 +1833,7 @@ static int render_bkg(rgbcontext *ctx)
 		y = floor_div((i - margin_main_y) * bs, scale) - bkg_y;
 		if (y != ty)
 		{
-			src = bkg_rgb + (y * bkg_w + x0) * 3;
+			src = bkg_rgb + ((size_t)y * bkg_w + x0) * 3;
 			for (dd = d0 , x = rxy[0]; x < rxy[2]; x++ , dest += 3)
 			{
 				dest[0] = src[0];
@@ -1850,7 +1857,7 @@ static int render_bkg(rgbcontext *ctx)
 
 static int get_bkg(int xc, int yc, int dclick)
 {
-	int xb, yb, xi, yi, x, scale;
+	int xb, yb, xi, yi, scale;
 
 	/* No background / not RGB / wrong scale */
 	if (!bkg_flag || (mem_channel != CHN_IMAGE) || (mem_img_bpp != 3) ||
@@ -1862,11 +1869,12 @@ static int get_bkg(int xc, int yc, int dclick)
 	if ((xi >= 0) && (xi < mem_width) && (yi >= 0) && (yi < mem_height))
 	{
 		/* Pixel must be transparent */
-		x = mem_width * yi + xi;
+		size_t ofs = xi + (size_t)mem_width * yi;
+
 		if (mem_img[CHN_ALPHA] && !channel_dis[CHN_ALPHA] &&
-			!mem_img[CHN_ALPHA][x]); // Alpha transparency
+			!mem_img[CHN_ALPHA][ofs]); // Alpha transparency
 		else if (mem_xpm_trans < 0) return (-1);
-		else if (x *= 3 , MEM_2_INT(mem_img[CHN_IMAGE], x) !=
+		else if (ofs *= 3 , MEM_2_INT(mem_img[CHN_IMAGE], ofs) !=
 			PNG_2_INT(mem_pal[mem_xpm_trans])) return (-1);
 
 		/* Double click averages background under image pixel */
@@ -1885,8 +1893,7 @@ static int get_bkg(int xc, int yc, int dclick)
 	yb = floor_div((yc - margin_main_y) * bkg_scale, scale) - bkg_y;
 	/* Outside of background */
 	if ((xb < 0) || (xb >= bkg_w) || (yb < 0) || (yb >= bkg_h)) return (-1);
-	x = (bkg_w * yb + xb) * 3;
-	return (MEM_2_INT(bkg_rgb, x));
+	return (MEM_2_INT(bkg_rgb, ((size_t)bkg_w * yb + xb) * 3));
 }
 
 /* This is set when background is at different scale than image */
@@ -1945,9 +1952,9 @@ void render_row(renderstate *r, unsigned char *rgb, chanlist base_img,
 		alpha = xtra_img[CHN_ALPHA];
 	}
 	if (rr.cmask & CMASK_ALPHA) alpha = &beta; /* Ignore alpha if disabled */
-	if (!src) src = base_img[CHN_IMAGE] + (rr.mw * y + x) * rr.bpp;
+	if (!src) src = base_img[CHN_IMAGE] + (x + (size_t)rr.mw * y) * rr.bpp;
 	if (!alpha) alpha = base_img[CHN_ALPHA] ? base_img[CHN_ALPHA] +
-		rr.mw * y + x : &beta;
+		x + (size_t)rr.mw * y : &beta;
 	if (alpha != &beta) da = rr.zoom;
 	dest = rgb;
 	ii = rr.dx;
@@ -2100,6 +2107,7 @@ void overlay_row(renderstate *r, unsigned char *rgb, chanlist base_img,
 {
 	renderstate rr = *r;
 	unsigned char *alpha, *sel, *mask, *dest;
+	size_t ofs;
 	int i, j, k, ii, dw, opA, opS, opM, t0, t1, t2, t3;
 
 	if (xtra_img)
@@ -2109,10 +2117,10 @@ void overlay_row(renderstate *r, unsigned char *rgb, chanlist base_img,
 		mask = xtra_img[CHN_MASK];
 	}
 	else alpha = sel = mask = NULL;
-	j = rr.mw * y + x;
-	if (!alpha && base_img[CHN_ALPHA]) alpha = base_img[CHN_ALPHA] + j;
-	if (!sel && base_img[CHN_SEL]) sel = base_img[CHN_SEL] + j;
-	if (!mask && base_img[CHN_MASK]) mask = base_img[CHN_MASK] + j;
+	ofs = x + (size_t)rr.mw * y;
+	if (!alpha && base_img[CHN_ALPHA]) alpha = base_img[CHN_ALPHA] + ofs;
+	if (!sel && base_img[CHN_SEL]) sel = base_img[CHN_SEL] + ofs;
+	if (!mask && base_img[CHN_MASK]) mask = base_img[CHN_MASK] + ofs;
 
 	/* Prepare channel weights (256-based) */
 	k = rr.cmask & CMASK_IMAGE ? 256 : 256 - channel_opacity[CHN_IMAGE] -
@@ -2286,7 +2294,7 @@ static void init_grad_render(render_mem_req *mr, grad_render_state *g, int len,
 static void grad_render(int start, int step, int cnt, int x, int y,
 	unsigned char *mask0, grad_render_state *g)
 {
-	int l = mem_width * y + x, li = l * mem_img_bpp;
+	size_t l = x + (size_t)mem_width * y, li = l * mem_img_bpp;
 
 	prep_mask(start, step, cnt, g->wmask, mask0, mem_img[CHN_IMAGE] + li);
 
@@ -2422,8 +2430,8 @@ static void init_paste_render(render_mem_req *mr, paste_render_state *p,
 
 static void paste_render(int start, int step, int y, paste_render_state *p)
 {
-	int ld = mem_width * y + p->dx;
-	int dc = mem_clip_w * (y - marq_y1) + p->dx - marq_x1;
+	size_t ld = p->dx + (size_t)mem_width * y;
+	size_t dc = p->dx - marq_x1 + (size_t)mem_clip_w * (y - marq_y1);
 	int bpp = p->bpp;
 	int cnt = p->pww;
 	unsigned char *clip_src = mem_clipboard + dc * mem_clip_bpp;
@@ -2453,7 +2461,7 @@ typedef struct {
 	main_render_state r;
 	paste_render_state p;
 	render_mem_req m;
-	int tflag, xflag, gflag, pflag, lr;
+	int tflag, xflag, gflag, pflag, lr, lrc, mip;
 	int pw;
 	int cxy[4];
 	unsigned char *rgb, *irgb;
@@ -2511,6 +2519,12 @@ static void main_render_req(u_render_state *u)
 		!u->xflag && !u->m.overlay_s && !u->gflag)
 		u->pflag = paste_render_req(&u->m, &u->p, &r);
 
+	/* Zoomed-out plain image - render from mipmap */
+	if ((r.zoom > 1) && !u->tflag && !u->xflag && !u->m.overlay_s &&
+		!u->gflag && !u->pflag && !hide_image && (r.xpm < 0) &&
+		(!mem_img[CHN_ALPHA] || channel_dis[CHN_ALPHA] || overlay_alpha) &&
+		(u->mip = mip_prepare(r.zoom))) u->m.rgb_s = r.pww * 3;
+
 	/* Pass the data */
 	u->r = r;
 }
@@ -2519,9 +2533,11 @@ static void main_render(u_render_state *u, int py, int ph)
 {
 	main_render_state r = u->r;
 	grad_render_state grstate;
-	renderstate rs;
+	renderstate rs, ms;
+	chanlist mlist;
 	unsigned char *rgb, **tlist = r.tlist, *overlay = u->m.overlay;
-	int j, jj, j0, l, pw2, pw;
+	size_t l;
+	int j, jj, j0, pw2, pw;
 
 	/* ****** Init phase ****** */
 
@@ -2558,6 +2574,15 @@ static void main_render(u_render_state *u, int py, int ph)
 		(channel_dis[CHN_ALPHA] ? CMASK_ALPHA : 0) |
 		(channel_dis[CHN_SEL] ? CMASK_SEL : 0) |
 		(channel_dis[CHN_MASK] ? CMASK_MASK : 0);
+	/* Mipmap rows are RGB, and packed */
+	if (u->mip)
+	{
+		setup_row(&ms, r.rxy[0], pw2, 1, r.scale, mem_width, -1, r.lop,
+			3, NULL);
+		ms.cmask = rs.cmask;
+		memcpy(mlist, r.tlist, sizeof(chanlist));
+		mlist[CHN_IMAGE] = u->m.rgb;
+	}
  	j0 = -1; pw2 *= 3;
 	rgb = u->irgb + (py - r.rxy[1]) * (pw = u->pw);
 	for (jj = 0; jj < ph; jj++ , rgb += pw)
@@ -2566,7 +2591,7 @@ static void main_render(u_render_state *u, int py, int ph)
 		if (j != j0)
 		{
 			j0 = j;
-			l = mem_width * j + r.dx;
+			l = r.dx + (size_t)mem_width * j;
 			tlist = r.tlist; /* Default override */
 
 			/* Color transform/threshold preview */
@@ -2603,6 +2628,9 @@ static void main_render(u_render_state *u, int py, int ph)
 			/* Gradient preview */
 			else if (u->gflag) grad_render(0, r.zoom, r.pww, r.dx, j,
 				r.mask0 ? r.mask0 + l : NULL, &grstate);
+			/* Mipmap */
+			else if (u->mip) mip_row(u->m.rgb, r.dx, j, r.zoom, r.pww,
+				u->mip);
 
 			/* Paste preview - should be after transform */
 			if (u->pflag && (j >= marq_y1) && (j <= marq_y2))
@@ -2621,7 +2649,8 @@ static void main_render(u_render_state *u, int py, int ph)
 			memcpy(rgb, rgb - pw, pw2);
 			continue;
 		}
-		render_row(&rs, rgb, mem_img, r.dx, j, tlist);
+		if (u->mip) render_row(&ms, rgb, mem_img, r.dx, j, mlist);
+		else render_row(&rs, rgb, mem_img, r.dx, j, tlist);
 		if (!overlay) overlay_row(&rs, rgb, mem_img, r.dx, j, tlist);
 		else overlay_preview(&rs, rgb, overlay, csel_preview, csel_preview_a);
 	}
@@ -2655,7 +2684,8 @@ static void scan_trans(unsigned char *dest, int delta, int y, int x, int w)
 {
 	static unsigned char beta = 255;
 	unsigned char *src, *srca = &beta;
-	int i, ofs, bit, buf, xpm, da = 0, bpp = mem_img_bpp;
+	size_t ofs;
+	int i, bit, buf, xpm, da = 0, bpp = mem_img_bpp;
 
 
 	delta += delta; dest += delta >> 3; delta &= 7;
@@ -2667,7 +2697,7 @@ static void scan_trans(unsigned char *dest, int delta, int y, int x, int w)
 
 	xpm = mem_xpm_trans < 0 ? -1 : bpp == 1 ? mem_xpm_trans :
 		PNG_2_INT(mem_pal[mem_xpm_trans]);
-	ofs = y * mem_width + x;
+	ofs = x + (size_t)mem_width * y;
 	src = mem_img[CHN_IMAGE] + ofs * bpp;
 	if (mem_img[CHN_ALPHA]) srca = mem_img[CHN_ALPHA] + ofs , da = 1;
 	bit = 1 << delta;
@@ -3061,7 +3091,8 @@ static void canvas_render(u_render_state *u, int py, int ph)
 		copy4(cxy, u->cxy);
 		rgb = u->rgb + (py - cxy[1]) * pw;
 		cxy[3] = (cxy[1] = py) + ph;
-		render_layers(rgb, cxy, pw, u->r.zoom, u->r.scale,
+		if (u->lrc) lr_cache_render(rgb, cxy, pw, u->r.zoom, u->r.scale);
+		else render_layers(rgb, cxy, pw, u->r.zoom, u->r.scale,
 			0, layer_selected - 1, FALSE);
 	}
 
@@ -3123,6 +3154,7 @@ static int paint_canvas(void *dt, void **wdata, int what, void **where,
 	xy_origin(u.cxy, ctx->xy, margin_main_x, margin_main_y);
 
 	u.lr = layers_total && show_layers_main;
+	if (u.lr) u.lrc = lr_cache_prepare(u.cxy, zoom, scale);
 
 	/* Set up image for renderer */
 	if (irgb)
@@ -3173,14 +3205,6 @@ static int paint_canvas(void *dt, void **wdata, int what, void **where,
 		nt2 = ceil_div(vpix, kpix_threads * 1024);
 		if (nt2 > nt) nt2 = nt;
 
-#ifndef HAVE__SFA
-		/* csel_scan() takes 50%+ of per-row time, so when it cannot share
-		 * its color cache, 2 threads can interleave calls to it but more
-		 * than 2 only waste even more time on lock contention - WJ */
-		if ((nt2 > 2) && (u.m.overlay_s || (mem_cselect &&
-			(u.tflag | u.xflag | u.gflag | u.pflag)))) nt2 = 2;
-#endif
-
 		u.tdata = talloc(MA_SKIP_ZEROSIZE | MA_FLAG_NONE, nt2,
 			&u, sizeof(u), NULL,
 #else /* ifndef U_THREADS */
@@ -3203,6 +3227,9 @@ static int paint_canvas(void *dt, void **wdata, int what, void **where,
 			 * self-initializes global tables, should get an init
 			 * call here to avoid a thread clash - WJ */
 			if (u.tflag) do_transform(0, 0, 0, NULL, NULL, NULL, 255);
+			else if (u.xflag == XF_XHOLD)
+				do_xhold(0, 0, 0, NULL, NULL, NULL);
+			if (u.gflag) grad_lut_update();
 
 			nt /= u.tdata->count;
 			if (nt > MAX_TH_STRIPS) nt = MAX_TH_STRIPS;
@@ -3298,9 +3325,16 @@ void main_update_area(int x, int y, int w, int h)
 {
 	int zoom, scale, rxy[4];
 
+	mip_update_area(x, y, w, h);
 	if (can_zoom < 1.0)
 	{
 		zoom = rint(1.0 / can_zoom);
+		/* Mipmap samples reach up to a box away in either direction */
+		if (canvas_mipmap)
+		{
+			x -= zoom * 2; y -= zoom * 2;
+			w += zoom * 3; h += zoom * 3;
+		}
 		w += x;
 		h += y;
 		x = floor_div(x + zoom - 1, zoom);
@@ -3710,7 +3744,7 @@ char **wj_parse_argv(char *src)
 	return (NULL);
 }
 
-static void **command_slot(char *cmd)
+static void **find_command(char *cmd)
 {
 	void **slot;
 	int l, m;
@@ -3729,13 +3763,90 @@ static void **command_slot(char *cmd)
 	return (slot);
 }
 
+/* Menu search is fuzzy and slow, so command strings once resolved are kept
+ * in a hashtable: the menubar lives as long as the program does */
+
+#define CMD_HASH 1024 /* Power of two */
+
+typedef struct {
+	char *cmd;
+	void **slot;
+} cmd_hslot;
+
+static cmd_hslot *cmd_hash;
+static int cmd_hashed;
+
+static void **command_slot(char *cmd)
+{
+	void **slot;
+	char *tmp;
+	guint32 h = 0;
+	int i, l = strcspn(cmd, "=");
+
+	if (!cmd_hash) return (find_command(cmd));
+	/* "One at a time" hash */
+	for (i = 0; i < l; i++)
+	{
+		h += (unsigned char)cmd[i];
+		h += h << 10;
+		h ^= h >> 6;
+	}
+	h += h << 3;
+	h ^= h >> 11;
+	h += h << 15;
+	for (i = h & (CMD_HASH - 1); (tmp = cmd_hash[i].cmd);
+		i = (i + 1) & (CMD_HASH - 1))
+		if (!strncmp(tmp, cmd, l) && !tmp[l]) return (cmd_hash[i].slot);
+
+	slot = find_command(cmd);
+	/* Keep occupancy at most 1/2 */
+	if (slot && (cmd_hashed < CMD_HASH / 2) &&
+		(cmd_hash[i].cmd = g_strndup(cmd, l)))
+	{
+		cmd_hash[i].slot = slot;
+		cmd_hashed++;
+	}
+	return (slot);
+}
+
+typedef struct {
+	char **cur;
+	void **slot;
+} script_step;
+
+void *compile_script(char **res)
+{
+	script_step *steps;
+	char **cur;
+	int n = 2;
+
+	if (!res) return (NULL);
+	for (cur = res; cur[0]; cur++) n += cur[0][0] == '-';
+	steps = malloc(n * sizeof(script_step));
+	if (!steps) return (NULL);
+	/* First step holds the script itself */
+	steps[0].cur = res;
+	steps[0].slot = NULL;
+	for (n = 1 , cur = res; cur[0]; cur++)
+	{
+		if (cur[0][0] != '-') continue; // Skip to next command
+		if (!strcmp(cur[0], "--")) break; // End marker
+		steps[n].cur = cur;
+		steps[n++].slot = command_slot(cur[0]);
+	}
+	steps[n].cur = NULL;
+	return (steps);
+}
+
 #define MAX_NESTING 16 /* Defuse recursion bombs */
 
-int run_script(char **res)
+int run_compiled(void *script)
 {
 	static int level;
+	script_step *step = script;
 	void **slot;
-	char **cur, *str = NULL, *err = NULL;
+	char **cur = NULL, **res = step ? step->cur : NULL;
+	char *str = NULL, *err = NULL;
 	int n;
 
 	level++;
@@ -3745,11 +3856,9 @@ int run_script(char **res)
 	else
 	{
 		user_break = 0;
-		for (cur = res; cur[0]; cur++)
+		while ((cur = (++step)->cur))
 		{
-			if (cur[0][0] != '-') continue; // Skip to next command
-			if (!strcmp(cur[0], "--")) break; // End marker
-			slot = command_slot(cur[0]);
+			slot = step->slot;
 			if (!slot) str = _("'%s' does not match any item");
 			else if (!cmd_checkv(slot, SLOT_SCRIPTABLE))
 				str = _("'%s' matches a non-scriptable item");
@@ -3787,6 +3896,21 @@ int run_script(char **res)
 	return (!err ? 1 : str ? -1 : 0); // 1 = clean, -1 = buggy, 0 = wrong
 }
 
+int run_script(char **res)
+{
+	void *script = compile_script(res);
+	int n;
+
+	if (res && !script)
+	{
+		memory_errors(1);
+		return (0);
+	}
+	n = run_compiled(script);
+	free(script);
+	return (n);
+}
+
 #define SCRIPT_ITEMS 10
 #define SCRIPTS_MAX FACTION_ROWS_TOTAL
 #define MAXNAMELEN 2048
@@ -5038,14 +5162,15 @@ static void pressed_pal_copy()
 	if ((marq_status == MARQUEE_DONE) || (poly_status == POLY_DONE))
 	{
 		unsigned char *mask2 = NULL;
-		int i, bpp, rect[4];
+		size_t i;
+		int bpp, rect[4];
 
 		marquee_at(rect);
 		if ((poly_status == POLY_DONE) &&
-			(mask2 = calloc(1, rect[2] * rect[3])))
+			(mask2 = calloc(rect[2], rect[3])))
 			poly_draw(TRUE, mask2, rect[2]);
 
-		i = rect[1] * mem_width + rect[0];
+		i = rect[0] + (size_t)mem_width * rect[1];
 		bpp = MEM_BPP;
 		n = do_pal_copy(tpal, mem_img[mem_channel] + i * bpp,
 			(mem_channel == CHN_IMAGE) && mem_img[CHN_ALPHA] ?
@@ -5091,7 +5216,7 @@ static void pressed_pal_paste()
 	}
 	mem_clip_paletted = 1;
 	mem_pal_copy(mem_clip_pal, mem_pal);
-	memset(dest = mem_clipboard, 0, w * h);
+	memset(dest = mem_clipboard, 0, (size_t)w * h);
 	for (i = 0; i < mem_cols; i++) dest[i] = i;
 
 	pressed_paste(TRUE);
@@ -5124,13 +5249,17 @@ static void pressed_sel_ramp(int vert)
 		return;
 	}
 
-	spot_undo(UNDO_FILT);
+	if (spot_undo(UNDO_FILT))
+	{
+		free(buf);
+		return;
+	}
 
 	opacity = IS_INDEXED ? 0 : tool_opacity;
 	gcor = paint_gamma && (bpp == 3);
-	img = mem_img[mem_channel] + (rect[1] * mem_width + rect[0]) * bpp;
+	img = mem_img[mem_channel] + (rect[0] + (size_t)mem_width * rect[1]) * bpp;
 	c0 = img;
-	c1 = img + (h - 1) * mem_width * bpp;
+	c1 = img + (size_t)(h - 1) * mem_width * bpp;
 	v = 0x3F; /* Vertical ramp: channel step 1, ramp step 0 */
 	vert = !!vert;
 	/* Horizontal ramp: for 1bpp channel step 0, ramp step 1;
@@ -5139,7 +5268,7 @@ static void pressed_sel_ramp(int vert)
 	/* Render the ramp row by row */
 	for (i = vert; i < h - vert; i++)
 	{
-		dest = img + i * mem_width * bpp;
+		dest = img + (size_t)i * mem_width * bpp;
 		if (vert) j = 0 , b = i;
 		else j = bpp , b = 1 , c0 = dest , c1 = dest + ww;
 		for (a = 0; j < ww; j++)
@@ -5815,6 +5944,8 @@ void main_init()
 	char *tdev, txt[PATHTXT];
 
 	memset(&tdata, 0, sizeof(tdata));
+	/* Prepare script command index */
+	cmd_hash = calloc(CMD_HASH, sizeof(cmd_hslot));
 	/* Prepare commandline list */
 	if ((show_dock = tdata.cline_d = files_passed > 1))
 	{
@@ -5866,10 +5997,11 @@ void main_init()
 	else toolbar_showhide();
 }
 
-void spot_undo(int mode)
+int spot_undo(int mode)
 {
-	mem_undo_next(mode);		// Do memory stuff for undo
+	int res = mem_undo_next(mode);	// Do memory stuff for undo
 	update_menus();			// Update menu undo issues
+	return (res);
 }
 
 #ifdef U_NLS
@@ -326,6 +326,8 @@ void main_init();			// Initialise and display the main window
 
 char **wj_parse_argv(char *src);	// Parse string into commands
 int run_script(char **res);		// Interpret parsed sequence of commands
+void *compile_script(char **res);	// Resolve commands for repeated runs
+int run_compiled(void *script);		// Run a resolved script
 
 void draw_dash(int c0, int c1, int ofs, int x, int y, int w, int h, rgbcontext *ctx);
 void draw_poly(int *xy, int cnt, int shift, int x00, int y00, rgbcontext *ctx);
@@ -360,7 +362,7 @@ void render_row(renderstate *r, unsigned char *rgb, chanlist base_img,
 void stop_line();
 void change_to_tool(int icon);
 
-void spot_undo(int mode);		// Take snapshot for undo
+int spot_undo(int mode);		// Take snapshot for undo; nonzero if failed
 void set_cursor(void **what);		// Set mouse cursor
 int check_for_changes();		// 1=STOP, 2=IGNORE, 10=ESCAPE, -10=NOT CHECKED
 
@@ -105,8 +105,6 @@ transform_state mem_bcsp[2];
 
 #define TILE_SIZE 64
 #define TILE_SHIFT 6
-#define MAX_TILEMAP ((((MAX_WIDTH + TILE_SIZE - 1) / TILE_SIZE + 7) / 8) * \
-	((MAX_HEIGHT + TILE_SIZE - 1) / TILE_SIZE))
 #define UF_TILED 0x01
 #define UF_FLAT  0x02
 #define UF_SIZED 0x04
@@ -794,15 +792,100 @@ void update_undo(image_info *image)
 	undo->flags = image->changed ? 0 : UF_ORIG;
 }
 
+/* Channel buffers shared between images, copy-on-write: undo_next_core()
+ * gives the image new buffers before anything gets changed, so a shared
+ * buffer is only ever read, and is freed along with its last user */
+
+typedef struct {
+	unsigned char *mem;
+	int refs;
+} chan_ref;
+
+static chan_ref *chan_refs;
+static int chan_nrefs, chan_maxrefs;
+
+static chan_ref *chan_find(unsigned char *mem)
+{
+	int i;
+
+	for (i = 0; i < chan_nrefs; i++)
+		if (chan_refs[i].mem == mem) return (chan_refs + i);
+	return (NULL);
+}
+
+/* Add a reference to channel buffer; return FALSE if cannot */
+static int chan_share(unsigned char *mem)
+{
+	chan_ref *r = chan_find(mem);
+	int n;
+
+	if (r)
+	{
+		r->refs++;
+		return (TRUE);
+	}
+	if (chan_nrefs >= chan_maxrefs)
+	{
+		n = chan_maxrefs ? chan_maxrefs * 2 : 16;
+		if (!(r = realloc(chan_refs, n * sizeof(chan_ref)))) return (FALSE);
+		chan_refs = r;
+		chan_maxrefs = n;
+	}
+	r = chan_refs + chan_nrefs++;
+	r->mem = mem;
+	r->refs = 2;
+	return (TRUE);
+}
+
+static int chan_shared(unsigned char *mem)
+{
+	return (chan_nrefs && mem && (mem != MEM_NONE) && chan_find(mem));
+}
+
+/* Drop a reference to channel buffer, freeing it if that was the last one */
+static void chan_free(unsigned char *mem)
+{
+	chan_ref *r;
+
+	if (!mem || (mem == MEM_NONE)) return;
+	if (chan_nrefs && (r = chan_find(mem)))
+	{
+		if (--r->refs < 2) *r = chan_refs[--chan_nrefs];
+		return;
+	}
+	free(mem);
+}
+
 void mem_free_chanlist(chanlist img)
 {
 	int i;
 
+	for (i = 0; i < NUM_CHANNELS; i++) chan_free(img[i]);
+}
+
+/* Give current image private copies of its shared channels in cmask, before
+ * changing them in place */
+static int mem_unshare(int cmask)
+{
+	unsigned char *tmp;
+	size_t l, sz = (size_t)mem_width * mem_height;
+	int i, res = TRUE;
+
 	for (i = 0; i < NUM_CHANNELS; i++)
 	{
-		if (!img[i]) continue;
-		if (img[i] != MEM_NONE) free(img[i]);
+		if (!(cmask & CMASK_FOR(i)) || !chan_shared(mem_img[i])) continue;
+		l = i == CHN_IMAGE ? sz * mem_img_bpp : sz;
+		if (!(tmp = malloc(l)))
+		{
+			res = FALSE;
+			continue;
+		}
+		memcpy(tmp, mem_img[i], l);
+		chan_free(mem_img[i]);
+		mem_img[i] = tmp;
 	}
+	update_undo(&mem_image);
+	return (res);
 }
 
 static size_t undo_free_x(undo_item **undo_)
@@ -883,6 +966,206 @@ void update_undo_depth()
 	}
 }
 
+/* Free sparse tiles */
+static void sparse_free(sparse_info *sp)
+{
+	unsigned char **tp;
+	size_t n, l;
+	int i;
+
+	if (!sp) return;
+	n = (size_t)sp->tw * sp->th;
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!(tp = sp->tiles[i])) continue;
+		for (l = 0; l < n; l++)
+			if (tp[l] && (tp[l] != MEM_NONE)) free(tp[l]);
+	}
+	free(sp);
+}
+
+/* Test if a tile-sized area is filled with given value */
+static int sparse_filled(unsigned char *src, int bpp, int stride, int w, int h,
+	unsigned char *fill)
+{
+	int i;
+
+	for (; h > 0; h-- , src += stride)
+	{
+		if (bpp == 1)
+		{
+			if (!is_filled(src, *fill, w)) return (FALSE);
+			continue;
+		}
+		for (i = 0; i < w * 3; i += 3)
+			if ((src[i] != fill[0]) || (src[i + 1] != fill[1]) ||
+				(src[i + 2] != fill[2])) return (FALSE);
+	}
+	return (TRUE);
+}
+
+int mem_sparse_pack(image_info *image)
+{
+	sparse_info *sp;
+	unsigned char *src, *dest, **tp;
+	size_t n, l, need = 0, total = 0;
+	int i, j, k, x, y, tx, ty, tw, th, tl, bpp, stride;
+	int w = image->width, h = image->height, cmask = cmask_from(image->img);
+
+	if (image->sparse || !cmask) return (FALSE);
+	tw = (w + SPARSE_SIZE - 1) >> SPARSE_SHIFT;
+	th = (h + SPARSE_SIZE - 1) >> SPARSE_SHIFT;
+	n = (size_t)tw * th;
+	sp = calloc(1, sizeof(sparse_info) + n * NUM_CHANNELS * sizeof(*tp));
+	if (!sp) return (FALSE);
+	sp->tw = tw;
+	sp->th = th;
+	sp->cmask = cmask;
+
+	/* Mark tiles which differ from fill, i.e. the pixel at (0, 0) */
+	tp = (void *)(sp + 1);
+	for (i = 0 , bpp = image->bpp; i < NUM_CHANNELS; i++ , bpp = 1)
+	{
+		if (!(src = image->img[i])) continue;
+		sp->tiles[i] = tp;
+		memcpy(sp->fill[i], src, bpp);
+		stride = w * bpp;
+		total += (size_t)h * stride;
+		for (l = ty = 0; ty < th; ty++)
+		{
+			y = ty << SPARSE_SHIFT;
+			j = h - y > SPARSE_SIZE ? SPARSE_SIZE : h - y;
+			for (tx = 0; tx < tw; tx++ , l++)
+			{
+				x = tx << SPARSE_SHIFT;
+				tl = w - x > SPARSE_SIZE ? SPARSE_SIZE : w - x;
+				if (sparse_filled(src + (size_t)y * stride + x * bpp,
+					bpp, stride, tl, j, sp->fill[i])) continue;
+				tp[l] = MEM_NONE;
+				need += SPARSE_SIZE * SPARSE_SIZE * bpp;
+			}
+		}
+		tp += n;
+	}
+
+	/* Only worth it if at least half the memory gets freed */
+	if (need > total / 2)
+	{
+		sparse_free(sp);
+		return (FALSE);
+	}
+
+	/* Allocate and fill tiles; all or nothing */
+	for (i = 0 , bpp = image->bpp; i < NUM_CHANNELS; i++ , bpp = 1)
+	{
+		if (!(tp = sp->tiles[i])) continue;
+		src = image->img[i];
+		stride = w * bpp;
+		for (l = ty = 0; ty < th; ty++)
+		{
+			y = ty << SPARSE_SHIFT;
+			j = h - y > SPARSE_SIZE ? SPARSE_SIZE : h - y;
+			for (tx = 0; tx < tw; tx++ , l++)
+			{
+				if (!tp[l]) continue;
+				tp[l] = NULL;
+				dest = malloc(SPARSE_SIZE * SPARSE_SIZE * bpp);
+				if (!dest)
+				{
+					sparse_free(sp);
+					return (FALSE);
+				}
+				tp[l] = dest;
+				x = tx << SPARSE_SHIFT;
+				tl = (w - x > SPARSE_SIZE ? SPARSE_SIZE : w - x) * bpp;
+				for (k = 0; k < j; k++ , dest += SPARSE_SIZE * bpp)
+					memcpy(dest, src + ((size_t)(y + k) * w + x) *
+						bpp, tl);
+			}
+		}
+	}
+
+	/* Drop dense channels, and the undo frame's aliases of them */
+	mem_free_chanlist(image->img);
+	memset(image->img, 0, sizeof(chanlist));
+	image->sparse = sp;
+	if (image->undo_.items)
+	{
+		undo_item *undo = image->undo_.items[image->undo_.pointer];
+		memset(undo->img, 0, sizeof(chanlist));
+		undo->flags &= ~UF_SIZED;
+		image->undo_.size = 0;
+	}
+	return (TRUE);
+}
+
+int mem_sparse_unpack(image_info *image)
+{
+	sparse_info *sp = image->sparse;
+	chanlist tmp, dest;
+	size_t l, sz;
+	int i, y, w = image->width, bpp = image->bpp;
+
+	if (!sp) return (TRUE);
+	memset(tmp, 0, sizeof(chanlist));
+	sz = (size_t)w * image->height;
+	for (i = 0 , l = sz * bpp; i < NUM_CHANNELS; i++ , l = sz)
+	{
+		if (!(sp->cmask & CMASK_FOR(i))) continue;
+		if ((tmp[i] = malloc(l))) continue;
+		mem_free_chanlist(tmp);
+		return (FALSE);
+	}
+
+	memcpy(dest, tmp, sizeof(chanlist));
+	for (y = 0; y < image->height; y++)
+	{
+		mem_sparse_row(sp, bpp, dest, 0, y, w);
+		for (i = 0 , l = w * bpp; i < NUM_CHANNELS; i++ , l = w)
+			if (dest[i]) dest[i] += l;
+	}
+
+	sparse_free(sp);
+	image->sparse = NULL;
+	memcpy(image->img, tmp, sizeof(chanlist));
+	if (image->undo_.items)
+	{
+		undo_item *undo = image->undo_.items[image->undo_.pointer];
+		memcpy(undo->img, tmp, sizeof(chanlist));
+		undo->flags &= ~UF_SIZED;
+		image->undo_.size = 0;
+	}
+	return (TRUE);
+}
+
+void mem_sparse_row(sparse_info *sp, int bpp, chanlist dest, int x, int y,
+	int w)
+{
+	unsigned char *d, *tile, **tp;
+	int i, j, l, n, xx, yo = (y & (SPARSE_SIZE - 1)) * SPARSE_SIZE;
+
+	for (i = 0; i < NUM_CHANNELS; i++ , bpp = 1)
+	{
+		if (!(d = dest[i]) || !(tp = sp->tiles[i])) continue;
+		tp += (size_t)(y >> SPARSE_SHIFT) * sp->tw;
+		for (xx = x , l = w; l > 0; xx += n , l -= n , d += n * bpp)
+		{
+			j = xx & (SPARSE_SIZE - 1);
+			n = SPARSE_SIZE - j;
+			if (n > l) n = l;
+			if ((tile = tp[xx >> SPARSE_SHIFT]))
+				memcpy(d, tile + (yo + j) * bpp, n * bpp);
+			else if (bpp == 1) memset(d, sp->fill[i][0], n);
+			else for (j = 0; j < n * 3; j += 3)
+			{
+				d[j] = sp->fill[i][0];
+				d[j + 1] = sp->fill[i][1];
+				d[j + 2] = sp->fill[i][2];
+			}
+		}
+	}
+}
+
 /* Clear/remove image data */
 void mem_free_image(image_info *image, int mode)
 {
@@ -893,6 +1176,8 @@ void mem_free_image(image_info *image, int mode)
 	{
 		mem_free_chanlist(image->img);
 		memset(image->img, 0, sizeof(chanlist));
+		sparse_free(image->sparse);
+		image->sparse = NULL;
 		image->width = image->height = 0;
 
 		free(image->filename);
@@ -957,7 +1242,10 @@ int mem_alloc_image(int mode, image_info *image, int w, int h, int bpp,
 	res = MEM_NONE;
 	for (i = CHN_IMAGE; res && (i < NUM_CHANNELS); i++)
 	{
-		if (cmask & CMASK_FOR(i)) res = image->img[i] = malloc(l);
+		if (!(cmask & CMASK_FOR(i)));
+		else if ((mode & AI_SHARE) && chan_share(src->img[i]))
+			res = image->img[i] = src->img[i];
+		else res = image->img[i] = malloc(l);
 		l = sz;
 	}
 	if (res && image->undo_.items)
@@ -969,7 +1257,7 @@ int mem_alloc_image(int mode, image_info *image, int w, int h, int bpp,
 	{
 		free(image->filename);
 		image->filename = NULL;
-		while (--i >= 0) free(image->img[i]);
+		while (--i >= 0) chan_free(image->img[i]);
 		memset(image->img, 0, sizeof(chanlist));
 		return (FALSE);
 	}
@@ -979,7 +1267,8 @@ int mem_alloc_image(int mode, image_info *image, int w, int h, int bpp,
 	{
 		for (i = CHN_IMAGE; i < NUM_CHANNELS; i++)
 		{
-			if (image->img[i]) memcpy(image->img[i], src->img[i], l);
+			if (image->img[i] && (image->img[i] != src->img[i]))
+				memcpy(image->img[i], src->img[i], l);
 			l = sz;
 		}
 	}
@@ -1241,7 +1530,7 @@ done:
 static void mem_undo_tile(undo_item *undo)
 {
 	unsigned char buf[((MAX_WIDTH + TILE_SIZE - 1) / TILE_SIZE) * 3];
-	unsigned char *tstrip, tmap[MAX_TILEMAP], *tmp = NULL;
+	unsigned char *tstrip, *tmap, *tmp = NULL;
 	int spans[(MAX_WIDTH + TILE_SIZE - 1) / TILE_SIZE + 3];
 	size_t sz, area = 0, msize = 0;
 	int i, j, k, nt, dw, cc, bpp;
@@ -1272,7 +1561,8 @@ static void mem_undo_tile(undo_item *undo)
 	dw = (TILE_SIZE - 1) & ~(mem_width - 1);
 	bw = (mem_width + TILE_SIZE - 1) / TILE_SIZE;
 	tw = (bw + 7) >> 3; tsz = tw * nstrips;
-	memset(tmap, 0, tsz);
+	/* Tilemap is sized to the image, not to the largest possible one */
+	if (!(tmap = calloc(1, tsz))) return;
 	for (i = 0 , tstrip = tmap; i < mem_height; i += TILE_SIZE , tstrip += tw)
 	{
 		h = mem_height - i;
@@ -1283,12 +1573,13 @@ static void mem_undo_tile(undo_item *undo)
 		for (cc = 0; nc >= 1 << cc; cc++)
 		{
 			unsigned char *src, *dest;
-			int j, k, j2, w;
+			size_t k;
+			int j, j2, w;
 
 			if (!(nc & 1 << cc)) continue;
 			bpp = BPP(cc);
 			w = mem_width * bpp;
-			k = i * w;
+			k = (size_t)i * w;
 			src = undo->img[cc] + k;
 			dest = mem_img[cc] + k;
 			if (!tile_row_compare(src, dest, w, h, buf)) continue;
@@ -1311,7 +1602,20 @@ static void mem_undo_tile(undo_item *undo)
 	/* Not tileable if tilemap cannot fit in space gained */
 	sz = (size_t)mem_width * mem_height;
 	bpp = (nc & CMASK_IMAGE ? mem_img_bpp : 1);
-	if ((sz - area) * bpp <= tsz) return;
+	if ((sz - area) * bpp <= tsz)
+	{
+		free(tmap);
+		return;
+	}
+
+	/* Shared channels cost nothing extra in a flat frame, and cannot be
+	 * compressed in place */
+	for (cc = 0; ntiles && (nc >= 1 << cc); cc++)
+	{
+		if (!(nc & 1 << cc) || !chan_shared(undo->img[cc])) continue;
+		free(tmap);
+		return;
+	}
 
 	/* Implement tiling */
 	sz = (size_t)mem_width * mem_height;
@@ -1324,7 +1628,7 @@ static void mem_undo_tile(undo_item *undo)
 		if (!(nc & 1 << cc)) continue;
 		if (!ntiles) /* Channels unchanged - free the memory */
 		{
-			free(undo->img[cc]);
+			chan_free(undo->img[cc]);
 			undo->img[cc] = MEM_NONE;
 			continue;
 		}
@@ -1389,6 +1693,7 @@ static void mem_undo_tile(undo_item *undo)
 		undo->tileptr = tmp;
 		memcpy(tmp, tmap, tsz);
 	}
+	free(tmap);
 
 	if (undo->pal_) msize += SIZEOF_PALETTE + 32;
 	undo->size = msize;
@@ -1561,6 +1866,89 @@ void *mem_try_malloc(size_t size)
 	return (ptr);
 }
 
+/* Drop all undo and redo frames of current image, leaving only the image
+ * itself - for operations which cannot fit in memory along with undo */
+static void mem_undo_drop()
+{
+	int i, k = mem_undo_pointer;
+
+	update_undo(&mem_image);
+	for (i = 0; i < mem_undo_redo; i++)
+	{
+		k = (k + 1) % mem_undo_max;
+		undo_free_x(mem_undo_im_ + k);
+	}
+	mem_undo_redo = 0;
+	while (mem_undo_done) lose_oldest(&mem_image.undo_);
+}
+
+/* Allocate channels of new size for streaming into, without undo; the undo
+ * history gets dropped, so ask the user first. Only channels in cmask get
+ * allocated here, the rest wait till the sources before them are released.
+ * Returns 0 if all is well, 1 if out of memory, -1 if cancelled */
+static int stream_alloc(chanlist neo, int cmask, int w, int h, int bpp)
+{
+	int i, j;
+
+	if ((mem_undo_done || mem_undo_redo) && !script_cmds &&
+		(alert_box(_("Warning"), _("There is not enough memory to keep undo history for this operation. Discard the undo history and continue?"),
+		_("No"), _("Yes"), NULL) != 2)) return (-1);
+
+	memset(neo, 0, sizeof(chanlist));
+	for (j = 0; j < 2; j++)
+	{
+		for (i = 0; i < NUM_CHANNELS; i++)
+		{
+			if (!mem_img[i] || !(cmask & CMASK_FOR(i))) continue;
+			if (!(neo[i] = malloc((size_t)w * h *
+				(i == CHN_IMAGE ? bpp : 1)))) break;
+		}
+		if (i >= NUM_CHANNELS) break;
+		mem_free_chanlist(neo);
+		memset(neo, 0, sizeof(chanlist));
+		if (!mem_undo_done && !mem_undo_redo) return (1);
+		mem_undo_drop();
+	}
+	if (j > 1) return (1);
+	/* Past this point, there is no going back */
+	mem_undo_fail = TRUE;
+	mem_undo_drop();
+	notify_changed();
+	return (0);
+}
+
+/* Allocate a channel of new size when its turn comes; if no memory, the
+ * channel gets dropped along with its source */
+static int stream_chan(chanlist neo, chanlist old, int cc, int w, int h)
+{
+	if (neo[cc] || (neo[cc] = malloc((size_t)w * h))) return (TRUE);
+	chan_free(old[cc]);
+	old[cc] = NULL;
+	return (FALSE);
+}
+
+/* Release source rows past the given count */
+static unsigned char *stream_trim(unsigned char *mem, size_t rowsize, int rows)
+{
+	unsigned char *tmp;
+
+	if (chan_shared(mem)) return (mem); // Another image still uses it all
+	tmp = realloc(mem, rowsize * (rows < 1 ? 1 : rows));
+	return (tmp ? tmp : mem);
+}
+
+/* Replace image with streamed-into channels */
+static void stream_commit(chanlist neo, int w, int h)
+{
+	memcpy(mem_img, neo, sizeof(chanlist));
+	mem_width = w;
+	mem_height = h;
+	if (!mem_img[mem_channel]) mem_channel = CHN_IMAGE;
+	update_undo(&mem_image);
+}
+
+static int pen_res; // Undo result for the rest of stroke
+
 int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cmask)
 {
 	png_color *newpal;
@@ -1572,8 +1960,9 @@ int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cma
 	int i, j, k, need_frame;
 
 
-	if (pen_down && (mode & UC_PENDOWN)) return (0);
+	if (pen_down && (mode & UC_PENDOWN)) return (pen_res);
 	pen_down = mode & UC_PENDOWN ? 1 : 0;
+	pen_res = 0;
 
 	/* Fill undo frame */
 	update_undo(&mem_image);
@@ -1619,13 +2008,17 @@ int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cma
 		if (cmask & CMASK_IMAGE) j += new_bpp - 1;
 		mem_req += (wh + 32) * j;
 // !!! Must be after update_undo() to get used memory right
-		if ((mem_undo_fail = mem_undo_space(mem_req))) return (2);
+		if ((mem_undo_fail = mem_undo_space(mem_req)))
+		{
+			/* Image will be changed in place, so stop sharing it */
+			return (mem_unshare(cmask) ? 2 : (pen_res = 3));
+		}
 	}
 	if (mode & UC_GETMEM) return (0); // Enough memory was freed
 
 	/* Ensure a new frame */
 	undo = newchunk(&undo_items);
-	if (!undo) return (1);
+	if (!undo) goto fail;
 	freechunk(&undo_items, undo); // It'll be waiting in the freelist
 
 	/* Prepare outgoing frame */
@@ -1636,7 +2029,7 @@ int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cma
 
 	/* Allocate new palette */
 	newpal = mem_try_malloc(SIZEOF_PALETTE);
-	if (!newpal) return (1);
+	if (!newpal) goto fail;
 
 	/* Duplicate affected channels */
 	for (i = 0; i < NUM_CHANNELS; i++)
@@ -1660,7 +2053,7 @@ int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cma
 			free(newpal);
 			for (j = 0; j < i; j++)
 				if (holder[j] != mem_img[j]) free(holder[j]);
-			return (1);
+			goto fail;
 		}
 		holder[i] = img;
 		/* Copy */
@@ -1689,12 +2082,14 @@ int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cma
 
 	update_undo(&mem_image);
 	return (0);
+
+fail:	return (mem_unshare(cmask) ? 1 : (pen_res = 3));
 }
 
 // Call this after a draw event but before any changes to image
-void mem_undo_next(int mode)
+int mem_undo_next(int mode)
 {
-	int cmask = CMASK_ALL, wmode = 0;
+	int cmask = CMASK_ALL, wmode = 0, again;
 
 	switch (mode)
 	{
@@ -1733,7 +2128,12 @@ void mem_undo_next(int mode)
 			(mem_clip_alpha || RGBA_mode) ? CMASK_RGBA : CMASK_CURR;
 		break;
 	}
-	undo_next_core(wmode, mem_width, mem_height, mem_img_bpp, cmask);
+	again = pen_down && (wmode & UC_PENDOWN);
+	if (undo_next_core(wmode, mem_width, mem_height, mem_img_bpp, cmask) < 3)
+		return (0);
+	/* Changing shared channels in place would change the other image too */
+	if (!again) memory_errors(1);
+	return (1);
 }
 
 /* Swap image & undo tiles; in process, normal order translates to reverse and
@@ -1759,7 +2159,7 @@ static void mem_undo_tile_swap(undo_item *undo, int redo)
 
 			if (!(l = mem_undo_spans(spans, tmap, mem_width, bpp)))
 				continue;
-			dest = mem_img[cc] + w * i;
+			dest = mem_img[cc] + (size_t)w * i;
 			h = mem_height - i;
 			if (h > TILE_SIZE) h = TILE_SIZE;
 
@@ -1847,7 +2247,7 @@ static void mem_undo_swap(undo_item *prev, int redo)
 void mem_do_undo(int redo)
 {
 	undo_item *curr, *prev;
-	int i, j;
+	int i, j, k, l;
 
 	/* Compress last undo frame */
 	mem_undo_prepare();
@@ -1860,6 +2260,15 @@ void mem_do_undo(int redo)
 		/* Swap data */
 		curr = mem_undo_im_[mem_undo_pointer];
 		prev = mem_undo_im_[i];
+		/* Tiles get swapped in place, into unshared channels only */
+		for (k = l = 0; l < NUM_CHANNELS; l++)
+			if (prev->img[l] && (prev->img[l] != MEM_NONE))
+				k |= CMASK_FOR(l);
+		if ((prev->flags & UF_TILED) && !mem_unshare(k))
+		{
+			memory_errors(1);
+			return;
+		}
 		mem_undo_swap(prev, redo);
 
 		/* Swap frames */
@@ -1949,6 +2358,7 @@ void mem_init()					// Initialise memory
 		{ 0, 36, 73, 109, 146, 182, 219, 255 };
 	unsigned char *dest;
 	char txt[64];
+	size_t l;
 	int i, j, ix, iy, bs, bf, bt;
 
 
@@ -1998,9 +2408,8 @@ void mem_init()					// Initialise memory
 	mem_col_B24.green = 0;
 	mem_col_B24.blue = 0;
 
-	j = mem_width * mem_height;
 	dest = mem_img[CHN_IMAGE];
-	for (i = 0; i < j; i++)
+	for (l = (size_t)mem_width * mem_height; l; l--)
 	{
 		*dest++ = mem_col_B24.red;
 		*dest++ = mem_col_B24.green;
@@ -2281,7 +2690,7 @@ void mem_mask_setv(int *what, int n, int state)
 
 void mem_get_histogram(int channel)	// Calculate how many of each colour index is on the canvas
 {
-	int i, j = mem_width * mem_height;
+	size_t i, j = (size_t)mem_width * mem_height;
 	unsigned char *img = mem_img[channel];
 
 	memset(mem_histogram, 0, sizeof(mem_histogram));
@@ -2291,7 +2700,9 @@ void mem_get_histogram(int channel)	// Calculate how many of each colour index i
 
 typedef struct {
 	int last_gamma, last_br, last_co, last_ps;
+	int lut_key[6];
 	unsigned char gamma_table[256], bc_table[256], ps_table[256];
+	unsigned char lut[256 * 3];
 } transform_cache;
 
 void do_transform(int start, int step, int cnt, unsigned char *mask,
@@ -2387,6 +2798,31 @@ void do_transform(int start, int step, int cnt, unsigned char *mask,
 	}
 	ix0 = ixx[dc]; ix1 = ixx[dc + 1]; ix2 = ixx[dc + 2];
 
+	/* Without hue & saturation, channels are independent: combine all the
+	 * rest into a per-channel lookup table */
+	if (!(dH | dc | sa))
+	{
+		int key[6] = { do_gamma, do_bc ? br : 0, do_bc ? co : 0, do_ps,
+			ops, TRUE };
+
+		if (memcmp(key, tp->lut_key, sizeof(key)))
+		{
+			int i, v;
+
+			memcpy(tp->lut_key, key, sizeof(key));
+			for (i = 0; i < 256; i++)
+			{
+				v = i;
+				if (do_gamma) v = tp->gamma_table[v];
+				if (do_bc) v = tp->bc_table[v];
+				if (do_ps) v = tp->ps_table[v];
+				tp->lut[i] = ops & 0xFF ? i : v;
+				tp->lut[i + 256] = ops & 0xFF00 ? i : v;
+				tp->lut[i + 512] = ops & 0xFF0000 ? i : v;
+			}
+		}
+	}
+
 	/* Use fake mask if no real one provided */
 	if (!mask) mask = &fmask , mstep = 0;
 	else mask += start - step , mstep = step;
@@ -2394,6 +2830,20 @@ void do_transform(int start, int step, int cnt, unsigned char *mask,
 	start *= 3; step *= 3; // Step by triples
 	img0 += start - step;
 	imgr += start - step;
+	if (!(dH | dc | sa))
+	{
+		unsigned char *lut = tp->lut;
+
+		while (cnt-- > 0)
+		{
+			img0 += step; imgr += step; mask += mstep;
+			if (*mask == (unsigned char)m0) continue;
+			imgr[0] = lut[img0[0]];
+			imgr[1] = lut[img0[1] + 256];
+			imgr[2] = lut[img0[2] + 512];
+		}
+		return;
+	}
 	while (cnt-- > 0)
 	{
 		img0 += step; imgr += step; mask += mstep;
@@ -2482,6 +2932,42 @@ void do_transform(int start, int step, int cnt, unsigned char *mask,
 	}
 }
 
+static void transform_rows(tcb *thread)
+{
+	unsigned char *mask = *(unsigned char **)thread->data;
+	unsigned char *mask0, *tmp, *xbuf = mask + mem_width;
+	int i, cnt = thread->nsteps;
+
+	for (i = thread->step0; cnt-- > 0; i++)
+	{
+		mask0 = NULL;
+		if (!channel_dis[CHN_MASK] && mem_img[CHN_MASK])
+			mask0 = mem_img[CHN_MASK] + (size_t)i * mem_width;
+		tmp = mem_img[CHN_IMAGE] + (size_t)i * mem_width * 3;
+		prep_mask(0, 1, mem_width, mask, mask0, tmp);
+		do_transform(0, 1, mem_width, mask, xbuf, tmp, 255);
+		process_img(0, 1, mem_width, mask, tmp, tmp, xbuf,
+			NULL, 3, BLENDF_SET | BLENDF_INVM);
+	}
+	thread_done(thread);
+}
+
+int mem_transform_image()	// Apply color transform to RGB image
+{
+	threaddata *tdata;
+	unsigned char *mask;
+
+	tdata = talloc(0, image_threads(mem_width, mem_height), &mask,
+		sizeof(mask), NULL, &mask, mem_width * 4, NULL);
+	if (!tdata) return (1);
+	/* Prepare tables before threads get to them */
+	do_transform(0, 0, 0, NULL, NULL, NULL, 255);
+	tdata->silent = TRUE;
+	launch_threads(transform_rows, tdata, NULL, mem_height);
+	free(tdata);
+	return (0);
+}
+
 static unsigned char pal_dupes[256];
 
 int scan_duplicates()	// Find duplicate palette colours, return number found
@@ -2506,7 +2992,7 @@ int scan_duplicates()	// Find duplicate palette colours, return number found
 
 void remove_duplicates()	// Remove duplicate palette colours - call AFTER scan_duplicates
 {
-	do_xlate(pal_dupes, mem_img[CHN_IMAGE], mem_width * mem_height);
+	do_xlate(pal_dupes, mem_img[CHN_IMAGE], (size_t)mem_width * mem_height);
 }
 
 int mem_remove_unused_check()
@@ -2543,7 +3029,7 @@ int mem_remove_unused()
 	mem_xpm_trans = (mem_xpm_trans < 0) || !mem_histogram[mem_xpm_trans] ?
 		-1 : conv[mem_xpm_trans];
 
-	do_xlate(conv, mem_img[CHN_IMAGE], mem_width * mem_height);
+	do_xlate(conv, mem_img[CHN_IMAGE], (size_t)mem_width * mem_height);
 
 	mem_cols -= found;
 
@@ -2606,7 +3092,7 @@ typedef struct {
 } rgb_256_map;
 
 // Convert RGB image to Indexed Palette
-int mem_convert_indexed(unsigned char *dest, unsigned char *src, int cnt,
+int mem_convert_indexed(unsigned char *dest, unsigned char *src, size_t cnt,
 	int cols, png_color *pal)
 {
 	rgb_256_map m;
@@ -2649,7 +3135,7 @@ int mem_convert_indexed(unsigned char *dest, unsigned char *src, int cnt,
 		idx[j] = i;
 	}
 
-	for (i = 0; i < cnt; i++)
+	for (; cnt; cnt--)
 	{
 		pix = MEM_2_INT(src, 0);
 		k = pix & 0xFF;
@@ -2678,14 +3164,15 @@ int mem_convert_indexed(unsigned char *dest, unsigned char *src, int cnt,
 int maxminquan(unsigned char *inbuf, int width, int height, int quant_to,
 	png_color *userpal)
 {
-	int i, j, k, ii, r, g, b, dr, dg, db, l = width * height, *hist;
+	size_t l;
+	int i, j, k, ii, r, g, b, dr, dg, db, *hist;
 
 	/* Allocate histogram */
 	hist = calloc(1, HISTSIZE * sizeof(int));
 	if (!hist) return (-1);
 
 	/* Fill histogram */
-	for (i = 0; i < l; i++)
+	for (l = (size_t)width * height; l; l--)
 	{
 		++hist[((inbuf[0] & 0xFC) << 10) + ((inbuf[1] & 0xFC) << 4) +
 			(inbuf[2] >> 2)];
@@ -2808,7 +3295,8 @@ int pnnquan(unsigned char *inbuf, int width, int height, int quant_to,
 	unsigned short heap[32769];
 	pnnbin *bins, *tb, *nb;
 	double d, err, n1, n2;
-	int i, j, k, l, l2, h, b1, maxbins, extbins, res = 1;
+	size_t n;
+	int i, j, l, l2, h, b1, maxbins, extbins, res = 1;
 
 
 	heap[0] = 0; // Empty
@@ -2818,8 +3306,7 @@ int pnnquan(unsigned char *inbuf, int width, int height, int quant_to,
 	progress_init(_("Quantize Pass 1"), 1);
 
 	/* Build histogram */
-	k = width * height;
-	for (i = 0; i < k; i++ , inbuf += 3)
+	for (n = (size_t)width * height; n; n-- , inbuf += 3)
 	{
 // !!! Can throw gamma correction in here, but what to do about perceptual
 // !!! nonuniformity then?
@@ -3087,7 +3574,7 @@ int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
 		NULL);
 	if (!ddata) return (1);
 
-	if ((progress = mem_width * mem_height > 1000000))
+	if ((progress = (size_t)mem_width * mem_height > 1000000))
 		progress_init(_("Converting to Indexed Palette"), 0);
 
 	/* Preprocess palette to find whether to extend precision and where */
@@ -3167,8 +3654,8 @@ int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
 	/* Process image */
 	for (i = 0; i < mem_height; i++)
 	{
-		src = old + i * mem_width * 3;
-		dest = mem_img[CHN_IMAGE] + i * mem_width;
+		src = old + (size_t)i * mem_width * 3;
+		dest = mem_img[CHN_IMAGE] + (size_t)i * mem_width;
 		memset(row2, 0, rlen);
 		if (serpent ^= 1)
 		{
@@ -3471,8 +3958,6 @@ int mem_quantize( unsigned char *old_mem_image, int target_cols, int type )
 	int closest[3][2];
 	png_color pcol;
 
-	j = mem_width * mem_height;
-
 	progress_init(_("Converting to Indexed Palette"),1);
 
 	for ( j=0; j<mem_height; j++ )		// Convert RGB to indexed
@@ -3481,9 +3966,11 @@ int mem_quantize( unsigned char *old_mem_image, int target_cols, int type )
 			if (progress_update( ((float) j)/(mem_height) )) break;
 		for ( i=0; i<mem_width; i++ )
 		{
-			pcol.red = old_mem_image[ 3*(i + mem_width*j) ];
-			pcol.green = old_mem_image[ 1 + 3*(i + mem_width*j) ];
-			pcol.blue = old_mem_image[ 2 + 3*(i + mem_width*j) ];
+			unsigned char *src = old_mem_image + 3 * (i + (size_t)mem_width * j);
+
+			pcol.red = src[0];
+			pcol.green = src[1];
+			pcol.blue = src[2];
 
 			closest[0][0] = 0;		// 1st Closest palette item to pixel
 			closest[1][0] = 100000000;
@@ -3713,7 +4200,7 @@ void mem_canvas_index_move( int c1, int c2 )	// Similar to palette item move but
 
 	// Change pixel index to new palette
 	if (mem_img_bpp == 1) do_xlate(table, mem_img[CHN_IMAGE],
-		mem_width * mem_height);
+		(size_t)mem_width * mem_height);
 }
 
 void mem_pal_sort( int a, int i1, int i2, int rev )		// Sort colours in palette
@@ -3806,7 +4293,7 @@ void mem_pal_sort( int a, int i1, int i2, int rev )		// Sort colours in palette
 	if (mem_img_bpp != 1) return;
 
 	// Adjust canvas pixels if in indexed palette mode
-	do_xlate(map, mem_img[CHN_IMAGE], mem_width * mem_height);
+	do_xlate(map, mem_img[CHN_IMAGE], (size_t)mem_width * mem_height);
 	/* Modify A & B */
 	mem_col_A = map[mem_col_A];
 	mem_col_B = map[mem_col_B];
@@ -3814,7 +4301,7 @@ void mem_pal_sort( int a, int i1, int i2, int rev )		// Sort colours in palette
 
 void mem_invert()			// Invert the palette
 {
-	int i, j;
+	size_t i, j;
 	png_color *col = mem_pal;
 	unsigned char *img;
 
@@ -3832,7 +4319,7 @@ void mem_invert()			// Invert the palette
 	{
 		unsigned char *mask = calloc(1, mem_width);
 
-		j = mem_width * mem_height;
+		j = (size_t)mem_width * mem_height;
 		if (mem_channel == CHN_IMAGE) j *= 3;
 		img = mem_img[mem_channel];
 		for (i = 0; i < j; i++)
@@ -3851,7 +4338,8 @@ void mem_normalize()		// Normalize contrast in image or palette
 {
 	unsigned char map[256], *img = NULL;
 	png_color *col;
-	int i, uninit_(j), k, k0, k1;
+	size_t uninit_(j);
+	int i, k, k0, k1;
 
 	memset(map, 0, 256);
 	if ((mem_channel == CHN_IMAGE) && (mem_img_bpp == 1))
@@ -3865,10 +4353,12 @@ void mem_normalize()		// Normalize contrast in image or palette
 	}
 	else
 	{
-		j = mem_width * mem_height;
+		size_t l;
+
+		j = (size_t)mem_width * mem_height;
 		if (mem_channel == CHN_IMAGE) j *= 3;
 		img = mem_img[mem_channel];
-		for (i = 0; i < j; i++) map[img[i]] = 1;
+		for (l = 0; l < j; l++) map[img[l]] = 1;
 	}
 
 	/* Range */
@@ -3923,8 +4413,8 @@ void mem_prepare_map(unsigned char *map, int how)
 	/* Clipboard */
 	else if (how == MAP_CLIP)
 	{
-		n = mem_clip_w * mem_clip_h;
-		if (n > 256) n = 256;
+		n = (size_t)mem_clip_w * mem_clip_h > 256 ? 256 :
+			mem_clip_w * mem_clip_h;
 		if (mem_clip_bpp == 3) memcpy(map, mem_clipboard, n * 3);
 		else do_convert_rgb(0, 1, n, map, mem_clipboard, mem_pal);
 	}
@@ -3933,7 +4423,7 @@ void mem_prepare_map(unsigned char *map, int how)
 void mem_remap_rgb(unsigned char *map, int what) // Remap V/R/G/B to color
 {
 	unsigned char *w, *img = mem_img[CHN_IMAGE];
-	int cnt = mem_width * mem_height;
+	size_t cnt = (size_t)mem_width * mem_height;
 
 	/* Value */
 	if (!what) while (cnt-- > 0)
@@ -3988,6 +4478,145 @@ void rgb2pal(png_color *pal, unsigned char *rgb, int cnt)
 	}
 }
 
+/* Pixel format conversions used by file loaders and savers; the common
+ * cases get simple fixed-stride loops, which the compiler can vectorize */
+
+/* Copy RGB triples, swapping R and B if "bgr" is set */
+void copy_run(unsigned char *dest, unsigned char *src, int len,
+	int dstep, int sstep, int bgr)
+{
+	unsigned char t;
+
+	if ((dstep == 3) && (sstep == 3))
+	{
+		if (!bgr) memmove(dest, src, len * 3);
+		else for (; len > 0; len-- , dest += 3 , src += 3)
+		{
+			t = src[0];
+			dest[0] = src[2];
+			dest[1] = src[1];
+			dest[2] = t;
+		}
+		return;
+	}
+	if ((dstep == 3) && (sstep == 4) && bgr) // BGRx
+	{
+		for (; len > 0; len-- , dest += 3 , src += 4)
+		{
+			dest[0] = src[2];
+			dest[1] = src[1];
+			dest[2] = src[0];
+		}
+		return;
+	}
+	if (bgr) bgr = 2;
+	while (len-- > 0)
+	{
+		dest[0] = src[bgr];
+		dest[1] = src[1];
+		dest[2] = src[bgr ^ 2];
+		dest += dstep;
+		src += sstep;
+	}
+}
+
+/* Copy "bpp" bytes per pixel, from "step" bytes per pixel */
+void copy_bytes(unsigned char *dest, unsigned char *src, int len,
+	int bpp, int step)
+{
+	int i, dd = 0;
+
+	if (step == bpp) // Contiguous
+	{
+		memmove(dest, src, len * bpp);
+		return;
+	}
+	if (bpp == 1) // Extract a channel
+	{
+		for (; len > 0; len-- , src += step) *dest++ = *src;
+		return;
+	}
+	if ((step -= bpp) < 0) bpp -= dd = -step , step = 0;
+	while (len-- > 0)
+	{
+		i = bpp;
+		while (i--) *dest++ = *src++;
+		src += step; dest += dd;
+	}	
+}
+
+static inline void convert_16b_(unsigned char *dest, unsigned char *src,
+	int len, int bpp, int step, int maxval)
+{
+	int i, v, m = maxval * 2;
+
+	if (!(step -= bpp)) bpp *= len , len = 1;
+	step *= 2;
+	while (len-- > 0)
+	{
+		i = bpp;
+		while (i--)
+		{
+			v = (src[0] << 8) + src[1];
+			src += 2;
+			*dest++ = (v * (255 * 2) + maxval) / m;
+		}
+		src += step;
+	}	
+}
+
+/* Scale big-endian 16-bit values down to bytes */
+void convert_16b(unsigned char *dest, unsigned char *src, int len,
+	int bpp, int step, int maxval)
+{
+	/* Full range is the usual case, and dividing by a constant is fast */
+	if (maxval == 65535) convert_16b_(dest, src, len, bpp, step, 65535);
+	else convert_16b_(dest, src, len, bpp, step, maxval);
+}
+
+/* Scale 0..maxval values up to 0..255 */
+void extend_bytes(unsigned char *dest, size_t len, int maxval)
+{
+	unsigned char tb[256];
+
+	memset(tb, 255, 256);
+	set_xlate_n(tb, maxval);
+	do_xlate(tb, dest, len);
+}
+
+/* OR a row of 1-bit MSB-first values into every "step"th byte, as 0x80 >> n */
+void or_bitplane(unsigned char *dest, unsigned char *src, int len, int n,
+	int step)
+{
+	unsigned char v = 0;
+	int i;
+
+	for (i = 0; i < len; i++ , v += v , dest += step)
+	{
+		if (!(i & 7)) v = *src++;
+		*dest |= (v & 0x80) >> n;
+	}
+}
+
+/* Simple CMYK to RGB conversion, without color management */
+void cmyk2rgb_plain(unsigned char *dest, unsigned char *src, size_t cnt,
+	int inverted)
+{
+	unsigned char xb = inverted ? 0 : 255;
+	int k, r, g, b;
+
+	for (; cnt; cnt-- , src += 4 , dest += 3)
+	{
+		k = src[3] ^ xb;
+		r = (src[0] ^ xb) * k;
+		dest[0] = (r + (r >> 8) + 1) >> 8;
+		g = (src[1] ^ xb) * k;
+		dest[1] = (g + (g >> 8) + 1) >> 8;
+		b = (src[2] ^ xb) * k;
+		dest[2] = (b + (b >> 8) + 1) >> 8;
+	}
+}
+
 /* !!! The rectangles here exclude bottom & right border */
 int clip(int *rxy, int x0, int y0, int x1, int y1, const int *vxy)
 {
@@ -4206,6 +4835,8 @@ void tline( int x1, int y1, int x2, int y2, int size )		// Draw size thickness s
 void draw_quad(linedata line1, linedata line2, linedata line3, linedata line4)
 {
 	int x1, x2, y1, xx[4];
+
+	put_pixel_batch(TRUE);
 	for (; line1[2] >= 0; line_step(line1) , line_step(line3))
 	{
 		y1 = line1[1];
@@ -4218,6 +4849,7 @@ void draw_quad(linedata line1, linedata line2, linedata line3, linedata line4)
 		x2 = xx[1] >= mem_width ? mem_width - 1 : xx[1];
 		put_pixel_row(x1, y1, x2 - x1 + 1, NULL);
 	}
+	put_pixel_batch(FALSE);
 }
 
 /* Draw general parallelogram */
@@ -4254,8 +4886,8 @@ static void put_pixel_sb(int x, int y)
 	j = pixel_protected(x, y);
 	if (IS_INDEXED ? j : j == 255) return;
 
-	if (!sb_buf2) sb_buf[y1 * sb_rect[2] + x1] = 0xFFFF;
-	else sb_buf2[y1 * sb_rect[2] + x1] = 0xFFFF;
+	if (!sb_buf2) sb_buf[(size_t)y1 * sb_rect[2] + x1] = 0xFFFF;
+	else sb_buf2[(size_t)y1 * sb_rect[2] + x1] = 0xFFFF;
 }
 
 static void mask_select(unsigned char *mask, unsigned char *xsel, int l);
@@ -4263,7 +4895,8 @@ static void mask_select(unsigned char *mask, unsigned char *xsel, int l);
 static void put_pixel_row_sb(int x, int y, int len, unsigned char *xsel)
 {
 	unsigned char mask[ROW_BUFLEN];
-	int x1, y1, sb_ofs, offset, use_mask, masked;
+	size_t sb_ofs, offset;
+	int x1, y1, use_mask, masked;
 
 
 	if ((len <= 0) || (x + len <= sb_rect[0])) return;
@@ -4274,8 +4907,8 @@ static void put_pixel_row_sb(int x, int y, int len, unsigned char *xsel)
 	if (x1 + len > sb_rect[2]) len = sb_rect[2] - x1; // Clip right side
 	if (x1 < 0) x -= x1 , len += x1 , xsel -= x1 , x1 = 0; // Clip left side
 
-	sb_ofs = y1 * sb_rect[2] + x1;
-	offset = x + mem_width * y;
+	sb_ofs = (size_t)y1 * sb_rect[2] + x1;
+	offset = x + (size_t)mem_width * y;
 	masked = IS_INDEXED ? 1 : 255;
 	use_mask = (mem_channel <= CHN_ALPHA) && mem_img[CHN_MASK] && !channel_dis[CHN_MASK];
 
@@ -4310,6 +4943,7 @@ static void put_pixel_row_sb(int x, int y, int len, unsigned char *xsel)
 static int shapeburst()
 {
 	unsigned short *r0, *dmap = sb_buf;
+	size_t n;
 	int i, j, k, l, dx, dy, maxd = 0, w = sb_rect[2], h = sb_rect[3];
 
 
@@ -4339,12 +4973,12 @@ static int shapeburst()
 			}
 		}
 		if (dx < 0) break; /* Both passes done */
-		r0 = dmap + w * h - 1; dx = -1; dy = -w; /* Backward pass */
+		r0 = dmap + (size_t)w * h - 1; dx = -1; dy = -w; /* Backward pass */
 	}
 
 	/* Find largest */
 	r0 = dmap;
-	for (k = w * h; k; k-- , r0++) if (maxd < *r0) maxd = *r0;
+	for (n = (size_t)w * h; n; n-- , r0++) if (maxd < *r0) maxd = *r0;
 	return (maxd);
 }
 
@@ -4354,7 +4988,8 @@ typedef struct {
 	int x, e, v, w;
 } par_data;
 
-static void dist_pass1(int w, int h, uint32_t *dmap)
+/* Process "cw" columns of "w"-wide map, starting at "dmap" */
+static void dist_pass1(int w, int h, int cw, uint32_t *dmap)
 {
 	uint32_t m, *r0;
 	int i, j, dy;
@@ -4365,12 +5000,12 @@ static void dist_pass1(int w, int h, uint32_t *dmap)
 	while (TRUE)
 	{
 		/* First row */
-		for (i = 0; i < w; i++) if (r0[i]) r0[i] = 1;
+		for (i = 0; i < cw; i++) if (r0[i]) r0[i] = 1;
 		/* Other rows */
 		for (j = 1; j < h; j++)
 		{
 			r0 += dy;
-			for (i = 0; i < w; i++)
+			for (i = 0; i < cw; i++)
 			{
 				m = r0[i - dy];
 				if (r0[i] > m) r0[i] = m + 1;
@@ -4435,19 +5070,66 @@ static int dist_pass2_e2(int w, int h, uint32_t *dmap, par_data *pb)
 	return (mx);
 }
 
+typedef struct {
+	uint32_t *dmap;
+	par_data *pb;
+	int w, h, maxd;
+} sbd;
+
+/* Columns are independent in pass 1 */
+static void sb_pass1(tcb *thread)
+{
+	sbd *sd = thread->data;
+
+	dist_pass1(sd->w, sd->h, thread->nsteps, sd->dmap + thread->step0);
+	thread_done(thread);
+}
+
+/* Rows are independent in pass 2, with a parabola buffer per thread */
+static void sb_pass2(tcb *thread)
+{
+	sbd *sd = thread->data;
+
+	sd->maxd = dist_pass2_e2(sd->w, thread->nsteps,
+		sd->dmap + (size_t)thread->step0 * sd->w, sd->pb);
+	thread_done(thread);
+}
+
 /* Euclidean (L2 metric) distance transform of binary image map */
 static int shapeburst_m()
 {
-	int maxd, w = sb_rect[2], h = sb_rect[3];
+	sbd sd = { sb_buf2, sb_mem, sb_rect[2], sb_rect[3], 0 };
+	threaddata *tdata = NULL;
+	int i, maxd, nt = image_threads(sd.w, sd.h);
 
-	dist_pass1(w, h, sb_buf2);
-	maxd = dist_pass2_e2(w, h, sb_buf2, sb_mem);
+	if (nt > 1) tdata = talloc(MA_ALIGN_DEFAULT, nt, &sd, sizeof(sd),
+		NULL,
+		&sd.pb, (sd.w + 3) * sizeof(par_data),
+		NULL);
+	if (!tdata) /* Do it in one go */
+	{
+		dist_pass1(sd.w, sd.h, sd.w, sd.dmap);
+		maxd = dist_pass2_e2(sd.w, sd.h, sd.dmap, sd.pb);
+	}
+	else
+	{
+		tdata->silent = TRUE;
+		launch_threads(sb_pass1, tdata, NULL, sd.w);
+		launch_threads(sb_pass2, tdata, NULL, sd.h);
+		for (maxd = i = 0; i < tdata->count; i++)
+		{
+			sbd *sp = tdata->threads[i]->data;
+			if (maxd < sp->maxd) maxd = sp->maxd;
+		}
+		free(tdata);
+	}
 	return (ceil(sqrt(maxd)));
 }
 
 int init_sb()
 {
-	int l = sb_rect[2] + 3, wh = sb_rect[2] * sb_rect[3];
+	size_t wh = (size_t)sb_rect[2] * sb_rect[3];
+	int l = sb_rect[2] + 3;
 
 	if (sb_dist != DIST_L2) /* Use simple distance algorithm */
 		sb_mem = sb_buf = calloc(wh, sizeof(unsigned short));
@@ -4486,7 +5168,7 @@ void render_sb(unsigned char *mask)
 
 		for (i = 0; i < sb_rect[3]; i++)
 			put_pixel_row(sb_rect[0], sb_rect[1] + i, sb_rect[2],
-				mask ? mask + sb_rect[2] * i : NULL);
+				mask ? mask + (size_t)sb_rect[2] * i : NULL);
 
 		*grad = svgrad;
 	}
@@ -4514,7 +5196,7 @@ void render_sb(unsigned char *mask)
 
 static int wjfloodfill(int x, int y, int col, unsigned char *bmap)
 {
-	short nearq[QMINSIZE * QMINSIZE * 2];
+	int nearq[QMINSIZE * QMINSIZE * 2];
 	/* QMINSIZE bits per cell */
 	guint32 tmap, lmap[(MAX_DIM >> QMINLEVEL) * 12 + QLEVELS * 4], maps[4];
 	int borders[4] = {0, mem_width, 0, mem_height};
@@ -4652,8 +5334,9 @@ static int wjfloodfill(int x, int y, int col, unsigned char *bmap)
 						continue;
 					break;
 				case 1: /* Centered mode */
-					if (!csel_scan(ty * mem_width + tx, 1, 1,
-						NULL, mem_img[CHN_IMAGE], flood_data))
+					if (!csel_scan(0, 1, 1, NULL, mem_img[CHN_IMAGE] +
+						(tx + (size_t)mem_width * ty) * mem_img_bpp,
+						flood_data))
 						continue;
 					break;
 				case 0: /* Normal mode */
@@ -4750,7 +5433,8 @@ static int bitmap_bounds(int *rect, unsigned char *pat)
 int try_pixel(int x, int y)
 {
 	unsigned char uninit_(ab), ib[3], *img, *uninit_(alpha);
-	int res, bpp = MEM_BPP, ofs = x + mem_width * y, op = mem_undo_opacity;
+	size_t ofs = x + (size_t)mem_width * y;
+	int res, bpp = MEM_BPP, op = mem_undo_opacity;
 
 	img = mem_img[mem_channel] + ofs * bpp;
 	memcpy(ib, img, bpp);
@@ -4781,8 +5465,7 @@ int flood_fill(int x, int y, unsigned int target)
 		!flood_step && (!flood_img || (mem_channel == CHN_IMAGE)))
 	{
 		/* Try modifying the first pixel */
-		if (!try_pixel(x, y)) return (FALSE);
-		spot_undo(UNDO_TOOL);
+		if (!try_pixel(x, y) || spot_undo(UNDO_TOOL)) return (FALSE);
 		return (wjfloodfill(x, y, target, NULL));
 	}
 
@@ -4805,11 +5488,11 @@ int flood_fill(int x, int y, unsigned int target)
 			sb_rect[3] = mem_height;
 			l = bitmap_bounds(sb_rect, pat);
 			if (!l) break; /* Nothing to draw */
-			if (!init_sb()) break; /* Not enough memory */
 		}
+		if (spot_undo(UNDO_TOOL)) break;
+		if (sb && !init_sb()) break; /* Not enough memory */
 
 		res = TRUE;
-		spot_undo(UNDO_TOOL);
 		for (i = 0; i < mem_height; i++)
 		{
 			unsigned u, f = 1 << (i & 7);
@@ -4839,14 +5522,12 @@ void f_rectangle(int x, int y, int w, int h)	// Draw a filled rectangle
 	if (h > mem_height) h = mem_height;
 	w -= x;
 
+	put_pixel_batch(TRUE);
 	/* !!! Test is oversimplified and is overkill, see rec_continuous() */
 	if ((tool_type == TOOL_CLONE) && (clone_dy < 0))
-	{
 		while (--h >= y) put_pixel_row(x, h, w, NULL);
-		return;
-	}
-
-	for (; y < h; y++) put_pixel_row(x, y, w, NULL);
+	else for (; y < h; y++) put_pixel_row(x, y, w, NULL);
+	put_pixel_batch(FALSE);
 }
 
 /*
@@ -5034,6 +5715,7 @@ void f_circle( int x, int y, int r )				// Draw a filled circle
 	if (circ_r != r) retrace_circle(r);
 
 	/* Draw result */
+	put_pixel_batch(TRUE);
 	for (i = half; i <= r1; i += 2)
 	{
 		y0 = y - ((i + half) >> 1);
@@ -5048,6 +5730,7 @@ void f_circle( int x, int y, int r )				// Draw a filled circle
 		if (y0 >= 0) put_pixel_row(x0, y0, x1, NULL);
 		if ((y1 != y0) && (y1 < mem_height)) put_pixel_row(x0, y1, x1, NULL);
 	}
+	put_pixel_batch(FALSE);
 }
 
 static int find_tangent(int dx, int dy)
@@ -5082,38 +5765,85 @@ void circle_line(int x0, int y0, int dx, int dy, int thick)
 	g_para(xx[0], yy[0], xx[1], yy[1], dx, dy);
 }
 
-void mem_flip_v(char *mem, char *tmp, int w, int h, int bpp)
+/* Rotations and flips work on blocks of rows, in parallel */
+
+#define ROT_TILE 32 /* Rotation is done in squares this large */
+
+typedef struct xformd xformd;
+struct xformd {
+	void (*rows)(xformd *xd, int y0, int y1);
+	unsigned char *new, *old;
+	int w, h, dir, bpp, progress;
+};
+
+static void xform_thread(tcb *thread)
 {
-	unsigned char *src, *dest;
-	int i, k;
+	xformd *xd = thread->data;
+	int i, cnt = thread->nsteps;
 
-	k = w * bpp;
-	src = mem;
-	dest = mem + (h - 1) * k;
-	h /= 2;
+	for (i = 0; i < cnt; i++)
+	{
+		xd->rows(xd, thread->step0 + i, thread->step0 + i + 1);
+		if (xd->progress) thread_step(thread, i + 1, cnt, 5);
+	}
+	thread_done(thread);
+}
 
-	for (i = 0; i < h; i++)
+static void mem_xform(xformd *xd, int n, char *title)
+{
+	threaddata *tdata;
+
+	xd->progress = title && ((size_t)xd->w * xd->h > PROGRESS_LIM * 4);
+	tdata = talloc(0, image_threads(xd->w, xd->h), xd, sizeof(xformd),
+		NULL, NULL);
+	if (!tdata) xd->rows(xd, 0, n); // Do it in one go
+	else
 	{
-		memcpy(tmp, src, k);
-		memcpy(src, dest, k);
-		memcpy(dest, tmp, k);
-		src += k;
-		dest -= k;
+		tdata->silent = !xd->progress;
+		launch_threads(xform_thread, tdata, xd->progress ? title : NULL, n);
+		free(tdata);
 	}
 }
 
-void mem_flip_h( char *mem, int w, int h, int bpp )
+static void flip_v_rows(xformd *xd, int y0, int y1)
+{
+	unsigned char tmp[1024], *src, *dest;
+	int i, l, k = xd->w * xd->bpp;
+
+	for (; y0 < y1; y0++)
+	{
+		src = xd->new + (size_t)y0 * k;
+		dest = xd->new + (size_t)(xd->h - 1 - y0) * k;
+		for (i = 0; i < k; i += l , src += l , dest += l)
+		{
+			l = k - i > sizeof(tmp) ? sizeof(tmp) : k - i;
+			memcpy(tmp, src, l);
+			memcpy(src, dest, l);
+			memcpy(dest, tmp, l);
+		}
+	}
+}
+
+void mem_flip_v(unsigned char *mem, int w, int h, int bpp)
+{
+	xformd xd;
+
+	xd.rows = flip_v_rows;
+	xd.new = mem;
+	xd.w = w; xd.h = h; xd.bpp = bpp;
+	mem_xform(&xd, h / 2, NULL);
+}
+
+static void flip_h_rows(xformd *xd, int y0, int y1)
 {
 	unsigned char tmp, *src, *dest;
-	int i, j, k;
+	int j, w = xd->w / 2, k = xd->w * xd->bpp;
 
-	k = w * bpp;
-	w /= 2;
-	for (i = 0; i < h; i++)
+	for (; y0 < y1; y0++)
 	{
-		src = mem + i * k;
-		dest = src + k - bpp;
-		if (bpp == 1)
+		src = xd->new + (size_t)y0 * k;
+		dest = src + k - xd->bpp;
+		if (xd->bpp == 1)
 		{
 			for (j = 0; j < w; j++)
 			{
@@ -5142,19 +5872,31 @@ void mem_flip_h( char *mem, int w, int h, int bpp )
 	}
 }
 
+void mem_flip_h(unsigned char *mem, int w, int h, int bpp)
+{
+	xformd xd;
+
+	xd.rows = flip_h_rows;
+	xd.new = mem;
+	xd.w = w; xd.h = h; xd.bpp = bpp;
+	mem_xform(&xd, h, NULL);
+}
+
 void mem_bacteria( int val )			// Apply bacteria effect val times the canvas area
 {						// Ode to 1994 and my Acorn A3000
-	int i, j, x, y, w = mem_width-2, h = mem_height-2, tot = w*h, np, cancel;
+	int i, j, x, y, w = mem_width-2, h = mem_height-2, tot, np, cancel;
+	size_t area = (size_t)w * h;
 	unsigned int pixy;
 	unsigned char *img;
 
-	while ( tot > PROGRESS_LIM )	// Ensure the user gets a regular opportunity to cancel
+	while ( area > PROGRESS_LIM )	// Ensure the user gets a regular opportunity to cancel
 	{
-		tot /= 2;
+		area /= 2;
 		val *= 2;
 	}
+	tot = area;
 
-	cancel = (w * h * val > PROGRESS_LIM);
+	cancel = ((size_t)w * h * val > PROGRESS_LIM);
 	if (cancel) progress_init(_("Bacteria Effect"), 1);
 
 	for ( i=0; i<val; i++ )
@@ -5166,7 +5908,7 @@ void mem_bacteria( int val )			// Apply bacteria effect val times the canvas are
 		{
 			x = rand() % w;
 			y = rand() % h;
-			img = mem_img[CHN_IMAGE] + x + mem_width * y;
+			img = mem_img[CHN_IMAGE] + x + (size_t)mem_width * y;
 			pixy = img[0] + img[1] + img[2];
 			img += mem_width;
 			pixy += img[0] + img[1] + img[2];
@@ -5179,50 +5921,124 @@ void mem_bacteria( int val )			// Apply bacteria effect val times the canvas are
 	if (cancel) progress_end();
 }
 
-void mem_rotate( char *new, char *old, int old_w, int old_h, int dir, int bpp )
+/* Rotate rows of blocks, from y0 to y1 */
+static void rotate_rows(xformd *xd, int y0, int y1)
 {
-	unsigned char *src;
-	int i, j, k, l, flag;
-
-	flag = (old_w * old_h > PROGRESS_LIM * 4);
-	j = old_w * bpp;
-	l = dir ? -bpp : bpp;
-	k = -old_w * l;
-	old += dir ? j - bpp: (old_h - 1) * j;
+	unsigned char *src, *dest, *old;
+	int x, y, x0, x1, ow = xd->w, oh = xd->h, bpp = xd->bpp;
+	int l = xd->dir ? -bpp : bpp, k = -ow * l;
 
-	if (flag) progress_init(_("Rotating"), 1);
-	for (i = 0; i < old_w; i++)
+	/* Source of new image's top left pixel */
+	old = xd->old + (xd->dir ? (ow - 1) * bpp : (size_t)(oh - 1) * ow * bpp);
+	y0 *= ROT_TILE;
+	y1 *= ROT_TILE;
+	if (y1 > ow) y1 = ow;
+	for (; y0 < y1; y0 += ROT_TILE)
+	for (x0 = 0; x0 < oh; x0 = x1)
 	{
-		if (flag && ((i * 5) % old_w >= old_w - 5))
-				progress_update((float)i / old_w);
-		src = old;
-		if (bpp == 1)
+		x1 = x0 + ROT_TILE;
+		if (x1 > oh) x1 = oh;
+		for (y = y0; (y < y0 + ROT_TILE) && (y < y1); y++)
 		{
-			for (j = 0; j < old_h; j++)
+			dest = xd->new + (x0 + (size_t)oh * y) * bpp;
+			src = old + y * l + (ptrdiff_t)x0 * k;
+			if (bpp == 1)
 			{
-				*new++ = *src;
-				src += k;
+				for (x = x0; x < x1; x++ , src += k)
+					*dest++ = *src;
+			}
+			else
+			{
+				for (x = x0; x < x1; x++ , src += k)
+				{
+					*dest++ = src[0];
+					*dest++ = src[1];
+					*dest++ = src[2];
+				}
 			}
 		}
-		else
+	}
+}
+
+void mem_rotate( unsigned char *new, unsigned char *old, int old_w, int old_h, int dir, int bpp )
+{
+	xformd xd;
+
+	xd.rows = rotate_rows;
+	xd.new = new;
+	xd.old = old;
+	xd.w = old_w; xd.h = old_h; xd.dir = dir; xd.bpp = bpp;
+	mem_xform(&xd, (old_w + ROT_TILE - 1) / ROT_TILE, _("Rotating"));
+}
+
+/* Transpose square image in place, swapping blocks across the diagonal */
+static void transpose_rows(xformd *xd, int y0, int y1)
+{
+	unsigned char tmp, *src, *dest;
+	int i, x, y, x0, x1, yy, n = xd->w, bpp = xd->bpp;
+
+	y0 *= ROT_TILE;
+	y1 *= ROT_TILE;
+	if (y1 > n) y1 = n;
+	for (; y0 < y1; y0 += ROT_TILE)
+	{
+		yy = y0 + ROT_TILE;
+		if (yy > n) yy = n;
+		for (x0 = y0; x0 < n; x0 = x1)
 		{
-			for (j = 0; j < old_h; j++)
+			x1 = x0 + ROT_TILE;
+			if (x1 > n) x1 = n;
+			for (y = y0; y < yy; y++)
 			{
-				*new++ = src[0];
-				*new++ = src[1];
-				*new++ = src[2];
-				src += k;
+				/* On the diagonal, only swap above it */
+				x = x0 > y ? x0 : y + 1;
+				src = xd->new + (x + (size_t)n * y) * bpp;
+				dest = xd->new + (y + (size_t)n * x) * bpp;
+				for (; x < x1; x++)
+				{
+					for (i = 0; i < bpp; i++)
+					{
+						tmp = src[i];
+						src[i] = dest[i];
+						dest[i] = tmp;
+					}
+					src += bpp;
+					dest += n * bpp;
+				}
 			}
 		}
-		old += l;
 	}
-	if (flag) progress_end();
+}
+
+/* Rotate square image in place - as transpose, then flip */
+static void mem_rotate_sq(unsigned char *mem, int w, int dir, int bpp)
+{
+	xformd xd;
+
+	xd.rows = transpose_rows;
+	xd.new = mem;
+	xd.w = xd.h = w; xd.bpp = bpp;
+	mem_xform(&xd, (w + ROT_TILE - 1) / ROT_TILE, _("Rotating"));
+	if (dir) mem_flip_v(mem, w, w, bpp);
+	else mem_flip_h(mem, w, w, bpp);
 }
 
 int mem_sel_rot( int dir )			// Rotate clipboard 90 degrees
 {
 	unsigned char *buf = NULL;
-	int i, j = mem_clip_w * mem_clip_h, bpp = mem_clip_bpp;
+	size_t j = (size_t)mem_clip_w * mem_clip_h;
+	int i, bpp = mem_clip_bpp;
+
+	/* Square needs no extra memory */
+	if (mem_clip_w == mem_clip_h)
+	{
+		for (i = 0; i < NUM_CHANNELS; i++ , bpp = 1)
+		{
+			if (mem_clip.img[i]) mem_rotate_sq(mem_clip.img[i],
+				mem_clip_w, dir, bpp);
+		}
+		return (0);
+	}
 
 	for (i = 0; i < NUM_CHANNELS; i++ , bpp = 1)
 	{
@@ -5248,7 +6064,8 @@ int mem_sel_rot( int dir )			// Rotate clipboard 90 degrees
 /* Clear the channels */
 static void mem_clear_img(chanlist img, int w, int h, int bpp)
 {
-	int i, j, k, l = w * h;
+	size_t i, j, l = (size_t)w * h;
+	int k;
 
 	if (!img[CHN_IMAGE]); // !!! Here, image channel CAN be absent
 	else if (bpp == 3)
@@ -5339,13 +6156,13 @@ void mem_rotate_free_real(chanlist old_img, chanlist new_img, int ow, int oh,
 			/* RGB nearest neighbour */
 			if (!mode && (cc == CHN_IMAGE) && (bpp == 3))
 			{
-				dest = new_img[CHN_IMAGE] + (ny * nw + xl) * 3;
+				dest = new_img[CHN_IMAGE] + (xl + (size_t)nw * ny) * 3;
 				for (nx = xl; nx <= xm; nx++ , dest += 3)
 				{
 					WJ_ROUND(ox, nx * s1 + x0y);
 					WJ_ROUND(oy, nx * c1 + y0y);
 					src = old_img[CHN_IMAGE] +
-						(oy * ow + ox) * 3;
+						(ox + (size_t)ow * oy) * 3;
 					dest[0] = src[0];
 					dest[1] = src[1];
 					dest[2] = src[2];
@@ -5355,12 +6172,12 @@ void mem_rotate_free_real(chanlist old_img, chanlist new_img, int ow, int oh,
 			/* One-bpp nearest neighbour */
 			if (!mode)
 			{
-				dest = new_img[cc] + ny * nw + xl;
+				dest = new_img[cc] + xl + (size_t)nw * ny;
 				for (nx = xl; nx <= xm; nx++)
 				{
 					WJ_ROUND(ox, nx * s1 + x0y);
 					WJ_ROUND(oy, nx * c1 + y0y);
-					*dest++ = old_img[cc][oy * ow + ox];
+					*dest++ = old_img[cc][ox + (size_t)ow * oy];
 				}
 				continue;
 			}
@@ -5369,8 +6186,8 @@ void mem_rotate_free_real(chanlist old_img, chanlist new_img, int ow, int oh,
 			{
 				alpha = NULL;
 				if (new_img[CHN_ALPHA] && !dis_a)
-					alpha = new_img[CHN_ALPHA] + ny * nw + xl;
-				dest = new_img[CHN_IMAGE] + (ny * nw + xl) * 3;
+					alpha = new_img[CHN_ALPHA] + xl + (size_t)nw * ny;
+				dest = new_img[CHN_IMAGE] + (xl + (size_t)nw * ny) * 3;
 				for (nx = xl; nx <= xm; nx++ , dest += 3)
 				{
 					fox = nx * s1 + x0y;
@@ -5384,7 +6201,7 @@ void mem_rotate_free_real(chanlist old_img, chanlist new_img, int ow, int oh,
 					k3 = foy - k4;
 					k2 = fox - k4;
 					k1 = 1.0 - fox - foy + k4;
-					pix1 = old_img[CHN_IMAGE] + (oy * ow + ox) * 3;
+					pix1 = old_img[CHN_IMAGE] + (ox + (size_t)ow * oy) * 3;
 					pix2 = pix1 + 3;
 					pix3 = pix1 + ow * 3;
 					pix4 = pix3 + 3;
@@ -5395,7 +6212,7 @@ void mem_rotate_free_real(chanlist old_img, chanlist new_img, int ow, int oh,
 					if (alpha)
 					{
 						aa1 = aa2 = aa3 = aa4 = 0.0;
-						src = old_img[CHN_ALPHA] + oy * ow + ox;
+						src = old_img[CHN_ALPHA] + ox + (size_t)ow * oy;
 						if (pix1 != A_rgb) aa1 = src[0] * k1;
 						if (pix2 != A_rgb) aa2 = src[1] * k2;
 						if (pix3 != A_rgb) aa3 = src[ow] * k3;
@@ -5447,7 +6264,7 @@ void mem_rotate_free_real(chanlist old_img, chanlist new_img, int ow, int oh,
 			if ((cc == CHN_ALPHA) && !dis_a)
 				continue;
 			/* Utility channel bilinear */
-			dest = new_img[cc] + ny * nw + xl;
+			dest = new_img[cc] + xl + (size_t)nw * ny;
 			for (nx = xl; nx <= xm; nx++)
 			{
 				fox = nx * s1 + x0y;
@@ -5461,7 +6278,7 @@ void mem_rotate_free_real(chanlist old_img, chanlist new_img, int ow, int oh,
 				k3 = foy - k4;
 				k2 = fox - k4;
 				k1 = 1.0 - fox - foy + k4;
-				src = old_img[cc] + oy * ow + ox;
+				src = old_img[cc] + ox + (size_t)ow * oy;
 				aa1 = aa2 = aa3 = aa4 = 0.0;
 				if (ox < ow - 1)
 				{
@@ -5757,6 +6574,7 @@ static fstep *make_filter(int l0, int l1, int type, int sharp, int bound)
 typedef struct {
 	int tmask, gcor, progress;
 	int ow, oh, nw, nh, bpp;
+	int *row0; // Where the band starts
 	unsigned char **src, **dest;
 	double *rgb;
 	fstep *hfilter, *vfilter;
@@ -5853,7 +6671,7 @@ static void scale_row(fstep *tmpy, fstep *hfilter, double *work_area,
 		const double tk = kp[y];
 		double *wrk = work_area;
 		/* Only simple tiling isn't built into filter */
-		img = src + ((y + oh) % oh) * ow;
+		img = src + (size_t)((y + oh) % oh) * ow;
 		if (gc) /* Gamma-correct */
 		{
 			for (j = 0; j < ow; j++)
@@ -5868,7 +6686,7 @@ static void scale_row(fstep *tmpy, fstep *hfilter, double *work_area,
 	tile_extend(work_area, ow, -ll * bpp);
 	/* Scale it horizontally */
 	istore = gc ? istore_gc : bpp == 1 ? istore_1 : istore_3;
-	img = dest + i * nw * bpp;
+	img = dest + (size_t)i * nw * bpp;
 	for (tmpx = hfilter; tmpx[1].k; tmpx++ , img += bpp)
 	{
 		__typeof__(*tmpx->k) *tp, *kp = tmpx[1].k;
@@ -5914,8 +6732,8 @@ static void scale_rgba(fstep *tmpy, fstep *hfilter, double *work_area,
 		unsigned char *img, *imga;
 		int ix = (y + oh) % oh;
 
-		img = src + ix * ow * 3;
-		imga = srca + ix * ow;
+		img = src + (size_t)ix * ow * 3;
+		imga = srca + (size_t)ix * ow;
 		if (gc) /* Gamma-correct */
 		{
 			const double tk = kp[y];
@@ -5957,8 +6775,8 @@ static void scale_rgba(fstep *tmpy, fstep *hfilter, double *work_area,
 	tile_extend(wrka, ow, -ll);
 	/* Scale it horizontally */
 	istore = gc ? istore_gc : bpp == 1 ? istore_1 : istore_3;
-	img = dest + i * nw * 3;
-	imga = dsta + i * nw;
+	img = dest + (size_t)i * nw * 3;
+	imga = dsta + (size_t)i * nw;
 	for (tmpx = hfilter; tmpx[1].k; tmpx++)
 	{
 		__typeof__(*tmpx->k) *tp, *kp = tmpx[1].k;
@@ -6002,7 +6820,7 @@ static void do_scale(tcb *thread)
 
 
 	/* For each destination line */
-	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
+	for (i = thread->step0 + *ctx.row0 , ii = 0; ii < cnt; i++ , ii++)
 	{
 		tmpy = ctx.vfilter + i;
 		if (ctx.dest[CHN_IMAGE]) // Chanlist may contain, e.g., only mask
@@ -6028,7 +6846,8 @@ static void do_scale(tcb *thread)
 }
 
 static void do_scale_nn(chanlist old_img, chanlist neo_img, int img_bpp,
-	int type, int ow, int oh, int nw, int nh, int gcor, int progress)
+	int type, int ow, int oh, int nw, int nh, int gcor, int y0, int y1,
+	int progress)
 {
 	char *src, *dest;
 	int i, j, oi, oj, cc, bpp;
@@ -6040,14 +6859,14 @@ static void do_scale_nn(chanlist old_img, chanlist neo_img, int img_bpp,
 	deltax = 0.5 * scalex - 0.5;
 	deltay = 0.5 * scaley - 0.5;
 
-	for (j = 0; j < nh; j++)
+	for (j = y0; j < y1; j++)
 	{
 		for (cc = 0 , bpp = img_bpp; cc < NUM_CHANNELS; cc++ , bpp = 1)
 		{
 			if (!neo_img[cc]) continue;
-			dest = neo_img[cc] + nw * j * bpp;
+			dest = neo_img[cc] + (size_t)nw * j * bpp;
 			WJ_ROUND(oj, scaley * j + deltay);
-			src = old_img[cc] + ow * oj * bpp;
+			src = old_img[cc] + (size_t)ow * oj * bpp;
 			for (i = 0; i < nw; i++)
 			{
 				WJ_ROUND(oi, scalex * i + deltax);
@@ -6068,10 +6887,12 @@ int mem_image_scale_real(chanlist old_img, int ow, int oh, int bpp,
 	chanlist new_img, int nw, int nh, int type, int gcor, int sharp)
 {
 	scale_context ctx;
+	int row0 = 0;
 
 	ctx.tmask = CMASK_NONE;
 	ctx.gcor = gcor;
 	ctx.progress = FALSE;
+	ctx.row0 = &row0;
 	ctx.ow = ow;
 	ctx.oh = oh;
 	ctx.nw = nw;
@@ -6085,7 +6906,99 @@ int mem_image_scale_real(chanlist old_img, int ow, int oh, int bpp,
 
 	if (type && (bpp == 3))
 		launch_threads(do_scale, ctx.tdata, NULL, nh);
-	else do_scale_nn(old_img, new_img, bpp, type, ow, oh, nw, nh, gcor, FALSE);
+	else do_scale_nn(old_img, new_img, bpp, type, ow, oh, nw, nh, gcor,
+		0, nh, FALSE);
+
+	return (0);
+}
+
+#define STREAM_BAND 256
+
+/* Scale image without undo, channel by channel and bottom up, releasing
+ * source rows as soon as no rows left to do need them */
+static int mem_image_scale_stream(scale_context *ctx, chanlist old_img,
+	chanlist new_img, int type)
+{
+	chanlist neo;
+	int *need;
+	int i, j, k, cc, res, lost = FALSE;
+	int ow = ctx->ow, oh = ctx->oh, nw = ctx->nw, nh = ctx->nh;
+
+	/* Last source row needed by destination rows up to this one */
+	need = malloc(nh * sizeof(int));
+	if (!need) return (1);
+	if (ctx->tdata) for (i = k = 0; i < nh; i++)
+	{
+		fstep *tmpy = ctx->vfilter + i;
+		int y0 = tmpy->idx, y1 = tmpy[1].k - (tmpy->k - tmpy->idx);
+
+		/* Tiling wraps around */
+		j = (y0 < 0) || (y1 > oh) ? oh - 1 : y1 - 1;
+		need[i] = k = j > k ? j : k;
+	}
+	else
+	{
+		double scaley = (double)oh / (double)nh;
+		double deltay = 0.5 * scaley - 0.5;
+
+		for (i = 0; i < nh; i++) WJ_ROUND(need[i], scaley * i + deltay);
+	}
+
+	if ((res = stream_alloc(neo, CMASK_IMAGE | ctx->tmask, nw, nh,
+		ctx->bpp)))
+	{
+		free(need);
+		return (res);
+	}
+
+	/* Progress is per pass here, not per band; and the window is not
+	 * updated, as the image is in pieces till the end */
+	if (ctx->tdata) for (i = 0; i < ctx->tdata->count; i++)
+		((scale_context *)ctx->tdata->threads[i]->data)->progress = FALSE;
+	progress_init(_("Scaling Image"), 0);
+	for (cc = 0; cc < NUM_CHANNELS; cc++)
+	{
+		int bpp = BPP(cc), cc2 = -1;
+
+		if (!old_img[cc]) continue;
+		/* Weighted alpha goes along with RGB */
+		if (cc && (ctx->tmask & CMASK_FOR(cc))) continue;
+		/* Allocated only now, after sources before it are gone */
+		if (!stream_chan(neo, old_img, cc, nw, nh))
+		{
+			lost = TRUE;
+			continue;
+		}
+		memset(new_img, 0, sizeof(chanlist));
+		new_img[cc] = neo[cc];
+		if (!cc && ctx->tmask) new_img[cc2 = CHN_ALPHA] = neo[CHN_ALPHA];
+
+		for (i = nh; i > 0; i = *ctx->row0)
+		{
+			*ctx->row0 = j = i - STREAM_BAND < 0 ? 0 : i - STREAM_BAND;
+			if (ctx->tdata) launch_threads(do_scale, ctx->tdata,
+				NULL, i - j);
+			else do_scale_nn(old_img, new_img, ctx->bpp, type,
+				ow, oh, nw, nh, ctx->gcor, j, i, FALSE);
+			if (!j) break;
+			/* Rows below are done with */
+			j = need[j - 1] + 1;
+			old_img[cc] = stream_trim(old_img[cc], ow * bpp, j);
+			if (cc2 > 0) old_img[cc2] = stream_trim(old_img[cc2], ow, j);
+		}
+		chan_free(old_img[cc]);
+		old_img[cc] = NULL;
+		if (cc2 > 0)
+		{
+			chan_free(old_img[cc2]);
+			old_img[cc2] = NULL;
+		}
+	}
+	stream_commit(neo, nw, nh);
+	progress_end();
+	free(need);
+	/* Utility channels which did not fit are lost */
+	if (lost) memory_errors(1);
 
 	return (0);
 }
@@ -6093,8 +7006,8 @@ int mem_image_scale_real(chanlist old_img, int ow, int oh, int bpp,
 int mem_image_scale(int nw, int nh, int type, int gcor, int sharp, int bound)	// Scale image
 {
 	scale_context ctx;
-	chanlist old_img;
-	int res;
+	chanlist old_img, new_img;
+	int res, row0 = 0;
 
 	memcpy(old_img, mem_img, sizeof(chanlist));
 	nw = nw < 1 ? 1 : nw > MAX_WIDTH ? MAX_WIDTH : nw;
@@ -6108,21 +7021,25 @@ int mem_image_scale(int nw, int nh, int type, int gcor, int sharp, int bound)	//
 	ctx.nw = nw;
 	ctx.nh = nh;
 	ctx.bpp = mem_img_bpp;
+	ctx.row0 = &row0;
 	ctx.src = old_img;
-	ctx.dest = mem_img;
+	ctx.dest = new_img;
 
 	if (!prepare_scale(&ctx, type, sharp, bound))
 		return (1);	// Not enough memory
 
 	if (!(res = undo_next_core(UC_NOCOPY, nw, nh, mem_img_bpp, CMASK_ALL)))
 	{
+		memcpy(new_img, mem_img, sizeof(chanlist));
 		progress_init(_("Scaling Image"), 0);
 		if (type && (mem_img_bpp == 3))
 			launch_threads(do_scale, ctx.tdata, NULL, mem_height);
 		else do_scale_nn(old_img, mem_img, mem_img_bpp, type,
-			ctx.ow, ctx.oh, nw, nh, gcor, TRUE);
+			ctx.ow, ctx.oh, nw, nh, gcor, 0, nh, TRUE);
 		progress_end();
 	}
+	/* No room for both images and undo - do without undo */
+	else res = mem_image_scale_stream(&ctx, old_img, new_img, type);
 
 	clear_scale(&ctx);
 	return (res);
@@ -6154,7 +7071,7 @@ int mem_isometrics(int type)
 		bpp = BPP(cc);
 		if ( type < 2 )		// Left/Right side down
 		{
-			fill = mem_img[cc] + (mem_height - 1) * ow * bpp;
+			fill = mem_img[cc] + (size_t)(mem_height - 1) * ow * bpp;
 			step = ow * bpp;
 			if (type) step = -step;
 			else fill += (2 - (ow & 1)) * bpp;
@@ -6164,13 +7081,14 @@ int mem_isometrics(int type)
 				if (k > ow) k = ow;
 				l = k;
 				j = 0;
-				dest = mem_img[cc] + i * ow * bpp;
+				dest = mem_img[cc] + (size_t)i * ow * bpp;
 				src = dest - step;
 				if (!type)
 				{
 					j = ow - k;
 					dest += j * bpp;
-					src += (j - ow * ((ow - j - 1) >> 1)) * bpp;
+					src += j * bpp;
+					src -= (size_t)ow * ((ow - j - 1) >> 1) * bpp;
 					j = j ? 0 : ow & 1;
 					k += j;
 					if (j) src += step;
@@ -6185,7 +7103,7 @@ int mem_isometrics(int type)
 				}
 				if (l < ow)
 				{
-					if (!type) dest = mem_img[cc] + i * ow * bpp;
+					if (!type) dest = mem_img[cc] + (size_t)i * ow * bpp;
 					memcpy(dest, fill, (ow - l) * bpp);
 				}
 			}
@@ -6194,10 +7112,9 @@ int mem_isometrics(int type)
 		{
 			step = mem_width * bpp;
 			fill = mem_img[cc] + ow * bpp;
-			k = (oh - 1) * mem_width * bpp;
 			if (type == 2)
 			{
-				fill += k;
+				fill += (size_t)(oh - 1) * step;
 				step = -step;
 			}
 			wrk = fill + step - 1;
@@ -6217,52 +7134,110 @@ int mem_isometrics(int type)
 	return 0;
 }
 
+typedef struct {
+	int ow, nw, hmode, hstep, oxo, nxo;
+	int span1, rspan1, span2, rspan2, rep, tail;
+} resize_spans;
+
+/* Build a row of resized image from a source row */
+static void resize_row(resize_spans *rs, unsigned char *dest,
+	unsigned char *src, int bpp)
+{
+	unsigned char *tmp, *row = dest;
+	int j, l;
+
+	dest += rs->nxo * bpp;
+	/* First direct span */
+	if (rs->span1)
+	{
+		memcpy(dest, src + rs->oxo * bpp, rs->span1 * bpp);
+		if (rs->hmode < 1) return; /* Single-span mode */
+		dest += rs->span1 * bpp;
+	}
+	/* First reverse span */
+	if (rs->rspan1)
+	{
+		tmp = src + (rs->hstep - rs->oxo - rs->span1) * bpp;
+		for (j = 0; j < rs->rspan1; j++ , tmp -= bpp)
+		{
+			*dest++ = tmp[0];
+			if (bpp == 1) continue;
+			*dest++ = tmp[1];
+			*dest++ = tmp[2];
+		}
+	}
+	/* Second direct span */
+	if (rs->span2)
+	{
+		memcpy(dest, src, rs->span2 * bpp);
+		dest += rs->span2 * bpp;
+	}
+	/* Second reverse span */
+	if (rs->rspan2)
+	{
+		tmp = src + (rs->ow - 1) * bpp;
+		for (j = 0; j < rs->rspan2; j++ , tmp -= bpp)
+		{
+			*dest++ = tmp[0];
+			if (bpp == 1) continue;
+			*dest++ = tmp[1];
+			*dest++ = tmp[2];
+		}
+	}
+	/* Repeats */
+	if (rs->rep)
+	{
+		l = rs->hstep * bpp;
+		for (j = 1; j < rs->rep; j++)
+		{
+			memcpy(dest, row, l);
+			dest += l;
+		}
+		memcpy(dest, row, rs->tail * bpp);
+	}
+}
+
+/* Fill channel area with background */
+static void resize_clear(unsigned char *dest, size_t l, int cc)
+{
+	if ((cc != CHN_IMAGE) || (mem_img_bpp == 1))
+	{
+		memset(dest, cc == CHN_IMAGE ? mem_col_A : 0, l);
+		return;
+	}
+	while (l-- > 0)	// Background is current colour A
+	{
+		*dest++ = mem_col_A24.red;
+		*dest++ = mem_col_A24.green;
+		*dest++ = mem_col_A24.blue;
+	}
+}
+
 /* Modes: 0 - clear, 1 - tile, 2 - mirror tile */
 int mem_image_resize(int nw, int nh, int ox, int oy, int mode)
 {
-	chanlist old_img;
-	char *src, *dest;
+	resize_spans rs;
+	chanlist old_img, neo;
+	unsigned char *src, *dest;
 	int i, h, ow = mem_width, oh = mem_height, hmode = mode;
-	int res, hstep, vstep, vstep2 = 0, oxo = 0, oyo = 0, nxo = 0, nyo = 0;
-	int rspan1 = 0, span1 = 0, rspan2 = 0, span2 = 0, rep = 0, tail = 0;
+	int res, clear, none, vstep, vstep2 = 0, oyo = 0, nyo = 0;
 
 	nw = nw < 1 ? 1 : nw > MAX_WIDTH ? MAX_WIDTH : nw;
 	nh = nh < 1 ? 1 : nh > MAX_HEIGHT ? MAX_HEIGHT : nh;
 
 	memcpy(old_img, mem_img, sizeof(chanlist));
-	res = undo_next_core(UC_NOCOPY, nw, nh, mem_img_bpp, CMASK_ALL);
-	if (res) return (res);			// Not enough memory
+	memset(&rs, 0, sizeof(rs));
+	rs.ow = ow;
+	rs.nw = nw;
 
 	/* Special mode for simplest, one-piece-covering case */
 	if ((ox <= 0) && (nw - ox <= ow)) hmode = -1;
 	if ((oy <= 0) && (nh - oy <= oh)) mode = -1;
 
-	/* Clear */
-	if (!mode || !hmode)
-	{			
-		int i, l, cc;
-
-		l = nw * nh;
-		for (cc = 0; cc < NUM_CHANNELS; cc++)
-		{
-			if (!mem_img[cc]) continue;
-			dest = mem_img[cc];
-			if ((cc != CHN_IMAGE) || (mem_img_bpp == 1))
-			{
-				memset(dest, cc == CHN_IMAGE ? mem_col_A : 0, l);
-				continue;
-			}
-			for (i = 0; i < l; i++)	// Background is current colour A
-			{
-				*dest++ = mem_col_A24.red;
-				*dest++ = mem_col_A24.green;
-				*dest++ = mem_col_A24.blue;
-			}
-		}
-		/* All done if source out of bounds */
-		if ((ox >= nw) || (ox + ow <= 0) || (oy >= nh) ||
-			(oy + oh <= 0)) return (0);
-	}
+	/* Clear, and maybe nothing else if source is out of bounds */
+	clear = !mode || !hmode;
+	none = clear && ((ox >= nw) || (ox + ow <= 0) || (oy >= nh) ||
+		(oy + oh <= 0));
 
 	/* Tiled vertically */
 	if (mode > 0)
@@ -6294,49 +7269,110 @@ int mem_image_resize(int nw, int nh, int ox, int oy, int mode)
 		/* No mirror when width < 3 */
 		if (ow < 3) hmode = 1;
 		/* Period length */
-		if (hmode == 2) hstep = ow + ow - 2;
-		else hstep = ow;
+		if (hmode == 2) rs.hstep = ow + ow - 2;
+		else rs.hstep = ow;
 		/* Normalize offset */
-		oxo = ox <= 0 ? -ox % hstep : hstep - 1 - (ox - 1) % hstep;
+		rs.oxo = ox <= 0 ? -ox % rs.hstep :
+			rs.hstep - 1 - (ox - 1) % rs.hstep;
 		/* Single direct span? */
-		if ((oxo <= 0) && (oxo + ow >= nw)) hmode = -1;
+		if ((rs.oxo <= 0) && (rs.oxo + ow >= nw)) hmode = -1;
 		if (hmode == 2) /* Mirror tiling */
 		{
-			if (oxo < ow - 1) span1 = ow - 1 - oxo;
-			res = nw - span1;
-			rspan1 = hstep - oxo - span1;
-			if (rspan1 > res) rspan1 = res;
-			span2 = (res = res - rspan1);
-			if (span2 > ow - 1 - span1) span2 = ow - 1 - span1;
-			rspan2 = res - span2;
-			if (rspan2 > ow - 1 - rspan1) rspan2 = ow - 1 - rspan1;
+			if (rs.oxo < ow - 1) rs.span1 = ow - 1 - rs.oxo;
+			if (rs.span1 > nw) rs.span1 = nw;
+			res = nw - rs.span1;
+			rs.rspan1 = rs.hstep - rs.oxo - rs.span1;
+			if (rs.rspan1 > res) rs.rspan1 = res;
+			rs.span2 = (res = res - rs.rspan1);
+			if (rs.span2 > ow - 1 - rs.span1)
+				rs.span2 = ow - 1 - rs.span1;
+			rs.rspan2 = res - rs.span2;
+			if (rs.rspan2 > ow - 1 - rs.rspan1)
+				rs.rspan2 = ow - 1 - rs.rspan1;
 		}
 		else /* Normal tiling */
 		{
-			span1 = ow - oxo;
-			span2 = nw - span1;
-			if (span2 > oxo) span2 = oxo;
+			rs.span1 = ow - rs.oxo;
+			if (rs.span1 > nw) rs.span1 = nw;
+			rs.span2 = nw - rs.span1;
+			if (rs.span2 > rs.oxo) rs.span2 = rs.oxo;
 		}
-		rep = nw / hstep;
-		if (rep) tail = nw % hstep;
+		rs.rep = nw / rs.hstep;
+		if (rs.rep) rs.tail = nw % rs.hstep;
 	}
 	/* Single horizontal span */
 	else
 	{
 		/* No periodicity */
-		hstep = nw;
+		rs.hstep = nw;
 		/* Normalize offset */
-		if (ox < 0) oxo = -ox;
-		else nxo = ox;
+		if (ox < 0) rs.oxo = -ox;
+		else rs.nxo = ox;
 		/* First direct span */
-		span1 = nw - nxo;
-		if (span1 > ow - oxo) span1 = ow - oxo;
+		rs.span1 = nw - rs.nxo;
+		if (rs.span1 > ow - rs.oxo) rs.span1 = ow - rs.oxo;
+	}
+	rs.hmode = hmode;
+
+	res = undo_next_core(UC_NOCOPY, nw, nh, mem_img_bpp, CMASK_ALL);
+
+	/* No room for both images and undo - do without undo, channel by
+	 * channel and bottom up, releasing source rows when done with */
+	if (res)
+	{
+		int cc, l, bpp, lost = FALSE;
+
+		if ((res = stream_alloc(neo, CMASK_IMAGE, nw, nh, mem_img_bpp)))
+			return (res);
+		for (cc = 0; cc < NUM_CHANNELS; cc++)
+		{
+			if (!old_img[cc]) continue;
+			/* Allocated only now, after sources before it are gone */
+			if (!stream_chan(neo, old_img, cc, nw, nh))
+			{
+				lost = TRUE;
+				continue;
+			}
+			bpp = BPP(cc);
+			l = nw * bpp;
+			for (i = nh - 1; i >= 0; i--)
+			{
+				dest = neo[cc] + (size_t)i * l;
+				if (clear) resize_clear(dest, nw, cc);
+				if (none || (i < nyo) || (i >= h)) continue;
+				res = (i - nyo + oyo) % vstep;
+				if (res >= oh) res = vstep - res;
+				resize_row(&rs, dest, old_img[cc] +
+					(size_t)res * ow * bpp, bpp);
+				/* Single vertical span goes down monotonically */
+				if ((mode > 0) || (i % STREAM_BAND)) continue;
+				old_img[cc] = stream_trim(old_img[cc], ow * bpp,
+					res);
+			}
+			chan_free(old_img[cc]);
+		}
+		stream_commit(neo, nw, nh);
+		/* Utility channels which did not fit are lost */
+		if (lost) memory_errors(1);
+		return (0);
+	}
+
+	/* Clear */
+	if (clear)
+	{
+		int cc;
+
+		for (cc = 0; cc < NUM_CHANNELS; cc++)
+			if (mem_img[cc]) resize_clear(mem_img[cc],
+				(size_t)nw * nh, cc);
+		/* All done if source out of bounds */
+		if (none) return (0);
 	}
 
 	/* Row loop */
 	for (i = nyo; i < h; i++)
 	{
-		int j, k, l, bpp, cc;
+		int k, l, cc;
 
 		/* Main period */
 		k = i - vstep;
@@ -6349,8 +7385,8 @@ int mem_image_resize(int nw, int nh, int ox, int oy, int mode)
 			{
 				if (!mem_img[cc]) continue;
 				l = nw * BPP(cc);
-				src = mem_img[cc] + k * l;
-				dest = mem_img[cc] + i * l;
+				src = mem_img[cc] + (size_t)k * l;
+				dest = mem_img[cc] + (size_t)i * l;
 				memcpy(dest, src, l);
 			}
 			continue;
@@ -6361,60 +7397,9 @@ int mem_image_resize(int nw, int nh, int ox, int oy, int mode)
 		for (cc = 0; cc < NUM_CHANNELS; cc++)
 		{
 			if (!mem_img[cc]) continue;
-			bpp = BPP(cc);
-			dest = mem_img[cc] + (i * nw + nxo) * bpp;
-			/* First direct span */
-			if (span1)
-			{
-				src = old_img[cc] + (k * ow + oxo) * bpp;
-				memcpy(dest, src, span1 * bpp);
-				if (hmode < 1) continue; /* Single-span mode */
-				dest += span1 * bpp;
-			}
-			/* First reverse span */
-			if (rspan1)
-			{
-				src = old_img[cc] + (k * ow + hstep - oxo -
-					span1) * bpp;
-				for (j = 0; j < rspan1; j++ , src -= bpp)
-				{
-					*dest++ = src[0];
-					if (bpp == 1) continue;
-					*dest++ = src[1];
-					*dest++ = src[2];
-				}
-			}
-			/* Second direct span */
-			if (span2)
-			{
-				src = old_img[cc] + k * ow * bpp;
-				memcpy(dest, src, span2 * bpp);
-				dest += span2 * bpp;
-			}
-			/* Second reverse span */
-			if (rspan2)
-			{
-				src = old_img[cc] + (k * ow + ow - 1) * bpp;
-				for (j = 0; j < rspan2; j++ , src -= bpp)
-				{
-					*dest++ = src[0];
-					if (bpp == 1) continue;
-					*dest++ = src[1];
-					*dest++ = src[2];
-				}
-			}
-			/* Repeats */
-			if (rep)
-			{
-				src = mem_img[cc] + i * nw * bpp;
-				l = hstep * bpp;
-				for (j = 1; j < rep; j++)
-				{
-					memcpy(dest, src, l);
-					dest += l;
-				}
-				memcpy(dest, src, tail * bpp);
-			}
+			l = BPP(cc);
+			resize_row(&rs, mem_img[cc] + (size_t)i * nw * l,
+				old_img[cc] + (size_t)k * ow * l, l);
 		}
 	}
 	mem_undo_prepare();
@@ -6422,21 +7407,96 @@ int mem_image_resize(int nw, int nh, int ox, int oy, int mode)
 	return (0);
 }
 
-/* Threshold channel values */
-void mem_threshold(unsigned char *img, int len, int level)
+/* Run a per-pixel function over a linear run of pixels, split into chunks
+ * and spread over threads; serially, if within threads already */
+
+#define SPAN_CHUNK 0x10000
+
+typedef struct {
+	span_func func;
+	void *data;
+	size_t len;
+} span_state;
+
+static void span_thread(tcb *thread)
 {
-	if (!img) return; /* Paranoia */
-	level += 0xFFFF;
+	span_state *ss = thread->data;
+	size_t l, ofs = (size_t)thread->step0 * SPAN_CHUNK;
+	int i;
+
+	for (i = thread->nsteps; i > 0; i-- , ofs += SPAN_CHUNK)
+	{
+		l = ss->len - ofs;
+		ss->func(ss->data, ofs, l < SPAN_CHUNK ? l : SPAN_CHUNK);
+	}
+	thread_done(thread);
+}
+
+void mem_span_map(span_func func, void *data, size_t len)
+{
+	span_state ss = { func, data, len };
+	threaddata *tdata = NULL;
+	int n = (len + SPAN_CHUNK - 1) / SPAN_CHUNK, nt = 1;
+
+#ifdef U_THREADS
+	if (!threads_running) nt = image_threads(SPAN_CHUNK, n);
+#endif
+	if (nt > 1) tdata = talloc(0, nt, &ss, sizeof(ss), NULL, NULL);
+	if (!tdata) /* Do it all in one go */
+	{
+		func(data, 0, len);
+		return;
+	}
+	tdata->silent = TRUE;
+	launch_threads(span_thread, tdata, NULL, n);
+	free(tdata);
+}
+
+typedef struct {
+	unsigned char *img, *alpha;
+	int n;
+} chanop_data;
+
+static void threshold_span(void *data, size_t ofs, size_t len)
+{
+	chanop_data *cd = data;
+	unsigned char *img = cd->img + ofs;
+	int level = cd->n + 0xFFFF;
+
 	for (; len; len-- , img++)
 		*img = (level - *img) >> 8;
 }
 
+/* Threshold channel values */
+void mem_threshold(unsigned char *img, size_t len, int level)
+{
+	chanop_data cd = { img, NULL, level };
+
+	if (!img) return; /* Paranoia */
+	mem_span_map(threshold_span, &cd, len);
+}
+
+static unsigned char xhold_lut[256];
+static int xhold_key[3] = { -1, -1, -1 };
+
 /* Industrial-grade thresholding */
 void do_xhold(int start, int step, int cnt, unsigned char *mask,
 	unsigned char *imgr, unsigned char *img0)
 {
-	unsigned char lo = mem_ts.lo, hi = mem_ts.hi;
-	int n, mstep = step, bpp = MEM_BPP;
+	unsigned char *lut = xhold_lut;
+	int n, mstep = step, bpp = MEM_BPP, mx = 255;
+
+	/* Threshold is the same for all pixels at a given level: table it */
+	if ((bpp == 1) && (mem_channel == CHN_IMAGE)) mx = mem_cols - 1;
+	if ((xhold_key[0] != mem_ts.lo) || (xhold_key[1] != mem_ts.hi) ||
+		(xhold_key[2] != mx))
+	{
+		xhold_key[0] = mem_ts.lo;
+		xhold_key[1] = mem_ts.hi;
+		xhold_key[2] = mx;
+		for (n = 0; n < 256; n++) lut[n] = mx & (((0xFFFF + mem_ts.lo - n) &
+			(0xFFFF - mem_ts.hi + n)) >> 8);
+	}
 
 	mask += start - step;
 	start *= bpp; step *= bpp;
@@ -6452,50 +7512,95 @@ void do_xhold(int start, int step, int cnt, unsigned char *mask,
 			if (*mask == 255) continue;
 			n = (img0[0] > img0[1]) ^ m ? img0[0] : img0[1];
 			n = (n > img0[2]) ^ m ? n : img0[2];
-			imgr[0] = imgr[1] = imgr[2] =
-				((0xFFFF + lo - n) & (0xFFFF - hi + n)) >> 8;
+			imgr[0] = imgr[1] = imgr[2] = lut[n];
 		}
 	}
 	else /* By R/G/B/value */
 	{
-		unsigned char mx = 255;
-
 		if (bpp > 1) img0 += mem_ts.mode - XHOLD_RED;
-		else if (mem_channel == CHN_IMAGE) mx = mem_cols - 1;
 
 		while (cnt-- > 0)
 		{
 			img0 += step; imgr += step; mask += mstep;
 			if (*mask == 255) continue;
-			n = *img0;
-			imgr[0] = n = mx &
-				(((0xFFFF + lo - n) & (0xFFFF - hi + n)) >> 8);
+			imgr[0] = n = lut[*img0];
 			if (bpp == 1) continue;
 			imgr[1] = imgr[2] = n;
 		}
 	}
 }
 
-/* Only supports BPP = 1 and 3 */
-void mem_demultiply(unsigned char *img, unsigned char *alpha, int len, int bpp)
+static void xhold_rows(tcb *thread)
 {
-	int i, k;
-	double d;
+	unsigned char *mask = *(unsigned char **)thread->data;
+	unsigned char *dest, *xbuf = mask + mem_width;
+	int i, cnt = thread->nsteps, bpp = MEM_BPP;
+
+	for (i = thread->step0; cnt-- > 0; i++)
+	{
+		row_protected(0, i, mem_width, mask);
+		dest = mem_img[mem_channel] + (size_t)i * mem_width * bpp;
+		do_xhold(0, 1, mem_width, mask, xbuf, dest);
+		process_img(0, 1, mem_width, mask, dest, dest, xbuf,
+			NULL, bpp, BLENDF_SET | BLENDF_INVM);
+	}
+	thread_done(thread);
+}
+
+/* Returns 0 if done, 1 if out of memory, -1 if undo refused (reported) */
+int mem_xhold()	// Apply thresholding to current channel
+{
+	threaddata *tdata;
+	unsigned char *mask;
+
+	tdata = talloc(0, image_threads(mem_width, mem_height), &mask,
+		sizeof(mask), NULL, &mask, mem_width * (MEM_BPP + 1), NULL);
+	if (!tdata) return (1);
+	/* Undo step only once there is memory to do the work */
+	if (mem_undo_next(UNDO_FILT))
+	{
+		free(tdata);
+		return (-1);
+	}
+	/* Prepare table before threads get to it */
+	do_xhold(0, 0, 0, NULL, NULL, NULL);
+	tdata->silent = TRUE;
+	launch_threads(xhold_rows, tdata, NULL, mem_height);
+	free(tdata);
+	return (0);
+}
+
+static void demultiply_span(void *data, size_t ofs, size_t len)
+{
+	chanop_data *cd = data;
+	unsigned char *img = cd->img + ofs * cd->n, *alpha = cd->alpha + ofs;
+	size_t i;
+	int j, k, a, a2, bpp = cd->n;
 
 	for (i = 0; i < len; i++ , img += bpp)
 	{
-		if (!alpha[i]) continue;
-		d = 255.0 / (double)alpha[i];
-		k = rint(d * img[0]);
-		img[0] = k > 255 ? 255 : k;
-		if (bpp == 1) continue;
-		k = rint(d * img[1]);
-		img[1] = k > 255 ? 255 : k;
-		k = rint(d * img[2]);
-		img[2] = k > 255 ? 255 : k;
+		/* Nothing to do for 0 and 255 */
+		if (!(a = alpha[i]) || (a == 255)) continue;
+		/* Integer rounding, with exact ties done the old way */
+		a2 = a * 2;
+		for (j = 0; j < bpp; j++)
+		{
+			k = img[j] * (255 * 2) + a;
+			if (k % a2) k /= a2;
+			else k = rint((255.0 / (double)a) * img[j]);
+			img[j] = k > 255 ? 255 : k;
+		}
 	}
 }
 
+/* Only supports BPP = 1 and 3 */
+void mem_demultiply(unsigned char *img, unsigned char *alpha, size_t len, int bpp)
+{
+	chanop_data cd = { img, alpha, bpp };
+
+	mem_span_map(demultiply_span, &cd, len);
+}
+
 /* Build value rescaling table */
 void set_xlate_n(unsigned char *xlat, int n)
 {
@@ -6506,7 +7611,7 @@ void set_xlate_n(unsigned char *xlat, int n)
 }
 
 /* Check if byte array is all one value */
-int is_filled(unsigned char *data, unsigned char val, int len)
+int is_filled(unsigned char *data, unsigned char val, size_t len)
 {
 	len++;
 	while (--len && (*data++ == val));
@@ -6515,28 +7620,28 @@ int is_filled(unsigned char *data, unsigned char val, int len)
 
 int get_pixel( int x, int y )	/* Mixed */
 {
-	x = mem_width * y + x;
+	size_t ofs = x + (size_t)mem_width * y;
 	if ((mem_channel != CHN_IMAGE) || (mem_img_bpp == 1))
-		return (mem_img[mem_channel][x]);
-	x *= 3;
-	return (MEM_2_INT(mem_img[CHN_IMAGE], x));
+		return (mem_img[mem_channel][ofs]);
+	ofs *= 3;
+	return (MEM_2_INT(mem_img[CHN_IMAGE], ofs));
 }
 
 int get_pixel_RGB( int x, int y )	/* RGB */
 {
-	x = mem_width * y + x;
+	size_t ofs = x + (size_t)mem_width * y;
 	if (mem_img_bpp == 1)
-		return (PNG_2_INT(mem_pal[mem_img[CHN_IMAGE][x]]));
-	x *= 3;
-	return (MEM_2_INT(mem_img[CHN_IMAGE], x));
+		return (PNG_2_INT(mem_pal[mem_img[CHN_IMAGE][ofs]]));
+	ofs *= 3;
+	return (MEM_2_INT(mem_img[CHN_IMAGE], ofs));
 }
 
 int get_pixel_img( int x, int y )	/* RGB or indexed */
 {
-	x = mem_width * y + x;
-	if (mem_img_bpp == 1) return (mem_img[CHN_IMAGE][x]);
-	x *= 3;
-	return (MEM_2_INT(mem_img[CHN_IMAGE], x));
+	size_t ofs = x + (size_t)mem_width * y;
+	if (mem_img_bpp == 1) return (mem_img[CHN_IMAGE][ofs]);
+	ofs *= 3;
+	return (MEM_2_INT(mem_img[CHN_IMAGE], ofs));
 }
 
 int mem_protected_RGB(int intcol)		// Is this intcol in bitmap?
@@ -6546,7 +7651,7 @@ int mem_protected_RGB(int intcol)		// Is this intcol in bitmap?
 
 int pixel_protected(int x, int y)
 {
-	int offset = y * mem_width + x;
+	size_t offset = x + (size_t)mem_width * y;
 
 	if (mem_unmask) return (0);
 
@@ -6562,8 +7667,8 @@ int pixel_protected(int x, int y)
 	}
 
 	/* Colour selectivity */
-	if (mem_cselect && csel_scan(offset, 1, 1, NULL, mem_img[CHN_IMAGE], csel_data))
-		return (255);
+	if (mem_cselect && csel_scan(0, 1, 1, NULL, mem_img[CHN_IMAGE] +
+		offset * mem_img_bpp, csel_data)) return (255);
 
 	/* Mask channel */
 	if ((mem_channel <= CHN_ALPHA) && mem_img[CHN_MASK] && !channel_dis[CHN_MASK])
@@ -6613,7 +7718,7 @@ void prep_mask(int start, int step, int cnt, unsigned char *mask,
 void row_protected(int x, int y, int len, unsigned char *mask)
 {
 	unsigned char *mask0 = NULL;
-	int ofs = y * mem_width + x;
+	size_t ofs = x + (size_t)mem_width * y;
 
 	/* Clear mask or copy mask channel into it */
 	if ((mem_channel <= CHN_ALPHA) && mem_img[CHN_MASK] && !channel_dis[CHN_MASK])
@@ -6925,13 +8030,18 @@ static void blend_pixels(int start, int step, int cnt, const unsigned char *mask
 #undef HHSV
 }
 
+static int pp_nspans;
+static void put_pixel_flush();
+
 void put_pixel_def(int x, int y)	/* Combined */
 {
 	unsigned char *src, *ti, *old_image, *old_alpha = NULL;
 	unsigned char fmask, opacity = 255, cset[NUM_CHANNELS + 3];
-	int i, j, offset, idx, bpp, op = tool_opacity;
+	size_t offset;
+	int i, j, idx, bpp, op = tool_opacity;
 
 
+	if (pp_nspans) put_pixel_flush(); // Keep drawing order
 	idx = IS_INDEXED;
 	j = pixel_protected(x, y);
 	if (idx ? j : j == 255) return;
@@ -6944,7 +8054,7 @@ void put_pixel_def(int x, int y)	/* Combined */
 		old_alpha = mem_undo_opacity ? mem_undo_previous(CHN_ALPHA) :
 			mem_img[CHN_ALPHA];
 
-	offset = x + mem_width * y;
+	offset = x + (size_t)mem_width * y;
 
 	if (mem_gradient) /* Gradient mode - ask for one pixel */
 	{
@@ -6967,12 +8077,14 @@ void put_pixel_def(int x, int y)	/* Combined */
 		{
 			layer_node *t = layer_table + blend_src - SRC_LAYER;
 			image_info *img = &t->image->image_;
-			int u, w;
+			size_t u;
+			int w;
 
+			if (!mem_sparse_unpack(img)) return; // No memory
 			src = img->img[mem_channel];
 			if (!src) return; // Nothing here
 			w = img->width;
-			u = floor_mod(y - t->y, img->height) * w +
+			u = (size_t)floor_mod(y - t->y, img->height) * w +
 				floor_mod(x - t->x, w);
 
 			if (mem_channel == CHN_IMAGE)
@@ -7089,6 +8201,7 @@ static void mask_select(unsigned char *mask, unsigned char *xsel, int l)
 }
 
 enum {
+	PP_NONE = -1,	// Nothing to draw
 	PP_DEF = 0,	// Default (pattern)
 	PP_OFS,		// Offset
 	PP_BUF,		// Buffer
@@ -7098,30 +8211,71 @@ enum {
 	PP_LBUF		// Buffered layer
 };
 
-/* Faster function for large brushes and fills */
-void put_pixel_row_def(int x, int y, int len, unsigned char *xsel)
+/* What stays the same for all rows of a dab */
+typedef struct {
+	unsigned char *old_image, *old_alpha;
+	layer_node *t;
+	int bpp, idx, use_mask, alpha, mode;
+} pp_state;
+
+static void pp_setup(pp_state *pp)
+{
+	pp->old_image = mem_undo_opacity ? mem_undo_previous(mem_channel) :
+		mem_img[mem_channel];
+	pp->old_alpha = mem_undo_opacity ? mem_undo_previous(CHN_ALPHA) :
+		mem_img[CHN_ALPHA];
+
+	pp->bpp = MEM_BPP; pp->idx = IS_INDEXED;
+	pp->use_mask = (mem_channel <= CHN_ALPHA) && mem_img[CHN_MASK] && !channel_dis[CHN_MASK];
+	pp->alpha = (mem_channel == CHN_IMAGE) && RGBA_mode && mem_img[CHN_ALPHA];
+	pp->t = NULL;
+
+	if (tool_type == TOOL_CLONE) pp->mode = PP_OFS; /* Clone mode */
+	else if (mem_gradient) pp->mode = PP_GRAD; /* Gradient mode */
+	else if (mem_blend && blend_src) /* Source mode */
+	{
+		if ((blend_src == SRC_IMAGE) || // Same layer - use offset
+			(blend_src == SRC_LAYER + layer_selected)) pp->mode = PP_OFS;
+		else // From other layer
+		{
+			layer_node *t = layer_table + blend_src - SRC_LAYER;
+			image_info *img = &t->image->image_;
+
+			pp->t = t;
+			pp->mode = PP_NONE;
+			if (!mem_sparse_unpack(img)) return; // No memory
+			if (!img->img[mem_channel]) return; // Nothing here
+
+			pp->mode = PP_LR;
+			if (mem_channel == CHN_IMAGE)
+			{
+				if (img->bpp > pp->bpp) pp->mode = PP_NONE; // Incompatible
+				else if (img->bpp < pp->bpp) pp->mode = PP_L2R; // Idx to RGB
+			}
+		}
+	}
+	/* Transform mode - use offset */
+	else if (mem_blend && (blend_mode & BLEND_XFORM) && (pp->bpp == 3))
+		pp->mode = PP_OFS;
+	else pp->mode = PP_DEF;
+}
+
+static void pp_row(pp_state *pp, int x, int y, int len, unsigned char *xsel)
 {
 	unsigned char tmp_image[ROW_BUFLEN * 3], mask[ROW_BUFLEN],
 		tmp_alpha[ROW_BUFLEN], tmp_opacity[ROW_BUFLEN],
 		*source_image = tmp_image, *source_alpha = NULL,
 		*source_opacity = NULL;
-	unsigned char *old_image, *old_alpha, *srcp, src1[8];
+	unsigned char *old_image = pp->old_image, *old_alpha = pp->old_alpha;
+	unsigned char *srcp, src1[8];
 	image_info *img = NULL;
-	int offset, use_mask, bpp, idx, uninit_(cx), cy, d = 0, s = ROW_BUFLEN;
-	int mode = PP_DEF;
-
-
-	if (len <= 0) return;
-
-	old_image = mem_undo_opacity ? mem_undo_previous(mem_channel) :
-		mem_img[mem_channel];
-	old_alpha = mem_undo_opacity ? mem_undo_previous(CHN_ALPHA) :
-		mem_img[CHN_ALPHA];
+	size_t offset, d = 0; // Offsets from image start
+	int bpp = pp->bpp, idx = pp->idx, uninit_(cx), cy;
+	int s = ROW_BUFLEN, mode = pp->mode;
 
-	bpp = MEM_BPP; idx = IS_INDEXED;
-	use_mask = (mem_channel <= CHN_ALPHA) && mem_img[CHN_MASK] && !channel_dis[CHN_MASK];
-	if ((mem_channel == CHN_IMAGE) && RGBA_mode && mem_img[CHN_ALPHA])
-		source_alpha = tmp_alpha;
+
+	if ((len <= 0) || (mode == PP_NONE)) return;
+	if (pp->alpha) source_alpha = tmp_alpha;
 
 	if (tool_type == TOOL_CLONE) /* Clone mode */
 	{
@@ -7131,8 +8285,8 @@ void put_pixel_row_def(int x, int y, int len, unsigned char *xsel)
 		if (cx + len > mem_width) len = mem_width - cx;
 		if (cx < 0) len += cx , x -= cx;
 		if (len <= 0) return;
-		d = clone_dx + clone_dy * mem_width;
-		mode = PP_OFS; // Use offset
+		/* Wraps around if negative, to still be added right */
+		d = clone_dx + (size_t)clone_dy * mem_width;
 		if (!clone_dy && (old_image == mem_img[mem_channel]))
 		{
 			mode = PP_BUF; // Use buffering
@@ -7141,60 +8295,43 @@ void put_pixel_row_def(int x, int y, int len, unsigned char *xsel)
 				x += len - ROW_BUFLEN , s = -ROW_BUFLEN;
 		}
 	}
-	else if (mem_gradient) mode = PP_GRAD; /* Gradient mode */
-	else if (mem_blend && blend_src) /* Source mode */
+	else if (pp->t) /* From other layer */
 	{
-		if ((blend_src == SRC_IMAGE) || // Same layer - use offset
-			(blend_src == SRC_LAYER + layer_selected)) mode = PP_OFS;
-		else // From other layer
-		{
-			layer_node *t = layer_table + blend_src - SRC_LAYER;
-			int u, w;
+		layer_node *t = pp->t;
+		int u, w;
 
-			img = &t->image->image_;
-			if (!img->img[mem_channel]) return; // Nothing here
-
-			mode = PP_LR;
-			if (mem_channel == CHN_IMAGE)
-			{
-				if (img->bpp > bpp) return; // Incompatible
-				if (img->bpp < bpp) mode = PP_L2R; // Idx to RGB
-			}
+		img = &t->image->image_;
+		w = img->width;
+		cx = floor_mod(x - t->x, w);
+		d = (size_t)floor_mod(y - t->y, img->height) * w;
+		u = len;
 
-			w = img->width;
-			cx = floor_mod(x - t->x, w);
-			d = floor_mod(y - t->y, img->height) * w;
-			u = len;
+		if ((len > w) && (w <= ROW_BUFLEN / 2)) // Buffered repeat
+		{
+			u += cx;
+			if (u > ROW_BUFLEN) u = ROW_BUFLEN;
 
-			if ((len > w) && (w <= ROW_BUFLEN / 2)) // Buffered repeat
-			{
-				u += cx;
-				if (u > ROW_BUFLEN) u = ROW_BUFLEN;
-
-				if (mode == PP_LR) memcpy(tmp_image,
-					img->img[mem_channel] + d * bpp, w * bpp);
-				else do_convert_rgb(0, 1, w, tmp_image,
-					img->img[CHN_IMAGE] + d, img->pal);
-				pattern_rep(tmp_image + w * bpp, tmp_image,
-					0, w, u - w, bpp);
-				
-				if (source_alpha && img->img[CHN_ALPHA])
-					pattern_rep(tmp_alpha, img->img[CHN_ALPHA] + d,
-						0, w, u, 1);
-
-				mode = PP_LBUF;
-			}
+			if (mode == PP_LR) memcpy(tmp_image,
+				img->img[mem_channel] + d * bpp, w * bpp);
+			else do_convert_rgb(0, 1, w, tmp_image,
+				img->img[CHN_IMAGE] + d, img->pal);
+			pattern_rep(tmp_image + w * bpp, tmp_image,
+				0, w, u - w, bpp);
+			
+			if (source_alpha && img->img[CHN_ALPHA])
+				pattern_rep(tmp_alpha, img->img[CHN_ALPHA] + d,
+					0, w, u, 1);
 
-			/* Fake alpha */
-			if (source_alpha && !img->img[CHN_ALPHA])
-				memset(tmp_alpha, channel_col_A[CHN_ALPHA],
-					u > ROW_BUFLEN ? ROW_BUFLEN : u);
+			mode = PP_LBUF;
 		}
+
+		/* Fake alpha */
+		if (source_alpha && !img->img[CHN_ALPHA])
+			memset(tmp_alpha, channel_col_A[CHN_ALPHA],
+				u > ROW_BUFLEN ? ROW_BUFLEN : u);
 	}
-	/* Transform mode - use offset */
-	else if (mem_blend && (blend_mode & BLEND_XFORM) && (bpp == 3)) mode = PP_OFS;
 // !!! This depends on buffer length being a multiple of pattern length
-	else /* Default mode - init buffer(s) from pattern */
+	else if (mode == PP_DEF) /* Default mode - init buffer(s) from pattern */
 	{
 		int i, dy = 8 * (y & 7), l = len <= ROW_BUFLEN ? len : ROW_BUFLEN;
 
@@ -7215,7 +8352,7 @@ void put_pixel_row_def(int x, int y, int len, unsigned char *xsel)
 		pattern_rep(tmp_image, srcp, x & 7, 8, l, bpp);
 	}
 
-	offset = x + mem_width * y;
+	offset = x + (size_t)mem_width * y;
 	idx ^= 1; // 0 if indexed, now
 	while (TRUE)
 	{
@@ -7260,7 +8397,7 @@ void put_pixel_row_def(int x, int y, int len, unsigned char *xsel)
 
 		/* Mask */
 		prep_mask(0, 1, l, mask,
-			use_mask ? mem_img[CHN_MASK] + offset : NULL,
+			pp->use_mask ? mem_img[CHN_MASK] + offset : NULL,
 			mem_img[CHN_IMAGE] + offset * mem_img_bpp);
 
 		if (xsel)
@@ -7288,6 +8425,116 @@ void put_pixel_row_def(int x, int y, int len, unsigned char *xsel)
 	}
 }
 
+/* Rows of a stroke can be queued, to do the setup once and draw in parallel */
+
+#define PP_SPANS  4096 /* Rows to queue at most */
+#define PP_THREAD 16384 /* Pixels to make threads worth it */
+
+typedef struct {
+	int x, y, len, n;
+} pp_span;
+
+static pp_span pp_spans[PP_SPANS];
+static int pp_batching;
+
+typedef struct {
+	pp_state pp;
+	pp_span *spans;
+	int *rows;
+} pp_threadd;
+
+static void pp_rows(tcb *thread)
+{
+	pp_threadd *pt = thread->data;
+	pp_span *sp = pt->spans + pt->rows[thread->step0];
+	pp_span *se = pt->spans + pt->rows[thread->step0 + thread->nsteps];
+
+	for (; sp < se; sp++) pp_row(&pt->pp, sp->x, sp->y, sp->len, NULL);
+	thread_done(thread);
+}
+
+static int cmp_spans(const void *a, const void *b)
+{
+	const pp_span *sa = a, *sb = b;
+
+	if (sa->y != sb->y) return (sa->y - sb->y);
+	return (sa->n - sb->n);
+}
+
+static void put_pixel_flush()
+{
+	threaddata *tdata = NULL;
+	pp_threadd pt;
+	int i, j, n = pp_nspans, rows[PP_SPANS + 1];
+
+
+	pp_nspans = 0;
+	if (!n) return;
+	pp_setup(&pt.pp);
+	if (pt.pp.mode == PP_NONE) return;
+
+	/* Rows are independent, unless cloning reads other rows of the very
+	 * image being drawn on */
+	for (i = j = 0; i < n; i++) j += pp_spans[i].len;
+	if ((j >= PP_THREAD) && !((tool_type == TOOL_CLONE) && clone_dy &&
+		(pt.pp.old_image == mem_img[mem_channel])))
+	{
+		/* Keep the order within each row */
+		qsort(pp_spans, n, sizeof(pp_span), cmp_spans);
+		for (i = j = 0; i < n; i++)
+			if (!i || (pp_spans[i].y != pp_spans[i - 1].y))
+				rows[j++] = i;
+		rows[j] = n;
+		pt.spans = pp_spans;
+		pt.rows = rows;
+		if (j > 1) tdata = talloc(0, image_threads(mem_width, j),
+			&pt, sizeof(pt), NULL, NULL);
+	}
+	if (!tdata) /* Draw in queue order */
+	{
+		for (i = 0; i < n; i++) pp_row(&pt.pp, pp_spans[i].x,
+			pp_spans[i].y, pp_spans[i].len, NULL);
+		return;
+	}
+
+	/* Set up the transform and gradient tables before threads get to them */
+	if (mem_blend && (blend_mode & BLEND_XFORM) && (pt.pp.bpp == 3))
+		do_transform(0, 0, 0, NULL, NULL, NULL, 256);
+	if (pt.pp.mode == PP_GRAD) grad_lut_update();
+	tdata->silent = TRUE;
+	launch_threads(pp_rows, tdata, NULL, j);
+	free(tdata);
+}
+
+/* Start or end queueing rows; calls can nest */
+void put_pixel_batch(int start)
+{
+	if (start) pp_batching++;
+	else if (pp_batching && !--pp_batching) put_pixel_flush();
+}
+
+/* Faster function for large brushes and fills */
+void put_pixel_row_def(int x, int y, int len, unsigned char *xsel)
+{
+	pp_state pp;
+
+	if (len <= 0) return;
+	/* Shapeburst buffers don't outlive render_sb() */
+	if (pp_batching && !xsel && !sb_mem)
+	{
+		if (pp_nspans >= PP_SPANS) put_pixel_flush();
+		pp_spans[pp_nspans].x = x;
+		pp_spans[pp_nspans].y = y;
+		pp_spans[pp_nspans].len = len;
+		pp_spans[pp_nspans].n = pp_nspans;
+		pp_nspans++;
+		return;
+	}
+	if (pp_nspans) put_pixel_flush(); // Keep drawing order
+	pp_setup(&pp);
+	pp_row(&pp, x, y, len, xsel);
+}
+
 void process_mask(int start, int step, int cnt, unsigned char *mask,
 	unsigned char *alphar, unsigned char *alpha0, unsigned char *alpha,
 	unsigned char *trans, int opacity, int noalpha)
@@ -7511,10 +8758,11 @@ void process_img(int start, int step, int cnt, unsigned char *mask,
 void copy_area(image_info *dest, image_info *src, int x, int y)
 {
 	int w = dest->width, h = dest->height, bpp = dest->bpp, ww = src->width;
-	int i, ofs, delta, len;
+	size_t ofs, delta;
+	int i, len;
 
 	/* Current channel */
-	ofs = (y * ww + x) * bpp;
+	ofs = (x + (size_t)ww * y) * bpp;
 	delta = 0;
 	len = w * bpp;
 	for (i = 0; i < h; i++)
@@ -7526,7 +8774,7 @@ void copy_area(image_info *dest, image_info *src, int x, int y)
 
 	/* Alpha channel */
 	if (!dest->img[CHN_ALPHA]) return;
-	ofs = y * ww + x;
+	ofs = x + (size_t)ww * y;
 	delta = 0;
 	for (i = 0; i < h; i++)
 	{
@@ -7544,14 +8792,14 @@ int mem_count_all_cols()				// Count all colours - Using main image
 int mem_count_all_cols_real(unsigned char *im, int w, int h)	// Count all colours - very memory greedy
 {
 	guint32 *tab;
+	size_t l;
 	int i, j, k, ix;
 
 	j = 0x80000;
 	tab = calloc(j, sizeof(guint32));	// HUGE colour cube
 	if (!tab) return -1;			// Not enough memory Mr Greedy ;-)
 
-	k = w * h;
-	for (i = 0; i < k; i++)			// Scan each pixel
+	for (l = (size_t)w * h; l; l--)		// Scan each pixel
 	{
 		ix = (im[0] >> 5) + (im[1] << 3) + (im[2] << 11);
 		tab[ix] |= 1U << (im[0] & 31);
@@ -7577,7 +8825,8 @@ int mem_cols_used_real(unsigned char *im, int w, int h, png_color *pal)
 			// Count and collect up to 256 colours used in RGB chunk
 {
 	rgb_256_map m;
-	int i, j = w * h, k, l, n, v, vn, res, pix;
+	size_t i, j = (size_t)w * h;
+	int k, l, n, v, vn, res, pix;
 
 	memset(&m, 0, sizeof(m));
 	for (i = res = 0; i < j; i++ , im += 3) // Skim all pixels
@@ -7778,7 +9027,7 @@ static void vert_gauss(unsigned char *chan, int w, int h, int y, double *temp,
 	double gv = gaussY[0];
 	int j, k, mh2 = h > 1 ? h + h - 2 : 1;
 
-	src0 = chan + y * w;
+	src0 = chan + (size_t)y * w;
 	if (gcor) /* Gamma-correct RGB values */
 	{
 		for (j = 0; j < w; j++) temp[j] = gamma256[src0[j]] * gv;
@@ -7793,10 +9042,10 @@ static void vert_gauss(unsigned char *chan, int w, int h, int y, double *temp,
 
 		k = (y + j) % mh2;
 		if (k >= h) k = mh2 - k;
-		src0 = chan + k * w;
+		src0 = chan + (size_t)k * w;
 		k = abs(y - j) % mh2;
 		if (k >= h) k = mh2 - k;
-		src1 = chan + k * w;
+		src1 = chan + (size_t)k * w;
 		if (gcor) /* Gamma-correct */
 		{
 			for (k = 0; k < w; k++)
@@ -8002,8 +9251,8 @@ static void gauss_filter_rgba(tcb *thread)
 			unsigned char *alff, *alf0, *alf1;
 			int j, k;
 
-			alff = alpha + i * mem_width;
-			srcc = chan + i * mem_width * 3;
+			alff = alpha + (size_t)i * mem_width;
+			srcc = chan + (size_t)i * mem_width * 3;
 			if (gcor) /* Gamma correct */
 			{
 				double gk = gaussY[0];
@@ -8046,12 +9295,12 @@ static void gauss_filter_rgba(tcb *thread)
 
 				k = (i + j) % mh2;
 				if (k >= mem_height) k = mh2 - k;
-				alf0 = alpha + k * mem_width;
-				src0 = chan + k * mem_width * 3;
+				alf0 = alpha + (size_t)k * mem_width;
+				src0 = chan + (size_t)k * mem_width * 3;
 				k = abs(i - j) % mh2;
 				if (k >= mem_height) k = mh2 - k;
-				alf1 = alpha + k * mem_width;
-				src1 = chan + k * mem_width * 3;
+				alf1 = alpha + (size_t)k * mem_width;
+				src1 = chan + (size_t)k * mem_width * 3;
 				if (gcor) /* Gamma correct */
 				{
 					int k, kk;
@@ -8108,8 +9357,8 @@ static void gauss_filter_rgba(tcb *thread)
 		gauss_extend(gd, tmpa, mem_width, 3);
 		gauss_extend(gd, atmp, mem_width, 1);
 		row_protected(0, i, mem_width, mask);
-		dest = mem_img[CHN_IMAGE] + i * mem_width * 3;
-		dsta = mem_img[CHN_ALPHA] + i * mem_width;
+		dest = mem_img[CHN_IMAGE] + (size_t)i * mem_width * 3;
+		dsta = mem_img[CHN_ALPHA] + (size_t)i * mem_width;
 		/* Horizontal RGBA filter */
 		{
 			int j, jj, k, kk, x1, x2;
@@ -8400,7 +9649,8 @@ void mask_merge(unsigned char *old, int channel, unsigned char *mask)
 {
 	chanlist tlist;
 	unsigned char *dest, *mask0 = NULL;
-	int i, ofs, bpp = BPP(channel);
+	size_t ofs;
+	int i, bpp = BPP(channel);
 
 	memcpy(tlist, mem_img, sizeof(chanlist));
 	tlist[channel] = old;
@@ -8411,7 +9661,7 @@ void mask_merge(unsigned char *old, int channel, unsigned char *mask)
 
 	for (i = 0; i < mem_height; i++)
 	{
-		ofs = i * mem_width;
+		ofs = (size_t)i * mem_width;
 		prep_mask(0, 1, mem_width, mask, mask0 ? mask0 + ofs : NULL,
 			tlist[CHN_IMAGE] + ofs * mem_img_bpp);
 		dest = mem_img[channel] + ofs * bpp;
@@ -8551,11 +9801,12 @@ void mem_dog(double radiusW, double radiusN, int norm, int gcor)
 	{
 		unsigned char *tmp, xtb[256];
 		double d;
-		int i, l, mx = 0;
+		size_t n, l;
+		int i, mx = 0;
 
-		l = mem_height * mem_width * BPP(mem_channel);
+		l = (size_t)mem_height * mem_width * BPP(mem_channel);
 		tmp = mem_img[mem_channel];
-		for (i = l; i; i-- , tmp++)
+		for (n = l; n; n-- , tmp++)
 			if (*tmp > mx) mx = *tmp;
 
 		if (!mx) break;
@@ -8563,7 +9814,7 @@ void mem_dog(double radiusW, double radiusN, int norm, int gcor)
 		for (i = 0; i <= mx; i++) xtb[i] = rint(i * d);
 
 		tmp = mem_img[mem_channel];
-		for (i = l; i; i-- , tmp++) *tmp = xtb[*tmp];
+		for (n = l; n; n-- , tmp++) *tmp = xtb[*tmp];
 
 		break;
 	}
@@ -8728,7 +9979,7 @@ static void kuwahara_detailed(unsigned char *buf, unsigned char *mask,
 #endif
 
 	row_protected(0, y, mem_width, mask);
-	tmp = mem_img[CHN_IMAGE] + y * w;
+	tmp = mem_img[CHN_IMAGE] + (size_t)y * w;
 	for (l = 0; l < mem_width; l++ , tmp += 3 , dest += 3)
 	{
 		unsigned char *tb, *found;
@@ -8919,7 +10170,7 @@ void mem_kuwahara(int r, int gcor, int detail)
 		else
 		{
 			/* Mask-merge current row */
-			tmp = mem_img[CHN_IMAGE] + i * w;
+			tmp = mem_img[CHN_IMAGE] + (size_t)i * w;
 			process_img(0, 1, mem_width, mask, tmp, tmp, buf + 3,
 				NULL, 3, BLENDF_SET | BLENDF_INVM);
 		}
@@ -8974,7 +10225,8 @@ int mem_clip_mask_init(unsigned char val)		// Initialise the clipboard mask
 void mem_mask_colors(unsigned char *mask, unsigned char *img, unsigned char v,
 	int width, int height, int bpp, int col0, int col1)
 {
-	int i, j = width * height, k;
+	size_t i, j = (size_t)width * height;
+	int k;
 
 	if (bpp == 1)
 	{
@@ -9032,7 +10284,8 @@ void mem_clip_mask_clear()		// Clear/remove the clipboard mask
 int mem_scale_alpha(unsigned char *img, unsigned char *alpha,
 	int width, int height, int mode)
 {
-	int i, j = width * height, AA[3], BB[3], DD[6], chan, c1, c2, dc1, dc2;
+	size_t l, j = (size_t)width * height;
+	int i, AA[3], BB[3], DD[6], chan, c1, c2, dc1, dc2;
 	double p0, p1, p2, dchan, KK[6];
 
 	if (!img || !alpha) return (1);
@@ -9069,7 +10322,7 @@ int mem_scale_alpha(unsigned char *img, unsigned char *alpha,
 			KK[i + 3] = AA[i] < 255 ? -255.0 / (255 - AA[i]) : 0.0;
 		}
 
-		for (i = 0; i < j; i++ , alpha++ , img += 3)
+		for (l = 0; l < j; l++ , alpha++ , img += 3)
 		{
 			/* Already semi-opaque so don't touch */
 			if (*alpha != 255) continue;
@@ -9100,7 +10353,7 @@ int mem_scale_alpha(unsigned char *img, unsigned char *alpha,
 		dc1 = BB[c1] - AA[c1];
 		dc2 = BB[c2] - AA[c2];
 
-		for (i = 0; i < j; i++ , alpha++ , img += 3)
+		for (l = 0; l < j; l++ , alpha++ , img += 3)
 		{
 			/* Already semi-opaque so don't touch */
 			if (*alpha != 255) continue;
@@ -9187,7 +10440,7 @@ void mem_smudge(int ox, int oy, int nx, int ny)
 	for (j = y0; j != y1; j += dy)	// Blend old area with new area
 	{
 		unsigned char *ts, *td, *tsa = NULL, *tda = NULL;
-		int offs = j * mem_width + ax;
+		size_t offs = ax + (size_t)mem_width * j;
 
 		row_protected(ax + xv, j + yv, w, mask);
 		ts = src + offs * bpp;
@@ -9237,29 +10490,29 @@ void mem_smudge(int ox, int oy, int nx, int ny)
 
 ///	GRADIENTS
 
-/* Evaluate channel gradient at coordinate, return opacity
- * Coordinate 0 is center of 1st pixel, 1 center of last
- * Scale of return values is 0x0000..0xFF00 (NOT 0xFFFF) */
-int grad_value(int *dest, int slot, double x)
+/* Evaluate opacity gradient at coordinate */
+static int grad_op(grad_map *gradmap, double x)
 {
-	int i, k, len, op;
-	unsigned char *gdata, *gmap;
-	grad_map *gradmap;
-	double xx, hsv[6];
-
-	/* Gradient slot (first RGB, then 1-bpp channels) */
-	gradmap = graddata + slot;
+	int i, k, len;
+	unsigned char *gdata = gradmap->op, *gmap = gradmap->opmap;
+	double xx;
 
-	/* Get opacity */
-	gdata = gradmap->op; gmap = gradmap->opmap; len = gradmap->oplen;
+	len = gradmap->oplen;
 	xx = (gradmap->orev ? 1.0 - x : x) * (len - 1);
 	i = xx;
 	if (i > len - 2) i = len - 2;
 	k = gmap[i] == GRAD_TYPE_CONST ? 0 : (int)((xx - i) * 0x10000 + 0.5);
-	op = (gdata[i] << 8) + ((k * (gdata[i + 1] - gdata[i]) + 127) >> 8);
-	if (!op) return (0); /* Stop if zero opacity */
+	return ((gdata[i] << 8) + ((k * (gdata[i + 1] - gdata[i]) + 127) >> 8));
+}
+
+/* Evaluate channel value gradient at coordinate */
+static void grad_color(int *dest, int slot, double x)
+{
+	int i, k, len;
+	unsigned char *gdata, *gmap;
+	grad_map *gradmap = graddata + slot;
+	double xx, hsv[6];
 
-	/* Get channel value */
 	gdata = gradmap->vs; gmap = gradmap->vsmap; len = gradmap->vslen;
 	xx = (gradmap->grev ? 1.0 - x : x) * (len - 1);
 	i = xx;
@@ -9329,7 +10582,16 @@ int grad_value(int *dest, int slot, double x)
 		dest[slot + 2] = (gdata[i] << 8) +
 			((k * (gdata[i + 1] - gdata[i]) + 127) >> 8);
 	}
+}
+
+/* Evaluate channel gradient at coordinate, return opacity
+ * Coordinate 0 is center of 1st pixel, 1 center of last
+ * Scale of return values is 0x0000..0xFF00 (NOT 0xFFFF) */
+int grad_value(int *dest, int slot, double x)
+{
+	int op = grad_op(graddata + slot, x);
 
+	if (op) grad_color(dest, slot, x); /* Stop if zero opacity */
 	return (op);
 }
 
@@ -9352,32 +10614,197 @@ static void grad_alpha(int *dest, double x)
 		((k * (gdata[i + 1] - gdata[i]) + 127) >> 8);
 }
 
+/* Gradient lookup table: opacity, 3 values, and coupled alpha per step */
+#define GRAD_LUT 4096
+#define GRAD_LSTEP 5
+#define GRAD_KEY (32 + GRAD_POINTS * 8)
+
+static int grad_lut[(GRAD_LUT + 2) * GRAD_LSTEP];
+static unsigned char grad_lut_key[GRAD_KEY];
+/* Steps with a gradient point inside, to be evaluated directly: interpolating
+ * over those would blur constant segments' edges, and pick wrong index pairs */
+static unsigned char grad_lut_cut[GRAD_LUT + 1];
+
+static int grad_key_map(unsigned char *key, grad_map *gmap, int bpp, int op)
+{
+	unsigned char *tmp = key;
+
+	*tmp++ = gmap->gtype; *tmp++ = gmap->grev;
+	memcpy(tmp, &gmap->vslen, sizeof(int)); tmp += sizeof(int);
+	memcpy(tmp, gmap->vs, gmap->vslen * bpp); tmp += gmap->vslen * bpp;
+	memcpy(tmp, gmap->vsmap, gmap->vslen); tmp += gmap->vslen;
+	if (!op) return (tmp - key);
+	*tmp++ = gmap->otype; *tmp++ = gmap->orev;
+	memcpy(tmp, &gmap->oplen, sizeof(int)); tmp += sizeof(int);
+	memcpy(tmp, gmap->op, gmap->oplen); tmp += gmap->oplen;
+	memcpy(tmp, gmap->opmap, gmap->oplen); tmp += gmap->oplen;
+	return (tmp - key);
+}
+
+/* Segment of gradient at coordinate */
+static int grad_seg(int len, int rev, double x)
+{
+	int i = (rev ? 1.0 - x : x) * (len - 1);
+	return (i > len - 2 ? len - 2 : i);
+}
+
+/* Fill one lookup table entry */
+static void grad_lut_fill(int *lut, int slot, double x)
+{
+	int wrk[NUM_CHANNELS + 3];
+
+	/* Values are resolved even where opacity is zero, for interpolation */
+	memset(wrk, 0, sizeof(wrk));
+	lut[0] = grad_op(graddata + slot, x);
+	grad_color(wrk, slot, x);
+	if (slot <= CHN_IMAGE + 1)
+	{
+		grad_alpha(wrk, x);
+		lut[4] = wrk[CHN_ALPHA + 3];
+	}
+	if (!slot)
+	{
+		lut[1] = wrk[0]; lut[2] = wrk[1]; lut[3] = wrk[2];
+	}
+	else if (slot == CHN_IMAGE + 1)
+	{
+		lut[1] = wrk[0]; lut[2] = wrk[1];
+		lut[3] = wrk[CHN_IMAGE + 3];
+	}
+	else lut[1] = wrk[slot + 2];
+}
+
+/* Rebuild the lookup table if gradient data changed, return slot; threaded
+ * callers must run it once beforehand, to not rebuild the table in parallel */
+int grad_lut_update()
+{
+	unsigned char key[GRAD_KEY];
+	grad_map *gmap, *amap = graddata + CHN_ALPHA + 1;
+	int i, l, slot, *lut, seg[3], seg0[3];
+
+	slot = mem_channel + ((0x81 + mem_channel + mem_channel - mem_img_bpp) >> 7);
+
+	/* Anything changed? */
+	key[0] = slot;
+	l = 1 + grad_key_map(key + 1, graddata + slot, slot ? 1 : 3, TRUE);
+	if (slot <= CHN_IMAGE + 1) /* Coupled alpha */
+		l += grad_key_map(key + l, graddata + CHN_ALPHA + 1, 1, FALSE);
+	memset(key + l, 0, GRAD_KEY - l);
+	if (!memcmp(key, grad_lut_key, GRAD_KEY)) return (slot);
+
+	gmap = graddata + slot;
+	seg[2] = 0;
+	for (lut = grad_lut , i = 0; i <= GRAD_LUT; i++ , lut += GRAD_LSTEP)
+	{
+		double x = i * (1.0 / GRAD_LUT);
+
+		grad_lut_fill(lut, slot, x);
+		/* Mark the previous step if it crossed a point */
+		memcpy(seg0, seg, sizeof(seg));
+		seg[0] = grad_seg(gmap->oplen, gmap->orev, x);
+		seg[1] = grad_seg(gmap->vslen, gmap->grev, x);
+		if (slot <= CHN_IMAGE + 1)
+			seg[2] = grad_seg(amap->vslen, amap->grev, x);
+		if (i) grad_lut_cut[i - 1] = !!memcmp(seg, seg0, sizeof(seg));
+	}
+	grad_lut_cut[GRAD_LUT] = FALSE;
+	/* Padding for interpolation at 1.0 */
+	memcpy(lut, lut - GRAD_LSTEP, GRAD_LSTEP * sizeof(int));
+	/* Table is valid only now */
+	memcpy(grad_lut_key, key, GRAD_KEY);
+
+	return (slot);
+}
+
+#define GRAD_CHUNK 256
+
+/* Compute placement distances for a run of pixels, incrementally along the
+ * row; return 0 if the mode needs to be done pixel by pixel */
+static int grad_dists(double *dd, grad_info *grad, int x, int y, int step, int cnt)
+{
+	double d0, d1, s0, s1;
+	int i, dx = x - grad->xy[0], dy = y - grad->xy[1];
+
+	switch (grad->wmode)
+	{
+	case GRAD_MODE_ANGULAR:	/* Angular/conical gradient */
+	case GRAD_MODE_CONICAL:
+		return (0);
+	default:
+	case GRAD_MODE_LINEAR:	/* Linear gradient */
+		d0 = dx * grad->xv + dy * grad->yv;
+		s0 = step * grad->xv;
+		for (i = 0; i < cnt; i++) dd[i] = d0 + i * s0;
+		break;
+	case GRAD_MODE_BILINEAR: /* Bilinear gradient */
+		d0 = dx * grad->xv + dy * grad->yv;
+		s0 = step * grad->xv;
+		for (i = 0; i < cnt; i++) dd[i] = fabs(d0 + i * s0);
+		break;
+	case GRAD_MODE_RADIAL:	/* Radial gradient */
+		d0 = (double)dy * dy;
+		for (i = 0; i < cnt; i++)
+		{
+			d1 = dx + i * step;
+			dd[i] = sqrt(d1 * d1 + d0);
+		}
+		break;
+	case GRAD_MODE_SQUARE:	/* Square gradient */
+		d0 = dx * grad->xv + dy * grad->yv;
+		d1 = dx * grad->yv - dy * grad->xv;
+		s0 = step * grad->xv;
+		s1 = step * grad->yv;
+		for (i = 0; i < cnt; i++)
+			dd[i] = fabs(d0 + i * s0) + fabs(d1 + i * s1);
+		break;
+	}
+	return (1);
+}
+
 /* Evaluate gradient at a sequence of points */
-/* !!! For now, works only in (slower) exact mode */
 void grad_pixels(int start, int step, int cnt, int x, int y, unsigned char *mask,
 	unsigned char *op0, unsigned char *img0, unsigned char *alpha0)
 {
 	grad_info *grad = gradient + mem_channel;
 	unsigned char *dest;
-	int i, mmask, dither, op, slot, wrk[NUM_CHANNELS + 3];
-	double dist, len1, l2;
-	
+	int i, j, l, k, f, mmask, dither, op, slot, rows, *lut;
+	int tmp[GRAD_LSTEP * 2];
+	double dist, len1, l2, dd[GRAD_CHUNK];
+
+
+	/* Disabled because of unusable settings? */
+	if (grad->wmode == GRAD_MODE_NONE)
+	{
+		for (cnt = start + step * cnt; start < cnt; start += step)
+			op0[start] = 0;
+		return;
+	}
 
 	if (!RGBA_mode) alpha0 = NULL;
 	mmask = IS_INDEXED ? 1 : 255; /* On/off opacity */
-	slot = mem_channel + ((0x81 + mem_channel + mem_channel - mem_img_bpp) >> 7);
+	slot = grad_lut_update();
+	len1 = grad->wrep;
 
 	cnt = start + step * cnt; x += start;
-	for (i = start; i < cnt; op0[i] = op , x += step , i += step)
+	for (i = start , j = l = 0; i < cnt;
+		op0[i] = op , x += step , i += step , j++)
 	{
+		/* Distances for placement gradient, a chunk at a time */
+		if (j >= l)
+		{
+			l = (cnt - i + step - 1) / step;
+			if (l > GRAD_CHUNK) l = GRAD_CHUNK;
+			rows = (grad->status != GRAD_NONE) &&
+				grad_dists(dd, grad, x, y, step, l);
+			j = 0;
+		}
+
 		op = 0;
 		if (mask[i] >= mmask) continue;
 
-		/* Disabled because of unusable settings? */
-		if (grad->wmode == GRAD_MODE_NONE) continue;
-
 		/* Distance for gradient mode */
-		if (grad->status == GRAD_NONE)
+		if (rows) dist = dd[j];
+		else if (grad->status == GRAD_NONE)
 		{
 			/* Stroke gradient */
 			if (grad->wmode != GRAD_MODE_BURST) dist = grad_path +
@@ -9385,56 +10812,29 @@ void grad_pixels(int start, int step, int cnt, int x, int y, unsigned char *mask
 			/* Shapeburst gradient */
 			else if (!sb_buf2)
 			{
-				int n = sb_buf[(y - sb_rect[1]) * sb_rect[2] +
+				int n = sb_buf[(size_t)(y - sb_rect[1]) * sb_rect[2] +
 					(x - sb_rect[0])] - 1;
 				if (n < 0) continue;
 				dist = n;
 			}
 			else
 			{
-				int n = sb_buf2[(y - sb_rect[1]) * sb_rect[2] +
+				int n = sb_buf2[(size_t)(y - sb_rect[1]) * sb_rect[2] +
 					(x - sb_rect[0])];
 				if (!n) continue;
 				dist = sqrt(n) - 1.0;
 			}
 		}
-		else
+		else /* Angular/conical gradient */
 		{
-			int dx = x - grad->xy[0], dy = y - grad->xy[1];
-
-			switch (grad->wmode)
-			{
-			default:
-			case GRAD_MODE_LINEAR:	/* Linear/bilinear gradient */
-			case GRAD_MODE_BILINEAR:
-				dist = dx * grad->xv + dy * grad->yv;
-				if (grad->wmode == GRAD_MODE_LINEAR) break;
-				dist = fabs(dist); /* Bilinear */
-				break;
-			case GRAD_MODE_RADIAL:	/* Radial gradient */
-				dist = sqrt(dx * dx + dy * dy);
-				break;
-			case GRAD_MODE_SQUARE:	/* Square gradient */
-				/* !!! Here is code duplication with linear/
-				 * bilinear path - but merged paths actually
-				 * LOSE in both time and space, at least
-				 * with GCC - WJ */
-				dist = fabs(dx * grad->xv + dy * grad->yv) +
-					fabs(dx * grad->yv - dy * grad->xv);
-				break;
-			case GRAD_MODE_ANGULAR:	/* Angular/conical gradient */
-			case GRAD_MODE_CONICAL:
-				dist = atan360(dx, dy) - grad->wa;
-				if (dist < 0.0) dist += 360.0;
-				if (grad->wmode == GRAD_MODE_ANGULAR) break;
-				if (dist >= 180.0) dist = 360.0 - dist;
-				break;
-			}
+			dist = atan360(x - grad->xy[0], y - grad->xy[1]) - grad->wa;
+			if (dist < 0.0) dist += 360.0;
+			if ((grad->wmode == GRAD_MODE_CONICAL) && (dist >= 180.0))
+				dist = 360.0 - dist;
 		}
 		dist -= grad->ofs;
 
 		/* Apply repeat mode */
-		len1 = grad->wrep;
 		switch (grad->wrmode)
 		{
 		case GRAD_BOUND_MIRROR: /* Mirror repeat */
@@ -9463,39 +10863,52 @@ void grad_pixels(int start, int step, int cnt, int x, int y, unsigned char *mask
 			break;
 		}
 
-		/* Rescale to 0..1, enforce boundaries */
-		dist = dist <= 0.0 ? 0.0 : dist >= len1 ? 1.0 : dist * grad->wil1;
+		/* Rescale to 0..GRAD_LUT, enforce boundaries */
+		dist = dist <= 0.0 ? 0.0 : dist >= len1 ? GRAD_LUT :
+			dist * grad->wil1 * GRAD_LUT;
+		k = dist;
+		f = (int)((dist - k) * 256.0 + 0.5);
+		lut = grad_lut + k * GRAD_LSTEP;
+		if (grad_lut_cut[k]) /* Evaluate directly */
+		{
+			grad_lut_fill(lut = tmp, slot, dist * (1.0 / GRAD_LUT));
+			memcpy(tmp + GRAD_LSTEP, tmp, GRAD_LSTEP * sizeof(int));
+			f = 0;
+		}
 
 		/* Value from Bayer dither matrix */
 		dither = BAYER(x, y);
 
 		/* Get gradient */
-		wrk[CHN_IMAGE + 3] = 0;
-		op = (grad_value(wrk, slot, dist) + dither) >> 8;
+		op = (lut[0] + (((lut[GRAD_LSTEP] - lut[0]) * f + 128) >> 8) +
+			dither) >> 8;
 		if (!op) continue;
 
 		if (mem_channel == CHN_IMAGE)
 		{
-			if (alpha0)
-			{
-				grad_alpha(wrk, dist);
-				alpha0[i] = (wrk[CHN_ALPHA + 3] + dither) >> 8;
-			}
+			if (alpha0) alpha0[i] = (lut[4] + (((lut[GRAD_LSTEP + 4] -
+				lut[4]) * f + 128) >> 8) + dither) >> 8;
 			if (mem_img_bpp == 3)
 			{
 				dest = img0 + i * 3;
-				dest[0] = (wrk[0] + dither) >> 8;
-				dest[1] = (wrk[1] + dither) >> 8;
-				dest[2] = (wrk[2] + dither) >> 8;
+				dest[0] = (lut[1] + (((lut[GRAD_LSTEP + 1] -
+					lut[1]) * f + 128) >> 8) + dither) >> 8;
+				dest[1] = (lut[2] + (((lut[GRAD_LSTEP + 2] -
+					lut[2]) * f + 128) >> 8) + dither) >> 8;
+				dest[2] = (lut[3] + (((lut[GRAD_LSTEP + 3] -
+					lut[3]) * f + 128) >> 8) + dither) >> 8;
 			}
 			else
 			{
-				img0[i] = (unsigned char)wrk[(wrk[CHN_IMAGE + 3] +
-					dither) >> 8];
+				/* Indexed: nearest step, no interpolation */
+				if (f > 128) lut += GRAD_LSTEP;
+				img0[i] = (unsigned char)lut[1 +
+					((lut[3] + dither) >> 8)];
 				op = 255;
 			}
 		}
-		else img0[i] = (wrk[mem_channel + 3] + dither) >> 8;
+		else img0[i] = (lut[1] + (((lut[GRAD_LSTEP + 1] - lut[1]) *
+			f + 128) >> 8) + dither) >> 8;
 	}
 }
 
@@ -9953,7 +11366,8 @@ static void skew_fill_rgba(double *buf, double *filler,
 	{
 		unsigned char *img, *alpha;
 		double *filt, acc = 0.0;
-		int x, y, x1, ofs;
+		size_t ofs;
+		int x, y, x1;
 
 		/* Get location */
 		y = y0 + dyy[j];
@@ -9966,7 +11380,7 @@ static void skew_fill_rgba(double *buf, double *filler,
 		while (x < 0) acc += filt[x++];
 
 		/* Setup source & dest */
-		ofs = y * ow + x;
+		ofs = x + (size_t)ow * y;
 		img = src + ofs * 3;
 		alpha = srca + ofs;
 // !!! Maybe use temp vars for accumulators - but will it make a difference?
@@ -10040,7 +11454,7 @@ static void skew_fill_rgb(double *buf, double *filler,
 		while (x < 0) acc += filt[x++];
 
 		/* Setup source & dest */
-		img = src + (y * ow + x) * 3;
+		img = src + (x + (size_t)ow * y) * 3;
 		rv = dest[0] * acc;
 		gv = dest[1] * acc;
 		bv = dest[2] * acc;
@@ -10102,7 +11516,7 @@ static void skew_fill_util(double *buf, double *filler,
 		while (x < 0) x++;
 
 		/* Setup source */
-		img = src + y * ow + x;
+		img = src + x + (size_t)ow * y;
 
 		/* Accumulate image data */
 		filt += x; sum = 0.0;
@@ -10185,7 +11599,8 @@ static void mem_skew_filt(chanlist old_img, chanlist new_img, int ow, int oh,
 		for (i = 1 - yfsz , idx = 0; i < nh; i++ , ++idx >= yfsz ? idx = 0 : 0)
 		{
 			double *filt0, *thatbuf, *thisbuf = wbuf + idx * wbsz;
-			int j, k, y0, xl, xr, len, ofs, lfx = -xfsz;
+			size_t ofs;
+			int j, k, y0, xl, xr, len, lfx = -xfsz;
 
 			if (!silent && ((++ny * 10) % nr >= nr - 10))
 				progress_update((float)ny / nr);
@@ -10274,7 +11689,7 @@ static void mem_skew_filt(chanlist old_img, chanlist new_img, int ow, int oh,
 			}
 
 			/* Write out results */
-			ofs = i * nw + xl;
+			ofs = xl + (size_t)nw * i;
 			if (cc == CHN_IMAGE) // RGB and RGBA
 			{
 				double *dsrc = thisbuf;
@@ -10393,7 +11808,7 @@ static void mem_skew_nn(chanlist old_img, chanlist new_img, int ow, int oh,
 			/* RGB nearest neighbour */
 			if ((cc == CHN_IMAGE) && (bpp == 3))
 			{
-				dest = new_img[CHN_IMAGE] + (ny * nw + xl) * 3;
+				dest = new_img[CHN_IMAGE] + (xl + (size_t)nw * ny) * 3;
 				for (nx = xl; nx < xr; nx++ , dest += 3)
 				{
 // !!! Later, try reimplementing these calculations in row-then-column way -
@@ -10402,7 +11817,7 @@ static void mem_skew_nn(chanlist old_img, chanlist new_img, int ow, int oh,
 					WJ_ROUND(ox, x0y + nx * d);
 					WJ_ROUND(oy, y0y - nx * yskew);
 					src = old_img[CHN_IMAGE] +
-						(oy * ow + ox) * 3;
+						(ox + (size_t)ow * oy) * 3;
 					dest[0] = src[0];
 					dest[1] = src[1];
 					dest[2] = src[2];
@@ -10411,12 +11826,12 @@ static void mem_skew_nn(chanlist old_img, chanlist new_img, int ow, int oh,
 			/* One-bpp nearest neighbour */
 			else
 			{
-				dest = new_img[cc] + ny * nw + xl;
+				dest = new_img[cc] + xl + (size_t)nw * ny;
 				for (nx = xl; nx < xr; nx++)
 				{
 					WJ_ROUND(ox, x0y + nx * d);
 					WJ_ROUND(oy, y0y - nx * yskew);
-					*dest++ = old_img[cc][oy * ow + ox];
+					*dest++ = old_img[cc][ox + (size_t)ow * oy];
 				}
 			}
 		}
@@ -10504,20 +11919,20 @@ int mem_skew(double xskew, double yskew, int type, int gcor)
 int average_channel(unsigned char *src, int iw, int *vxy)
 {
 	unsigned char *tmp;
-	unsigned int nn, wh;
+	size_t nn, wh;
 	int i, j, x, y, w, h;
 
 	w = vxy[2] - (x = vxy[0]);
 	h = vxy[3] - (y = vxy[1]);
-	src += y * iw + x;
+	src += x + (size_t)iw * y;
 
 	/* Average area */
 	for (nn = i = 0; i < h; i++)
 	{
-		tmp = src + i * iw;
+		tmp = src + (size_t)i * iw;
 		for (j = w; j--; nn += *tmp++);
 	}
-	wh = w * h;
+	wh = (size_t)w * h;
 	return ((nn + (wh >> 1)) / wh);
 }
 
@@ -10530,17 +11945,17 @@ int average_pixels(unsigned char *rgb, unsigned char *alpha, int iw, int *vxy)
 
 	w = vxy[2] - (x = vxy[0]);
 	h = vxy[3] - (y = vxy[1]);
-	rgb += (y * iw + x) * 3;
-	if (alpha) alpha += y * iw + x;
+	rgb += (x + (size_t)iw * y) * 3;
+	if (alpha) alpha += x + (size_t)iw * y;
 
 	/* Average (gamma corrected) area */
 	rr = gg = bb = dd = 0.0;
 	for (i = 0; i < h; i++)
 	{
-		tmp = rgb + i * iw * 3;
+		tmp = rgb + (size_t)i * iw * 3;
 		if (alpha)
 		{
-			tma = alpha + i * iw;
+			tma = alpha + (size_t)i * iw;
 			for (j = 0; j < w; j++ , tmp += 3)
 			{
 				dd += k = *tma++;
@@ -10596,11 +12011,162 @@ static void mem_convert_row(double *dest, unsigned char *src, int l, int cspace)
  * Pedro F. Felzenszwalb, "Efficient Graph-Based Image Segmentation"
  */
 
-static int cmp_edge(const void *v1, const void *v2)
+/* Edges are ordered by difference, then by index; since they get generated in
+ * index order, a stable radix sort on difference alone does exactly that */
+
+typedef struct {
+	unsigned char *img;
+	seg_edge *edges, *tmp;
+	unsigned int *hist;
+	double *rows, mult;
+	unsigned int cnt;
+	int w, h, cspace, dist, shift, nchunks, progress;
+} segd;
+
+#define SEG_RADIX_BITS 8
+#define SEG_RADIX (1 << SEG_RADIX_BITS)
+
+/* Positive floats compare the same way as their bit patterns do */
+static inline unsigned int seg_key(const seg_edge *e, int shift)
+{
+	union { float f; uint32_t i; } v;
+
+	v.f = e->diff;
+	return ((v.i >> shift) & (SEG_RADIX - 1));
+}
+
+/* Compute color distances for rows, fill their part of connections buffer */
+static void seg_edges(tcb *thread)
+{
+	segd *sd = thread->data;
+	const distance_func dist = distance_3d[sd->dist];
+	seg_edge *e;
+	double *tmp, *row0 = sd->rows, *row1 = sd->rows + sd->w * 3;
+	size_t l = sd->w * 3;
+	unsigned int k;
+	int i, ii, j, cnt = thread->nsteps;
+
+
+	if (!cnt) goto done;
+	i = thread->step0;
+	mem_convert_row(row0, sd->img + i * l, sd->w, sd->cspace);
+	e = sd->edges + (size_t)i * (sd->w * 2 - 1);
+	for (ii = 0; ii < cnt; ii++ , i++)
+	{
+		int down = i < sd->h - 1;
+
+		if (down) mem_convert_row(row1, sd->img + (i + 1) * l,
+			sd->w, sd->cspace);
+		/* Right and bottom vertices for this row, in index order */
+		k = (unsigned int)i * sd->w * 2;
+		for (j = 0; j < l; j += 3 , k += 2)
+		{
+			if (j + 3 < l)
+			{
+				e->which = k;
+				e->diff = sd->mult * dist(row0 + j, row0 + j + 3);
+				e++;
+			}
+			if (!down) continue;
+			e->which = k + 1;
+			e->diff = sd->mult * dist(row0 + j, row1 + j);
+			e++;
+		}
+		tmp = row0; row0 = row1; row1 = tmp;
+		if (sd->progress && thread_step(thread, ii + 1, cnt, 20))
+		{
+			thread->stop = TRUE; // Let caller know
+			break;
+		}
+	}
+done:	thread_done(thread);
+}
+
+/* Range of edges in a sort chunk */
+static seg_edge *seg_chunk(segd *sd, seg_edge *edges, int n, unsigned int *cnt)
+{
+	unsigned int l = sd->cnt / sd->nchunks, r = sd->cnt % sd->nchunks;
+
+	*cnt = l + (n < r);
+	return (edges + l * n + (n < r ? n : r));
+}
+
+/* Count radix digits in each chunk */
+static void seg_hist(tcb *thread)
+{
+	segd *sd = thread->data;
+	seg_edge *e;
+	unsigned int l, *hist;
+	int n;
+
+	for (n = thread->step0; n < thread->step0 + thread->nsteps; n++)
+	{
+		hist = sd->hist + n * SEG_RADIX;
+		memset(hist, 0, SEG_RADIX * sizeof(*hist));
+		e = seg_chunk(sd, sd->edges, n, &l);
+		for (; l; l-- , e++) hist[seg_key(e, sd->shift)]++;
+	}
+	thread_done(thread);
+}
+
+/* Distribute each chunk's edges to their precomputed places */
+static void seg_scatter(tcb *thread)
+{
+	segd *sd = thread->data;
+	seg_edge *e;
+	unsigned int l, *hist;
+	int n;
+
+	for (n = thread->step0; n < thread->step0 + thread->nsteps; n++)
+	{
+		hist = sd->hist + n * SEG_RADIX;
+		e = seg_chunk(sd, sd->edges, n, &l);
+		for (; l; l-- , e++) sd->tmp[hist[seg_key(e, sd->shift)]++] = *e;
+	}
+	thread_done(thread);
+}
+
+/* Stable LSD radix sort, each pass split into chunks between threads */
+static void seg_sort(threaddata *tdata, segd *sd)
 {
-	float f1 = ((seg_edge *)v1)->diff, f2 = ((seg_edge *)v2)->diff;
-	return (f1 < f2 ? -1 : f1 != f2 ? f1 > f2 :
-		((seg_edge *)v1)->which - ((seg_edge *)v2)->which);
+	seg_edge *e, *e0 = sd->edges;
+	unsigned int i, j, n, *hist = sd->hist;
+	int k;
+
+	for (sd->shift = 0; sd->shift < 32; sd->shift += SEG_RADIX_BITS)
+	{
+		for (k = 0; k < tdata->count; k++)
+		{
+			segd *sp = tdata->threads[k]->data;
+			sp->edges = sd->edges;
+			sp->tmp = sd->tmp;
+			sp->shift = sd->shift;
+		}
+		launch_threads(seg_hist, tdata, NULL, sd->nchunks);
+
+		/* Turn counts into offsets, chunk by chunk within each digit */
+		for (i = n = 0; i < SEG_RADIX; i++)
+		{
+			for (j = k = 0; k < sd->nchunks; k++)
+				j += hist[k * SEG_RADIX + i];
+			if (j == sd->cnt) break; // All in one bucket
+			for (k = 0; k < sd->nchunks; k++)
+			{
+				j = hist[k * SEG_RADIX + i];
+				hist[k * SEG_RADIX + i] = n;
+				n += j;
+			}
+		}
+		if (i < SEG_RADIX) continue; // Nothing to do in this pass
+
+		launch_threads(seg_scatter, tdata, NULL, sd->nchunks);
+		e = sd->tmp; sd->tmp = sd->edges; sd->edges = e;
+	}
+
+	/* Return the result to its proper place */
+	if (sd->edges == e0) return;
+	memcpy(e0, sd->edges, sd->cnt * sizeof(seg_edge));
+	sd->tmp = sd->edges; sd->edges = e0;
 }
 
 static inline int seg_find(seg_pixel *pix, int n)
@@ -10629,85 +12195,89 @@ seg_state *mem_seg_prepare(seg_state *s, unsigned char *img, int w, int h,
 	int flags, int cspace, int dist)
 {
 	static const unsigned char dist_scales[NUM_CSPACES] = { 1, 255, 1 };
-	seg_edge *e;
-	double mult, *row0, *row1, *rows[2];
-	int i, j, k, l, bsz, sz = w * h;
+	segd sd;
+	threaddata *tdata;
+	seg_state *s0 = s;
+	size_t bsz, esz, sz = (size_t)w * h;
+	int nt;
 
 
-	// !!! Will need a longer int type (and twice the memory) otherwise
-	if (sz > (INT_MAX >> 1) + 1) return (NULL);
+	/* Pixel index * 2 + 1 must fit into edge's "which" */
+	if (sz > (UINT_MAX >> 1) + 1U) return (NULL);
 
-	/* 3 buffers will be sharing space */
-	bsz = w * 3 * 2 * sizeof(double);
-	l = sz * sizeof(seg_pixel);
-	if (l > bsz) bsz = l;
+	/* Pixel nodes also serve as the sort buffer */
+	esz = (sz * 2 - w - h) * sizeof(seg_edge);
+	bsz = sz * sizeof(seg_pixel);
+	if (bsz < esz) bsz = esz;
 
 	if (!s) // Reuse existing allocation if possible
 	{ /* Allocation is HUGE, but no way to make do with smaller one - WJ */
-		void *v[3];
+		size_t hsz = (sizeof(seg_state) + sizeof(double) - 1) &
+			~(sizeof(double) - 1);
 
-		s = multialloc(MA_ALIGN_DOUBLE,
-			v, sizeof(seg_state), // Dummy pointer (header struct)
-			v + 1, bsz, // Row buffers/pixel nodes
-			v + 2, sz * 2 * sizeof(seg_edge), // Pixel connections
-			NULL);
+		/* Sizes can exceed int, so no multialloc() here */
+		s = calloc(1, hsz + bsz + esz);
 		if (!s) return (NULL);
-		s->pix = v[1];
-		s->edges = v[2];
+		s->pix = (void *)((char *)s + hsz);
+		s->edges = (void *)((char *)s->pix + bsz);
 		s->w = w;
 		s->h = h;
 	}
-	rows[0] = (void *)s->pix; // 1st row buffer
-	rows[1] = rows[0] + w * 3; // 2nd row buffer
 	s->phase = 0; // Struct is to be refilled
 
+	/* Set up threads */
+	memset(&sd, 0, sizeof(sd));
+	sd.img = img;
+	sd.edges = s->edges;
+	sd.tmp = (void *)s->pix;
+	sd.cnt = esz / sizeof(seg_edge);
+	sd.mult = dist_scales[cspace]; // Make all colorspaces use similar scale
+	sd.w = w;
+	sd.h = h;
+	sd.cspace = cspace;
+	sd.dist = dist;
+	sd.progress = flags & SEG_PROGRESS;
+	sd.nchunks = nt = image_threads(w, h);
+	if (nt < 1) sd.nchunks = 1;
+	tdata = talloc(MA_ALIGN_DOUBLE, nt, &sd, sizeof(sd),
+		&sd.hist, sd.nchunks * SEG_RADIX * sizeof(int),
+		NULL,
+		&sd.rows, w * 3 * 2 * sizeof(double),
+		NULL);
+	if (!tdata)
+	{
+		if (!s0) free(s);
+		return (NULL);
+	}
+	tdata->silent = !sd.progress;
+
 	if (flags & SEG_PROGRESS) progress_init(_("Segmentation Pass 1"), 1);
 
 	/* Compute color distances, fill connections buffer */
-	l = w * 3;
-	mult = dist_scales[cspace]; // Make all colorspaces use similar scale
-	for (i = 0 , e = s->edges; i < h; i++)
-	{
-		k = i * w;
-		mem_convert_row(row1 = rows[i & 1], img + k * 3, w, cspace);
-		/* Right vertices for this row */
-		for (j = 3 , k *= 2; j < l; j += 3 , k += 2 , e++)
-		{
-			e->which = k;
-			e->diff = mult * distance_3d[dist](row1 + j - 3, row1 + j);
-		}
-		if (!i) continue;
-		/* Bottom vertices for previous row */
-		k = (i - 1) * w * 2 + 1;
-		row0 = rows[~i & 1];
-		for (j = 0; j < l; j += 3 , k += 2 , e++)
-		{
-			e->which = k;
-			e->diff = mult * distance_3d[dist](row0 + j, row1 + j);
-		}
-		if ((flags & SEG_PROGRESS) && ((i * 20) % h >= h - 20))
-			if (progress_update((0.9 * i) / h)) goto quit;
-	}
+	launch_threads(seg_edges, tdata, NULL, h);
+	if (tdata->threads[0]->stop) goto quit;
 
 	/* Sort connections, smallest distances first */
-	s->cnt = e - s->edges;
-	qsort(s->edges, s->cnt, sizeof(seg_edge), cmp_edge);
+	s->cnt = sd.cnt;
+	seg_sort(tdata, &sd);
 
 	s->phase = 1;
 
 quit:	if (flags & SEG_PROGRESS) progress_end();
+	free(tdata);
 
 	return (s);
 }
 
-int mem_seg_process_chunk(int start, int cnt, seg_state *s)
+size_t mem_seg_process_chunk(size_t start, size_t cnt, seg_state *s)
 {
 	seg_edge *edge;
 	seg_pixel *cp, *pix = s->pix;
 	double threshold = s->threshold;
 	int minrank = s->minrank, minsize = s->minsize;
-	int sz = s->w * s->h, w1[2] = { 1, s->w };
-	int i, ix, pass;
+	unsigned int w1[2] = { 1, s->w };
+	size_t i, ix, sz = (size_t)s->w * s->h;
+	int pass;
 
 	/* Initialize pixel nodes */
 	if (!start)
@@ -10733,7 +12303,7 @@ int mem_seg_process_chunk(int start, int cnt, seg_state *s)
 		for (; i < ix; i++ , edge++)
 		{
 			float dist;
-			int j, k, idx;
+			unsigned int j, k, idx;
 
 			/* Get the original pixel */
 			dist = edge->diff;
@@ -10776,10 +12346,10 @@ int mem_seg_process_chunk(int start, int cnt, seg_state *s)
 
 int mem_seg_process(seg_state *s)
 {
-	int i, n, cnt = s->cnt * 3;
+	size_t i, n, cnt = s->cnt * 3;
 
 
-	if (s->w * s->h < 1024 * 1024)
+	if ((size_t)s->w * s->h < 1024 * 1024)
 	{
 		/* Run silently */
 		mem_seg_process_chunk(0, cnt, s);
@@ -10800,13 +12370,14 @@ int mem_seg_process(seg_state *s)
 void mem_seg_scan(unsigned char *dest, int y, int x, int w, int zoom,
 	const seg_state *s)
 {
-	int i, j, k, l, ofs, dy;
+	size_t ofs, dy;
+	int i, j, k, l;
 	seg_pixel *pix = s->pix;
 
 	memset(dest, 0, (w + 3) >> 2);
-	ofs = (y * s->w + x) * zoom;
-	dy = y ? s->w * zoom : 0; // No up neighbors for Y=0
-	j = pix[ofs + (!x - 1) * zoom].group; // No left neighbor for X=0
+	ofs = ((size_t)y * s->w + x) * zoom;
+	dy = y ? (size_t)s->w * zoom : 0; // No up neighbors for Y=0
+	j = pix[x ? ofs - zoom : ofs].group; // No left neighbor for X=0
 	for (i = 0; i < w; i++ , j = k , ofs += zoom)
 	{
 		k = pix[ofs].group , l = pix[ofs - dy].group;
@@ -10817,7 +12388,8 @@ void mem_seg_scan(unsigned char *dest, int y, int x, int w, int zoom,
 /* Draw segments in unique colors */
 void mem_seg_render(unsigned char *img, const seg_state *s)
 {
-	int i, k, l, sz = s->w * s->h;
+	size_t i, sz = (size_t)s->w * s->h;
+	int k, l;
 	seg_pixel *pix = s->pix;
 
 	for (i = l = 0; i < sz; i++)
@@ -10854,7 +12426,10 @@ void mem_seg_render(unsigned char *img, const seg_state *s)
  * this way as threshold's base value */
 double mem_seg_threshold(seg_state *s)
 {
-	int k = s->cnt - FRACTAL_THR * pow(s->cnt, 0.5 * FRACTAL_DIM);
+	double d = s->cnt - FRACTAL_THR * pow(s->cnt, 0.5 * FRACTAL_DIM);
+	size_t k = d > 0 ? d : 0;
+
+	if (!s->cnt) return (1.0);
 	while (!s->edges[k].diff && (k < s->cnt - 1)) k++;
 	return (s->edges[k].diff ? s->edges[k].diff * THRESHOLD_MULT : 1.0);
 }
@@ -10937,11 +12512,14 @@ void init_perlin(int seed, int xstep, int ystep, int lvl, int maptype)
 	}
 }
 
+#define PERLIN_CHUNK 256
+
 void do_perlin(int start, int step, int cnt, unsigned char *mask,
 	unsigned char *imgr, int x, int y)
 {
-	double sum, tx, ty, yb, d, dx, dy, sc, wyy[8], ybb[8];
-	int i, k, lvl, a, b, yp0[8], yp1[8], mstep = step, bpp = MEM_BPP;
+	double tx[PERLIN_CHUNK], xf[PERLIN_CHUNK], xw[PERLIN_CHUNK];
+	double sum[PERLIN_CHUNK], ty, yb, d, dx, dy, sc, m, wyy[8], ybb[8];
+	int i, k, l, lvl, b, xi[PERLIN_CHUNK], yp0[8], yp1[8], bpp = MEM_BPP;
 
 	/* Y-dependent values stay same for whole row */
 	dy = 0;
@@ -10962,52 +12540,81 @@ void do_perlin(int start, int step, int cnt, unsigned char *mask,
 	i = 1 << perlin_info.lvl;
 	sc = 255 * i / (M_SQRT2 * 2 * (i - 1));
 
-	x += start - step;
-	start *= bpp; step *= bpp;
-	imgr += start - step;
-
-	while (cnt-- > 0)
+	x += start; mask += start;
+	imgr += start * bpp;
+	for (; cnt > 0; cnt -= l)
 	{
-		imgr += step; x += mstep;
-		if (mask[x] == 255) continue;
-		sum = dx = 0;
-		tx = (double)x / perlin_info.xstep;
-		d = 1;
+		l = cnt < PERLIN_CHUNK ? cnt : PERLIN_CHUNK;
+		for (i = 0; i < l; i++)
+		{
+			tx[i] = (double)(x + i * step) / perlin_info.xstep;
+			sum[i] = 0;
+		}
+
+		/* Octave by octave: positions and fades for the whole run
+		 * first, then gradients, looked up only when crossing into
+		 * the next cell */
+		dx = 0; m = d = 1;
 		for (lvl = 0; lvl < perlin_info.lvl; lvl++)
 		{
-			float *xp0, *xp1, *xp2, *xp3;
-			double xa, yb, wx, wy, dd, dd1;
+			float *xp;
+			double xa, wx, dd, dd1, wy = wyy[lvl];
+			double g0 = 0, g1 = 0, g2 = 0, g3 = 0;
+			double c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+			int a, ca = -1;
 
-			xa = tx + dx;
-			xa -= (a = (int)xa);
-			wx = ((xa * 6.0 - 15.0) * xa + 10.0) * xa * xa * xa;
 			yb = ybb[lvl];
-			wy = wyy[lvl];
-			a += perlin_info.p[lvl] * lvl;
-			b = a + yp0[lvl];
-			xp0 = perlin_info.grad + perlin_info.p[b & 255] * 2;
-			dd = xp0[0] * xa + xp0[1] * yb;
-			xp1 = perlin_info.grad + perlin_info.p[(b + 1) & 255] * 2;
-			dd += wx * (xp1[0] * (xa - 1) + xp1[1] * yb - dd);
-			b = a + yp1[lvl];
-			xp2 = perlin_info.grad + perlin_info.p[b & 255] * 2;
-			dd1 = xp2[0] * xa + xp2[1] * (yb - 1);
-			xp3 = perlin_info.grad + perlin_info.p[(b + 1) & 255] * 2;
-			dd1 += wx * (xp3[0] * (xa - 1) + xp3[1] * (yb - 1) - dd1);
-			sum += (dd + (dd1 - dd) * wy) * d;
-			tx += tx;
+			for (i = 0; i < l; i++)
+			{
+				xa = tx[i] * m + dx;
+				xi[i] = (int)xa;
+				xa -= xi[i];
+				xf[i] = xa;
+				xw[i] = ((xa * 6.0 - 15.0) * xa + 10.0) * xa * xa * xa;
+			}
+			for (i = 0; i < l; i++)
+			{
+				xa = xf[i]; wx = xw[i]; a = xi[i];
+				if (a != ca)
+				{
+					ca = a;
+					a += perlin_info.p[lvl] * lvl;
+					b = a + yp0[lvl];
+					xp = perlin_info.grad + perlin_info.p[b & 255] * 2;
+					g0 = xp[0]; c0 = xp[1] * yb;
+					xp = perlin_info.grad + perlin_info.p[(b + 1) & 255] * 2;
+					g1 = xp[0]; c1 = xp[1] * yb;
+					b = a + yp1[lvl];
+					xp = perlin_info.grad + perlin_info.p[b & 255] * 2;
+					g2 = xp[0]; c2 = xp[1] * (yb - 1);
+					xp = perlin_info.grad + perlin_info.p[(b + 1) & 255] * 2;
+					g3 = xp[0]; c3 = xp[1] * (yb - 1);
+				}
+				dd = g0 * xa + c0;
+				dd += wx * (g1 * (xa - 1) + c1 - dd);
+				dd1 = g2 * xa + c2;
+				dd1 += wx * (g3 * (xa - 1) + c3 - dd1);
+				sum[i] += (dd + (dd1 - dd) * wy) * d;
+			}
+			m += m;
 			d *= 0.5;
 			dx = 0.5; // Dealign levels' anchor grid
 		}
-		k = rint(sum * sc + 0.5 * 255.0);
-		if (bpp == 1) *imgr = k;
-		else
+
+		for (i = 0; i < l; i++ , mask += step , imgr += step * bpp)
 		{
-			k *= 3;
-			imgr[0] = perlin_info.map[k + 0];
-			imgr[1] = perlin_info.map[k + 1];
-			imgr[2] = perlin_info.map[k + 2];
+			if (*mask == 255) continue;
+			k = rint(sum[i] * sc + 0.5 * 255.0);
+			if (bpp == 1) *imgr = k;
+			else
+			{
+				k *= 3;
+				imgr[0] = perlin_info.map[k + 0];
+				imgr[1] = perlin_info.map[k + 1];
+				imgr[2] = perlin_info.map[k + 2];
+			}
 		}
+		x += l * step;
 	}
 }
 
@@ -11019,15 +12626,21 @@ static void perlin_noise(tcb *thread)
 {
 	noised *nd = thread->data;
 	unsigned char *dest, *buf = nd->buf, *mask = nd->mask;
-	int i, ii, cnt = thread->nsteps, bpp = MEM_BPP;
+	int i, ii, j, cnt = thread->nsteps, bpp = MEM_BPP;
 
 	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
 	{
 		row_protected(0, i, mem_width, mask);
-		do_perlin(0, 1, mem_width, mask, buf, 0, i);
-		dest = mem_img[mem_channel] + i * mem_width * bpp;
-		process_img(0, 1, mem_width, mask, dest, dest, buf,
-			NULL, bpp, BLENDF_SET | BLENDF_INVM);
+		dest = mem_img[mem_channel] + (size_t)i * mem_width * bpp;
+		/* Nothing protected - render right into the image */
+		for (j = 0; (j < mem_width) && !mask[j]; j++);
+		if (j == mem_width) do_perlin(0, 1, mem_width, mask, dest, 0, i);
+		else
+		{
+			do_perlin(0, 1, mem_width, mask, buf, 0, i);
+			process_img(0, 1, mem_width, mask, dest, dest, buf,
+				NULL, bpp, BLENDF_SET | BLENDF_INVM);
+		}
 		if (thread_step(thread, ii + 1, cnt, 10)) break;
 	}
 	thread_done(thread);
@@ -22,12 +22,18 @@
 
 /// Definitions, structures & variables
 
+/* Build with -DU_MAXDIM=N to change the limit; up to 65536 is supported.
+ * Image size is not limited to int - whole-image offsets and pixel counts
+ * must be size_t; a single row, or a single tile strip, still fits in int */
+#ifdef U_MAXDIM
+#define MAX_WIDTH U_MAXDIM
+#define MAX_HEIGHT U_MAXDIM
+#else
 #define MAX_WIDTH 16384
 #define MAX_HEIGHT 16384
+#endif
 #define MIN_WIDTH 1
 #define MIN_HEIGHT 1
-/* !!! If MAX_WIDTH * MAX_HEIGHT * max bpp won't fit into int, lots of code
- * !!! will have to be modified to use size_t instead */
 #define MAX_DIM (MAX_WIDTH > MAX_HEIGHT ? MAX_WIDTH : MAX_HEIGHT)
 
 #define DEFAULT_WIDTH 640
@@ -159,8 +165,21 @@ typedef struct {
 	size_t size;		// Total used memory (0 means count it anew)
 } undo_stack;
 
+/* Sparse storage for inactive layers: each channel is cut into square tiles,
+ * and tiles holding nothing but the fill value are not allocated */
+#define SPARSE_SHIFT 6
+#define SPARSE_SIZE (1 << SPARSE_SHIFT)
+
+typedef struct {
+	int tw, th;		// Size in tiles
+	int cmask;		// Channels present
+	unsigned char **tiles[NUM_CHANNELS]; // Tile maps, NULL tile = fill
+	unsigned char fill[NUM_CHANNELS][3]; // Value of unallocated tiles
+} sparse_info;
+
 typedef struct {
 	chanlist img;		// Array of pointers to image channels
+	sparse_info *sparse;	// Packed channels, if img[] is empty
 	png_color pal[256];	// RGB entries for all 256 palette colours
 	int cols;	// Number of colours in the palette: 1..256 or 0 for no image
 	int bpp;		// Bytes per pixel = 1 or 3
@@ -555,9 +574,9 @@ static inline int floor_mod(int dd, int dr)
 
 /// Table-based translation
 
-static inline void do_xlate(unsigned char *xlat, unsigned char *data, int len)
+static inline void do_xlate(unsigned char *xlat, unsigned char *data, size_t len)
 {
-	int i;
+	size_t i;
 
 	for (i = 0; i < len; i++) data[i] = xlat[data[i]];
 }
@@ -664,9 +683,21 @@ int mem_cols_used_real(unsigned char *im, int w, int h, png_color *pal);
 //	Clear/remove image data
 void mem_free_image(image_info *image, int mode);
 
+//	Move image channels into sparse tiles, if that saves enough memory
+int mem_sparse_pack(image_info *image);
+//	Move image channels back into dense buffers
+int mem_sparse_unpack(image_info *image);
+//	Copy a row span out of sparse tiles
+void mem_sparse_row(sparse_info *sp, int bpp, chanlist dest, int x, int y,
+	int w);
+//	Test if image has a channel, packed or not
+#define IMG_HAS(I,C) ((I)->img[C] || \
+	((I)->sparse && ((I)->sparse->cmask & CMASK_FOR(C))))
+
 #define AI_COPY   1 /* Duplicate source channels, not insert them */
 #define AI_NOINIT 2 /* Do not initialize source-less channels */
 #define AI_CLEAR  4 /* Initialize image structure first */
+#define AI_SHARE  8 /* Share source channels copy-on-write, with AI_COPY */
 
 //	Allocate new image data
 int mem_alloc_image(int mode, image_info *image, int w, int h, int bpp,
@@ -728,11 +759,28 @@ void mem_pal_init();			// Initialise whole of palette RGB
 void pal2rgb(unsigned char *rgb, png_color *pal, int cnt, int len);
 //	Pack RGB triples into palette
 void rgb2pal(png_color *pal, unsigned char *rgb, int cnt);
+//	Copy RGB triples, swapping R and B if "bgr" is set
+void copy_run(unsigned char *dest, unsigned char *src, int len,
+	int dstep, int sstep, int bgr);
+//	Copy "bpp" bytes per pixel, from "step" bytes per pixel
+void copy_bytes(unsigned char *dest, unsigned char *src, int len,
+	int bpp, int step);
+//	Scale big-endian 16-bit values down to bytes
+void convert_16b(unsigned char *dest, unsigned char *src, int len,
+	int bpp, int step, int maxval);
+//	Scale 0..maxval values up to 0..255
+void extend_bytes(unsigned char *dest, size_t len, int maxval);
+//	OR a row of 1-bit values into every "step"th byte, as 0x80 >> n
+void or_bitplane(unsigned char *dest, unsigned char *src, int len, int n,
+	int step);
+//	Simple CMYK to RGB conversion, without color management
+void cmyk2rgb_plain(unsigned char *dest, unsigned char *src, size_t cnt,
+	int inverted);
 double pal2B(png_color *c);		// Linear brightness for palette color
 void mem_greyscale(int gcor);		// Convert image to greyscale
 void do_convert_rgb(int start, int step, int cnt, unsigned char *dest,
 	unsigned char *src, png_color *pal);	// Convert image to RGB
-int mem_convert_indexed(unsigned char *dest, unsigned char *src, int cnt,
+int mem_convert_indexed(unsigned char *dest, unsigned char *src, size_t cnt,
 	int cols, png_color *pal);	// Convert image to Indexed Palette
 //	Quantize image using Max-Min algorithm
 int maxminquan(unsigned char *inbuf, int width, int height, int quant_to,
@@ -795,7 +843,8 @@ enum {
 	UNDO_TRANS	/* Transparent colour change (cumulative) */
 };
 
-void mem_undo_next(int mode);	// Call this after a draw event but before any changes to image
+int mem_undo_next(int mode);	// Call this after a draw event but before any changes to image;
+				// if it returns nonzero, the image must not be changed
 //	 Get address of previous channel data (or current if none)
 unsigned char *mem_undo_previous(int channel);
 void mem_undo_prepare();	// Call this after changes to image, to compress last frame
@@ -810,6 +859,8 @@ void mem_do_undo(int redo);	// Undo or redo requested by user
 #define UC_ACCUM   0x20 /* Cumulative change */
 #define UC_RESET   0x40 /* Delete all, create flagged */
 
+/* Returns 0 if all is well, 1 or 2 if no undo (in case of memory_errors()),
+ * 3 if channels shared with another image could not be split off either */
 int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cmask);
 void update_undo(image_info *image);	// Copy image state into current undo frame
 //	Try to allocate a memory block, releasing undo frames if needed
@@ -836,13 +887,15 @@ void mem_smudge(int ox, int oy, int nx, int ny);
 //	Apply colour transform
 void do_transform(int start, int step, int cnt, unsigned char *mask,
 	unsigned char *imgr, unsigned char *img0, int m0);
+int mem_transform_image();	// Apply color transform to RGB image
 
 //	Apply thresholding
 void do_xhold(int start, int step, int cnt, unsigned char *mask,
 	unsigned char *imgr, unsigned char *img0);
+int mem_xhold();	// Apply thresholding to current channel
 
-void mem_flip_v(char *mem, char *tmp, int w, int h, int bpp);	// Flip image vertically
-void mem_flip_h( char *mem, int w, int h, int bpp );		// Flip image horizontally
+void mem_flip_v(unsigned char *mem, int w, int h, int bpp);		// Flip image vertically
+void mem_flip_h(unsigned char *mem, int w, int h, int bpp);		// Flip image horizontally
 int mem_sel_rot( int dir );					// Rotate clipboard 90 degrees
 int mem_image_rot( int dir );					// Rotate canvas 90 degrees
 
@@ -866,12 +919,16 @@ int mem_image_resize(int nw, int nh, int ox, int oy, int mode);	// Resize image
 
 int mem_isometrics(int type);
 
-void mem_threshold(unsigned char *img, int len, int level);	// Threshold channel values
-void mem_demultiply(unsigned char *img, unsigned char *alpha, int len, int bpp);
+//	Run per-pixel function over a run of pixels, in parallel if possible
+typedef void (*span_func)(void *data, size_t ofs, size_t len);
+void mem_span_map(span_func func, void *data, size_t len);
+
+void mem_threshold(unsigned char *img, size_t len, int level);	// Threshold channel values
+void mem_demultiply(unsigned char *img, unsigned char *alpha, size_t len, int bpp);
 
 void set_xlate_n(unsigned char *xlat, int n);			// Build value rescaling table
 #define set_xlate(A,B) set_xlate_n((A), (1 << (B)) - 1)		/* Bitdepth translation table */
-int is_filled(unsigned char *data, unsigned char val, int len);	// Check if byte array is all one value
+int is_filled(unsigned char *data, unsigned char val, size_t len);	// Check if byte array is all one value
 
 int flood_fill(int x, int y, unsigned int target);
 
@@ -919,11 +976,13 @@ int pixel_protected(int x, int y);				// generic
 void row_protected(int x, int y, int len, unsigned char *mask);
 void put_pixel_def( int x, int y );				// generic
 void put_pixel_row_def(int x, int y, int len, unsigned char *xsel); // generic
+void put_pixel_batch(int start);	// Start/end queueing rows for the above
 int get_pixel( int x, int y );					// generic
 int get_pixel_RGB( int x, int y );				// converter
 int get_pixel_img( int x, int y );				// from image
 
 int grad_value(int *dest, int slot, double x);
+int grad_lut_update();
 void grad_pixels(int start, int step, int cnt, int x, int y, unsigned char *mask,
 	unsigned char *op0, unsigned char *img0, unsigned char *alpha0);
 void grad_update(grad_info *grad);
@@ -952,7 +1011,7 @@ int average_pixels(unsigned char *rgb, unsigned char *alpha, int iw, int *vxy);
 #define SEG_PROGRESS 1
 
 typedef struct {
-	int which; // Pixel index * 2 + (0 if right / 1 if down)
+	unsigned int which; // Pixel index * 2 + (0 if right / 1 if down)
 	float diff;
 } seg_edge;
 
@@ -967,7 +1026,8 @@ typedef struct {
 	/* Working set */
 	seg_edge *edges;
 	seg_pixel *pix;
-	int w, h, cnt;
+	int w, h;
+	size_t cnt;
 	int phase; // Which phase is currently valid
 	/* Parameters */
 	int minrank;
@@ -977,7 +1037,7 @@ typedef struct {
 
 seg_state *mem_seg_prepare(seg_state *s, unsigned char *img, int w, int h,
 	int flags, int cspace, int dist);
-int mem_seg_process_chunk(int start, int cnt, seg_state *s);
+size_t mem_seg_process_chunk(size_t start, size_t cnt, seg_state *s);
 int mem_seg_process(seg_state *s);
 double mem_seg_threshold(seg_state *s);
 void mem_seg_scan(unsigned char *dest, int y, int x, int w, int zoom,
@@ -527,7 +527,7 @@ void *spin1_code[] = { SPINa(n), RET };
 static int do_bacteria(spin1_dd *dt, void **wdata)
 {
 	run_query(wdata);
-	spot_undo(UNDO_FILT);
+	if (spot_undo(UNDO_FILT)) return (FALSE);
 	mem_bacteria(dt->n[0]);
 	mem_undo_prepare();
 	return (FALSE);
@@ -560,7 +560,7 @@ static void spal_evt(spal_dd *dt, void **wdata, int what)
 
 	if (index1 != index2)
 	{
-		spot_undo(UNDO_XPAL);
+		if (spot_undo(UNDO_XPAL)) return;
 		mem_pal_sort(spal_mode, index1, index2, dt->rev);
 		mem_undo_prepare();
 		update_stuff(UPD_TPAL);
@@ -673,47 +673,30 @@ static void brcosa_moved(brcosa_dd *dt, void **wdata, int what, void **where)
 
 static void brcosa_btn(brcosa_dd *dt, void **wdata, int what)
 {
-	unsigned char *mask, *mask0, *tmp, *xbuf;
-	int i;
-
 	mem_pal_copy(mem_pal, dt->pal);
 
 	if (what == op_EVT_CANCEL); 
 	else if (!dt->tmode) // OK/Apply
 	{
 		// !!! Buttons disabled for default values
-		spot_undo(UNDO_COL);
-
-		run_query(wdata); // This may modify palette if preview active
-
-		brcosa_preview(dt, NULL); // This definitely modifies it
-		while (mem_preview && (mem_img_bpp == 3)) // This modifies image
+		if (!spot_undo(UNDO_COL))
 		{
-			mask = malloc(mem_width * 4);
-			if (!mask) break;
-			xbuf = mask + mem_width;
-			mask0 = NULL;
-			if (!channel_dis[CHN_MASK]) mask0 = mem_img[CHN_MASK];
-			tmp = mem_img[CHN_IMAGE];
-			for (i = 0; i < mem_height; i++)
+			run_query(wdata); // This may modify palette if preview active
+
+			brcosa_preview(dt, NULL); // This definitely modifies it
+			if (mem_preview && (mem_img_bpp == 3)) // This modifies image
+				mem_transform_image();
+			if (mem_preview_clip && (mem_img_bpp == 3) && (mem_clip_bpp == 3))
 			{
-				prep_mask(0, 1, mem_width, mask, mask0, tmp);
-				do_transform(0, 1, mem_width, mask, xbuf, tmp, 255);
-				process_img(0, 1, mem_width, mask, tmp, tmp, xbuf,
-					NULL, 3, BLENDF_SET | BLENDF_INVM);
-				if (mask0) mask0 += mem_width;
-				tmp += mem_width * 3;
+				unsigned char *tmp = mem_clipboard;
+				int i;
+
+				// This modifies clipboard
+				for (i = 0; i < mem_clip_h; i++ , tmp += mem_clip_w * 3)
+					do_transform(0, 1, mem_clip_w, NULL, tmp, tmp, 0);
 			}
-			free(mask);
-			break;
-		}
-		if (mem_preview_clip && (mem_img_bpp == 3) && (mem_clip_bpp == 3))
-		{
-			// This modifies clipboard
-			do_transform(0, 1, mem_clip_w * mem_clip_h, NULL,
-				mem_clipboard, mem_clipboard, 0);
+			mem_undo_prepare();
 		}
-		mem_undo_prepare();
 	}
 	else // OK/Apply for transform mode
 	{
@@ -910,13 +893,13 @@ static void sisca_moved(sisca_dd *dt, void **wdata, int what, void **where)
 	w = dt->w; h = dt->h;
 	if (!idx)
 	{
-		nw = (h * mem_width * 2 + mem_height) / (mem_height * 2);
+		nw = ((double)h * mem_width * 2 + mem_height) / (mem_height * 2);
 		nw = nw < 1 ? 1 : nw > MAX_WIDTH ? MAX_WIDTH : nw;
 		if (nw == w) return;
 	}
 	else
 	{
-		nw = (w * mem_height * 2 + mem_width) / (mem_width * 2);
+		nw = ((double)w * mem_height * 2 + mem_width) / (mem_width * 2);
 		nw = nw < 1 ? 1 : nw > MAX_HEIGHT ? MAX_HEIGHT : nw;
 		if (nw == h) return;
 	}
@@ -975,7 +958,7 @@ static void click_sisca_ok(sisca_dd *dt, void **wdata)
 
 void memory_errors(int type)
 {
-	if ( type == 1 )
+	if ((type == 1) || (type == 3))
 		alert_box(_("Error"), _("The operating system cannot allocate the memory for this operation."), NULL);
 	if ( type == 2 )
 		alert_box(_("Error"), _("You have not allocated enough memory in the Preferences window for this operation."), NULL);
@@ -1946,7 +1929,7 @@ static void click_quantize_ok(quantize_dd *dt, void **wdata)
 	case QUAN_EXACT: /* Use image colours */
 		new_cols = quantize_cols;
 		if (have_image) err = mem_convert_indexed(mem_img[CHN_IMAGE],
-			old_image, mem_width * mem_height, new_cols, newpal);
+			old_image, (size_t)mem_width * mem_height, new_cols, newpal);
 		dither = DITH_MAX;
 		break;
 	default:
@@ -2779,7 +2762,7 @@ typedef struct {
 	int cspace, dist;
 	int threshold, rank, size[3];
 	int preview, progress;
-	int step;
+	size_t step;
 	void **tspin, **pbutton;
 	seg_state *s;
 } seg_dd;
@@ -2887,9 +2870,8 @@ static void seg_evt(seg_dd *dt, void **wdata, int what, void **where)
 		seg_minsize = dt->size[0];
 
 		/* Now, finish segmentation & render results */
-		if (seg_process(dt))
+		if (seg_process(dt) && !spot_undo(UNDO_FILT))
 		{
-			spot_undo(UNDO_FILT);
 			mem_seg_render(mem_img[CHN_IMAGE], dt->s);
 			mem_undo_prepare();
 			update |= UPD_IMG;
@@ -2932,7 +2914,8 @@ void pressed_segment()
 {
 	seg_dd tdata;
 	seg_state *s;
-	int progress = 0, sz = mem_width * mem_height;
+	size_t sz = (size_t)mem_width * mem_height;
+	int progress = 0;
 
 
 	if (sz == 1) return; /* 1 pixel in image is trivial - do nothing */
@@ -2992,7 +2975,7 @@ static void xhold_changed(xhold_dd *dt, void **wdata, int what, void **where)
 
 static void xhold_evt(xhold_dd *dt, void **wdata, int what, void **where)
 {
-	int update = 0;
+	int res, update = 0;
 
 	if (what == op_EVT_CHANGE) // Toggle preview
 	{
@@ -3007,30 +2990,16 @@ static void xhold_evt(xhold_dd *dt, void **wdata, int what, void **where)
 	if (xhold_preview) update = UPD_RENDER;
 	xhold_preview = FALSE;
 
-	while (what == op_EVT_OK)
+	if (what == op_EVT_OK)
 	{
-		unsigned char *dest, *xbuf, *mask;
-		int i, bpp = MEM_BPP;
-
 		run_query(wdata); // Update parameters
-		mask = malloc(mem_width * (bpp + 1));
-		if (!mask) break;
-		spot_undo(UNDO_FILT);
-		xbuf = mask + mem_width;
-
-		for (i = 0; i < mem_height; i++)
+		res = mem_xhold(); // Does its own undo step
+		if (res > 0) memory_errors(1);
+		else if (!res)
 		{
-			row_protected(0, i, mem_width, mask);
-			dest = mem_img[mem_channel] + i * mem_width * bpp;
-			do_xhold(0, 1, mem_width, mask, xbuf, dest);
-			process_img(0, 1, mem_width, mask, dest, dest, xbuf,
-				NULL, bpp, BLENDF_SET | BLENDF_INVM);
+			mem_undo_prepare();
+			update |= UPD_IMG | CF_MENU;
 		}
-
-		free(mask);
-		mem_undo_prepare();
-		update |= UPD_IMG;
-		break;
 	}
 
 	run_destroy(wdata); // Finished
@@ -3076,12 +3045,12 @@ void pressed_xhold()
 /// NOISE WINDOW
 
 int noise_preview;
-static int noise_seed, noise_map;
+static int noise_seed, noise_map, noise_newl;
 static int noise_xs = 256, noise_ys = 256, noise_lvl = 1;
 
 typedef struct {
 	int xs, ys, lvl, seed, map, preview;
-	int rgb;
+	int rgb, newl;
 	char **ncp, *nc[5];
 	void **sspin, **xspin, **yspin, **lspin, **copt, **pbutton;
 } noise_dd;
@@ -3107,6 +3076,7 @@ static void noise_evt(noise_dd *dt, void **wdata, int what, void **where)
 		noise_xs = dt->xs;
 		noise_ys = dt->ys;
 		noise_lvl = dt->lvl;
+		noise_newl = dt->newl;
 	}
 
 	if (what != op_EVT_CANCEL)
@@ -3127,7 +3097,14 @@ static void noise_evt(noise_dd *dt, void **wdata, int what, void **where)
 
 	while (what == op_EVT_OK)
 	{
-		spot_undo(UNDO_FILT);
+		/* Render into a new layer, of same size and type */
+		if (dt->newl)
+		{
+			if (!layer_add(mem_width, mem_height, mem_img_bpp,
+				mem_cols, mem_pal, CMASK_IMAGE)) break;
+			layer_show_new();
+		}
+		if (spot_undo(UNDO_FILT)) break;
 		mem_perlin();
 		mem_undo_prepare();
 		update |= UPD_IMG;
@@ -3151,6 +3128,7 @@ static void *noise_code[] = {
 		REF(copt), TOPTDe(_("Colours"), ncp, map, noise_changed),
 	ENDIF(1),
 	WDONE,
+	CHECK(_("New layer"), newl),
 	HSEP,
 	EQBOX,
 	CANCELBTN(_("Cancel"), noise_evt),
@@ -3163,8 +3141,9 @@ static void *noise_code[] = {
 void pressed_noise()
 {
 	noise_dd tdata = { noise_xs, noise_ys, noise_lvl, noise_seed, noise_map,
-		FALSE, MEM_BPP == 3, tdata.nc, { _("Greyscale"), _("Gradient"),
-		_("Palette"), mem_clipboard ? _("Clipboard") : "", NULL } };
+		FALSE, MEM_BPP == 3, noise_newl, tdata.nc, { _("Greyscale"),
+		_("Gradient"), _("Palette"), mem_clipboard ? _("Clipboard") : "",
+		NULL } };
 
 	run_create_(noise_code, &tdata, sizeof(tdata), script_cmds);
 }
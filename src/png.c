@@ -118,6 +118,7 @@ typedef struct {
 int silence_limit, jpeg_quality, png_compression;
 int tga_RLE, tga_565, tga_defdir, jp2_rate;
 int lzma_preset, zstd_level, tiff_predictor, tiff_rtype, tiff_itype, tiff_btype;
+int tiff_tiled;
 int webp_preset, webp_quality, webp_compression;
 int lbm_mask, lbm_untrans, lbm_pack, lbm_pbm;
 int apply_icc;
@@ -306,7 +307,7 @@ static int allocate_image(ls_settings *settings, int cmask)
 		return (TOO_BIG);
 
 	/* Don't show progress bar where there's no need */
-	if (settings->width * settings->height <= (1 << silence_limit))
+	if ((size_t)settings->width * settings->height <= (1 << silence_limit))
 		settings->silent = TRUE;
 	if (mode == FS_PATTERN_LOAD) settings->silent = TRUE;
 
@@ -430,7 +431,7 @@ static void deallocate_image(ls_settings *settings, int cmask)
 static void delete_alpha(ls_settings *settings, int v)
 {
 	if (settings->img[CHN_ALPHA] && is_filled(settings->img[CHN_ALPHA], v,
-		settings->width * settings->height))
+		(size_t)settings->width * settings->height))
 		deallocate_image(settings, CMASK_ALPHA);
 }
 
@@ -539,26 +540,13 @@ static int mfputss(memFILE *mf, const char *s, ...)
 	return (m);
 }
 
-static void copy_run(unsigned char *dest, unsigned char *src, int len,
-	int dstep, int sstep, int bgr)
-{
-	if (bgr) bgr = 2;
-	while (len-- > 0)
-	{
-		dest[0] = src[bgr];
-		dest[1] = src[1];
-		dest[2] = src[bgr ^ 2];
-		dest += dstep;
-		src += sstep;
-	}
-}
-
 /* Fills temp buffer row, or returns image row if no buffer */
 static unsigned char *prepare_row(unsigned char *buf, ls_settings *settings,
 	int bpp, int y)
 {
 	unsigned char *tmp, *tmi, *tma, *tms;
-	int i, j, w = settings->width, h = y * w;
+	size_t h = (size_t)y * settings->width;
+	int i, j, w = settings->width;
 	int bgr = (settings->ftype == FT_BMP) || (settings->ftype == FT_TGA) ? 2 : 0;
 
 	tmi = settings->img[CHN_IMAGE] + h * settings->bpp;
@@ -888,8 +876,8 @@ static int load_png(char *file_name, ls_settings *settings, memFILE *mf, int fra
 				{
 					png_read_rows(png_ptr, &row_pointers[0], NULL, 1);
 					src = row_pointers[0];
-					dest = settings->img[CHN_IMAGE] + (i * width + x0) * 3;
-					dsta = settings->img[CHN_ALPHA] + i * width;
+					dest = settings->img[CHN_IMAGE] + ((size_t)i * width + x0) * 3;
+					dsta = settings->img[CHN_ALPHA] + (size_t)i * width;
 					for (j = x0; j < width; j += dx)
 					{
 						dest[0] = src[0];
@@ -908,7 +896,7 @@ static int load_png(char *file_name, ls_settings *settings, memFILE *mf, int fra
 			png_set_strip_alpha(png_ptr);
 			for (i = 0; i < height; i++)
 			{
-				row_pointers[i] = settings->img[CHN_IMAGE] + i * width * 3;
+				row_pointers[i] = settings->img[CHN_IMAGE] + (size_t)i * width * 3;
 			}
 			png_read_image(png_ptr, row_pointers);
 		}
@@ -934,7 +922,7 @@ static int load_png(char *file_name, ls_settings *settings, memFILE *mf, int fra
 			png_set_gray_1_2_4_to_8(png_ptr);
 		for (i = 0; i < height; i++)
 		{
-			row_pointers[i] = settings->img[CHN_IMAGE] + i * width;
+			row_pointers[i] = settings->img[CHN_IMAGE] + (size_t)i * width;
 		}
 		png_read_image(png_ptr, row_pointers);
 	}
@@ -962,7 +950,7 @@ static int load_png(char *file_name, ls_settings *settings, memFILE *mf, int fra
 			/* Skip if not allocated */
 			if (!settings->img[j]) continue;
 
-			dest_len = width * height;
+			dest_len = (long)width * height;
 			uncompress(settings->img[j], &dest_len, uk_p[i].data,
 				uk_p[i].size);
 		}
@@ -1014,7 +1002,7 @@ static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 	FILE *fp = NULL;
 	int h = settings->height, w = settings->width, bpp = settings->bpp;
 	int i, j, res = -1;
-	long uninit_(dest_len), res_len;
+	long uninit_(dest_len), res_len, wh;
 	char *mess = NULL;
 	unsigned char trans[256], *tmp, *rgba_row = NULL;
 	png_color_16 trans_rgb;
@@ -1120,11 +1108,11 @@ static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 		if (!tmp)
 		{
 			/* Get size required for each zlib compress */
-			w = settings->width * settings->height;
+			wh = (long)settings->width * settings->height;
 #if ZLIB_VERNUM >= 0x1200
-			dest_len = compressBound(w);
+			dest_len = compressBound(wh);
 #else
-			dest_len = w + (w >> 8) + 32;
+			dest_len = wh + (wh >> 8) + 32;
 #endif
 			res = -1;
 			tmp = malloc(dest_len);	  // Temporary space for compression
@@ -1132,7 +1120,7 @@ static int save_png(char *file_name, ls_settings *settings, memFILE *mf)
 			res = 0;
 		}
 		res_len = dest_len;
-		if (compress2(tmp, &res_len, settings->img[i], w,
+		if (compress2(tmp, &res_len, settings->img[i], wh,
 			settings->png_compression) != Z_OK) continue;
 		strncpy(unknown0.name, chunk_names[i], 5);
 		unknown0.data = tmp;
@@ -1396,7 +1384,9 @@ static void composite_rgba_frame(image_frame *frame, ani_status *stat,
 	unsigned char *dest, *src, *dsta, *srca, *bg, *bga, *lmap = stat->lmap;
 	image_frame *bkf = &stat->prev;
 	int rxy[4] = { 0, 0, frame->width, frame->height };
-	int x, y, w, bgw, bgoff, fgw, ww, fgoff, dstoff, bpp, tr;
+	ptrdiff_t bgoff;
+	size_t fgoff, dstoff;
+	int x, y, w, bgw, fgw, ww, bpp, tr;
 
 
 	/* Do the mixing if source is present */
@@ -1404,7 +1394,7 @@ static void composite_rgba_frame(image_frame *frame, ani_status *stat,
 
 	w = frame->width;
 	bgw = bkf->width;
-	bgoff = bkf->y * bgw + bkf->x;
+	bgoff = (ptrdiff_t)bkf->y * bgw + bkf->x;
 	bpp = bkf->bpp;
 	if (bpp == 1) pal2rgb(pal, bkf->pal, bkf->cols, 256);
 
@@ -1455,8 +1445,8 @@ static void composite_rgba_frame(image_frame *frame, ani_status *stat,
 	/* Then, paste it over */
 	fgw = settings->width;
 	ww = rxy[2] - rxy[0];
-	fgoff = (rxy[1] - settings->y) * fgw + (rxy[0] - settings->x);
-	dstoff = rxy[1] * w + rxy[0];
+	fgoff = (size_t)(rxy[1] - settings->y) * fgw + (rxy[0] - settings->x);
+	dstoff = (size_t)rxy[1] * w + rxy[0];
 	memset(alpha, 255, ww);
 	tr = settings->rgb_trans;
 	for (y = rxy[1]; y < rxy[3]; y++)
@@ -1518,7 +1508,7 @@ static void composite_frame(frameset *fset, ani_status *stat, ls_settings *setti
 
 		/* Drop alpha if not used */
 		if (frame->img[CHN_ALPHA] && is_filled(frame->img[CHN_ALPHA], 255,
-			frame->width * frame->height))
+			(size_t)frame->width * frame->height))
 		{
 			free(frame->img[CHN_ALPHA]);
 			frame->img[CHN_ALPHA] = NULL;
@@ -1842,7 +1832,7 @@ static int png_scan(FILE *fp, pnghead *pg)
 static int load_apng_frame(FILE *fp, pnghead *pg, ls_settings *settings)
 {
 	unsigned char *w;
-	int l, res;
+	int i, l, res;
 
 	/* Try scanning the frame */
 	res = png_scan(fp, pg);
@@ -1855,10 +1845,13 @@ static int load_apng_frame(FILE *fp, pnghead *pg, ls_settings *settings)
 	w = settings->img[CHN_ALPHA];
 	if ((settings->bpp == 1) && w)
 	{
-		l = settings->width * settings->height;
-		w = malloc((size_t)l * 3);
+		l = settings->width;
+		w = malloc((size_t)l * settings->height * 3);
 		if (!w) return (FILE_MEM_ERROR); // No memory
-		do_convert_rgb(0, 1, l, w, settings->img[CHN_IMAGE], settings->pal);
+		for (i = 0; i < settings->height; i++)
+			do_convert_rgb(0, 1, l, w + (size_t)i * l * 3,
+				settings->img[CHN_IMAGE] + (size_t)i * l,
+				settings->pal);
 		free(settings->img[CHN_IMAGE]);
 		settings->img[CHN_IMAGE] = w;
 		settings->bpp = 3;
@@ -2414,7 +2407,7 @@ static int load_gif_frame(FILE *fp, ls_settings *settings)
 		dy = interlace[k + 1];
 		for (i = interlace[k]; i < h; n++ , i += dy)
 		{
-			if (!getlzw(settings->img[CHN_IMAGE] + i * w, w, &gif))
+			if (!getlzw(settings->img[CHN_IMAGE] + (size_t)i * w, w, &gif))
 				goto fail;
 			ls_progress(settings, n, 10);
 		}
@@ -2800,7 +2793,7 @@ static int save_gif(char *file_name, ls_settings *settings)
 	initclzw(&gif, nc + 1, fp); // "Min code size" = palette index bits
 	for (i = 0; i < h; i++)
 	{
-		putlzw(&gif, settings->img[CHN_IMAGE] + i * w, w);
+		putlzw(&gif, settings->img[CHN_IMAGE] + (size_t)i * w, w);
 		ls_progress(settings, i, 20);
 	}
 	donelzw(&gif);
@@ -2852,12 +2845,9 @@ static void done_cmyk2rgb(ls_settings *settings)
 #endif
 #endif
 
-static void cmyk2rgb(unsigned char *dest, unsigned char *src, int cnt,
+static void cmyk2rgb(unsigned char *dest, unsigned char *src, size_t cnt,
 	int inverted, ls_settings *settings)
 {
-	unsigned char xb;
-	int j, k, r, g, b;
-
 #ifdef U_LCMS
 	/* Convert CMYK to RGB using LCMS if possible */
 	if (settings->icc_size == -2)
@@ -2866,18 +2856,7 @@ static void cmyk2rgb(unsigned char *dest, unsigned char *src, int cnt,
 		return;
 	}
 #endif
-	/* Simple CMYK->RGB conversion */
-	xb = inverted ? 0 : 255;
-	for (j = 0; j < cnt; j++ , src += 4 , dest += 3)
-	{
-		k = src[3] ^ xb;
-		r = (src[0] ^ xb) * k;
-		dest[0] = (r + (r >> 8) + 1) >> 8;
-		g = (src[1] ^ xb) * k;
-		dest[1] = (g + (g >> 8) + 1) >> 8;
-		b = (src[2] ^ xb) * k;
-		dest[2] = (b + (b >> 8) + 1) >> 8;
-	}
+	cmyk2rgb_plain(dest, src, cnt, inverted);
 }
 
 #ifdef U_JPEG
@@ -3007,7 +2986,7 @@ static int load_jpeg(char *file_name, ls_settings *settings)
 
 	for (i = 0; i < height; i++)
 	{
-		memp = settings->img[CHN_IMAGE] + width * i * bpp;
+		memp = settings->img[CHN_IMAGE] + (size_t)width * i * bpp;
 		jpeg_read_scanlines(&cinfo, memx ? &memx : &memp, 1);
 		if (memx) cmyk2rgb(memp, memx, width, inv, settings);
 		ls_progress(settings, i, 20);
@@ -3198,7 +3177,8 @@ static opj_image_t *prepare_opj(ls_settings *settings)
 	opj_image_cmptparm_t channels[4];
 	opj_image_t *image;
 	unsigned char *src;
-	int i, j, k, nc, step;
+	size_t j, k;
+	int i, nc, step;
 	int *dest, w = settings->width, h = settings->height;
 
 	nc = settings->img[CHN_ALPHA] ? 4 : 3;
@@ -3222,7 +3202,7 @@ static opj_image_t *prepare_opj(ls_settings *settings)
 	image->x1 = w; image->y1 = h;
 
 	/* Fill it */
-	k = w * h;
+	k = (size_t)w * h;
 	for (i = 0; i < nc; i++)
 	{
 		if (i < 3)
@@ -3746,9 +3726,6 @@ static void pack_MSB(unsigned char *dest, unsigned char *src, int len, int bw)
 		dest[i >> 3] |= (*src++ == bw) << (~i & 7);
 }
 
-static void copy_bytes(unsigned char *dest, unsigned char *src, int len,
-	int bpp, int step);
-
 #ifdef U_TIFF
 
 /* *** PREFACE ***
@@ -3802,7 +3779,271 @@ void init_tiff_formats()	// Check what libtiff can handle
 #endif
 }
 
-static int load_tiff_frame(TIFF *tif, ls_settings *settings)
+#ifndef TIFF_VERSION_BIG /* The ONLY useful way to detect libtiff 4.x vs 3.x */
+#define tmsize_t tsize_t
+#endif
+
+static tmsize_t mTIFFread(thandle_t fd, void* buf, tmsize_t size)
+{
+	return mfread(buf, 1, size, (memFILE *)fd);
+}
+
+static tmsize_t mTIFFwrite(thandle_t fd, void* buf, tmsize_t size)
+{
+	return mfwrite(buf, 1, size, (memFILE *)fd);
+}
+
+static toff_t mTIFFlseek(thandle_t fd, toff_t off, int whence)
+{
+	return mfseek((memFILE *)fd, (f_long)off, whence) ? -1 : ((memFILE *)fd)->m.here;
+}
+
+static int mTIFFclose(thandle_t fd)
+{
+	return 0;
+}
+
+static toff_t mTIFFsize(thandle_t fd)
+{
+	return ((memFILE *)fd)->top;
+}
+
+static int mTIFFmap(thandle_t fd, void** base, toff_t* size)
+{
+	*base = ((memFILE *)fd)->m.buf;
+	*size = ((memFILE *)fd)->top;
+	return 1;
+}
+
+static void mTIFFunmap(thandle_t fd, void* base, toff_t size)
+{
+}
+
+/* Tile/strip decoding context */
+typedef struct {
+	ls_settings *settings;
+	TIFF *tif;
+	memFILE *mf;
+	unsigned char *buf, *tbuf, *xtable;
+	uint32 width, height, xstep, ystep;
+	int tw, bsz, bpr, mirror, bpp, wbpp, bpsamp;
+	int bits1, bit0, db, planar, nplanes;
+	int dir, pr, tpr, n, nx, res;
+} tiff_rtiles;
+
+/* Read and decode one tile or strip */
+static int tiff_read_piece(tiff_rtiles *rt, TIFF *tif, unsigned char *buf,
+	uint32 x0, uint32 y0, int plane)
+{
+	ls_settings *settings = rt->settings;
+	unsigned char *src, *tmp, *tmpa, *tbuf = rt->tbuf;
+	uint32 x, y, w, h, l, width = rt->width, height = rt->height;
+	uint32 xstep = rt->xstep, ystep = rt->ystep;
+	size_t i;
+	int k, dx, dxa, dy, dys, bpp = rt->bpp, wbpp = rt->wbpp;
+	int mirror = rt->mirror, bits1 = rt->bits1, db = rt->db;
+
+
+	/* Read one piece */
+	if (rt->tw)
+	{
+		if (TIFFReadTile(tif, buf, x0, y0, 0, plane) < 0)
+			return (FALSE);
+	}
+	else
+	{
+		if (TIFFReadEncodedStrip(tif, TIFFComputeStrip(tif, y0, plane),
+			buf, rt->bsz) < 0) return (FALSE);
+	}
+
+	/* Prepare decoding loops */
+	if (mirror & 1) /* X mirror */
+	{
+		x = width - x0;
+		w = x < xstep ? x : xstep;
+		x -= w;
+	}
+	else
+	{
+		x = x0;
+		w = x + xstep > width ? width - x : xstep;
+	}
+	if (mirror & 2) /* Y mirror */
+	{
+		y = height - y0;
+		h = y < ystep ? y : ystep;
+		y -= h;
+	}
+	else
+	{
+		y = y0;
+		h = y + ystep > height ? height - y : ystep;
+	}
+
+	/* Prepare pointers */
+	dx = dxa = 1; dy = width;
+	i = (size_t)y * width + x;
+	tmp = tmpa = settings->img[CHN_ALPHA] + i;
+	if (plane >= wbpp); // Alpha
+	else if (tbuf) // CMYK
+	{
+		dx = 4; dy = w;
+		tmp = tbuf + plane;
+	}
+	else // RGB/indexed
+	{
+		dx = bpp;
+		tmp = settings->img[CHN_IMAGE] + plane + i * bpp;
+	}
+	dy *= dx; dys = rt->bpr;
+	src = buf;
+	/* Account for horizontal mirroring */
+	if (mirror & 1)
+	{
+		// Write bytes backward
+		tmp += (w - 1) * dx; tmpa += w - 1;
+		dx = -dx; dxa = -1;
+	}
+	/* Account for vertical mirroring */
+	if (mirror & 2)
+	{
+		// Read rows backward
+		src += (h - 1) * dys;
+		dys = -dys;
+	}
+
+	/* Decode it */
+	for (l = 0; l < h; l++ , src += dys , tmp += dy)
+	{
+		if (rt->pr && ((rt->n * 10) % rt->nx >= rt->nx - 10))
+			progress_update((float)rt->n / rt->nx);
+		rt->n++;
+
+		stream_MSB(src, tmp, w, bits1, rt->bit0, db, dx);
+		if (rt->planar) continue;
+		for (k = 1; k < wbpp; k++)
+		{
+			stream_MSB(src, tmp + k, w, bits1,
+				rt->bit0 + rt->bpsamp * k, db, dx);
+		}
+		if (settings->img[CHN_ALPHA])
+		{
+			stream_MSB(src, tmpa, w, bits1,
+				rt->bit0 + rt->bpsamp * wbpp, db, dxa);
+			tmpa += width;
+		}
+	}
+
+	/* Convert CMYK to RGB if needed */
+	if (!tbuf || (rt->planar && (plane != 3))) return (TRUE);
+	if (bits1 < 8)	// Rescale to 8-bit
+		do_xlate(rt->xtable, tbuf, (size_t)w * h * 4);
+	cmyk2rgb(tbuf, tbuf, (size_t)w * h, FALSE, settings);
+	src = tbuf;
+	tmp = settings->img[CHN_IMAGE] + ((size_t)y * width + x) * 3;
+	w *= 3;
+	for (l = 0; l < h; l++ , tmp += width * 3 , src += w)
+		memcpy(tmp, src, w);
+	return (TRUE);
+}
+
+/* Read a row of tiles */
+static int tiff_read_row(tiff_rtiles *rt, TIFF *tif, unsigned char *buf,
+	uint32 y0)
+{
+	uint32 x0;
+	int plane;
+
+	for (x0 = 0; x0 < rt->width; x0 += rt->xstep)
+	for (plane = 0; plane < rt->nplanes; plane++)
+		if (!tiff_read_piece(rt, tif, buf, x0, y0, plane)) return (FALSE);
+	return (TRUE);
+}
+
+/* Tiles are decoded in parallel, each thread reading through its own libtiff
+ * handle; rows a thread could not do get redone by the main thread */
+static void tiff_read_tiles(tcb *thread)
+{
+	tiff_rtiles *rt = thread->data;
+	TIFF *tif = rt->tif;
+	memFILE mf;
+	int i, cnt = thread->nsteps;
+
+
+	rt->res = FALSE;
+	if (!cnt) goto done;
+	if (thread->index)
+	{
+		if (!rt->mf) tif = TIFFOpen(TIFFFileName(rt->tif), "r");
+		else
+		{
+			/* Share the data block, but not the position */
+			mf = *rt->mf;
+			mf.m.here = 0;
+			tif = TIFFClientOpen("", "r", (void *)&mf, mTIFFread,
+				mTIFFwrite, mTIFFlseek, mTIFFclose, mTIFFsize,
+				mTIFFmap, mTIFFunmap);
+		}
+		if (!tif) goto done;
+		if (!TIFFSetDirectory(tif, rt->dir)) goto fail;
+	}
+	for (i = 0; i < cnt; i++)
+	{
+		if (!tiff_read_row(rt, tif, rt->buf,
+			(thread->step0 + i) * rt->ystep)) break;
+		/* Loading isn't cancellable */
+		if (rt->tpr) thread_step(thread, i + 1, cnt, 10);
+	}
+	rt->res = i >= cnt;
+fail:	if (tif != rt->tif) TIFFClose(tif);
+done:	thread_done(thread);
+}
+
+static int tiff_read_threaded(tiff_rtiles *rt)
+{
+	threaddata *tdata;
+	tiff_rtiles *tp;
+	int i, j, nt, pr, ny = (rt->height + rt->ystep - 1) / rt->ystep;
+
+
+	nt = image_threads(rt->width, rt->height);
+	if (nt > ny) nt = ny;
+	if (nt < 2) return (FALSE);
+	/* Progress by rows of tiles, from thread 0 only */
+	pr = rt->tpr = rt->pr;
+	rt->pr = FALSE;
+	tdata = talloc(0, nt, rt, sizeof(*rt), NULL, &rt->buf, rt->bsz, NULL);
+	rt->pr = pr;
+	if (!tdata) return (FALSE);
+	tdata->silent = !pr;
+
+	rt->dir = TIFFCurrentDirectory(rt->tif);
+	for (i = 0; i < tdata->count; i++)
+		((tiff_rtiles *)tdata->threads[i]->data)->dir = rt->dir;
+	launch_threads(tiff_read_tiles, tdata, NULL, ny);
+
+	/* Redo what failed, in main thread */
+	rt->res = TRUE;
+	for (i = 0; rt->res && (i < tdata->count); i++)
+	{
+		tcb *thread = tdata->threads[i];
+
+		tp = thread->data;
+		if (tp->res) continue;
+		for (j = 0; j < thread->nsteps; j++)
+		{
+			if (tiff_read_row(tp, rt->tif, tp->buf,
+				(thread->step0 + j) * rt->ystep)) continue;
+			rt->res = FALSE;
+			break;
+		}
+	}
+	rt->pr = pr;
+	free(tdata);
+	return (TRUE);
+}
+
+static int load_tiff_frame(TIFF *tif, ls_settings *settings, memFILE *mf)
 {
 	char cbuf[1024];
 	uint16 bpsamp, sampp, xsamp, pmetric, planar, orient, sform;
@@ -3810,6 +4051,7 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 	uint32 width, height, tw = 0, th = 0, rps = 0;
 	uint32 *tr, *raster = NULL;
 	unsigned char *tmp, *buf = NULL;
+	size_t l;
 	int bpp = 3, cmask = CMASK_IMAGE, argb = FALSE, pr = FALSE;
 	int i, j, mirror, res;
 
@@ -3970,7 +4212,8 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 	{
 		/* libtiff is too much of a moving target if finer control is
 		 * needed, so let's trade memory for stability */
-		raster = (uint32 *)_TIFFmalloc(width * height * sizeof(uint32));
+		raster = (uint32 *)_TIFFmalloc((size_t)width * height *
+			sizeof(uint32));
 		res = FILE_MEM_ERROR;
 		if (!raster) goto fail2;
 		res = FILE_LIB_ERROR;
@@ -3981,7 +4224,7 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 		tr = raster;
 		for (i = height - 1; i >= 0; i--)
 		{
-			tmp = settings->img[CHN_IMAGE] + width * i * bpp;
+			tmp = settings->img[CHN_IMAGE] + (size_t)width * i * bpp;
 			j = width;
 			while (j--)
 			{
@@ -4004,11 +4247,12 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 	/* Read & interpret it ourselves */
 	else
 	{
+		tiff_rtiles rt;
 		unsigned char xtable[256], *src, *tbuf = NULL;
-		uint32 x0, y0, xstep = tw ? tw : width, ystep = th ? th : rps;
+		uint32 y0, xstep = tw ? tw : width, ystep = th ? th : rps;
 		int aalpha, tsz = 0, wbpp = bpp;
-		int bpr, bits1, bit0, db, n, nx;
-		int j, k, bsz, plane, nplanes;
+		int bpr, bits1, bit0, db, nx;
+		int j, k, bsz, nplanes;
 
 
 		if (pmetric == PHOTOMETRIC_SEPARATED) // Needs temp buffer
@@ -4062,118 +4306,42 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 		nx = ((width + xstep - 1) / xstep) * nplanes * height;
 
 		/* Read image tile by tile - considering strip a wide tile */
-		for (n = y0 = 0; y0 < height; y0 += ystep)
-		for (x0 = 0; x0 < width; x0 += xstep)
-		for (plane = 0; plane < nplanes; plane++)
-		{
-			unsigned char *tmp, *tmpa;
-			uint32 x, y, w, h, l;
-			int i, k, dx, dxa, dy, dys;
-
-			/* Read one piece */
-			if (tw)
-			{
-				if (TIFFReadTile(tif, buf, x0, y0, 0, plane) < 0)
-					goto fail2;
-			}
-			else
-			{
-				if (TIFFReadEncodedStrip(tif,
-					TIFFComputeStrip(tif, y0, plane),
-					buf, bsz) < 0) goto fail2;
-			}
-
-			/* Prepare decoding loops */
-			if (mirror & 1) /* X mirror */
-			{
-				x = width - x0;
-				w = x < xstep ? x : xstep;
-				x -= w;
-			}
-			else
-			{
-				x = x0;
-				w = x + xstep > width ? width - x : xstep;
-			}
-			if (mirror & 2) /* Y mirror */
-			{
-				y = height - y0;
-				h = y < ystep ? y : ystep;
-				y -= h;
-			}
-			else
-			{
-				y = y0;
-				h = y + ystep > height ? height - y : ystep;
-			}
-
-			/* Prepare pointers */
-			dx = dxa = 1; dy = width;
-			i = y * width + x;
-			tmp = tmpa = settings->img[CHN_ALPHA] + i;
-			if (plane >= wbpp); // Alpha
-			else if (tbuf) // CMYK
-			{
-				dx = 4; dy = w;
-				tmp = tbuf + plane;
-			}
-			else // RGB/indexed
-			{
-				dx = bpp;
-				tmp = settings->img[CHN_IMAGE] + plane + i * bpp;
-			}
-			dy *= dx; dys = bpr;
-			src = buf;
-			/* Account for horizontal mirroring */
-			if (mirror & 1)
-			{
-				// Write bytes backward
-				tmp += (w - 1) * dx; tmpa += w - 1;
-				dx = -dx; dxa = -1;
-			}
-			/* Account for vertical mirroring */
-			if (mirror & 2)
-			{
-				// Read rows backward
-				src += (h - 1) * dys;
-				dys = -dys;
-			}
-
-			/* Decode it */
-			for (l = 0; l < h; l++ , n++ , src += dys , tmp += dy)
-			{
-				if (pr && ((n * 10) % nx >= nx - 10))
-					progress_update((float)n / nx);
-
-				stream_MSB(src, tmp, w, bits1, bit0, db, dx);
-				if (planar) continue;
-				for (k = 1; k < wbpp; k++)
-				{
-					stream_MSB(src, tmp + k, w, bits1,
-						bit0 + bpsamp * k, db, dx);
-				}
-				if (settings->img[CHN_ALPHA])
-				{
-					stream_MSB(src, tmpa, w, bits1,
-						bit0 + bpsamp * wbpp, db, dxa);
-					tmpa += width;
-				}
-			}
-
-			/* Convert CMYK to RGB if needed */
-			if (!tbuf || (planar && (plane != 3))) continue;
-			if (bits1 < 8)	// Rescale to 8-bit
-				do_xlate(xtable, tbuf, w * h * 4);
-			cmyk2rgb(tbuf, tbuf, w * h, FALSE, settings);
-			src = tbuf;
-			tmp = settings->img[CHN_IMAGE] + (y * width + x) * 3;
-			w *= 3;
-			for (l = 0; l < h; l++ , tmp += width * 3 , src += w)
-				memcpy(tmp, src, w);
-		}
+		memset(&rt, 0, sizeof(rt));
+		rt.settings = settings;
+		rt.tif = tif;
+		rt.mf = mf;
+		rt.buf = buf;
+		rt.tbuf = tbuf;
+		rt.xtable = xtable;
+		rt.width = width;
+		rt.height = height;
+		rt.xstep = xstep;
+		rt.ystep = ystep;
+		rt.tw = tw;
+		rt.bsz = bsz;
+		rt.bpr = bpr;
+		rt.mirror = mirror;
+		rt.bpp = bpp;
+		rt.wbpp = wbpp;
+		rt.bpsamp = bpsamp;
+		rt.bits1 = bits1;
+		rt.bit0 = bit0;
+		rt.db = db;
+		rt.planar = planar;
+		rt.nplanes = nplanes;
+		rt.pr = pr;
+		rt.nx = nx;
+		/* Tiles without CMYK conversion can be done in parallel */
+		if (!tw || tbuf || (mf && mf->file) || !tiff_read_threaded(&rt))
+		{
+			rt.res = TRUE;
+			for (y0 = 0; rt.res && (y0 < height); y0 += ystep)
+				rt.res = tiff_read_row(&rt, tif, buf, y0);
+		}
+		if (!rt.res) goto fail2;
 		done_cmyk2rgb(settings);
 
-		j = width * height;
+		l = (size_t)width * height;
 		tmp = settings->img[CHN_IMAGE];
 		src = settings->img[CHN_ALPHA];
 
@@ -4183,13 +4351,14 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 			if (wbpp > 3) // Converted from CMYK
 			{
 				unsigned char *img = tmp;
-				int i, k, a;
+				size_t i;
+				int k, a;
 
-				if (bits1 < 8) do_xlate(xtable, src, j);
+				if (bits1 < 8) do_xlate(xtable, src, l);
 				bits1 = 8; // No further rescaling needed
 
 				/* Remove white background */
-				for (i = 0; i < j; i++ , img += 3)
+				for (i = 0; i < l; i++ , img += 3)
 				{
 					a = src[i] - 255;
 					k = a + img[0];
@@ -4200,16 +4369,16 @@ static int load_tiff_frame(TIFF *tif, ls_settings *settings)
 					img[2] = k < 0 ? 0 : k;
 				}
 			}
-			mem_demultiply(tmp, src, j, bpp);
+			mem_demultiply(tmp, src, l, bpp);
 			tmp = NULL; // Image is done
 		}
 
 		if (bits1 < 8)
 		{
 			/* Rescale alpha */
-			if (src) do_xlate(xtable, src, j);
+			if (src) do_xlate(xtable, src, l);
 			/* Rescale RGB */
-			if (tmp && (wbpp == 3)) do_xlate(xtable, tmp, j * 3);
+			if (tmp && (wbpp == 3)) do_xlate(xtable, tmp, l * 3);
 		}
 		res = 1;
 	}
@@ -4240,7 +4409,7 @@ static int load_tiff_frames(char *file_name, ani_settings *ani)
 			goto fail;
 		w_set = ani->settings;
 		w_set.gif_delay = -1; // Multipage
-		res = load_tiff_frame(tif, &w_set);
+		res = load_tiff_frame(tif, &w_set, NULL);
 		if (res != 1) goto fail;
 		res = process_page_frame(file_name, ani, &w_set);
 		if (res) goto fail;
@@ -4252,46 +4421,6 @@ fail:	TIFFClose(tif);
 	return (res);
 }
 
-#ifndef TIFF_VERSION_BIG /* The ONLY useful way to detect libtiff 4.x vs 3.x */
-#define tmsize_t tsize_t
-#endif
-
-static tmsize_t mTIFFread(thandle_t fd, void* buf, tmsize_t size)
-{
-	return mfread(buf, 1, size, (memFILE *)fd);
-}
-
-static tmsize_t mTIFFwrite(thandle_t fd, void* buf, tmsize_t size)
-{
-	return mfwrite(buf, 1, size, (memFILE *)fd);
-}
-
-static toff_t mTIFFlseek(thandle_t fd, toff_t off, int whence)
-{
-	return mfseek((memFILE *)fd, (f_long)off, whence) ? -1 : ((memFILE *)fd)->m.here;
-}
-
-static int mTIFFclose(thandle_t fd)
-{
-	return 0;
-}
-
-static toff_t mTIFFsize(thandle_t fd)
-{
-	return ((memFILE *)fd)->top;
-}
-
-static int mTIFFmap(thandle_t fd, void** base, toff_t* size)
-{
-	*base = ((memFILE *)fd)->m.buf;
-	*size = ((memFILE *)fd)->top;
-	return 1;
-}
-
-static void mTIFFunmap(thandle_t fd, void* base, toff_t size)
-{
-}
-
 static int load_tiff(char *file_name, ls_settings *settings, memFILE *mf)
 {
 	TIFF *tif;
@@ -4306,72 +4435,23 @@ static int load_tiff(char *file_name, ls_settings *settings, memFILE *mf)
 	else tif = TIFFClientOpen("", "r", (void *)mf, mTIFFread, mTIFFwrite,
 		mTIFFlseek, mTIFFclose, mTIFFsize, mTIFFmap, mTIFFunmap);
 	if (!tif) return (-1);
-	res = load_tiff_frame(tif, settings);
+	res = load_tiff_frame(tif, settings, mf);
 	if ((res == 1) && TIFFReadDirectory(tif)) res = FILE_HAS_FRAMES;
 	TIFFClose(tif);
 	return (res);
 }
 
-static int save_tiff(char *file_name, ls_settings *settings, memFILE *mf)
+static void tiff_set_tags(TIFF *tif, ls_settings *settings, int type,
+	int bpp, int af, int bw, int pf)
 {
-	unsigned char buf[MAX_WIDTH / 8], *src, *row = NULL;
 	uint16 rgb[256 * 3];
-	unsigned int tflags, sflags, xflags;
-	int i, l, type, bw, af, pf, res = 0, pmetric = -1;
-	int w = settings->width, h = settings->height, bpp = settings->bpp;
-	TIFF *tif;
-
-
-	/* Select output mode */
-	sflags = FF_SAVE_MASK_FOR(*settings);
-	type = settings->tiff_type;
-	if (type < 0) type = bpp == 3 ? tiff_rtype : // RGB
-		settings->colors <= 2 ?	tiff_btype : // BW
-		tiff_itype; // Indexed
-	if (settings->mode == FS_CLIPBOARD)
-	{
-		type = 0; // Uncompressed
-		/* RGB for clipboard mask */
-		if (settings->img[CHN_ALPHA]) sflags = FF_RGB , bpp = 3;
-	}
-	tflags = tiff_formats[type].flags;
-	sflags &= tflags;
-	bw = !(sflags & (FF_256 | FF_RGB));
-	if (!sflags) return WRONG_FORMAT; // Paranoia
-
-	af = settings->img[CHN_ALPHA] && (tflags & FF_ALPHA);
-
-	/* Use 1-bit mode where possible */
-	if (!bw && !af && (sflags & FF_BW))
-	{
-		/* No need of palette if the colors are full white and black */
-		i = PNG_2_INT(settings->pal[0]);
-		bw = (!i ? 0xFFFFFF : i == 0xFFFFFF ? 0 : -1) ==
-			PNG_2_INT(settings->pal[1]) ? 1 : -1;
-	}		
-
-	/* !!! When using predictor, libtiff 3.8 modifies row buffer in-place */
-	pf = tiff_predictor && !bw && tiff_formats[type].pflag;
-	if (af || pf || (bpp > settings->bpp))
-	{
-		row = malloc(w * (bpp + af));
-		if (!row) return -1;
-	}
+	unsigned int xflags;
+	int i, l, pmetric = -1;
 
-	TIFFSetErrorHandler(NULL);	// We don't want any echoing to the output
-	TIFFSetWarningHandler(NULL);
-	if (!mf) tif = TIFFOpen(file_name, "w");
-	else tif = TIFFClientOpen("", "w", (void *)mf, mTIFFread, mTIFFwrite,
-		mTIFFlseek, mTIFFclose, mTIFFsize, mTIFFmap, mTIFFunmap);
-	if (!tif)
-	{
-		free(row);
-		return -1;
-	}
 
 	/* Write regular tags */
-	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, w);
-	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, h);
+	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, settings->width);
+	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, settings->height);
 	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, bpp + af);
 	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, bw ? 1 : 8);
 	TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
@@ -4428,30 +4508,239 @@ static int save_tiff(char *file_name, ls_settings *settings, memFILE *mf)
 		rgb[0] = EXTRASAMPLE_UNASSALPHA;
 		TIFFSetField(tif, TIFFTAG_EXTRASAMPLES, 1, rgb);
 	}
+}
 
-	/* Actually write the image */
+/* Tiled TIFF is written in parallel: each thread encodes its rows of tiles
+ * through its own libtiff handle into a memory buffer, then the main thread
+ * copies the compressed tiles to the real file in order */
+
+#define TIFF_TILE 256 /* Must be a multiple of 16 */
+
+typedef struct {
+	int thread, ofs, len;
+} tiff_tile;
+
+typedef struct {
+	ls_settings *settings;
+	tiff_tile *tiles;
+	unsigned char *band, *tbuf;
+	memFILE mf;
+	int type, bpp, af, pf, nx;
+	int res;
+} tiff_wtiles;
+
+static void tiff_write_tiles(tcb *thread)
+{
+	tiff_wtiles *tw = thread->data;
+	ls_settings *settings = tw->settings;
+	TIFF *tif;
+	unsigned char *src, *dest;
+	int spp = tw->bpp + tw->af, tl = TIFF_TILE * spp;
+	int bl = tl * tw->nx, tsz = tl * TIFF_TILE;
+	int i, j, l, h, y, top, cnt = thread->nsteps;
+
+
+	tw->res = -1;
+	if (!cnt) goto done;
+	tif = TIFFClientOpen("", "w", (void *)&tw->mf, mTIFFread, mTIFFwrite,
+		mTIFFlseek, mTIFFclose, mTIFFsize, mTIFFmap, mTIFFunmap);
+	if (!tif) goto done;
+	tiff_set_tags(tif, settings, tw->type, tw->bpp, tw->af, FALSE, tw->pf);
+	TIFFSetField(tif, TIFFTAG_TILEWIDTH, TIFF_TILE);
+	TIFFSetField(tif, TIFFTAG_TILELENGTH, TIFF_TILE);
+
+	/* Padding to the right stays zeroed */
+	memset(tw->band, 0, bl * TIFF_TILE);
+	for (i = 0; i < cnt; i++)
+	{
+		y = (thread->step0 + i) * TIFF_TILE;
+		h = settings->height - y;
+		if (h > TIFF_TILE) h = TIFF_TILE;
+		/* Prepare a band of rows */
+		for (l = 0; l < h; l++)
+			prepare_row(tw->band + bl * l, settings, spp, y + l);
+		if (h < TIFF_TILE) memset(tw->band + bl * h, 0,
+			bl * (TIFF_TILE - h));
+		/* Cut it into tiles and encode them */
+		for (j = 0; j < tw->nx; j++)
+		{
+			tiff_tile *tt = tw->tiles + (thread->step0 + i) * tw->nx + j;
+
+			src = tw->band + tl * j;
+			dest = tw->tbuf;
+			for (l = 0; l < TIFF_TILE; l++ , src += bl , dest += tl)
+				memcpy(dest, src, tl);
+			top = tw->mf.top;
+			if (TIFFWriteEncodedTile(tif, TIFFComputeTile(tif,
+				TIFF_TILE * j, y, 0, 0), tw->tbuf, tsz) == -1)
+				break;
+			tt->thread = thread->index;
+			tt->ofs = top;
+			tt->len = tw->mf.top - top;
+		}
+		if (j < tw->nx) break;
+		if (settings->silent) continue;
+		if (thread_step(thread, i + 1, cnt, 10)) break;
+	}
+	if (i >= cnt) tw->res = 0;
+	TIFFClose(tif);
+done:	thread_done(thread);
+}
+
+static int save_tiff_tiled(TIFF *tif, ls_settings *settings, int type,
+	int bpp, int af, int pf)
+{
+	threaddata *tdata;
+	tiff_wtiles tw, *twp;
+	tiff_tile *tt;
+	int i, n, ny, nt, res = -1, w = settings->width, h = settings->height;
+
+
+	memset(&tw, 0, sizeof(tw));
+	tw.settings = settings;
+	tw.type = type;
+	tw.bpp = bpp;
+	tw.af = af;
+	tw.pf = pf;
+	tw.nx = (w + TIFF_TILE - 1) / TIFF_TILE;
+	ny = (h + TIFF_TILE - 1) / TIFF_TILE;
+	nt = image_threads(w, h);
+	if (nt > ny) nt = ny;
+	n = TIFF_TILE * TIFF_TILE * (bpp + af);
+	tdata = talloc(0, nt, &tw, sizeof(tw),
+		&tw.tiles, tw.nx * ny * sizeof(tiff_tile), NULL,
+		&tw.band, n * tw.nx, &tw.tbuf, n, NULL);
+	if (!tdata) return (-1);
+	tdata->silent = settings->silent;
+
+	/* Each thread's tiles go into one memFILE; leave room for incompressible
+	 * data, and let the caller write scanlines if that might not fit */
+	nt = tdata->count;
+	if ((size_t)((ny + nt - 1) / nt) * tw.nx * n > MEMFILE_MAX / 2)
+	{
+		free(tdata);
+		return (1);
+	}
+
+	TIFFSetField(tif, TIFFTAG_TILEWIDTH, TIFF_TILE);
+	TIFFSetField(tif, TIFFTAG_TILELENGTH, TIFF_TILE);
+
+	/* Compress the tiles */
 	if (!settings->silent) ls_init("TIFF", 1);
-	for (i = 0; i < h; i++)
+	launch_threads(tiff_write_tiles, tdata, NULL, ny);
+	if (!settings->silent) progress_end();
+
+	/* Write them out */
+	for (i = 0; i < tdata->count; i++)
+		if (((tiff_wtiles *)tdata->threads[i]->data)->res) break;
+	if (i >= tdata->count)
 	{
-		src = settings->img[CHN_IMAGE] + w * i * settings->bpp;
-		if (bw) /* Pack the bits */
+		tt = tw.tiles;
+		for (i = tw.nx * ny; i > 0; i-- , tt++)
 		{
-			pack_MSB(buf, src, w, 1);
-			src = buf;
+			twp = tdata->threads[tt->thread]->data;
+			if (TIFFWriteRawTile(tif, tt - tw.tiles,
+				twp->mf.m.buf + tt->ofs, tt->len) == -1) break;
 		}
-		else if (row) /* Fill the buffer */
-			src = prepare_row(row, settings, bpp + af, i);
-		if (TIFFWriteScanline(tif, src, i, 0) == -1)
+		if (!i) res = 0;
+	}
+
+	for (i = 0; i < tdata->count; i++)
+		free(((tiff_wtiles *)tdata->threads[i]->data)->mf.m.buf);
+	free(tdata);
+	return (res);
+}
+
+static int save_tiff(char *file_name, ls_settings *settings, memFILE *mf)
+{
+	unsigned char buf[MAX_WIDTH / 8], *src, *row = NULL;
+	unsigned int tflags, sflags;
+	int i, type, bw, af, pf, tiled, res = 0;
+	int w = settings->width, h = settings->height, bpp = settings->bpp;
+	TIFF *tif;
+
+
+	/* Select output mode */
+	sflags = FF_SAVE_MASK_FOR(*settings);
+	type = settings->tiff_type;
+	if (type < 0) type = bpp == 3 ? tiff_rtype : // RGB
+		settings->colors <= 2 ?	tiff_btype : // BW
+		tiff_itype; // Indexed
+	if (settings->mode == FS_CLIPBOARD)
+	{
+		type = 0; // Uncompressed
+		/* RGB for clipboard mask */
+		if (settings->img[CHN_ALPHA]) sflags = FF_RGB , bpp = 3;
+	}
+	tflags = tiff_formats[type].flags;
+	sflags &= tflags;
+	bw = !(sflags & (FF_256 | FF_RGB));
+	if (!sflags) return WRONG_FORMAT; // Paranoia
+
+	af = settings->img[CHN_ALPHA] && (tflags & FF_ALPHA);
+
+	/* Use 1-bit mode where possible */
+	if (!bw && !af && (sflags & FF_BW))
+	{
+		/* No need of palette if the colors are full white and black */
+		i = PNG_2_INT(settings->pal[0]);
+		bw = (!i ? 0xFFFFFF : i == 0xFFFFFF ? 0 : -1) ==
+			PNG_2_INT(settings->pal[1]) ? 1 : -1;
+	}		
+
+	/* !!! When using predictor, libtiff 3.8 modifies row buffer in-place */
+	pf = tiff_predictor && !bw && tiff_formats[type].pflag;
+
+	/* Tiles for multithreaded compression; JPEG tables are per handle */
+	tiled = tiff_tiled && !bw && (settings->mode != FS_CLIPBOARD) &&
+		!(tiff_formats[type].xflags & XF_COMPJ);
+	/* Tiled saving can fall back to scanlines, so get the row anyway */
+	if (af || pf || (bpp > settings->bpp))
+	{
+		row = malloc(w * (bpp + af));
+		if (!row) return -1;
+	}
+
+	TIFFSetErrorHandler(NULL);	// We don't want any echoing to the output
+	TIFFSetWarningHandler(NULL);
+	if (!mf) tif = TIFFOpen(file_name, "w");
+	else tif = TIFFClientOpen("", "w", (void *)mf, mTIFFread, mTIFFwrite,
+		mTIFFlseek, mTIFFclose, mTIFFsize, mTIFFmap, mTIFFunmap);
+	if (!tif)
+	{
+		free(row);
+		return -1;
+	}
+
+	tiff_set_tags(tif, settings, type, bpp, af, bw, pf);
+
+	/* Actually write the image */
+	if (tiled) res = save_tiff_tiled(tif, settings, type, bpp, af, pf);
+	if (!tiled || (res > 0)) /* Tiles would overflow memory files */
+	{
+		res = 0;
+		if (!settings->silent) ls_init("TIFF", 1);
+		for (i = 0; i < h; i++)
 		{
-			res = -1;
-			break;
+			src = settings->img[CHN_IMAGE] + (size_t)w * i * settings->bpp;
+			if (bw) /* Pack the bits */
+			{
+				pack_MSB(buf, src, w, 1);
+				src = buf;
+			}
+			else if (row) /* Fill the buffer */
+				src = prepare_row(row, settings, bpp + af, i);
+			if (TIFFWriteScanline(tif, src, i, 0) == -1)
+			{
+				res = -1;
+				break;
+			}
+			ls_progress(settings, i, 20);
 		}
-		ls_progress(settings, i, 20);
+		if (!settings->silent) progress_end();
 	}
 	TIFFClose(tif);
 
-	if (!settings->silent) progress_end();
-
 	free(row);
 	return (res);
 }
@@ -4978,10 +5267,11 @@ static int load_bmp(char *file_name, ls_settings *settings, memFILE *mf)
 	memFILE fake_mf;
 	FILE *fp = NULL;
 	unsigned l, ofs;
+	size_t wh;
 	int shifts[4], bpps[4];
 	int def_alpha = FALSE, cmask = CMASK_IMAGE, comp = 0, ba = 0, rle = 0, res = -1;
 	int i, j, k, n, ii, w, h, bpp, wbpp;
-	int bl, rl, step, skip, dx, dy;
+	int bl, rl, step, skip, dx, dy, std;
 
 
 	if (!mf)
@@ -5034,7 +5324,7 @@ static int load_bmp(char *file_name, ls_settings *settings, memFILE *mf)
 	if (!comp && (bpp == 8) && (h > 0) && (l == OS2BMP2_HSIZE_S))
 	{
 		unsigned fsize = GET32(hdr + BMP_DATASIZE);
-		if (fsize && (fsize != w * h)) comp = 1;
+		if (fsize && (fsize != (unsigned)w * h)) comp = 1;
 	}
 	/* Only 1, 4, 8, 16, 24 and 32 bpp allowed */
 	rle = comp;
@@ -5202,6 +5492,11 @@ static int load_bmp(char *file_name, ls_settings *settings, memFILE *mf)
 
 	if (!rle) /* No RLE */
 	{
+		/* Byte-aligned 8:8:8(:8) fields need no bit parsing */
+		std = (bpp >= 24) && (shifts[0] == 16) && (shifts[1] == 8) &&
+			!shifts[2] && ((bpps[0] & bpps[1] & bpps[2]) == 8) &&
+			(!settings->img[CHN_ALPHA] || ((bpp == 32) &&
+			(shifts[3] == 24) && (bpps[3] == 8)));
 		for (n = 0; (i < h) && (i >= 0); n++ , i += step)
 		{
 			j = mfread(buf, 1, rl, mf);
@@ -5209,6 +5504,13 @@ static int load_bmp(char *file_name, ls_settings *settings, memFILE *mf)
 			dest = settings->img[CHN_IMAGE] + w * i * wbpp;
 			if (bpp < 16) /* Indexed */
 				stream_MSB(buf, dest, w, bpp, 0, bpp, 1);
+			else if (std) /* Plain BGR(A) */
+			{
+				copy_run(dest, buf, w, 3, bpp >> 3, TRUE);
+				if (settings->img[CHN_ALPHA]) copy_bytes(
+					settings->img[CHN_ALPHA] + w * i,
+					buf + 3, w, 1, 4);
+			}
 			else /* RGB */
 			{
 				stream_LSB(buf, dest + 0, w, bpps[0],
@@ -5238,8 +5540,8 @@ static int load_bmp(char *file_name, ls_settings *settings, memFILE *mf)
 			}
 			else tmp = settings->img[CHN_IMAGE] + i;
 			set_xlate(xlat, bpps[i] + !bpps[i]); // Let 0-wide fields be
-			n = w * h;
-			for (j = 0; j < n; j++ , tmp += k) *tmp = xlat[*tmp];
+			for (wh = (size_t)w * h; wh; wh-- , tmp += k)
+				*tmp = xlat[*tmp];
 		}
 
 		res = 1;
@@ -5248,7 +5550,7 @@ static int load_bmp(char *file_name, ls_settings *settings, memFILE *mf)
 	{
 		k = mfread(buf, 1, bl, mf);
 		if (k < bl) goto fail3;
-		memset(settings->img[CHN_IMAGE], 0, w * h * wbpp);
+		memset(settings->img[CHN_IMAGE], 0, (size_t)w * h * wbpp);
 		skip = j = 0;
 
 		dest = settings->img[CHN_IMAGE] + w * i * wbpp;
@@ -5329,7 +5631,7 @@ static int load_bmp(char *file_name, ls_settings *settings, memFILE *mf)
 				skip = 1;
 				if (settings->img[CHN_ALPHA]) /* Got alpha */
 				{
-					memset(settings->img[CHN_ALPHA], 255, w * h);
+					memset(settings->img[CHN_ALPHA], 255, (size_t)w * h);
 					skip = 2;
 				}
 			}
@@ -6104,6 +6406,7 @@ static int save_xpm(char *file_name, ls_settings *settings)
 	FILE *fp;
 	int bpp = settings->bpp, w = settings->width, h = settings->height;
 	int uninit_(ccmask);
+	size_t ii, wh = (size_t)w * h;
 	int i, j, k, l, c, cpp, cols, trans = -1;
 
 
@@ -6122,20 +6425,19 @@ static int save_xpm(char *file_name, ls_settings *settings)
 		cuckoo.cpp = 3;
 		cuckoo.seed = HASHSEED;
 
-		j = w * h;
 		src = settings->img[CHN_IMAGE];
-		for (i = 0; i < j; i++ , src += 3)
+		for (ii = 0; ii < wh; ii++ , src += 3)
 		{
 			if (ch_insert(&cuckoo, src) < 0)
 				break; /* Too many colors for this mode */
 		}
 
-		if (i < j) /* Too many colors, collect & count 'em */
+		if (ii < wh) /* Too many colors, collect & count 'em */
 		{
 			ctable = calloc(CTABLE_SIZE + CINDEX_SIZE, sizeof(*ctable));
 			if (!ctable) return (-1); // No memory
 			src = settings->img[CHN_IMAGE];
-			for (i = 0; i < j; i++ , src += 3)
+			for (ii = 0; ii < wh; ii++ , src += 3)
 			{
 				int n = MEM_2_INT(src, 0);
 				ctable[n >> 5] |= 1U << (n & 31);
@@ -6249,7 +6551,7 @@ static int save_xpm(char *file_name, ls_settings *settings)
 	w *= bpp;
 	for (i = 0; i < h; i++)
 	{
-		src = settings->img[CHN_IMAGE] + i * w;
+		src = settings->img[CHN_IMAGE] + (size_t)i * w;
 		tmp = buf;
 		*tmp++ = '"';
 		for (j = 0; j < w; j += bpp, tmp += cpp)
@@ -6426,7 +6728,7 @@ static int save_xbm(char *file_name, ls_settings *settings)
 		if (j >= k)
 		{
 			if (i >= h) break;
-			src = settings->img[CHN_IMAGE] + i * w;
+			src = settings->img[CHN_IMAGE] + (size_t)i * w;
 			memset(row, 0, k);
 			for (j = 0; j < w; j++)
 			{
@@ -6512,8 +6814,9 @@ static int load_lss(char *file_name, ls_settings *settings)
 	if (l <= LSS_HSIZE) goto fail; /* Too large or too small */
 	l -= LSS_HSIZE;
 	fseek(fp, LSS_HSIZE, SEEK_SET);
-	bl = (w * h * 3) >> 1; /* Cannot possibly be longer */
-	if (bl > l) bl = l;
+	/* Cannot possibly be longer */
+	if (l > ((f_long)w * h * 3) >> 1) l = ((f_long)w * h * 3) >> 1;
+	bl = l;
 	buf = malloc(bl);
 	res = FILE_MEM_ERROR;
 	if (!buf) goto fail2;
@@ -6686,15 +6989,6 @@ static int save_lss(char *file_name, ls_settings *settings)
 #define TGA_ATYPE   494 /* 8b */
 #define TGA_EXTSIZE 495
 
-static void extend_bytes(unsigned char *dest, int len, int maxval)
-{
-	unsigned char tb[256];
-
-	memset(tb, 255, 256);
-	set_xlate_n(tb, maxval);
-	do_xlate(tb, dest, len);
-}
-
 static int load_tga(char *file_name, ls_settings *settings)
 {
 	unsigned char hdr[TGA_HSIZE], ftr[TGA_FSIZE], ext[TGA_EXTSIZE];
@@ -6708,7 +7002,8 @@ static int load_tga(char *file_name, ls_settings *settings)
 	int rle, real_alpha = FALSE, assoc_alpha = FALSE, wmode = 0, res = -1;
 	int iofs, buflen;
 	int ix, ishift, imask, ax, ashift, amask;
-	int start, xstep, xstepb, ystep, ccnt, rcnt, strl, y;
+	size_t start;
+	int xstep, xstepb, ystep, ccnt, rcnt, strl, y;
 
 
 	if (!(fp = fopen(file_name, "rb"))) return (-1);
@@ -6925,7 +7220,7 @@ static int load_tga(char *file_name, ls_settings *settings)
 	if (!(hdr[TGA_DESC] & TGA_T2B))
 	{
 		/* Bottom-to-top */
-		start += (h - 1) * w;
+		start += (size_t)(h - 1) * w;
 		ystep -= 2 * w;
 	}
 	xstepb = xstep * bpp;
@@ -6963,6 +7258,16 @@ static int load_tga(char *file_name, ls_settings *settings)
 				l = rcnt < strl ? rcnt : strl;
 				if (j < ibpp * l) l = j / ibpp;
 				rcnt -= l; strl -= l;
+				if (wmode >= 6) /* 8:8:8 BGR, maybe with alpha */
+				{
+					copy_run(dest, bstart, l, xstepb, ibpp, TRUE);
+					if (wmode == 7) for (n = 0; n < l; n++)
+						dsta[n * xstep] = bstart[n * 4 + 3];
+					dest += xstepb * l;
+					dsta += xstep * l;
+					bstart += ibpp * l;
+					l = 0;
+				}
 				while (l--)
 				{
 					switch (wmode)
@@ -7051,7 +7356,8 @@ static int load_tga(char *file_name, ls_settings *settings)
 	if (settings->img[CHN_ALPHA] && (wmode == 3) && !assoc_alpha)
 	{
 		unsigned char *timg, *talpha;
-		int i, j = w * h, k = 0, l;
+		size_t i, j = (size_t)w * h;
+		int k = 0, l;
 
 		timg = settings->img[CHN_IMAGE];
 		talpha = settings->img[CHN_ALPHA];
@@ -7073,13 +7379,14 @@ static int load_tga(char *file_name, ls_settings *settings)
 
 	/* Rescale alpha */
 	if (settings->img[CHN_ALPHA] && (abits < 8))
-		extend_bytes(settings->img[CHN_ALPHA], w * h, (1 << abits) - 1);
+		extend_bytes(settings->img[CHN_ALPHA], (size_t)w * h,
+			(1 << abits) - 1);
 
 	/* Unassociate alpha */
 	if (settings->img[CHN_ALPHA] && assoc_alpha && (abits > 1))
 	{
 		mem_demultiply(settings->img[CHN_IMAGE],
-			settings->img[CHN_ALPHA], w * h, bpp);
+			settings->img[CHN_ALPHA], (size_t)w * h, bpp);
 	}
 	res = 0;
 
@@ -7373,7 +7680,7 @@ static int load_pcx(char *file_name, ls_settings *settings)
 	res = FILE_LIB_ERROR;
 	fseek(fp, PCX_HSIZE, SEEK_SET);
 	dest = settings->img[CHN_IMAGE];
-	if (bits == 1) memset(dest, 0, w * h); // Write will be by OR
+	if (bits == 1) memset(dest, 0, (size_t)w * h); // Write will be by OR
 	y = plane = ccnt = 0;
 	bstart = bstop = PCX_BUFSIZE;
 	strl = buflen;
@@ -7409,22 +7716,13 @@ static int load_pcx(char *file_name, ls_settings *settings)
 
 		/* Store a line */
 		if (bits == 1) // N planes of 1-bit data (MSB first)
-		{
-			unsigned char uninit_(v), *tmp = row;
-			int i, n = 7 - plane;
-
-			for (i = 0; i < w; i++ , v += v)
-			{
-				if (!(i & 7)) v = *tmp++;
-				dest[i] |= (v & 0x80) >> n;
-			}
-		}
+			or_bitplane(dest, row, w, 7 - plane, 1);
 		else if (bits == 24) // 1 plane of RGB
 			memcpy(dest, row, w * 3);
 		else if (plane < 3) // BPP planes of 2/4/8-bit data (MSB first)
 			stream_MSB(row, dest + plane, w, bits, 0, bits, bpp);
 		else if (settings->img[CHN_ALPHA]) // 8-bit alpha plane
-			memcpy(settings->img[CHN_ALPHA] + y * w, row, w);
+			memcpy(settings->img[CHN_ALPHA] + (size_t)y * w, row, w);
 
 		if (++plane >= planes)
 		{
@@ -7592,7 +7890,8 @@ static int load_lbm(char *file_name, ls_settings *settings)
 	int pstart = 0, ctbll = 0, pchgl = 0, pcnt = 0, sh2 = 0;
 	int w, h, bpp, bits, mask, tbits, buflen, plen, half = 0, ham = 0;
 	int pbm, palsize = 0, blocks = 0, hx = 0, hy = 0, res = -1;
-	int i, j, l, p, pad, want_pal;
+	size_t p;
+	int i, j, l, pad, want_pal;
 
 
 	if (!(fp = fopen(file_name, "rb"))) return (-1);
@@ -7815,11 +8114,11 @@ static int load_lbm(char *file_name, ls_settings *settings)
 	if ((res = allocate_image(settings, i))) goto fail2;
 	if (!pbm) // Prepare for writes by OR
 	{
-		memset(settings->img[CHN_IMAGE], 0, w * h * bpp);
+		memset(settings->img[CHN_IMAGE], 0, (size_t)w * h * bpp);
 		if (settings->img[CHN_ALPHA])
-			memset(settings->img[CHN_ALPHA], 0, w * h);
+			memset(settings->img[CHN_ALPHA], 0, (size_t)w * h);
 		if ((i & ~CMASK_RGBA) && settings->img[lbm_mask])
-			memset(settings->img[lbm_mask], 0, w * h);
+			memset(settings->img[lbm_mask], 0, (size_t)w * h);
 	}
 
 	/* Load color change table if any */
@@ -7879,31 +8178,27 @@ static int load_lbm(char *file_name, ls_settings *settings)
 		if (strl) continue;
 
 		/* Store a line */
-		p = y * w;
+		p = (size_t)y * w;
 		dest = settings->img[CHN_IMAGE] + p * bpp;
 		if (pbm) memcpy(dest, row, w);
 		while (!pbm)
 		{
 			unsigned char *dsta = NULL, *dstm = NULL;
-			unsigned char uninit_(v), *tmp, *dp;
+			unsigned char v, *tmp, *dp;
 			int i, n, plane, step = bpp;
 
 			if (ap > 0) dsta = settings->img[CHN_ALPHA] + p;
 			if (mp > 0) dstm = settings->img[lbm_mask] + p;
 			for (plane = 0; plane < np; plane++)
 			{
-				tmp = row + ((w + 15) >> 4) * 2 * plane;
 				if (bits == 21)
 					dp = dest + plane % 3 , n = 1 + plane / 3;
 				else dp = dest + (plane >> 3) , n = 7 - (plane & 7);
 				if (plane == mp) dp = dstm , step = 1; // Mask
 				else if (plane >= 24) dp = dsta , step = 1; // Alpha
 				if (!dp) continue; // Skipping alpha till mask
-				for (i = 0; i < w; i++ , v += v , dp += step)
-				{
-					if (!(i & 7)) v = *tmp++;
-					*dp |= (v & 0x80) >> n;
-				}
+				or_bitplane(dp, row + ((w + 15) >> 4) * 2 * plane,
+					w, n, step);
 			}
 
 			if (!ham) break;
@@ -7979,16 +8274,18 @@ static int load_lbm(char *file_name, ls_settings *settings)
 	res = 1;
 
 	/* Finalize DEST or 21-bit */
-	if (blocks & HAVE_DEST) do_xlate(wbuf, settings->img[CHN_IMAGE], w * h * bpp);
+	if (blocks & HAVE_DEST) do_xlate(wbuf, settings->img[CHN_IMAGE],
+		(size_t)w * h * bpp);
 	/* Finalize mask */
 	if (mp < 0); // No mask
-	else if (is_filled(settings->img[lbm_mask], settings->img[lbm_mask][0], w * h))
+	else if (is_filled(settings->img[lbm_mask], settings->img[lbm_mask][0],
+		(size_t)w * h))
 		deallocate_image(settings, CMASK_FOR(lbm_mask)); // Useless mask
 	else
 	{
 		memset(wbuf + 1, 255, 255); // Nonzero means fully opaque
 		wbuf[0] = 0;
-		do_xlate(wbuf, settings->img[lbm_mask], w * h);
+		do_xlate(wbuf, settings->img[lbm_mask], (size_t)w * h);
 	}
 
 fail3:	if (!settings->silent) progress_end();
@@ -8088,7 +8385,7 @@ static int save_lbm(char *file_name, ls_settings *settings)
 	np1 = np + (pbm || mask); // Total planes
 	for (i = 0; i < h; i++)
 	{
-		src = settings->img[CHN_IMAGE] + w * bpp * i;
+		src = settings->img[CHN_IMAGE] + (size_t)w * bpp * i;
 		dest = wb;
 		for (plane = 0; plane < np1; plane++)
 		{
@@ -8204,41 +8501,6 @@ static int save_lbm(char *file_name, ls_settings *settings)
 typedef void (*cvt_func)(unsigned char *dest, unsigned char *src, int len,
 	int bpp, int step, int maxval);
 
-static void convert_16b(unsigned char *dest, unsigned char *src, int len,
-	int bpp, int step, int maxval)
-{
-	int i, v, m = maxval * 2;
-
-	if (!(step -= bpp)) bpp *= len , len = 1;
-	step *= 2;
-	while (len-- > 0)
-	{
-		i = bpp;
-		while (i--)
-		{
-			v = (src[0] << 8) + src[1];
-			src += 2;
-			*dest++ = (v * (255 * 2) + maxval) / m;
-		}
-		src += step;
-	}	
-}
-
-static void copy_bytes(unsigned char *dest, unsigned char *src, int len,
-	int bpp, int step)
-{
-	int i, dd = 0;
-
-	if (!(step -= bpp)) bpp *= len , len = 1;
-	else if (step < 0) bpp -= dd = -step , step = 0;
-	while (len-- > 0)
-	{
-		i = bpp;
-		while (i--) *dest++ = *src++;
-		src += step; dest += dd;
-	}	
-}
-
 static int check_next_pnm(FILE *fp, char id)
 {
 	char buf[2];
@@ -8328,6 +8590,7 @@ static int load_pam_frame(FILE *fp, ls_settings *settings)
 	char *t1;
 	unsigned char *dest, *buf = NULL;
 	int maxval, w, h, depth, ftype = -1;
+	size_t l;
 	int i, j, ll, bpp, trans, vl, res, whdm[4];
 
 
@@ -8390,7 +8653,7 @@ static int load_pam_frame(FILE *fp, ls_settings *settings)
 			cvt_stream(settings->img[CHN_ALPHA] + w * i,
 				buf + depths[ftype] * vl - vl, w, 1, depth, maxval);
 		}
-		dest = settings->img[CHN_IMAGE] + w * bpp * i;
+		dest = settings->img[CHN_IMAGE] + (size_t)w * bpp * i;
 		if (ftype >= 6) // CMYK
 		{
 			cvt_stream(buf, buf, w, 4, depth, maxval);
@@ -8405,16 +8668,16 @@ static int load_pam_frame(FILE *fp, ls_settings *settings)
 
 fail2:	if (maxval < 255) // Extend what we've read
 	{
-		j = w * h;
+		l = (size_t)w * h;
 		if (settings->img[CHN_ALPHA])
-			extend_bytes(settings->img[CHN_ALPHA], j, maxval);
-		j *= bpp;
+			extend_bytes(settings->img[CHN_ALPHA], l, maxval);
+		l *= bpp;
 		dest = settings->img[CHN_IMAGE];
 		if (ftype >= 6); // CMYK is done already
-		else if (ftype > 1) extend_bytes(dest, j, maxval);
+		else if (ftype > 1) extend_bytes(dest, l, maxval);
 		else // Convert BW from 1-is-white to 1-is-black
 		{
-			for (i = 0; i < j; i++ , dest++) *dest = !*dest;
+			for (; l; l-- , dest++) *dest = !*dest;
 		}
 	}
 	if (!settings->silent) progress_end();
@@ -8628,7 +8891,7 @@ static int load_pnm_frame(FILE *fp, ls_settings *settings)
 	if (!plain) res = check_next_pnm(fp, fid + '4');
 
 fail2:	if (mode == 3) // Extend what we've read
-		extend_bytes(settings->img[CHN_IMAGE], l * h, maxval);
+		extend_bytes(settings->img[CHN_IMAGE], (size_t)l * h, maxval);
 	if (!settings->silent) progress_end();
 
 	return (res);
@@ -8767,12 +9030,12 @@ static int save_pam(char *file_name, ls_settings *settings)
 
 	for (i = 0; i < h; i++)
 	{
-		src = settings->img[CHN_IMAGE] + i * w * ibpp;
+		src = settings->img[CHN_IMAGE] + (size_t)i * w * ibpp;
 		if ((dest = buf))
 		{
 			srca = NULL;
 			if (settings->img[CHN_ALPHA])
-				srca = settings->img[CHN_ALPHA] + i * w;
+				srca = settings->img[CHN_ALPHA] + (size_t)i * w;
 			for (j = 0; j < w; j++)
 			{
 				*dest++ = *src++ ^ xv;
@@ -8926,7 +9189,7 @@ static int load_pmm_frame(memFILE *mf, ls_settings *settings)
 
 		if (j <= 0) /* !!! IGNORE anything unrecognized & skip "TAGS" */
 		{
-			mfseek(mf, w * h * depth, SEEK_CUR);
+			mfseek(mf, (f_long)w * h * depth, SEEK_CUR);
 			continue;
 		}
 
@@ -9015,12 +9278,12 @@ static int load_pmm_frame(memFILE *mf, ls_settings *settings)
 		/* Extend what we've read */
 		if (whdm[3] < 255)
 		{
-			i = w * h * rgbpp;
+			size_t l = (size_t)w * h * rgbpp;
 			for (j = CHN_IMAGE; j < NUM_CHANNELS; j++)
 			{
 				if (settings->img[j]) extend_bytes(
-					settings->img[j], i, whdm[3]);
-				i = w * h;
+					settings->img[j], l, whdm[3]);
+				l = (size_t)w * h;
 			}
 		}
 
@@ -9160,14 +9423,14 @@ static int save_pmm(char *file_name, ls_settings *settings, memFILE *mf)
 
 	for (i = 0; i < h; i++)
 	{
-		src = settings->img[CHN_IMAGE] + i * w * rgbpp;
+		src = settings->img[CHN_IMAGE] + (size_t)i * w * rgbpp;
 		if ((dest = buf))
 		{
 			copy_bytes(dest, src, w, bpp, rgbpp);
 			dest += rgbpp;
 			for (k = CHN_ALPHA; k < NUM_CHANNELS; k++)
 				if (settings->img[k]) copy_bytes(dest++,
-					settings->img[k] + i * w, w, bpp, 1);
+					settings->img[k] + (size_t)i * w, w, bpp, 1);
 			src = buf;
 		}
 		mfwrite(src, 1, w * bpp, mf);
@@ -9726,7 +9989,7 @@ static int load_image_x(char *file_name, memFILE *mf, int mode, int ftype,
 	layer_image *lim = NULL;
 	png_color pal[256];
 	ls_settings settings;
-	int i, tr, res, res0, undo = ftype & FTM_UNDO;
+	int tr, res, res0, undo = ftype & FTM_UNDO;
 
 
 	/* Clipboard import - from mtPaint, or from something other? */
@@ -9872,13 +10135,13 @@ static int load_image_x(char *file_name, memFILE *mf, int mode, int ftype,
 			/* Add alpha channel if no alpha yet */
 			if (!settings.img[CHN_ALPHA])
 			{
-				i = settings.width * settings.height;
+				size_t l = (size_t)settings.width * settings.height;
 				/* !!! Create committed */
-				mem_clip_alpha = malloc(i);
+				mem_clip_alpha = malloc(l);
 				if (mem_clip_alpha)
 				{
 					settings.img[CHN_ALPHA] = mem_clip_alpha;
-					memset(mem_clip_alpha, 255, i);
+					memset(mem_clip_alpha, 255, l);
 				}
 			}
 			if (!settings.img[CHN_ALPHA]) res = FILE_MEM_ERROR;
@@ -173,6 +173,7 @@ typedef struct {
 int silence_limit, jpeg_quality, png_compression;
 int tga_RLE, tga_565, tga_defdir, jp2_rate;
 int lzma_preset, zstd_level, tiff_predictor, tiff_rtype, tiff_itype, tiff_btype;
+int tiff_tiled;
 int webp_preset, webp_quality, webp_compression;
 int lbm_mask, lbm_untrans, lbm_pack, lbm_pbm;
 int apply_icc;
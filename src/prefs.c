@@ -162,7 +162,7 @@ static void *pref_code[] = {
 	TABLE2(6),
 	TSPINv(_("Max threads (0 to autodetect)"), maxthreads, 0, 256),
 	TSPINv(_("Min kpixels per render thread"), kpix_threads,
-		16, (MAX_WIDTH * MAX_HEIGHT + 1023) / 1024),
+		16, ((MAX_WIDTH + 31) / 32) * ((MAX_HEIGHT + 31) / 32)),
 #define XROWS 2
 #else
 	TABLE2(4),
@@ -181,6 +181,7 @@ static void *pref_code[] = {
 	/* !!! Only processing is scriptable, interface is not */
 	UNLESSx(script, 1),
 	CHECKv(_("Optimize alpha chequers"), chequers_optimize),
+	CHECKv(_("Smooth zoomed-out canvas (mipmap)"), canvas_mipmap),
 	CHECKv(_("Disable view window transparencies"), opaque_view),
 	CHECKv(_("Enable overlays by layer"), layer_overlay),
 	WDONE,
@@ -253,6 +254,7 @@ static void *pref_code[] = {
 	ENDIF(1),
 	WDONE,
 	CHECKv(_("Enable predictor"), tiff_predictor),
+	CHECKv(_("Write tiles (multithreaded)"), tiff_tiled),
 	WDONE,
 #endif
 #ifdef U_WEBP
@@ -182,7 +182,7 @@ static char *get_temp_file(int type, int rgb)
 	tempfile *tmp;
 	unsigned char *img = NULL;
 	char buf[PATHBUF], *f = "tmp.png";
-	int res;
+	int i, res;
 
 	/* Use the original file if possible */
 	if (!mem_changed && mem_filename && (!rgb ^ (mem_img_bpp == 3)) &&
@@ -218,11 +218,13 @@ static char *get_temp_file(int type, int rgb)
 	if (rgb && (mem_img_bpp == 1)) /* Save indexed as RGB */
 	{
 		settings.img[CHN_IMAGE] = img =
-			malloc(mem_width * mem_height * 3);
+			malloc((size_t)mem_width * mem_height * 3);
 		if (!img) return (NULL); /* Failed to allocate RGB buffer */
 		settings.bpp = 3;
-		do_convert_rgb(0, 1, mem_width * mem_height, img,
-			mem_img[CHN_IMAGE], mem_pal);
+		for (i = 0; i < mem_height; i++)
+			do_convert_rgb(0, 1, mem_width, img +
+				(size_t)i * mem_width * 3, mem_img[CHN_IMAGE] +
+				(size_t)i * mem_width, mem_pal);
 	}
 	res = save_image(buf, &settings);
 	free(img);
@@ -858,7 +860,7 @@ int spawn_process(char *argv[], char *directory)
 /*	global colourmaps, suppress warning, high optimizations, background
  *	removal method, infinite loops, ensure result works with Java & MS IE */
 #define CMD_GIF_CREATE \
-	"gifsicle --colors 256 -w -O2 -D 2 -l0 --careful -d ((delay)) ((srcmask)) -o ((dest))"
+	"gifsicle --colors 256 -w -O2 -D ((disposal)) -l0 --careful -d ((delay)) ((srcmask)) -o ((dest))"
 #define CMD_GIF_PLAY "gifview -a ((src)) &"
 
 #endif
@@ -931,6 +933,10 @@ static char *interpolate_action(char *pattern, da_settings *ds)
 			/* Delay in 1/100s */
 			else if (!strncmp(p, "delay", n))
 				j = sprintf(line ? line + l : buf, "%d", ds->delay);
+			/* Disposal method, background removal by default */
+			else if (!strncmp(p, "disposal", n))
+				j = sprintf(line ? line + l : buf, "%d",
+					ds->disposal ? ds->disposal : 2);
 			/* Width */
 			else if (!strncmp(p, "w", n))
 			{
@@ -56,6 +56,7 @@ typedef struct {
 	char *dname;
 	int delay; // in 1/100s of a second
 	int width, height;
+	int disposal; // GIF frame disposal method, 0 for default
 } da_settings;
 
 //	Run any default action
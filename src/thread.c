@@ -268,7 +268,7 @@ int launch_threads(thread_func thread, threaddata *tdata, char *title, int total
 {
 	tcb *tp;
 	clock_t uninit_(before), now;
-	int i, j, n0, n1, flag = FALSE;
+	int i, j, n0, n1, flag = FALSE, nested = threads_running;
 #if GTK_MAJOR_VERSION == 1
 	pthread_t tid;
 	pthread_attr_t attr;
@@ -291,7 +291,8 @@ int launch_threads(thread_func thread, threaddata *tdata, char *title, int total
 	/* Launch aux threads */
 	tdata->what = thread;
 	if (tdata->chunks >= 0) thread = thread_chunk;
-	threads_running = TRUE;
+	/* Called from a helper thread, do everything in it, part by part */
+	if (!nested) threads_running = TRUE;
 	for (i -= 1; i > 0; i--)
 	{
 		tp = tdata->threads[i];
@@ -301,16 +302,17 @@ int launch_threads(thread_func thread, threaddata *tdata, char *title, int total
 		/* Allocate work to thread */
 		tp->step0 = n0 = (n1 * i) / (i + 1);
 		tp->nsteps = n1 - n0;
+		if (nested) thread(tp) , n1 = n0;
 #if GTK_MAJOR_VERSION == 1
-		if (attr_failed || pthread_create(&tid, &attr,
+		else if (attr_failed || pthread_create(&tid, &attr,
 			(void *(*)(void *))thread, tp))
 #else 
-		if (!g_thread_create((GThreadFunc)thread, tp, FALSE, NULL))
+		else if (!g_thread_create((GThreadFunc)thread, tp, FALSE, NULL))
 #endif
 			tp->stop = TRUE , tp->stopped = TRUE; // Failed to launch
 		else n1 = n0 , flag = TRUE; // Success - work is now being done
 	}
-	threads_running = flag;
+	if (!nested) threads_running = flag;
 #if GTK_MAJOR_VERSION == 1
 	pthread_attr_destroy(&attr);
 #endif
@@ -354,7 +356,7 @@ int launch_threads(thread_func thread, threaddata *tdata, char *title, int total
 		g_thread_yield();
 #endif
 	}
-	threads_running = FALSE;
+	if (!nested) threads_running = FALSE;
 	if (title) progress_end();
 
 /* !!! Even with OS threading, killing a thread is not supported on some systems,
@@ -775,12 +775,14 @@ static int release_palette(void *dt, void **wdata, int what, void **where,
 		if ( drag_index_vals[0] != drag_index_vals[1] )
 		{
 			mem_pal_copy(mem_pal, brcosa_palette);	// Get old values back
-			mem_undo_next(UNDO_XPAL);		// Do undo stuff
-			mem_pal_index_move( drag_index_vals[0], drag_index_vals[1] );
-
-			mem_canvas_index_move( drag_index_vals[0], drag_index_vals[1] );
-
-			mem_undo_prepare();
+			if (!mem_undo_next(UNDO_XPAL))		// Do undo stuff
+			{
+				mem_pal_index_move(drag_index_vals[0],
+					drag_index_vals[1]);
+				mem_canvas_index_move(drag_index_vals[0],
+					drag_index_vals[1]);
+				mem_undo_prepare();
+			}
 			update_stuff(UPD_TPAL | CF_MENU);
 		}
 	}
@@ -136,6 +136,198 @@ void pressed_help()
 
 
 
+///	CANVAS MIPMAP
+
+/* Box-filtered RGB pyramid of current image, level N being 1/2^N size, for
+ * zoomed-out canvas and pan window; areas changed in the image are marked
+ * dirty, and levels get refreshed from them when next used */
+
+#define MIP_LEVELS 12
+
+int canvas_mipmap;
+
+static struct {
+	unsigned char *img, *mem;	// Source image, and memory for levels
+	unsigned char *lv[MIP_LEVELS + 1];
+	int w[MIP_LEVELS + 1], h[MIP_LEVELS + 1];
+	int dirty[MIP_LEVELS + 1][4];	// Dirty areas in image coords; [0] is all
+	int n, bpp;
+} mip;
+
+typedef struct {
+	int l, xy[4];		// Level and area to refresh
+} mip_fill_state;
+
+void mip_reset()
+{
+	free(mip.mem);
+	mip.mem = mip.img = NULL;
+}
+
+/* Mark x,y,w,h area of current image as changed */
+void mip_update_area(int x, int y, int w, int h)
+{
+	int i, *d, rxy[4];
+
+	if (!mip.mem || !clip(rxy, x, y, x + w, y + h, mip.dirty[0])) return;
+	for (i = 1; i <= mip.n; i++)
+	{
+		d = mip.dirty[i];
+		if (d[0] >= d[2]) copy4(d, rxy);
+		else
+		{
+			if (d[0] > rxy[0]) d[0] = rxy[0];
+			if (d[1] > rxy[1]) d[1] = rxy[1];
+			if (d[2] < rxy[2]) d[2] = rxy[2];
+			if (d[3] < rxy[3]) d[3] = rxy[3];
+		}
+	}
+}
+
+static void mip_rows(mip_fill_state *fs, int y0, int y1)
+{
+	png_color *p0, *p1, *p2, *p3;
+	unsigned char *src0, *src1, *dest;
+	int l = fs->l, sw = mip.w[l - 1], sh = mip.h[l - 1];
+	int bpp = l > 1 ? 3 : mip.bpp;
+	int i, j, k, x, xx;
+
+	for (i = y0; i < y1; i++)
+	{
+		src0 = mip.lv[l - 1] + (size_t)i * 2 * sw * bpp;
+		src1 = i * 2 + 1 < sh ? src0 + sw * bpp : src0;
+		dest = mip.lv[l] + ((size_t)i * mip.w[l] + fs->xy[0]) * 3;
+		for (j = fs->xy[0]; j < fs->xy[2]; j++ , dest += 3)
+		{
+			x = j * 2;
+			xx = x + 1 < sw ? x + 1 : x;
+			if (bpp == 1) /* Indexed */
+			{
+				p0 = mem_pal + src0[x]; p1 = mem_pal + src0[xx];
+				p2 = mem_pal + src1[x]; p3 = mem_pal + src1[xx];
+				dest[0] = (p0->red + p1->red +
+					p2->red + p3->red + 2) >> 2;
+				dest[1] = (p0->green + p1->green +
+					p2->green + p3->green + 2) >> 2;
+				dest[2] = (p0->blue + p1->blue +
+					p2->blue + p3->blue + 2) >> 2;
+				continue;
+			}
+			x *= 3; xx *= 3;
+			for (k = 0; k < 3; k++) dest[k] = (src0[x + k] +
+				src0[xx + k] + src1[x + k] + src1[xx + k] + 2) >> 2;
+		}
+	}
+}
+
+static void mip_fill(tcb *thread)
+{
+	mip_fill_state *fs = thread->data;
+	int y0 = fs->xy[1] + thread->step0;
+
+	mip_rows(fs, y0, y0 + thread->nsteps);
+	thread_done(thread);
+}
+
+/* Bring pyramid up to date for given zoom; return level to use, or 0 */
+int mip_prepare(int zoom)
+{
+	mip_fill_state fs;
+	threaddata *tdata = NULL;
+	size_t sz;
+	int i, l, n, w, h, *d;
+
+	if (!canvas_mipmap)
+	{
+		mip_reset();
+		return (0);
+	}
+	for (l = 0; (l < MIP_LEVELS) && (zoom >> (l + 1)); l++);
+	if (!l) return (0);
+
+	/* (Re)create pyramid if image changed */
+	if ((mip.img != mem_img[CHN_IMAGE]) || (mip.bpp != mem_img_bpp) ||
+		(mip.w[0] != mem_width) || (mip.h[0] != mem_height))
+	{
+		mip_reset();
+		mip.w[0] = mem_width;
+		mip.h[0] = mem_height;
+		for (sz = n = 0; (n < MIP_LEVELS) &&
+			((mip.w[n] > 1) || (mip.h[n] > 1)); n++)
+		{
+			mip.w[n + 1] = (mip.w[n] + 1) >> 1;
+			mip.h[n + 1] = (mip.h[n] + 1) >> 1;
+			sz += (size_t)mip.w[n + 1] * mip.h[n + 1] * 3;
+		}
+		if (!n || !(mip.mem = malloc(sz))) return (0);
+		mip.lv[0] = mip.img = mem_img[CHN_IMAGE];
+		mip.bpp = mem_img_bpp;
+		mip.n = n;
+		for (sz = 0 , i = 1; i <= n; i++)
+		{
+			mip.lv[i] = mip.mem + sz;
+			sz += (size_t)mip.w[i] * mip.h[i] * 3;
+		}
+		for (i = 0; i <= n; i++)
+		{
+			d = mip.dirty[i];
+			d[0] = d[1] = 0;
+			d[2] = mip.w[0];
+			d[3] = mip.h[0];
+		}
+	}
+	if (l > mip.n) l = mip.n;
+
+	/* Refresh dirty areas, from bottom up */
+	for (i = 1; i <= l; i++)
+	{
+		d = mip.dirty[i];
+		if (d[0] >= d[2]) continue;
+		fs.l = i;
+		fs.xy[0] = d[0] >> i;
+		fs.xy[1] = d[1] >> i;
+		fs.xy[2] = ((d[2] - 1) >> i) + 1;
+		fs.xy[3] = ((d[3] - 1) >> i) + 1;
+		d[0] = d[2] = 0;
+
+		w = fs.xy[2] - fs.xy[0];
+		h = fs.xy[3] - fs.xy[1];
+		n = image_threads(w * 2, h * 2);
+		if (n > 1) tdata = talloc(MA_ALIGN_DEFAULT, n, &fs, sizeof(fs),
+			NULL, NULL);
+		if (!tdata) mip_rows(&fs, fs.xy[1], fs.xy[3]);
+		else
+		{
+			tdata->silent = TRUE;
+			launch_threads(mip_fill, tdata, NULL, h);
+			free(tdata);
+			tdata = NULL;
+		}
+	}
+	return (l);
+}
+
+/* Fill RGB row of cnt pixels at zoom, from level l, for image's x,y */
+void mip_row(unsigned char *dest, int x, int y, int zoom, int cnt, int l)
+{
+	unsigned char *src;
+	int i, j, w = mip.w[l] - 1, half = zoom >> 1;
+
+	/* Level pixel which is nearest to the box's center */
+	j = (y + half) >> l;
+	src = mip.lv[l] + (size_t)(j < mip.h[l] ? j : mip.h[l] - 1) * (w + 1) * 3;
+	for (x += half , i = 0; i < cnt; i++ , x += zoom , dest += 3)
+	{
+		j = x >> l;
+		if (j > w) j = w;
+		j *= 3;
+		dest[0] = src[j + 0];
+		dest[1] = src[j + 1];
+		dest[2] = src[j + 2];
+	}
+}
+
+
 ///	PAN WINDOW
 
 int max_pan;
@@ -149,17 +341,25 @@ typedef struct {
 
 void draw_pan_thumb(pan_dd *dt, int x1, int y1, int x2, int y2)
 {
-	int i, j, k, ix, iy, zoom = 1, scale = 1;
+	int i, j, k, l, ix, iy, zoom, scale = 1;
 	int pan_w = dt->wh[0], pan_h = dt->wh[1];
 	unsigned char *dest, *src;
 
 	/* Create thumbnail */
 	dest = dt->rgb;
+	zoom = mem_width / pan_w;
+	if (zoom > mem_height / pan_h) zoom = mem_height / pan_h;
+	l = mip_prepare(zoom);
 	for (i = 0; i < pan_h; i++)
 	{
 		iy = (i * mem_height) / pan_h;
-		src = mem_img[CHN_IMAGE] + iy * mem_width * mem_img_bpp;
-		if (mem_img_bpp == 3) /* RGB */
+		src = mem_img[CHN_IMAGE] + (size_t)iy * mem_width * mem_img_bpp;
+		if (l) /* Mipmap */
+		{
+			for (j = 0; j < pan_w; j++ , dest += 3)
+				mip_row(dest, (j * mem_width) / pan_w, iy, zoom, 1, l);
+		}
+		else if (mem_img_bpp == 3) /* RGB */
 		{
 			for (j = 0; j < pan_w; j++ , dest += 3)
 			{
@@ -183,6 +383,7 @@ void draw_pan_thumb(pan_dd *dt, int x1, int y1, int x2, int y2)
 
 
 	/* !!! This uses the fact that zoom factor is either N or 1/N !!! */
+	zoom = 1;
 	if (can_zoom < 1.0) zoom = rint(1.0 / can_zoom);
 	else scale = rint(can_zoom);
 
@@ -373,14 +574,49 @@ static void **vw_scrolledwindow;
 void **vw_drawing;
 int vw_focus_on;
 
+/* Test if packed channel is all fill, and the fill is a given value */
+static int sparse_solid(sparse_info *sp, int chan, int v)
+{
+	unsigned char **tp = sp->tiles[chan];
+	size_t l, n = (size_t)sp->tw * sp->th;
+
+	if (sp->fill[chan][0] != v) return (FALSE);
+	for (l = 0; l < n; l++) if (tp[l]) return (FALSE);
+	return (TRUE);
+}
+
+/* Test if a packed row span is invisible: its tiles are all unallocated, with
+ * fill being either zero alpha or the transparent colour */
+static int sparse_clear(sparse_info *sp, int bpp, int xpm, int x, int y, int w)
+{
+	unsigned char **ap = NULL, **ip = NULL, *f = sp->fill[CHN_IMAGE];
+	size_t n;
+	int i;
+
+	if (sp->tiles[CHN_ALPHA] && !sp->fill[CHN_ALPHA][0])
+		ap = sp->tiles[CHN_ALPHA];
+	if ((xpm > -1) && ((bpp == 1 ? *f : MEM_2_INT(f, 0)) == xpm))
+		ip = sp->tiles[CHN_IMAGE];
+	if (!ap && !ip) return (FALSE);
+	n = (size_t)(y >> SPARSE_SHIFT) * sp->tw;
+	for (i = x >> SPARSE_SHIFT; i <= (x + w - 1) >> SPARSE_SHIFT; i++)
+	{
+		if (ap && !ap[n + i]) continue;
+		if (ip && !ip[n + i]) continue;
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
 size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale,
 	int lr0, int lr1, int view)
 {
 	renderstate rs;
 	int rxy[4], txy[4] = { cxy[2], cxy[3], cxy[0], cxy[1] };
 	image_info *image;
-	unsigned char *tmp, **img;
-	int i, j, ii, jj, ll, wx0, wy0, wx1, wy1, xpm, opac;
+	unsigned char *tmp, **img, *sbuf;
+	chanlist xtra;
+	int i, j, ii, jj, ll, wx0, wy0, wx1, wy1, xpm, opac, sw = 0;
 	int dx, dy, ddx, ddy, mx, mw, my, mh;
 	int px = cxy[0], py = cxy[1];
 	size_t npix = 0, nrow = 0;
@@ -437,7 +673,7 @@ size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale
 		if (!rgb) /* Calculating area & load */
 		{
 			int mw = rxy[2] - rxy[0], mh = rxy[3] - rxy[1];
-			npix += mw * mh;
+			npix += (size_t)mw * mh;
 			nrow += mh;
 			if (txy[0] > rxy[0]) txy[0] = rxy[0];
 			if (txy[1] > rxy[1]) txy[1] = rxy[1];
@@ -453,7 +689,7 @@ size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale
 		setup_row(&rs, mx, mw, zoom, scale, image->width, xpm, opac,
 			image->bpp, image->pal);
 		mh = rxy[3] - (my = rxy[1]);
-		tmp = rgb + (my - py) * pw + (mx - px) * 3;
+		tmp = rgb + (size_t)(my - py) * pw + (mx - px) * 3;
 		ddx = floor_div(mx * zoom, scale) - i;
 		ddy = floor_div(my * zoom, scale) - j;
 
@@ -461,6 +697,17 @@ size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale
 		if (i < 0) i += scale;
 		mh = mh * zoom + i;
 		img = image->img;
+		sbuf = NULL;
+		if (image->sparse) /* Gather rows out of tiles */
+		{
+			sw = floor_div((mx + mw - 1) * zoom, scale) -
+				floor_div(mx * zoom, scale) + 1;
+			if (!(sbuf = malloc(sw * (image->bpp + 1)))) continue;
+			memset(xtra, 0, sizeof(chanlist));
+			xtra[CHN_IMAGE] = sbuf;
+			if (IMG_HAS(image, CHN_ALPHA))
+				xtra[CHN_ALPHA] = sbuf + sw * image->bpp;
+		}
 		for (j = -1; i < mh; i += zoom , tmp += pw)
 		{
 			if ((i / scale == j) && !async_bk)
@@ -469,8 +716,17 @@ size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale
 				continue;
 			}
 			j = i / scale;
-			render_row(&rs, tmp, img, ddx, ddy + j, NULL);
+			if (!sbuf) render_row(&rs, tmp, img, ddx, ddy + j, NULL);
+			/* Skip rows where all tiles are empty */
+			else if (overlay_alpha || !sparse_clear(image->sparse,
+				image->bpp, rs.xpm, ddx, ddy + j, sw))
+			{
+				mem_sparse_row(image->sparse, image->bpp, xtra,
+					ddx, ddy + j, sw);
+				render_row(&rs, tmp, xtra, 0, 0, xtra);
+			}
 		}
+		free(sbuf);
 	}
 
 #ifdef U_THREADS
@@ -542,7 +798,7 @@ void view_render_rgb( unsigned char *rgb, int px, int py, int pw, int ph, double
 	nt2 = ceil_div(vpix, kpix_threads * 1024 * 4);
 	if (nt2 > nt) nt2 = nt;
 
-	ls.rgb += ((ls.cxy[1] - py) * pw + ls.cxy[0] - px) * 3;
+	ls.rgb += ((size_t)(ls.cxy[1] - py) * pw + ls.cxy[0] - px) * 3;
 
 	ls.tdata = talloc(MA_SKIP_ZEROSIZE | MA_FLAG_NONE, nt2,
 		&ls, sizeof(ls), NULL, NULL);
@@ -566,6 +822,238 @@ void view_render_rgb( unsigned char *rgb, int px, int py, int pw, int ph, double
 	overlay_alpha = tmp;
 }
 
+////	CANVAS LAYERS CACHE
+
+/* Where the background layer is opaque, the composite of layers below the
+ * current one does not depend on anything beneath, and nearest-neighbour
+ * zooming commutes with per-pixel compositing; so the composite is kept at
+ * canvas zoom (but not scale), filled in tiles on demand, and reused until
+ * something below changes */
+
+#define LRC_TILE 64
+
+typedef struct {
+	layer_image *image;
+	unsigned char *img, *alpha;
+	int x, y, opacity, visible;
+} lrc_sig;
+
+static struct {
+	unsigned char *rgb, *valid;
+	int xy[4];		// Covered area, in cache coords (canvas at scale 1)
+	int w, h, tw, th;	// Size in pixels and in tiles
+	int zoom, sel, oalpha;
+	lrc_sig sig[MAX_LAYERS];
+} lr_cache;
+
+void lr_cache_reset()
+{
+	free(lr_cache.rgb);
+	lr_cache.rgb = lr_cache.valid = NULL;
+}
+
+/* Check if layers below still are what the cache was made from */
+static int lr_cache_check(int zoom, int *cxy)
+{
+	lrc_sig sig[MAX_LAYERS];
+	int i;
+
+	memset(sig, 0, sizeof(sig));
+	for (i = 0; i < layer_selected; i++)
+	{
+		layer_node *t = layer_table_p + i;
+		image_info *image = &t->image->image_;
+
+		sig[i].image = t->image;
+		sig[i].img = image->img[CHN_IMAGE];
+		sig[i].alpha = image->img[CHN_ALPHA];
+		sig[i].x = t->x;
+		sig[i].y = t->y;
+		sig[i].opacity = t->opacity;
+		sig[i].visible = t->visible;
+	}
+	i = lr_cache.rgb && (lr_cache.sel == layer_selected) &&
+		(lr_cache.zoom == zoom) && (lr_cache.oalpha == overlay_alpha) &&
+		!memcmp(lr_cache.xy, cxy, sizeof(int) * 4) &&
+		!memcmp(lr_cache.sig, sig, sizeof(sig));
+	if (!i) memcpy(lr_cache.sig, sig, sizeof(sig));
+	return (i);
+}
+
+typedef struct {
+	int txy[4];		// Tiles to fill
+	int tw;
+} lrc_fill_state;
+
+static void lr_cache_fill(tcb *thread)
+{
+	lrc_fill_state *fs = thread->data;
+	int n, x, y, rxy[4];
+
+	for (n = thread->step0; n < thread->step0 + thread->nsteps; n++)
+	{
+		x = fs->txy[0] + n % fs->tw;
+		y = fs->txy[1] + n / fs->tw;
+		if (lr_cache.valid[y * lr_cache.tw + x]) continue;
+		clip(rxy, x * LRC_TILE + lr_cache.xy[0],
+			y * LRC_TILE + lr_cache.xy[1],
+			(x + 1) * LRC_TILE + lr_cache.xy[0],
+			(y + 1) * LRC_TILE + lr_cache.xy[1], lr_cache.xy);
+		render_layers(lr_cache.rgb + ((size_t)(rxy[1] - lr_cache.xy[1]) *
+			lr_cache.w + rxy[0] - lr_cache.xy[0]) * 3, rxy,
+			lr_cache.w * 3, lr_cache.zoom, 1, 0, layer_selected - 1,
+			FALSE);
+		lr_cache.valid[y * lr_cache.tw + x] = 1;
+	}
+}
+
+/* Make cache ready for rendering canvas area at given zoom & scale; return
+ * FALSE if it cannot be used there */
+int lr_cache_prepare(int *vxy, int zoom, int scale)
+{
+	lrc_fill_state fs;
+	threaddata *tdata;
+	layer_node *t = layer_table_p;
+	image_info *image = &t->image->image_;
+	int cxy[4], rxy[4], ixy[4] = { 0, 0, 0, 0 }, i, w, h, tw, th;
+
+
+	/* Need some layers below, and an opaque background layer */
+	if (!layer_selected || !t->visible || (t->opacity < 100) ||
+		(IMG_HAS(image, CHN_ALPHA) && !overlay_alpha))
+	{
+		lr_cache_reset();
+		return (FALSE);
+	}
+
+	/* Where background layer and current image overlap */
+	ixy[2] = ceil_div(mem_width, zoom);
+	ixy[3] = ceil_div(mem_height, zoom);
+	i = t->x - layer_table_p[layer_selected].x;
+	w = t->y - layer_table_p[layer_selected].y;
+	if (!clip(cxy, ceil_div(i, zoom), ceil_div(w, zoom),
+		floor_div(i + image->width - 1, zoom) + 1,
+		floor_div(w + image->height - 1, zoom) + 1, ixy))
+	{
+		lr_cache_reset();
+		return (FALSE);
+	}
+
+	/* (Re)create cache if anything changed */
+	if (!lr_cache_check(zoom, cxy))
+	{
+		lr_cache_reset();
+		w = cxy[2] - cxy[0];
+		h = cxy[3] - cxy[1];
+		tw = (w + LRC_TILE - 1) / LRC_TILE;
+		th = (h + LRC_TILE - 1) / LRC_TILE;
+		lr_cache.rgb = calloc(1, (size_t)w * h * 3 + tw * th);
+		if (!lr_cache.rgb) return (FALSE);
+		lr_cache.valid = lr_cache.rgb + (size_t)w * h * 3;
+		copy4(lr_cache.xy, cxy);
+		lr_cache.w = w;
+		lr_cache.h = h;
+		lr_cache.tw = tw;
+		lr_cache.th = th;
+		lr_cache.zoom = zoom;
+		lr_cache.sel = layer_selected;
+		lr_cache.oalpha = overlay_alpha;
+	}
+
+	/* Find which tiles the area needs */
+	if (!clip(rxy, floor_div(vxy[0], scale), floor_div(vxy[1], scale),
+		floor_div(vxy[2] - 1, scale) + 1,
+		floor_div(vxy[3] - 1, scale) + 1, cxy)) return (FALSE);
+	fs.txy[0] = (rxy[0] - cxy[0]) / LRC_TILE;
+	fs.txy[1] = (rxy[1] - cxy[1]) / LRC_TILE;
+	fs.txy[2] = (rxy[2] - cxy[0] - 1) / LRC_TILE + 1;
+	fs.txy[3] = (rxy[3] - cxy[1] - 1) / LRC_TILE + 1;
+	fs.tw = fs.txy[2] - fs.txy[0];
+	th = fs.txy[3] - fs.txy[1];
+
+	/* Fill the missing ones */
+	for (i = fs.txy[1]; i < fs.txy[3]; i++)
+		if (!is_filled(lr_cache.valid + i * lr_cache.tw + fs.txy[0],
+			1, fs.tw)) break;
+	if (i < fs.txy[3])
+	{
+		tdata = talloc(MA_ALIGN_DEFAULT,
+			image_threads(rxy[2] - rxy[0], rxy[3] - rxy[1]),
+			&fs, sizeof(fs), NULL, NULL);
+		if (!tdata) return (FALSE);
+		tdata->chunks = MAX_TH_STRIPS;
+		tdata->silent = TRUE;
+		launch_threads(lr_cache_fill, tdata, NULL, fs.tw * th);
+		free(tdata);
+	}
+	return (TRUE);
+}
+
+/* Mark image area of layers below as needing a refill */
+static void lr_cache_update(int x, int y, int w, int h)
+{
+	int i, zoom = lr_cache.zoom, rxy[4];
+
+	if (!lr_cache.rgb || (w <= 0) || (h <= 0)) return;
+	if (!clip(rxy, floor_div(x, zoom), floor_div(y, zoom),
+		floor_div(x + w - 1, zoom) + 1, floor_div(y + h - 1, zoom) + 1,
+		lr_cache.xy)) return;
+	rxy[0] = (rxy[0] - lr_cache.xy[0]) / LRC_TILE;
+	rxy[1] = (rxy[1] - lr_cache.xy[1]) / LRC_TILE;
+	rxy[2] = (rxy[2] - lr_cache.xy[0] - 1) / LRC_TILE + 1;
+	rxy[3] = (rxy[3] - lr_cache.xy[1] - 1) / LRC_TILE + 1;
+	for (i = rxy[1]; i < rxy[3]; i++)
+		memset(lr_cache.valid + i * lr_cache.tw + rxy[0], 0,
+			rxy[2] - rxy[0]);
+}
+
+/* Render canvas area from cache, falling back on layers where not cached */
+void lr_cache_render(unsigned char *rgb, int *vxy, int pw, int zoom, int scale)
+{
+	unsigned char *dest, *src;
+	int rect04[5 * 4], *p = rect04;
+	int i, j, k, n, x0, w;
+
+	n = clip4(rect04, vxy[0], vxy[1], vxy[2] - vxy[0], vxy[3] - vxy[1],
+		lr_cache.xy[0] * scale, lr_cache.xy[1] * scale,
+		lr_cache.w * scale, lr_cache.h * scale);
+
+	/* Cached part */
+	x0 = p[0] - vxy[0];
+	w = p[2];
+	for (i = 0; i < p[3]; i++)
+	{
+		dest = rgb + (p[1] - vxy[1] + i) * pw + x0 * 3;
+		src = lr_cache.rgb + ((size_t)(floor_div(p[1] + i, scale) -
+			lr_cache.xy[1]) * lr_cache.w - lr_cache.xy[0]) * 3;
+		if (scale == 1)
+		{
+			memcpy(dest, src + p[0] * 3, w * 3);
+			continue;
+		}
+		for (j = 0; j < w; j++ , dest += 3)
+		{
+			k = floor_div(p[0] + j, scale) * 3;
+			dest[0] = src[k + 0];
+			dest[1] = src[k + 1];
+			dest[2] = src[k + 2];
+		}
+	}
+
+	/* Uncached parts */
+	while (n--)
+	{
+		int rxy[4];
+
+		p += 4;
+		if (!p[2] || !p[3]) continue;
+		rxy[2] = (rxy[0] = p[0]) + p[2];
+		rxy[3] = (rxy[1] = p[1]) + p[3];
+		render_layers(rgb + (rxy[1] - vxy[1]) * pw + (rxy[0] - vxy[0]) * 3,
+			rxy, pw, zoom, scale, 0, layer_selected - 1, FALSE);
+	}
+}
+
 ////	COMPOSITE ALPHA
 
 int comp_need_alpha(int ftype)
@@ -573,6 +1061,7 @@ int comp_need_alpha(int ftype)
 	layer_node *t = layer_table;
 	image_info *image = layer_selected ? &t->image->image_ : &mem_image;
 	unsigned char *alpha = image->img[CHN_ALPHA];
+	sparse_info *sp = image->sparse;
 
 	/* Format has to support alpha */
 	ftype &= FTM_FTYPE;
@@ -580,7 +1069,9 @@ int comp_need_alpha(int ftype)
 		return (FALSE);
 	/* Background has to not be solid */
 	return (!t->visible || (!opaque_view && ((t->opacity < 100) ||
-		(alpha && !is_filled(alpha, 255, image->width * image->height)))));
+		(alpha ? !is_filled(alpha, 255,
+		(size_t)image->width * image->height) :
+		sp && sp->tiles[CHN_ALPHA] && !sparse_solid(sp, CHN_ALPHA, 255)))));
 }
 
 void collect_alpha(unsigned char *alpha, int pw, int ph)
@@ -588,15 +1079,17 @@ void collect_alpha(unsigned char *alpha, int pw, int ph)
 	int rxy[4], cxy[4] = { 0, 0, pw, ph };
 	unsigned char buf[MAX_WIDTH];
 	image_info *image;
-	unsigned char *tmp, *src, **img;
+	unsigned char *tmp, *src, **img, *sbuf;
+	chanlist xtra;
+	size_t loc;
 	int i, j, k, ll, xpm, opac;
-	int dx, dy, ddx, ddy, mx, mw, my, mh, loc;
+	int dx, dy, ddx, ddy, mx, mw, my, mh;
 
 	/* Align on background */
 	dx = layer_table[0].x;
 	dy = layer_table[0].y;
 
-	memset(alpha, 0, pw * ph);
+	memset(alpha, 0, (size_t)pw * ph);
 	for (ll = 0; ll <= layers_total; ll++)
 	{
 		layer_node *t = layer_table + ll;
@@ -614,14 +1107,32 @@ void collect_alpha(unsigned char *alpha, int pw, int ph)
 		opac = opaque_view ? 255 : (t->opacity * 255 + 50) / 100;
 		mw = rxy[2] - (mx = rxy[0]);
 		mh = rxy[3] - (my = rxy[1]);
-		tmp = alpha + my * pw + mx;
+		tmp = alpha + (size_t)my * pw + mx;
 		ddx = mx - i;
 		ddy = my - j;
 
 		img = image->img;
+		sbuf = NULL;
+		if (image->sparse && !opaque_view) /* Gather rows out of tiles */
+		{
+			if (!(sbuf = malloc(mw * (image->bpp + 1)))) continue;
+			memset(img = xtra, 0, sizeof(chanlist));
+			xtra[CHN_IMAGE] = sbuf;
+			if (IMG_HAS(image, CHN_ALPHA))
+				xtra[CHN_ALPHA] = sbuf + mw * image->bpp;
+		}
 		for (i = 0; i < mh; i++ , tmp += pw)
 		{
-			loc = (ddy + i) * image->width + ddx;
+			loc = (size_t)(ddy + i) * image->width + ddx;
+			if (sbuf)
+			{
+				/* Skip rows where all tiles are empty */
+				if (sparse_clear(image->sparse, image->bpp, xpm,
+					ddx, ddy + i, mw)) continue;
+				mem_sparse_row(image->sparse, image->bpp, xtra,
+					ddx, ddy + i, mw);
+				loc = 0;
+			}
 			/* Prepare effective source alpha */
 			if (!img[CHN_ALPHA] || opaque_view) memset(buf, 255, mw);
 			else memcpy(buf, img[CHN_ALPHA] + loc, mw);
@@ -655,6 +1166,7 @@ void collect_alpha(unsigned char *alpha, int pw, int ph)
 				tmp[j] = (k + (k >> 8) + 1) >> 8;
 			}
 		}
+		free(sbuf);
 	}
 }
 
@@ -823,6 +1335,7 @@ void lr_update_area(int lr, int x, int y, int w, int h)	// Update x,y,w,h area o
 	{
 		mx = x + layer_table_p[lr].x - layer_table_p[layer_selected].x;
 		my = y + layer_table_p[lr].y - layer_table_p[layer_selected].y;
+		if (lr < lr_cache.sel) lr_cache_update(mx, my, w, h);
 		main_update_area(mx, my, w, h);
 	}
 
@@ -862,8 +1375,10 @@ static int vw_mouse_event(void *dt, void **wdata, int what, void **where,
 	mouse_ext *mouse)
 {
 	image_info *image;
-	unsigned char *rgb, **img;
-	int x, y, dx, dy, i, lx, ly, lw, lh, bpp, tpix, ppix, ofs;
+	unsigned char *rgb, **img, pix[4];
+	chanlist pxl;
+	size_t ofs;
+	int x, y, dx, dy, i, lx, ly, lw, lh, bpp, tpix, ppix;
 	int pflag = mouse->count >= 0, zoom = 1, scale = 1;
 	png_color *pal;
 
@@ -919,9 +1434,20 @@ static int vw_mouse_event(void *dt, void **wdata, int what, void **where,
 			if ( x>=lx && x<(lx + lw) && y>=ly && y<(ly + lh) &&
 				layer_table[i].visible )
 			{
-				ofs = (x-lx) + lw*(y-ly);
+				ofs = (x-lx) + lw*(size_t)(y-ly);
 				/* Is transparency disabled? */
 				if (opaque_view) break;
+				if (image->sparse) /* Fetch the one pixel */
+				{
+					memset(pxl, 0, sizeof(chanlist));
+					pxl[CHN_IMAGE] = rgb = pix;
+					if (IMG_HAS(image, CHN_ALPHA))
+						pxl[CHN_ALPHA] = pix + 3;
+					mem_sparse_row(image->sparse, bpp, pxl,
+						x - lx, y - ly, 1);
+					img = pxl;
+					ofs = 0;
+				}
 				/* Is click on a non transparent pixel? */
 				if (img[CHN_ALPHA])
 				{
@@ -28,6 +28,7 @@ int vw_focus_on;
 float vw_zoom;
 int opaque_view;
 int max_pan;
+int canvas_mipmap;
 
 void **vw_drawing;
 
@@ -54,6 +55,13 @@ void view_render_rgb( unsigned char *rgb, int px, int py, int pw, int ph, double
 size_t render_layers(unsigned char *rgb, int cxy[4], int pw, int zoom, int scale,
 	int lr0, int lr1, int view);
 void lr_update_area(int lr, int x, int y, int w, int h);	// Update x,y,w,h area of a layer
+void lr_cache_reset();						// Drop cached layers composite
+int lr_cache_prepare(int *vxy, int zoom, int scale);		// Ready cache for canvas area
+void lr_cache_render(unsigned char *rgb, int *vxy, int pw, int zoom, int scale);
+void mip_reset();						// Drop image mipmap
+void mip_update_area(int x, int y, int w, int h);		// Mark x,y,w,h area as changed
+int mip_prepare(int zoom);					// Ready mipmap for zoom
+void mip_row(unsigned char *dest, int x, int y, int zoom, int cnt, int l);
 #define LR_ANIM 0x10000 /* Update only view window */
 
 int comp_need_alpha(int ftype);					// Need RGBA compositing